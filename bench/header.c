@@ -0,0 +1,449 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Response headers benchmark
+ * --------------------------
+ * Composes the headers of a few usual responses with mk_header_build()
+ * and with the former mk_header_send(), rebuilt below from the same
+ * primitives it used: a linear search of the status table, one iovec
+ * entry per field, mk_string_build() for Content-Range and a second
+ * writev() for the rows added by plugins.
+ *
+ * Every case is timed twice: composing only, then composing and sending
+ * to a local socket pair which is drained after each response. Times
+ * are in nanoseconds per response.
+ *
+ *   make bench && bench/header [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "monkey.h"
+#include "mk_header.h"
+#include "mk_request.h"
+#include "mk_config.h"
+#include "mk_clock.h"
+#include "mk_cache.h"
+#include "mk_iov.h"
+#include "mk_string.h"
+#include "mk_memory.h"
+#include "mk_plugin.h"
+#include "mk_utils.h"
+#include "mk_http.h"
+#include "mk_http_status.h"
+
+#define BENCH_ITERATIONS 1000000
+
+void mk_thread_keys_init(void);
+
+static inline uint64_t bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* The former status table, searched in order */
+struct old_status {
+    int status;
+    int length;
+    char *response;
+};
+
+#define old_entry(num, str) {num, sizeof(str) - 1, str}
+
+static const struct old_status old_status_response[] = {
+    old_entry(MK_HTTP_OK, MK_RH_HTTP_OK),
+    old_entry(MK_CLIENT_NOT_FOUND, MK_RH_CLIENT_NOT_FOUND),
+    old_entry(MK_INFO_CONTINUE, MK_RH_INFO_CONTINUE),
+    old_entry(MK_INFO_SWITCH_PROTOCOL, MK_RH_INFO_SWITCH_PROTOCOL),
+    old_entry(MK_HTTP_CREATED, MK_RH_HTTP_CREATED),
+    old_entry(MK_HTTP_ACCEPTED, MK_RH_HTTP_ACCEPTED),
+    old_entry(MK_HTTP_NON_AUTH_INFO, MK_RH_HTTP_NON_AUTH_INFO),
+    old_entry(MK_HTTP_NOCONTENT, MK_RH_HTTP_NOCONTENT),
+    old_entry(MK_HTTP_RESET, MK_RH_HTTP_RESET),
+    old_entry(MK_HTTP_PARTIAL, MK_RH_HTTP_PARTIAL),
+    old_entry(MK_REDIR_MULTIPLE, MK_RH_REDIR_MULTIPLE),
+    old_entry(MK_REDIR_MOVED, MK_RH_REDIR_MOVED),
+    old_entry(MK_REDIR_MOVED_T, MK_RH_REDIR_MOVED_T),
+    old_entry(MK_REDIR_SEE_OTHER, MK_RH_REDIR_SEE_OTHER),
+    old_entry(MK_NOT_MODIFIED, MK_RH_NOT_MODIFIED),
+    old_entry(MK_REDIR_USE_PROXY, MK_RH_REDIR_USE_PROXY),
+    old_entry(MK_CLIENT_BAD_REQUEST, MK_RH_CLIENT_BAD_REQUEST),
+    old_entry(MK_CLIENT_UNAUTH, MK_RH_CLIENT_UNAUTH),
+    old_entry(MK_CLIENT_PAYMENT_REQ, MK_RH_CLIENT_PAYMENT_REQ),
+    old_entry(MK_CLIENT_FORBIDDEN, MK_RH_CLIENT_FORBIDDEN),
+    old_entry(MK_CLIENT_METHOD_NOT_ALLOWED, MK_RH_CLIENT_METHOD_NOT_ALLOWED),
+    old_entry(MK_CLIENT_NOT_ACCEPTABLE, MK_RH_CLIENT_NOT_ACCEPTABLE),
+    old_entry(MK_CLIENT_PROXY_AUTH, MK_RH_CLIENT_PROXY_AUTH),
+    old_entry(MK_CLIENT_REQUEST_TIMEOUT, MK_RH_CLIENT_REQUEST_TIMEOUT),
+    old_entry(MK_CLIENT_CONFLICT, MK_RH_CLIENT_CONFLICT),
+    old_entry(MK_CLIENT_GONE, MK_RH_CLIENT_GONE),
+    old_entry(MK_CLIENT_LENGTH_REQUIRED, MK_RH_CLIENT_LENGTH_REQUIRED),
+    old_entry(MK_CLIENT_PRECOND_FAILED, MK_RH_CLIENT_PRECOND_FAILED),
+    old_entry(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE,
+              MK_RH_CLIENT_REQUEST_ENTITY_TOO_LARGE),
+    old_entry(MK_CLIENT_REQUEST_URI_TOO_LONG,
+              MK_RH_CLIENT_REQUEST_URI_TOO_LONG),
+    old_entry(MK_CLIENT_UNSUPPORTED_MEDIA, MK_RH_CLIENT_UNSUPPORTED_MEDIA),
+    old_entry(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF,
+              MK_RH_CLIENT_REQUESTED_RANGE_NOT_SATISF),
+    old_entry(MK_SERVER_INTERNAL_ERROR, MK_RH_SERVER_INTERNAL_ERROR),
+    old_entry(MK_SERVER_NOT_IMPLEMENTED, MK_RH_SERVER_NOT_IMPLEMENTED),
+    old_entry(MK_SERVER_BAD_GATEWAY, MK_RH_SERVER_BAD_GATEWAY),
+    old_entry(MK_SERVER_SERVICE_UNAV, MK_RH_SERVER_SERVICE_UNAV),
+    old_entry(MK_SERVER_GATEWAY_TIMEOUT, MK_RH_SERVER_GATEWAY_TIMEOUT),
+    old_entry(MK_SERVER_HTTP_VERSION_UNSUP, MK_RH_SERVER_HTTP_VERSION_UNSUP)
+};
+
+static const int old_status_response_len =
+    (sizeof(old_status_response)/(sizeof(old_status_response[0])));
+
+/* The per thread buffers the former code kept in mk_cache */
+static struct mk_iov *old_iov;
+static mk_pointer old_cl;
+static mk_pointer old_ka_max;
+
+static void old_init()
+{
+    old_iov = mk_iov_create(32, 0);
+    old_cl.data = mk_mem_malloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
+    old_ka_max.data = mk_mem_malloc_z(64);
+}
+
+/* The former mk_header_send(), up to the socket calls */
+static void old_header_build(struct client_session *cs,
+                             struct session_request *sr)
+{
+    int i = 0;
+    unsigned long len = 0;
+    char *buffer = 0;
+    mk_pointer response;
+    struct response_headers *sh = &sr->headers;
+    struct mk_iov *iov = old_iov;
+
+    for (i = 0; i < old_status_response_len; i++) {
+        if (old_status_response[i].status == sh->status) {
+            response.data = old_status_response[i].response;
+            response.len  = old_status_response[i].length;
+            break;
+        }
+    }
+    mk_bug(i == old_status_response_len);
+
+    mk_iov_add_entry(iov, response.data, response.len,
+                     mk_iov_none, MK_IOV_NOT_FREE_BUF);
+    mk_iov_add_entry(iov, sr->host_conf->header_host_signature.data,
+                     sr->host_conf->header_host_signature.len,
+                     mk_iov_crlf, MK_IOV_NOT_FREE_BUF);
+    mk_iov_add_entry(iov, mk_header_short_date.data, mk_header_short_date.len,
+                     header_current_time, MK_IOV_NOT_FREE_BUF);
+
+    if (sh->last_modified > 0) {
+        mk_pointer *lm = mk_cache_get(mk_cache_header_lm);
+        lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
+
+        mk_iov_add_entry(iov, mk_header_last_modified.data,
+                         mk_header_last_modified.len,
+                         *lm, MK_IOV_NOT_FREE_BUF);
+    }
+
+    if (sh->connection == 0) {
+        if (mk_http_keepalive_check(cs) == 0) {
+            if (sr->connection.len > 0) {
+                mk_pointer *ka_format = mk_cache_get(mk_cache_header_ka);
+
+                mk_string_itop(config->max_keep_alive_request -
+                               cs->counter_connections, &old_ka_max);
+                mk_iov_add_entry(iov, ka_format->data, ka_format->len,
+                                 mk_iov_none, MK_IOV_NOT_FREE_BUF);
+                mk_iov_add_entry(iov, old_ka_max.data, old_ka_max.len,
+                                 mk_header_conn_ka, MK_IOV_NOT_FREE_BUF);
+            }
+        }
+        else {
+            mk_iov_add_entry(iov, mk_header_conn_close.data,
+                             mk_header_conn_close.len,
+                             mk_iov_none, MK_IOV_NOT_FREE_BUF);
+        }
+    }
+
+    if (sh->content_type.len > 0) {
+        mk_iov_add_entry(iov, mk_header_short_ct.data, mk_header_short_ct.len,
+                         sh->content_type, MK_IOV_NOT_FREE_BUF);
+    }
+
+    if ((sh->status < MK_REDIR_MULTIPLE) || (sh->status > MK_REDIR_USE_PROXY)) {
+        if (sh->transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED) {
+            mk_iov_add_entry(iov, mk_header_te_chunked.data,
+                             mk_header_te_chunked.len,
+                             mk_iov_none, MK_IOV_NOT_FREE_BUF);
+        }
+    }
+
+    if (sh->content_length >= 0) {
+        mk_string_itop(sh->content_length, &old_cl);
+        mk_iov_add_entry(iov, mk_header_content_length.data,
+                         mk_header_content_length.len,
+                         old_cl, MK_IOV_NOT_FREE_BUF);
+    }
+
+    if (sh->content_length != 0 && sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
+        mk_string_build(&buffer, &len, "%s bytes %d-%d/%ld",
+                        RH_CONTENT_RANGE,
+                        sh->ranges[0], sh->ranges[1], sh->real_length);
+        mk_iov_add_entry(iov, buffer, len, mk_iov_crlf, MK_IOV_FREE_BUF);
+    }
+
+    if (sh->cgi == SH_NOCGI || sh->breakline == MK_HEADER_BREAKLINE) {
+        if (!sh->_extra_rows) {
+            mk_iov_add_entry(iov, mk_iov_crlf.data, mk_iov_crlf.len,
+                             mk_iov_none, MK_IOV_NOT_FREE_BUF);
+        }
+        else {
+            mk_iov_add_entry(sh->_extra_rows, mk_iov_crlf.data,
+                             mk_iov_crlf.len, mk_iov_none, MK_IOV_NOT_FREE_BUF);
+        }
+    }
+}
+
+static void old_header_send(int fd, struct client_session *cs,
+                            struct session_request *sr)
+{
+    struct response_headers *sh = &sr->headers;
+
+    old_header_build(cs, sr);
+
+    if (fd >= 0) {
+        mk_iov_send(fd, old_iov);
+        if (sh->_extra_rows) {
+            mk_iov_send(fd, sh->_extra_rows);
+        }
+    }
+
+    if (sh->_extra_rows) {
+        mk_iov_free(sh->_extra_rows);
+        sh->_extra_rows = NULL;
+    }
+    mk_iov_free_marked(old_iov);
+}
+
+static void new_header_send(int fd, struct client_session *cs,
+                            struct session_request *sr)
+{
+    struct mk_header_buf *hb;
+
+    hb = mk_header_build(cs, sr);
+    if (fd >= 0) {
+        if (send(fd, hb->data, hb->len, 0) != hb->len) {
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* A response of each case */
+enum {
+    CASE_STATIC = 0,    /* 200, keep-alive, Last-Modified, Content-Length */
+    CASE_RANGE,         /* 206 with Content-Range */
+    CASE_ROWS,          /* 200 chunked, two rows added by a plugin */
+    CASE_NOT_FOUND,     /* 404, connection close */
+    CASE_MAX
+};
+
+static const char *case_names[CASE_MAX] = {
+    "200 static", "206 range", "200 plugin rows", "404 close"
+};
+
+static void case_set(int c, struct client_session *cs,
+                     struct session_request *sr)
+{
+    struct response_headers *sh = &sr->headers;
+
+    mk_header_response_reset(sh);
+    sr->keep_alive = MK_TRUE;
+    sr->close_now = MK_FALSE;
+    cs->counter_connections = 3;
+
+    switch (c) {
+    case CASE_STATIC:
+        sh->status = MK_HTTP_OK;
+        sh->last_modified = 1350000000;
+        sh->content_length = 15321;
+        sh->real_length = 15321;
+        mk_pointer_set(&sh->content_type, "text/html" MK_CRLF);
+        break;
+    case CASE_RANGE:
+        sh->status = MK_HTTP_PARTIAL;
+        sh->last_modified = 1350000000;
+        sh->real_length = 1048576;
+        sh->ranges[0] = 1024;
+        sh->ranges[1] = 65535;
+        sh->content_length = sh->ranges[1] - sh->ranges[0] + 1;
+        mk_pointer_set(&sh->content_type, "application/octet-stream" MK_CRLF);
+        break;
+    case CASE_ROWS:
+        sh->status = MK_HTTP_OK;
+        sh->transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        mk_pointer_set(&sh->content_type, "text/plain" MK_CRLF);
+        mk_plugin_header_add(sr, "Cache-Control: no-cache", 23);
+        mk_plugin_header_add(sr, "X-Powered-By: bench", 19);
+        break;
+    case CASE_NOT_FOUND:
+        sh->status = MK_CLIENT_NOT_FOUND;
+        sh->content_length = 311;
+        sr->close_now = MK_TRUE;
+        mk_pointer_set(&sh->content_type, "text/html" MK_CRLF);
+        break;
+    }
+}
+
+static double run(int c, int iterations, int fd, int peer,
+                  void (*send_cb) (int, struct client_session *,
+                                   struct session_request *),
+                  struct client_session *cs, struct session_request *sr)
+{
+    int i;
+    char drain[4096];
+    uint64_t start, ns = 0;
+
+    for (i = 0; i < iterations; i++) {
+        case_set(c, cs, sr);
+
+        start = bench_now();
+        send_cb(fd, cs, sr);
+        ns += bench_now() - start;
+
+        if (peer >= 0 && read(peer, drain, sizeof(drain)) <= 0) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return (double) ns / iterations;
+}
+
+/* Both builders must compose the same bytes for the numbers to compare */
+static int check(int c, int fd, int peer,
+                 struct client_session *cs, struct session_request *sr)
+{
+    int old_len, new_len;
+    char old_buf[4096], new_buf[4096];
+
+    case_set(c, cs, sr);
+    old_header_send(fd, cs, sr);
+    old_len = read(peer, old_buf, sizeof(old_buf));
+
+    case_set(c, cs, sr);
+    new_header_send(fd, cs, sr);
+    new_len = read(peer, new_buf, sizeof(new_buf));
+
+    if (old_len <= 0 || old_len != new_len ||
+        memcmp(old_buf, new_buf, old_len) != 0) {
+        fprintf(stderr, "%s: the headers differ\n--\n%.*s--\n%.*s",
+                case_names[c], old_len, old_buf, new_len, new_buf);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    int sv[2];
+    int iterations = BENCH_ITERATIONS;
+    double old_t, new_t;
+    struct host host;
+    struct client_session cs;
+    struct session_request sr;
+
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+
+    /* The little of the server state the builders read */
+    mk_thread_keys_init();
+    config = mk_mem_malloc_z(sizeof(struct server_config));
+    config->keep_alive = MK_TRUE;
+    config->keep_alive_timeout = 15;
+    config->max_keep_alive_request = 50;
+    config->resume = MK_TRUE;
+
+    mk_clock_sequential_init();
+    mk_cache_thread_init();
+    old_init();
+
+    memset(&host, '\0', sizeof(host));
+    mk_string_build(&host.header_host_signature.data,
+                    &host.header_host_signature.len,
+                    "Server: Monkey/%s", VERSION);
+    mk_header_host_prefix_init(&host);
+
+    memset(&cs, '\0', sizeof(cs));
+    memset(&sr, '\0', sizeof(sr));
+    mk_list_init(&cs.request_list);
+    mk_list_add(&sr._head, &cs.request_list);
+    sr.host_conf = &host;
+    sr.protocol = HTTP_PROTOCOL_11;
+    mk_pointer_set(&sr.connection, "keep-alive");
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    for (c = 0; c < CASE_MAX; c++) {
+        if (check(c, sv[0], sv[1], &cs, &sr) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%i responses per case, ns per response\n\n", iterations);
+    printf("%-16s %10s %10s %8s   %10s %10s %8s\n", "",
+           "old build", "new build", "saved",
+           "old +send", "new +send", "saved");
+
+    for (c = 0; c < CASE_MAX; c++) {
+        printf("%-16s", case_names[c]);
+
+        old_t = run(c, iterations, -1, -1, old_header_send, &cs, &sr);
+        new_t = run(c, iterations, -1, -1, new_header_send, &cs, &sr);
+        printf(" %10.1f %10.1f %7.1f%%", old_t, new_t,
+               (old_t - new_t) * 100.0 / old_t);
+
+        old_t = run(c, iterations, sv[0], sv[1], old_header_send, &cs, &sr);
+        new_t = run(c, iterations, sv[0], sv[1], new_header_send, &cs, &sr);
+        printf("   %10.1f %10.1f %7.1f%%\n", old_t, new_t,
+               (old_t - new_t) * 100.0 / old_t);
+    }
+
+    return 0;
+}
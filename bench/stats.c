@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Request counters benchmark
+ * --------------------------
+ * Times what the stats counters add to every request: the start time
+ * taken once the request is parsed (mk_stats_ticks()) and the accounting
+ * done when it ends (mk_stats_request(), which reads the clock again).
+ * The loop feeding the requests is timed alone first and taken out of
+ * every result.
+ *
+ * Times are in nanoseconds per request. The last column relates them
+ * to the CPU time the server spends on a whole request, given in
+ * nanoseconds as the second argument (default 8300, a keep-alive GET of
+ * a small static file measured with /proc/<pid>/schedstat).
+ *
+ *   make bench && bench/stats [iterations] [request ns]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "monkey.h"
+#include "mk_stats.h"
+#include "mk_request.h"
+#include "mk_config.h"
+#include "mk_scheduler.h"
+#include "mk_memory.h"
+#include "mk_http.h"
+#include "mk_http_status.h"
+
+#define BENCH_ITERATIONS 10000000
+#define BENCH_REQUEST_NS 8300
+
+void mk_thread_keys_init(void);
+
+/* What a request leaves for the counters, taken in turn */
+static const int bench_status[] = {
+    MK_HTTP_OK, MK_HTTP_OK, MK_HTTP_OK, MK_NOT_MODIFIED,
+    MK_HTTP_OK, MK_HTTP_PARTIAL, MK_HTTP_OK, MK_CLIENT_NOT_FOUND
+};
+
+#define BENCH_STATUS (sizeof(bench_status) / sizeof(bench_status[0]))
+
+enum {
+    CASE_LOOP = 0,      /* feeding the requests only */
+    CASE_CLOCK,         /* the two clock reads */
+    CASE_COUNTERS,      /* mk_stats_request() without the latency */
+    CASE_FULL,          /* start time plus mk_stats_request() */
+    CASE_MAX
+};
+
+static const char *case_names[CASE_MAX] = {
+    "loop", "clock reads", "counters", "per request"
+};
+
+static volatile uint64_t bench_sink;
+
+static double run(int c, int iterations, struct session_request *sr)
+{
+    int i;
+    uint64_t start;
+
+    start = mk_stats_now();
+    for (i = 0; i < iterations; i++) {
+        sr->headers.status = bench_status[i % BENCH_STATUS];
+        sr->headers.content_length = 15321 + (i & 1023);
+        sr->stats_start = 0;
+
+        switch (c) {
+        case CASE_CLOCK:
+            bench_sink = mk_stats_ticks();
+            bench_sink = mk_stats_ticks();
+            break;
+        case CASE_COUNTERS:
+            mk_stats_request(sr);
+            break;
+        case CASE_FULL:
+            sr->stats_start = mk_stats_ticks();
+            mk_stats_request(sr);
+            break;
+        }
+    }
+
+    return (double) (mk_stats_now() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    int iterations = BENCH_ITERATIONS;
+    double request_ns = BENCH_REQUEST_NS;
+    double loop_ns, ns;
+    uint64_t expected;
+    struct host host;
+    struct session_request sr;
+    struct sched_list_node sched;
+    struct mk_stats *total;
+
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        request_ns = atof(argv[2]);
+    }
+
+    /* One worker serving one virtual host */
+    mk_thread_keys_init();
+    config = mk_mem_malloc_z(sizeof(struct server_config));
+    config->workers = 1;
+    mk_list_init(&config->hosts);
+
+    memset(&host, '\0', sizeof(host));
+    mk_list_add(&host._head, &config->hosts);
+    mk_stats_init();
+
+    memset(&sched, '\0', sizeof(sched));
+    sched.idx = 0;
+    pthread_setspecific(worker_sched_node, (void *) &sched);
+
+    memset(&sr, '\0', sizeof(sr));
+    sr.method = HTTP_METHOD_GET;
+    sr.host_conf = &host;
+
+    /* Warm up the counters and the clock */
+    run(CASE_FULL, iterations / 10 + 1, &sr);
+
+    printf("%i requests per case, ns per request\n\n", iterations);
+    printf("%-16s %10s %12s\n", "", "ns", "of a request");
+
+    loop_ns = run(CASE_LOOP, iterations, &sr);
+    printf("%-16s %10.1f\n", case_names[CASE_LOOP], loop_ns);
+
+    for (c = CASE_CLOCK; c < CASE_MAX; c++) {
+        ns = run(c, iterations, &sr) - loop_ns;
+        printf("%-16s %10.1f %11.2f%%\n", case_names[c], ns,
+               ns * 100.0 / request_ns);
+    }
+
+    /* Every accounted request must be found by a reader */
+    expected = (uint64_t) iterations * 2 + iterations / 10 + 1;
+    total = mk_mem_malloc_z(sizeof(struct mk_stats));
+    mk_stats_read(total, NULL);
+    if (total->requests != expected) {
+        fprintf(stderr, "requests: %lu counted, %lu expected\n",
+                (unsigned long) total->requests, (unsigned long) expected);
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
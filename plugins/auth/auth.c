@@ -45,6 +45,7 @@ static int mk_auth_validate_user(struct users_file *users,
     unsigned char *decoded = NULL;
     unsigned char digest[SHA1_DIGEST_LEN];
     struct mk_list *head;
+    struct mk_list *bucket;
     struct user *entry;
 
     SHA_CTX sha; /* defined in sha1/sha1.h */
@@ -83,10 +84,14 @@ static int mk_auth_validate_user(struct users_file *users,
     SHA1_Update(&sha, (unsigned char *) decoded + sep + 1, auth_len - (sep + 1));
     SHA1_Final(digest, &sha);
 
-    mk_list_foreach(head, &users->_users) {
-        entry = mk_list_entry(head, struct user, _head);
+    pthread_rwlock_rdlock(&users->lock);
+
+    bucket = &users->table->buckets[mk_auth_hash((char *) decoded, sep) &
+                                    (users->table->size - 1)];
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct user, _hash);
         /* match user */
-        if (strlen(entry->user) != (unsigned int) sep) {
+        if (entry->user_len != sep) {
             continue;
         }
         if (strncmp(entry->user, (char *) decoded, sep) != 0) {
@@ -98,6 +103,7 @@ static int mk_auth_validate_user(struct users_file *users,
         /* match password */
         if (memcmp(entry->passwd_decoded, digest, SHA1_DIGEST_LEN) == 0) {
             PLUGIN_TRACE("User '%s' matched password", entry->user);
+            pthread_rwlock_unlock(&users->lock);
             free(decoded);
             return 0;
         }
@@ -105,6 +111,8 @@ static int mk_auth_validate_user(struct users_file *users,
         break;
     }
 
+    pthread_rwlock_unlock(&users->lock);
+
     error:
     if (decoded) {
         free(decoded);
@@ -112,6 +120,76 @@ static int mk_auth_validate_user(struct users_file *users,
     return -1;
 }
 
+/* Worker cache slot for the given Authorization header hash */
+static struct auth_cache_entry *mk_auth_cache_slot(uint32_t hash)
+{
+    struct auth_cache *cache = pthread_getspecific(_mkp_data);
+
+    return &cache->slots[hash & (MK_AUTH_CACHE_SLOTS - 1)];
+}
+
+/*
+ * A cached entry is valid while the users file was not reloaded and
+ * the TTL did not expire.
+ */
+static int mk_auth_cache_get(struct auth_cache_entry *slot,
+                             struct users_file *users,
+                             const char *credentials, unsigned int len,
+                             uint32_t hash)
+{
+    return (slot->users == users &&
+            slot->hash == hash &&
+            slot->len == len &&
+            slot->generation == users->generation &&
+            slot->expires > mk_api->time_unix() &&
+            memcmp(slot->value, credentials, len) == 0);
+}
+
+static void mk_auth_cache_set(struct auth_cache_entry *slot,
+                              struct users_file *users,
+                              const char *credentials, unsigned int len,
+                              uint32_t hash, unsigned int generation)
+{
+    if (len > sizeof(slot->value)) {
+        return;
+    }
+
+    slot->users = users;
+    slot->hash = hash;
+    slot->len = len;
+    slot->generation = generation;
+    slot->expires = mk_api->time_unix() + MK_AUTH_CACHE_TTL;
+    memcpy(slot->value, credentials, len);
+}
+
+static struct location *mk_auth_location(struct vhost *vh, mk_pointer *uri)
+{
+    unsigned long i;
+    struct auth_trie *node = vh->trie;
+    struct location *loc;
+
+    if (!node) {
+        return NULL;
+    }
+
+    /* Every location ending on the way is a prefix, keep the first one */
+    loc = node->loc;
+    for (i = 0; i < uri->len; i++) {
+        node = node->child;
+        while (node && node->c != (unsigned char) uri->data[i]) {
+            node = node->next;
+        }
+        if (!node) {
+            break;
+        }
+        if (node->loc && (!loc || node->loc->index < loc->index)) {
+            loc = node->loc;
+        }
+    }
+
+    return loc;
+}
+
 int _mkp_init(struct plugin_api **api, char *confdir)
 {
     (void) confdir;
@@ -139,11 +217,11 @@ void _mkp_exit()
 
 void _mkp_core_thctx()
 {
-    char *user;
+    struct auth_cache *cache;
 
-    /* Init thread buffer for given credentials */
-    user = mk_api->mem_alloc(MK_AUTH_CREDENTIALS_LEN - 1);
-    pthread_setspecific(_mkp_data, (void *) user);
+    /* Init thread cache for validated credentials */
+    cache = mk_api->mem_alloc_z(sizeof(struct auth_cache));
+    pthread_setspecific(_mkp_data, (void *) cache);
 }
 
 /* Object handler */
@@ -152,13 +230,14 @@ int _mkp_stage_30(struct plugin *plugin,
                   struct session_request *sr)
 {
     int val;
-    short int is_restricted = MK_FALSE;
+    unsigned int generation;
+    uint32_t hash;
     mk_pointer res;
     (void) plugin;
     struct mk_list *vh_head;
-    struct mk_list *loc_head;
     struct vhost *vh_entry = NULL;
     struct location *loc_entry;
+    struct auth_cache_entry *slot;
 
     PLUGIN_TRACE("[FD %i] Handler received request");
 
@@ -171,40 +250,48 @@ int _mkp_stage_30(struct plugin *plugin,
                          vh_entry->host->host_signature);
             break;
         }
+        vh_entry = NULL;
     }
 
-    /* Check vhost locations */
-    mk_list_foreach(loc_head, &vh_entry->locations) {
-        loc_entry = mk_list_entry(loc_head, struct location, _head);
-        if (sr->uri_processed.len < loc_entry->path.len) {
-            continue;
-        }
-        if (strncmp(sr->uri_processed.data,
-                    loc_entry->path.data, loc_entry->path.len) == 0) {
-            is_restricted = MK_TRUE;
-            PLUGIN_TRACE("[FD %i] Location matched %s",
-                         cs->socket,
-                         loc_entry->path.data);
-            break;
-        }
+    if (!vh_entry) {
+        return MK_PLUGIN_RET_NOT_ME;
     }
 
+    /* Check vhost locations */
+    loc_entry = mk_auth_location(vh_entry, &sr->uri_processed);
+
     /* For non-restricted location do not take any action, just returns */
-    if (is_restricted == MK_FALSE) {
+    if (!loc_entry) {
         return MK_PLUGIN_RET_NOT_ME;
     }
 
+    PLUGIN_TRACE("[FD %i] Location matched %s",
+                 cs->socket,
+                 loc_entry->path.data);
+
     /* Check authorization header */
     res = mk_api->header_get(&sr->headers_toc,
                              auth_header_request.data,
                              auth_header_request.len);
 
     if (res.data && res.len > 0) {
+        mk_auth_conf_check_users(loc_entry->users);
+
+        hash = mk_auth_hash(res.data, res.len);
+        slot = mk_auth_cache_slot(hash);
+        if (mk_auth_cache_get(slot, loc_entry->users, res.data, res.len, hash)) {
+            PLUGIN_TRACE("[FD %i] user validated (cached)", cs->socket);
+            return MK_PLUGIN_RET_NOT_ME;
+        }
+
         /* Validate user */
+        generation = loc_entry->users->generation;
         val = mk_auth_validate_user(loc_entry->users, res.data, res.len);
         if (val == 0) {
             /* user validated, success */
             PLUGIN_TRACE("[FD %i] user validated!", cs->socket);
+            mk_auth_cache_set(slot, loc_entry->users, res.data, res.len,
+                              hash, generation);
             return MK_PLUGIN_RET_NOT_ME;
         }
     }
@@ -23,6 +23,9 @@
 #ifndef MK_AUTH_H
 #define MK_AUTH_H
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include "MKPlugin.h"
 
 /* Header stuff */
@@ -33,6 +36,13 @@
 /* Credentials length */
 #define MK_AUTH_CREDENTIALS_LEN 256
 
+/* Per worker cache of validated Authorization headers */
+#define MK_AUTH_CACHE_SLOTS     256
+#define MK_AUTH_CACHE_TTL       60
+
+/* Seconds between checks of the users files modification time */
+#define MK_AUTH_USERS_CHECK     2
+
 /*
  * The plugin hold one struct per virtual host and link to the
  * locations and users file associated:
@@ -53,10 +63,24 @@
 /* List of virtual hosts to handle locations */
 struct mk_list vhosts_list;
 
+/*
+ * Prefix trie of the locations paths, one byte per node. A node where
+ * a location path ends points to it, a request walks the trie with its
+ * URI and gets the first location (in configuration order) whose path
+ * is a prefix of it.
+ */
+struct auth_trie {
+    unsigned char c;
+    struct location *loc;
+    struct auth_trie *child;
+    struct auth_trie *next;
+};
+
 /* main index for locations under a virtualhost */
 struct vhost {
     struct host *host;
     struct mk_list locations;
+    struct auth_trie *trie;
     struct mk_list _head;
 };
 
@@ -65,6 +89,7 @@ struct vhost {
  * of allowed users
  */
 struct location {
+    int index;             /* position in the vhost configuration */
     mk_pointer path;
     mk_pointer title;
     mk_pointer auth_http_header;
@@ -76,14 +101,32 @@ struct location {
 /* Head index for user files list */
 struct mk_list users_file_list;
 
+/* Users loaded from a file, hashed by name */
+struct users_table {
+    unsigned int size;          /* number of buckets, power of two */
+    struct mk_list *buckets;
+    struct mk_list users;
+};
+
 /* 
  * Represents a users file, each entry represents a physical
- * file and belongs to a node of the users_file_list list
+ * file and belongs to a node of the users_file_list list.
+ *
+ * The file is loaded again when it changes: the new table replaces the
+ * old one under the write lock and the generation is increased, so the
+ * credentials cached by the workers for this file are no longer valid.
  */
 struct users_file {
     time_t last_updated;   /* last time this entry was modified */
+    off_t last_size;
+    time_t next_check;
+    unsigned int generation;
     char *path;            /* file path */
-    struct mk_list _users; /* list of users */
+
+    pthread_rwlock_t lock; /* protects table */
+    pthread_mutex_t reload;
+    struct users_table *table;
+
     struct mk_list _head;  /* head for main mk_list users_file_list */
 };
 
@@ -93,12 +136,29 @@ struct users_file {
  */
 struct user {
     char user[128];
+    int user_len;
     char passwd_raw[256];
     unsigned char *passwd_decoded;
 
+    struct mk_list _hash;
     struct mk_list _head;
 };
 
+/* A validated Authorization header value */
+struct auth_cache_entry {
+    uint32_t hash;
+    unsigned int len;
+    char value[MK_AUTH_CREDENTIALS_LEN];
+
+    struct users_file *users;
+    unsigned int generation;
+    time_t expires;
+};
+
+struct auth_cache {
+    struct auth_cache_entry slots[MK_AUTH_CACHE_SLOTS];
+};
+
 struct mk_list users_file_list;
 
 /* Thread key */
@@ -107,4 +167,17 @@ mk_pointer auth_header_basic;
 
 #define SHA1_DIGEST_LEN 20
 
+/* FNV-1a */
+static inline uint32_t mk_auth_hash(const char *data, unsigned int len)
+{
+    unsigned int i;
+    uint32_t hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 #endif
@@ -26,53 +26,33 @@
 #include "auth.h"
 #include "conf.h"
 
-/*
- * Register a users file into the main list, if the users
- * file already exists it just return the node in question,
- * otherwise add the node to the list and return the node
- * created.
- */
-static struct users_file *mk_auth_conf_add_users(char *users_path)
+static void mk_auth_conf_free_table(struct users_table *table)
 {
-    struct file_info finfo;
+    struct mk_list *head, *tmp;
+    struct user *cred;
+
+    mk_list_foreach_safe(head, tmp, &table->users) {
+        cred = mk_list_entry(head, struct user, _head);
+        mk_list_del(&cred->_head);
+        free(cred->passwd_decoded);
+        mk_api->mem_free(cred);
+    }
+    mk_api->mem_free(table->buckets);
+    mk_api->mem_free(table);
+}
+
+/* Read a users file into a new table */
+static struct users_table *mk_auth_conf_load_table(char *users_path)
+{
+    struct users_table *table;
     struct mk_list *head;
-    struct users_file *entry;
     struct user *cred;
     int i, sep, len;
     int offset = 0;
+    unsigned int n = 0;
     size_t decoded_len;
     char *buf;
 
-    mk_list_foreach(head, &users_file_list) {
-        entry = mk_list_entry(head, struct users_file, _head);
-        if (strcmp(entry->path, users_path) == 0) {
-            return entry;
-        }
-    }
-
-    if (mk_api->file_get_info(users_path, &finfo) != 0) {
-        mk_warn("Auth: Invalid users file '%s'", users_path);
-        return NULL;
-    }
-
-    if (finfo.is_directory == MK_TRUE) {
-        mk_warn("Auth: Not a credentials file '%s'", users_path);
-        return NULL;
-    }
-
-    if (finfo.read_access == MK_FALSE) {
-        mk_warn("Auth: Could not read file '%s'", users_path);
-        return NULL;
-    }
-
-    /* We did not find the path in our list, let's create a new node */
-    entry  = mk_api->mem_alloc(sizeof(struct users_file));
-    entry->last_updated = finfo.last_modification;
-    entry->path = users_path;
-
-    /* Read file and add users to the list */
-    mk_list_init(&entry->_users);
-
     /* Read credentials file */
     buf = mk_api->file_to_buffer(users_path);
     if (!buf) {
@@ -80,6 +60,9 @@ static struct users_file *mk_auth_conf_add_users(char *users_path)
         return NULL;
     }
 
+    table = mk_api->mem_alloc(sizeof(struct users_table));
+    mk_list_init(&table->users);
+
     /* Read users list buffer lines */
     len = strlen(buf);
     for (i = 0; i < len; i++) {
@@ -102,6 +85,7 @@ static struct users_file *mk_auth_conf_add_users(char *users_path)
             /* Copy username */
             strncpy(cred->user, buf + offset, sep);
             cred->user[sep] = '\0';
+            cred->user_len = sep;
 
             /* Copy raw password */
             offset += sep + 1 + 5;
@@ -123,17 +107,157 @@ static struct users_file *mk_auth_conf_add_users(char *users_path)
                 mk_api->mem_free(cred);
                 continue;
             }
-            mk_list_add(&cred->_head, &entry->_users);
+            mk_list_add(&cred->_head, &table->users);
+            n++;
         }
     }
     mk_api->mem_free(buf);
 
+    /* Hash the users by name, about one per bucket */
+    table->size = 16;
+    while (table->size < n) {
+        table->size <<= 1;
+    }
+    table->buckets = mk_api->mem_alloc(sizeof(struct mk_list) * table->size);
+    for (i = 0; i < (int) table->size; i++) {
+        mk_list_init(&table->buckets[i]);
+    }
+
+    mk_list_foreach(head, &table->users) {
+        cred = mk_list_entry(head, struct user, _head);
+        mk_list_add(&cred->_hash,
+                    &table->buckets[mk_auth_hash(cred->user, cred->user_len) &
+                                    (table->size - 1)]);
+    }
+
+    return table;
+}
+
+/*
+ * Register a users file into the main list, if the users
+ * file already exists it just return the node in question,
+ * otherwise add the node to the list and return the node
+ * created.
+ */
+static struct users_file *mk_auth_conf_add_users(char *users_path)
+{
+    struct file_info finfo;
+    struct mk_list *head;
+    struct users_file *entry;
+    struct users_table *table;
+
+    mk_list_foreach(head, &users_file_list) {
+        entry = mk_list_entry(head, struct users_file, _head);
+        if (strcmp(entry->path, users_path) == 0) {
+            return entry;
+        }
+    }
+
+    if (mk_api->file_get_info(users_path, &finfo) != 0) {
+        mk_warn("Auth: Invalid users file '%s'", users_path);
+        return NULL;
+    }
+
+    if (finfo.is_directory == MK_TRUE) {
+        mk_warn("Auth: Not a credentials file '%s'", users_path);
+        return NULL;
+    }
+
+    if (finfo.read_access == MK_FALSE) {
+        mk_warn("Auth: Could not read file '%s'", users_path);
+        return NULL;
+    }
+
+    table = mk_auth_conf_load_table(users_path);
+    if (!table) {
+        return NULL;
+    }
+
+    /* We did not find the path in our list, let's create a new node */
+    entry  = mk_api->mem_alloc(sizeof(struct users_file));
+    entry->last_updated = finfo.last_modification;
+    entry->last_size = finfo.size;
+    entry->next_check = 0;
+    entry->generation = 0;
+    entry->path = users_path;
+    entry->table = table;
+    pthread_rwlock_init(&entry->lock, NULL);
+    pthread_mutex_init(&entry->reload, NULL);
+
     /* Link node to global list */
     mk_list_add(&entry->_head, &users_file_list);
 
     return entry;
 }
 
+/*
+ * Called on requests to a protected location: every few seconds one
+ * worker checks if the users file changed and loads it again.
+ */
+void mk_auth_conf_check_users(struct users_file *uf)
+{
+    time_t now = mk_api->time_unix();
+    struct file_info finfo;
+    struct users_table *table, *old;
+
+    if (now < uf->next_check || pthread_mutex_trylock(&uf->reload) != 0) {
+        return;
+    }
+
+    if (now >= uf->next_check) {
+        uf->next_check = now + MK_AUTH_USERS_CHECK;
+
+        if (mk_api->file_get_info(uf->path, &finfo) == 0 &&
+            (finfo.last_modification != uf->last_updated ||
+             finfo.size != uf->last_size)) {
+            PLUGIN_TRACE("Users file '%s' changed, reloading", uf->path);
+
+            table = mk_auth_conf_load_table(uf->path);
+            if (table) {
+                pthread_rwlock_wrlock(&uf->lock);
+                old = uf->table;
+                uf->table = table;
+                uf->last_updated = finfo.last_modification;
+                uf->last_size = finfo.size;
+                __sync_fetch_and_add(&uf->generation, 1);
+                pthread_rwlock_unlock(&uf->lock);
+
+                mk_auth_conf_free_table(old);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&uf->reload);
+}
+
+/* Add a location path to the vhost trie, the first one wins */
+static void mk_auth_conf_trie_add(struct auth_trie **root, struct location *loc)
+{
+    unsigned long i;
+    struct auth_trie *node, **slot;
+
+    if (!*root) {
+        *root = mk_api->mem_alloc_z(sizeof(struct auth_trie));
+    }
+    node = *root;
+
+    for (i = 0; i < loc->path.len; i++) {
+        slot = &node->child;
+        while (*slot && (*slot)->c != (unsigned char) loc->path.data[i]) {
+            slot = &(*slot)->next;
+        }
+        if (!*slot) {
+            *slot = mk_api->mem_alloc_z(sizeof(struct auth_trie));
+            (*slot)->c = loc->path.data[i];
+        }
+        node = *slot;
+    }
+
+    if (!node->loc) {
+        node->loc = loc;
+    }
+}
+
 /*
  * Read all vhost configuration nodes and looks for users files under an [AUTH]
  * section, if present, it add that file to the unique list. It parse all user's
@@ -160,6 +284,7 @@ int mk_auth_conf_init_users_list()
 
     /* User files list */
     struct users_file *uf;
+    int index;
 
     PLUGIN_TRACE("Loading user's files");
 
@@ -169,6 +294,8 @@ int mk_auth_conf_init_users_list()
         auth_vhost = mk_api->mem_alloc(sizeof(struct vhost));
         auth_vhost->host = entry_host;        /* link virtual host entry */
         mk_list_init(&auth_vhost->locations); /* init locations list */
+        auth_vhost->trie = NULL;
+        index = 0;
 
         /*
          * check vhost 'config' and look for [AUTH] sections, we don't use
@@ -212,9 +339,11 @@ int mk_auth_conf_init_users_list()
                                   MK_AUTH_HEADER_TITLE, title);
 
                 loc->users = uf;
+                loc->index = index++;
 
                 /* Add new location to auth_vhost node */
                 mk_list_add(&loc->_head, &auth_vhost->locations);
+                mk_auth_conf_trie_add(&auth_vhost->trie, loc);
             }
         }
 
@@ -23,6 +23,9 @@
 #ifndef MK_AUTH_CONF_H
 #define MK_AUTH_CONF_H
 
+struct users_file;
+
 int mk_auth_conf_init_users_list();
+void mk_auth_conf_check_users(struct users_file *uf);
 
 #endif
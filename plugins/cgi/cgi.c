@@ -21,7 +21,6 @@
  */
 
 #include <sys/time.h>
-#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -32,34 +31,10 @@
 MONKEY_PLUGIN("cgi",		/* shortname */
               "CGI handler",	/* name */
               VERSION,		/* version */
-              MK_PLUGIN_STAGE_30 | MK_PLUGIN_CORE_THCTX);	/* hooks */
+              MK_PLUGIN_STAGE_30 | MK_PLUGIN_STAGE_40 |
+              MK_PLUGIN_CORE_THCTX);	/* hooks */
 
 
-int swrite(const int fd, const void *buf, const size_t count)
-{
-    ssize_t pos = count, ret = 0;
-
-    while (pos > 0 && ret >= 0) {
-        ret = write(fd, buf, pos);
-
-        if (ret < 0)
-            return ret;
-
-        pos -= ret;
-        buf += ret;
-    }
-
-    return count;
-}
-
-static void cgi_write_post(void *p)
-{
-    const struct post_t * const in = p;
-
-    swrite(in->fd, in->buf, in->len);
-    close(in->fd);
-}
-
 static int do_cgi(const char *const __restrict__ file,
                   const char *const __restrict__ url,
                   struct session_request *const sr,
@@ -114,24 +89,29 @@ static int do_cgi(const char *const __restrict__ file,
     snprintf(server_protocol, SHORTLEN, "SERVER_PROTOCOL=%s", protocol);
     env[envpos++] = server_protocol;
 
+    int n;
     if (sr->query_string.len) {
         query = mk_api->mem_alloc_z(sr->query_string.len + 1);
         memcpy(query, sr->query_string.data, sr->query_string.len);
-        snprintf(request_uri, PATHLEN, "REQUEST_URI=%s?%s", url, query);
+        n = snprintf(request_uri, PATHLEN, "REQUEST_URI=%s?%s", url, query);
     }
     else {
-        snprintf(request_uri, PATHLEN, "REQUEST_URI=%s", url);
+        n = snprintf(request_uri, PATHLEN, "REQUEST_URI=%s", url);
     }
     env[envpos++] = request_uri;
 
-    snprintf(script_filename, PATHLEN, "SCRIPT_FILENAME=%s", file);
+    /* Don't run the app with a truncated environment */
+    if (n >= PATHLEN ||
+        snprintf(script_filename, PATHLEN, "SCRIPT_FILENAME=%s", file) >= PATHLEN ||
+        snprintf(script_name, PATHLEN, "SCRIPT_NAME=%s", url) >= PATHLEN ||
+        (query && snprintf(query_string, PATHLEN, "QUERY_STRING=%s", query) >= PATHLEN)) {
+        free(query);
+        return 403;
+    }
     env[envpos++] = script_filename;
-
-    snprintf(script_name, PATHLEN, "SCRIPT_NAME=%s", url);
     env[envpos++] = script_name;
 
     if (query) {
-        snprintf(query_string, PATHLEN, "QUERY_STRING=%s", query);
         env[envpos++] = query_string;
         free(query);
     }
@@ -142,7 +122,14 @@ static int do_cgi(const char *const __restrict__ file,
     snprintf(remote_addr, INET6_ADDRSTRLEN+SHORTLEN, "REMOTE_ADDR=%s", tmpaddr);
     env[envpos++] = remote_addr;
 
-    snprintf(remote_port, SHORTLEN, "REMOTE_PORT=%ld", sr->port);
+    /* sr->port is the port of the server, not the one of the client */
+    struct sched_connection *conx = mk_api->sched_conn_get(socket);
+    unsigned int peer_port = 0;
+    if (conx && conx->addr.sa.sa_family == AF_INET6)
+        peer_port = ntohs(conx->addr.in6.sin6_port);
+    else if (conx && conx->addr.sa.sa_family == AF_INET)
+        peer_port = ntohs(conx->addr.in.sin_port);
+    snprintf(remote_port, SHORTLEN, "REMOTE_PORT=%u", peer_port);
     env[envpos++] = remote_port;
 
     if (sr->data.len) {
@@ -159,92 +146,20 @@ static int do_cgi(const char *const __restrict__ file,
     /* Must be NULL-terminated */
     env[envpos] = NULL;
 
-    /* pipes, from monkey's POV */
-    int writepipe[2], readpipe[2];
-    if (pipe(writepipe) || pipe(readpipe)) {
-        mk_err("Failed to create pipe");
-        return 403;
-    }
+    /* The app runs from its own directory */
+    char dir[PATHLEN], name[PATHLEN];
+    char *argv[3] = { NULL };
 
-    pid_t pid = vfork();
-    if (pid < 0) {
-        mk_err("Failed to fork");
-        return 403;
+    snprintf(dir, PATHLEN, "%s", file);
+    snprintf(name, PATHLEN, "%s", match->bin ? match->bin : file);
+    argv[0] = basename(name);
+    if (match->bin) {
+        argv[1] = (char *) file;
     }
 
-    /* Child */
-    if (pid == 0) {
-        close(writepipe[1]);
-        close(readpipe[0]);
-
-        /* Our stdin is the read end of monkey's writing */
-        if (dup2(writepipe[0], 0) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(writepipe[0]);
-
-        /* Our stdout is the write end of monkey's reading */
-        if (dup2(readpipe[1], 1) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(readpipe[1]);
-
-        /* Our stderr goes to /dev/null */
-        const int devnull = open("/dev/null", O_WRONLY);
-        if (dup2(devnull, 2) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(devnull);
-
-        char *argv[3] = { NULL };
-
-        char *tmp = strdup(file);
-        if (chdir(dirname(tmp)))
-            _exit(1);
-
-        char *tmp2 = strdup(file);
-        argv[0] = basename(tmp2);
-
-        /* Restore signals for the child */
-        signal(SIGPIPE, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-
-        if (!match->bin) {
-            execve(file, argv, env);
-        }
-        else {
-            argv[0] = basename(match->bin);
-            argv[1] = (char *) file;
-            execve(match->bin, argv, env);
-        }
-
-        /* Exec failed, return */
-        _exit(1);
-    }
-
-    /* Yay me */
-    close(writepipe[0]);
-    close(readpipe[1]);
-
-    /* If we have POST data to write, spawn a thread to do that */
-    if (sr->data.len) {
-        struct post_t p;
-        p.fd = writepipe[1];
-        p.buf = sr->data.data;
-        p.len = sr->data.len;
-
-        mk_api->worker_spawn(cgi_write_post, &p);
-    }
-    else {
-        close(writepipe[1]);
-    }
-
-
-    struct cgi_request *r = cgi_req_create(readpipe[0], socket, sr, cs);
-    if (!r) return 403;
+    struct cgi_request *r = cgi_req_create(-1, socket, sr, cs);
+    if (!r)
+        return 403;
 
     if (r->sr->protocol >= HTTP_PROTOCOL_11 &&
         (r->sr->headers.status < MK_REDIR_MULTIPLE ||
@@ -254,12 +169,31 @@ static int do_cgi(const char *const __restrict__ file,
         r->chunked = 1;
     }
 
+    /* The spawner answers on the event loop, the worker moves on */
+    struct cgi_worker *w = cgi_worker_get();
+    const char *path = match->bin ? match->bin : file;
+    const char *appdir = dirname(dir);
+
+    if (cgi_spawn_request(w, path, appdir, argv, env) == 0) {
+        r->spawning = 1;
+        mk_list_add(&r->_head, &w->spawns);
+    }
+    else {
+        int writefd, readfd;
+        pid_t pid = cgi_spawn_fork(path, appdir, argv, env, &writefd, &readfd);
+        if (pid < 0) {
+            mk_err("Failed to spawn the CGI app");
+            cgi_req_del(r);
+            return 403;
+        }
 
-    cgi_req_add(r);
-    mk_api->event_add(readpipe[0], MK_EPOLL_READ, plugin, MK_EPOLL_LEVEL_TRIGGERED);
+        if (cgi_req_start(r, writefd, readfd) != 0) {
+            cgi_req_del(r);
+            return 403;
+        }
+    }
 
-    /* XXX Fixme: this needs to be atomic */
-    requests_by_socket[socket] = r;
+    mk_api->session_data_set(plugin, cs, r, cgi_req_detach);
 
     /* We have nothing to write yet */
     mk_api->event_socket_change_mode(socket, MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
@@ -411,25 +345,28 @@ int _mkp_init(struct plugin_api **api, char *confdir)
 
     mk_list_init(&cgi_global_matches);
     cgi_read_config(confdir);
-    pthread_key_create(&cgi_request_list, NULL);
-
-    struct rlimit lim;
-    getrlimit(RLIMIT_NOFILE, &lim);
-    requests_by_socket = mk_api->mem_alloc_z(sizeof(struct cgi_request *) * lim.rlim_cur);
+    pthread_key_create(&cgi_worker_key, NULL);
 
     /* Make sure we act good if the child dies */
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
 
+    /* Still single threaded and not yet running as User */
+    if (cgi_spawner_init(mk_api->config->workers) != 0) {
+        mk_warn("CGI: No spawner, apps will be forked from the workers");
+    }
+
     return 0;
 }
 
 void _mkp_exit()
 {
     regfree(&match_regex);
-    free(requests_by_socket);
 }
 
+/* Routed requests skip the Match rules, there is no interpreter */
+static struct cgi_match_t cgi_routed_match;
+
 int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
                   struct session_request *sr)
 {
@@ -450,6 +387,12 @@ int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
         return MK_PLUGIN_RET_NOT_ME;
     }
 
+    /* The vhost routes this URI to us, the app is run as it is */
+    if (sr->route == plugin) {
+        match_rule = &cgi_routed_match;
+        goto run_cgi;
+    }
+
     /* Go around each global CGI Match entry and check if one of them applies */
     mk_list_foreach(head_matches, &cgi_global_matches) {
         match_rule = mk_list_entry(head_matches, struct cgi_match_t,  _head);
@@ -488,11 +431,18 @@ int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
 
  run_cgi:
     /* start running the CGI */
-    if (cgi_req_get(cs->socket)) {
+    if (mk_api->session_data_get(plugin, cs)) {
         printf("Error, someone tried to retry\n");
         return MK_PLUGIN_RET_CONTINUE;
     }
 
+    switch (mk_api->rcache_lookup(cs, sr)) {
+    case MK_RCACHE_HIT:
+        return MK_PLUGIN_RET_END;
+    case MK_RCACHE_PARKED:
+        return MK_PLUGIN_RET_CONTINUE;
+    }
+
     int status = do_cgi(file, url, sr, cs, match_rule, plugin);
 
     /* These are just for the other plugins, such as logger; bogus data */
@@ -506,10 +456,27 @@ int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
     return MK_PLUGIN_RET_CONTINUE;
 }
 
+/* The request ended, let go of the CGI which served it */
+int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
+{
+    struct cgi_request *r = mk_api->session_data_get(_plugin_info.plugin, cs);
+
+    if (r && r->sr == sr) {
+        mk_api->session_data_set(_plugin_info.plugin, cs, NULL, NULL);
+        cgi_req_detach(r);
+    }
+
+    return 0;
+}
+
 void _mkp_core_thctx(void)
 {
-    struct mk_list *list = mk_api->mem_alloc_z(sizeof(struct mk_list));
+    struct cgi_worker *w = mk_api->mem_alloc_z(sizeof(struct cgi_worker));
+
+    w->size = 64;
+    w->fds = mk_api->mem_alloc_z(sizeof(struct cgi_request *) * w->size);
+    mk_list_init(&w->spawns);
+    pthread_setspecific(cgi_worker_key, (void *) w);
 
-    mk_list_init(list);
-    pthread_setspecific(cgi_request_list, (void *) list);
+    cgi_spawner_attach(w);
 }
@@ -35,19 +35,12 @@
 
 enum {
     PATHLEN = 1024,
+    HEADERLEN = 8192,
     SHORTLEN = 64
 };
 
 regex_t match_regex;
 
-struct cgi_request **requests_by_socket;
-
-struct post_t {
-    int fd;
-    void *buf;
-    unsigned long len;
-};
-
 struct cgi_match_t {
     regex_t match;
     char *bin;
@@ -67,9 +60,9 @@ struct mk_list cgi_global_matches;
 
 struct cgi_request {
 
-    char in_buf[PATHLEN];
+    char in_buf[HEADERLEN];	/* The app's headers */
 
-    struct mk_list _head;
+    struct mk_list _head;	/* In the worker's queue of spawns */
 
     struct session_request *sr;
     struct client_session *cs;
@@ -79,48 +72,83 @@ struct cgi_request {
     int fd;			/* From the CGI app */
     int socket;
 
-    unsigned char status_done;
-    unsigned char all_headers_done;
+    int post_fd;		/* To the CGI app, while POST data is left */
+    unsigned long post_off;
+
     unsigned char chunked;
+    unsigned char streaming;	/* Headers sent, the core streams the pipe */
+    unsigned char spawning;	/* Waiting for the spawner to start the app */
 };
 
-/* Global list per worker */
-pthread_key_t cgi_request_list;
+/* Per worker state */
+struct cgi_worker {
+    int size;
+    struct cgi_request **fds;	/* Requests by the fds of their pipes */
 
-extern struct cgi_request **requests_by_socket;
+    int channel;		/* To the spawner, -1 if there is none */
+    struct mk_list spawns;	/* Requests sent to the spawner, in order */
+};
+
+pthread_key_t cgi_worker_key;
 
-int swrite(const int fd, const void *buf, const size_t count);
+static inline struct cgi_worker *cgi_worker_get()
+{
+    return pthread_getspecific(cgi_worker_key);
+}
 
 struct cgi_request *cgi_req_create(int fd, int socket, struct session_request *sr,
 					struct client_session *cs);
-void cgi_req_add(struct cgi_request *r);
+int cgi_req_start(struct cgi_request *r, int in_fd, int out_fd);
 int cgi_req_del(struct cgi_request *r);
-
-// Get the CGI request by the client socket
+void cgi_req_cleanup(struct cgi_request *r, int fd);
+void cgi_req_detach(void *data);
+void cgi_req_close_post(struct cgi_request *r);
+
+int cgi_spawner_init(int workers);
+void cgi_spawner_attach(struct cgi_worker *w);
+int cgi_spawn_request(struct cgi_worker *w, const char *path, const char *dir,
+                      char *const argv[], char *const env[]);
+int cgi_spawn_reply(struct cgi_worker *w, pid_t *pid, int *in_fd, int *out_fd);
+void cgi_spawner_close(struct cgi_worker *w);
+pid_t cgi_spawn_fork(const char *path, const char *dir,
+                     char *const argv[], char *const env[],
+                     int *in_fd, int *out_fd);
+
+// Get the CGI request by the client socket, it lives in the session data slot
 static inline struct cgi_request *cgi_req_get(int socket)
 {
-    struct cgi_request *r = requests_by_socket[socket];
+    struct client_session *cs = mk_api->session_get(socket);
+
+    if (!cs)
+        return NULL;
 
-    return r;
+    return mk_api->session_data_get(_plugin_info.plugin, cs);
 }
 
 // Get the CGI request by the CGI app's fd
 static inline struct cgi_request *cgi_req_get_by_fd(int fd)
 {
-    struct mk_list *list, *node;
+    struct cgi_worker *w = cgi_worker_get();
     struct cgi_request *r;
 
-    list = pthread_getspecific(cgi_request_list);
-    if (mk_list_is_empty(list) == 0)
+    if (fd < 0 || fd >= w->size)
         return NULL;
 
-    mk_list_foreach(node, list) {
-        r = mk_list_entry(node, struct cgi_request, _head);
-        if (r->fd == fd)
-            return r;
-    }
+    r = w->fds[fd];
+    return (r && r->fd == fd) ? r : NULL;
+}
+
+// Get the CGI request by the pipe to the CGI app's stdin
+static inline struct cgi_request *cgi_req_get_by_post_fd(int fd)
+{
+    struct cgi_worker *w = cgi_worker_get();
+    struct cgi_request *r;
+
+    if (fd < 0 || fd >= w->size)
+        return NULL;
 
-    return NULL;
+    r = w->fds[fd];
+    return (r && r->post_fd == fd) ? r : NULL;
 }
 
 #endif
@@ -21,7 +21,7 @@
  */
 
 #include "cgi.h"
-#include <fcntl.h>
+#include <errno.h>
 
 /* Get the earliest break between headers and content.
 
@@ -59,215 +59,372 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
-static void done(struct cgi_request * const r) {
+/* Take the status out of a "Status: " or "HTTP/1.x" line at the start */
+static const char *parse_status(struct cgi_request * const r,
+                                const char *buf, const char *end)
+{
+    const char *endl;
+    int status;
+
+    if (end - buf >= 8 && memcmp(buf, "Status: ", 8) == 0)
+        status = atoi(buf + 8);
+    else if (end - buf >= 9 && memcmp(buf, "HTTP", 4) == 0)
+        status = atoi(buf + 9);
+    else
+        return buf;
+
+    endl = memchr(buf, '\n', end - buf);
+    if (!endl)
+        return buf;
+
+    mk_api->header_set_http_status(r->sr, status);
+    return endl + 1;
+}
 
-    if (!r)
-        return;
+/* Feed the response cache with the body on its way to the client */
+static int cache_write(struct mk_stream *stream, struct mk_stream_filter *filter,
+                       struct mk_output_buf *buf, size_t offset, size_t len)
+{
+    mk_api->rcache_store_body(stream->sr, buf->data + offset, len);
+    return mk_api->stream_filter_next(stream, filter, buf, offset, len);
+}
 
-    /* If the CGI app is fast, we might get a hangup event before
-     * a write event. Try to write things out first. */
-    _mkp_event_write(r->socket);
+static int cache_end(struct mk_stream *stream, struct mk_stream_filter *filter)
+{
+    (void) filter;
 
-    mk_api->event_del(r->fd);
+    mk_api->rcache_store_end(stream->sr);
+    return 0;
+}
 
-    if (r->chunked)
-    {
-        swrite(r->socket, "0\r\n\r\n", 5);
+static void cache_free(struct mk_stream_filter *filter)
+{
+    mk_api->mem_free(filter);
+}
+
+/*
+ * The headers are out, the body is streamed by the core straight from
+ * the app's pipe. We only wake the connection up when the pipe has data.
+ */
+static int stream_body(struct cgi_request * const r, const char *data,
+                       const size_t len)
+{
+    struct mk_stream *stream;
+    struct mk_stream_filter *cache;
+
+    stream = mk_api->stream_fd(r->cs, r->sr, r->fd, MK_FALSE);
+    if (!stream)
+        return -1;
+
+    /* Nothing to fill when the headers said the response can't be kept */
+    if (r->sr->rcache) {
+        cache = mk_api->mem_alloc_z(sizeof(struct mk_stream_filter));
+        if (!cache)
+            return -1;
+        cache->write = cache_write;
+        cache->end = cache_end;
+        cache->free = cache_free;
+        mk_api->stream_filter_add(stream, cache);
     }
 
-    /* XXX Fixme: this needs to be atomic */
-    requests_by_socket[r->socket] = NULL;
+    if (r->chunked && mk_api->stream_filter_chunked(stream) != 0)
+        return -1;
 
-    /* Note: Must make sure we ignore the close event caused by this line */
-    mk_api->http_request_end(r->socket);
-    mk_api->socket_close(r->fd);
+    /* What came along with the headers goes first */
+    if (len > 0 && mk_api->stream_write_copy(stream, data, len) != 0)
+        return -1;
 
+    r->streaming = 1;
+    mk_api->event_socket_change_mode(r->fd, MK_EPOLL_READ, MK_EPOLL_EDGE_TRIGGERED);
+    mk_api->event_socket_change_mode(r->socket, MK_EPOLL_WRITE, MK_EPOLL_LEVEL_TRIGGERED);
 
-    cgi_req_del(r);
+    return 0;
 }
 
-static int hangup(const int socket)
+/* The app failed, the request is detached at its end */
+static void fail(struct cgi_request * const r)
 {
-    struct cgi_request *r = cgi_req_get_by_fd(socket);
+    const int socket = r->socket;
 
-    if (r) {
+    mk_api->rcache_abort(r->sr);
+    if (r->sr->headers.sent == MK_FALSE)
+        mk_api->http_request_error(MK_SERVER_INTERNAL_ERROR, r->cs, r->sr);
 
-        /* This kind of sucks, but epoll can give a hangup while
-           we still have a lot of data to read.
-
-           At this point we must turn the socket to blocking, otherwise
-           the data won't get across fully.
-        */
-
-        fcntl(r->socket, F_SETFL, fcntl(r->socket, F_GETFL, 0) & ~O_NONBLOCK);
-        while (1) {
-            int ret = _mkp_event_read(socket);
-            if (ret == MK_PLUGIN_RET_EVENT_CLOSE) {
-                done(r);
-                break;
-            }
+    mk_api->http_request_end(socket);
+}
 
-            ret = _mkp_event_write(r->socket);
-            if (ret == MK_PLUGIN_RET_EVENT_CLOSE) {
-                done(r);
-                break;
-            }
+/*
+ * Look for the end of the headers in what was read so far. Apps write
+ * them a line at a time, nothing is sent until all of them are in.
+ */
+static int headers(struct cgi_request * const r, const int eof)
+{
+    unsigned char advance = 4;
+    const char *outptr = r->in_buf;
+    const char *bufend = r->in_buf + r->in_len;
+    char *end;
+
+    end = getearliestbreak(r->in_buf, r->in_len, &advance);
+    if (!end) {
+        if (!eof)
+            return (r->in_len < sizeof(r->in_buf)) ? 0 : -1;
+
+        /* No body, the blank line is added if the app forgot it */
+        if (r->in_len == 0)
+            return -1;
+        end = (char *) bufend;
+        advance = 0;
+    }
+    end += advance;
+
+    outptr = parse_status(r, outptr, end);
+
+    /*
+     * The cache takes the headers before they are sent, the core drops
+     * the rows added by plugins once they are out.
+     */
+    if (mk_api->rcache_store_headers(r->sr, outptr, end - outptr) != 0)
+        mk_api->rcache_store_end(r->sr);
+
+    mk_api->socket_cork_flag(r->socket, TCP_CORK_ON);
+    mk_api->header_send(r->socket, r->cs, r->sr);
+
+    // Write the rest of the headers without chunking
+    if (mk_api->output_add_copy(&r->cs->output, outptr, end - outptr) != 0)
+        return -1;
+    if (advance == 0 && mk_api->output_add_copy(&r->cs->output, MK_CRLF, 2) != 0)
+        return -1;
+
+    return stream_body(r, end, bufend - end);
+}
+
+/* Write as much POST data as the app's stdin takes without blocking */
+static int write_post(struct cgi_request * const r)
+{
+    const struct session_request * const sr = r->sr;
+    ssize_t n;
+
+    while (r->post_off < sr->data.len) {
+        n = write(r->post_fd, sr->data.data + r->post_off,
+                  sr->data.len - r->post_off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return MK_PLUGIN_RET_EVENT_OWNED;
+
+            /* The app quit reading, it's up to it to answer */
+            break;
         }
 
-        return MK_PLUGIN_RET_EVENT_OWNED;
+        r->post_off += n;
+    }
 
-    } else if ((r = cgi_req_get(socket))) {
+    cgi_req_close_post(r);
 
-        /* If this was closed by us, do nothing */
-        if (!requests_by_socket[r->socket])
-            return MK_PLUGIN_RET_EVENT_OWNED;
+    return MK_PLUGIN_RET_EVENT_OWNED;
+}
 
-        mk_api->event_del(r->fd);
-        mk_api->socket_close(r->fd);
+/*
+ * Read from the app until its headers are complete. Returns 1 if the
+ * pipe is empty, -1 if the request failed and was ended.
+ */
+static int pull(struct cgi_request * const r)
+{
+    int n = read(r->fd, r->in_buf + r->in_len, sizeof(r->in_buf) - r->in_len);
 
-        /* XXX Fixme: this needs to be atomic */
-        requests_by_socket[r->socket] = NULL;
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
 
-        cgi_req_del(r);
+    if (n > 0)
+        r->in_len += n;
 
-        return MK_PLUGIN_RET_EVENT_OWNED;
+    if (headers(r, n <= 0) != 0) {
+        fail(r);
+        return -1;
     }
 
-    return MK_PLUGIN_RET_EVENT_CONTINUE;
+    return 0;
 }
 
-int _mkp_event_write(int socket)
+/* The app could not be run, the request is detached at its end */
+static void spawn_fail(struct cgi_request * const r)
 {
-    struct cgi_request *r = cgi_req_get(socket);
-    if (!r) return MK_PLUGIN_RET_EVENT_NEXT;
+    const int socket = r->socket;
 
-    if (r->in_len > 0) {
+    mk_err("Failed to spawn the CGI app");
+    mk_api->http_request_error(MK_CLIENT_FORBIDDEN, r->cs, r->sr);
+    mk_api->http_request_end(socket);
+}
 
-        mk_api->socket_cork_flag(socket, TCP_CORK_ON);
+/* Take the oldest spawn off the queue, the helper answers in order */
+static struct cgi_request *spawn_next(struct cgi_worker * const w)
+{
+    struct cgi_request *r;
 
-        const char * const buf = r->in_buf, *outptr = r->in_buf;
+    if (mk_list_is_empty(&w->spawns) == 0)
+        return NULL;
 
-        if (!r->status_done && r->in_len >= 8) {
-            if (memcmp(buf, "Status: ", 8) == 0) {
-                int status = atoi(buf + 8);
-                mk_api->header_set_http_status(r->sr, status);
+    r = mk_list_entry_first(&w->spawns, struct cgi_request, _head);
+    mk_list_del(&r->_head);
+    r->spawning = 0;
 
-                char *endl = memchr(buf + 8, '\n', r->in_len - 8);
-                if (!endl) {
-                    return MK_PLUGIN_RET_EVENT_OWNED;
-                }
-                else {
-                    endl++;
-                    outptr = endl;
-                    r->in_len -= endl - buf;
-                }
+    return r;
+}
 
-            }
-            else if (memcmp(buf, "HTTP", 4) == 0) {
-                int status = atoi(buf + 9);
-                mk_api->header_set_http_status(r->sr, status);
-
-                char *endl = memchr(buf + 8, '\n', r->in_len - 8);
-                if (!endl) {
-                    return MK_PLUGIN_RET_EVENT_OWNED;
-                }
-                else {
-                    endl++;
-                    outptr = endl;
-                    r->in_len -= endl - buf;
-                }
-            }
+/* The helper is gone, nothing queued will ever be answered */
+static void spawn_lost(struct cgi_worker * const w)
+{
+    struct cgi_request *r;
+
+    cgi_spawner_close(w);
 
-            mk_api->header_send(socket, r->cs, r->sr);
+    while ((r = spawn_next(w))) {
+        if (r->sr)
+            spawn_fail(r);
+        if (!r->sr)
+            cgi_req_del(r);
+    }
+}
 
-            r->status_done = 1;
+/* Hook the apps started by the helper to their requests */
+static int spawn_replies(struct cgi_worker * const w)
+{
+    struct cgi_request *r;
+    int ret, in_fd, out_fd;
+    pid_t pid;
+
+    while ((ret = cgi_spawn_reply(w, &pid, &in_fd, &out_fd)) == 1) {
+        r = spawn_next(w);
+        if (!r) {
+            /* An answer nobody asked for, the channel can't be trusted */
+            if (pid >= 0) {
+                close(in_fd);
+                close(out_fd);
+            }
+            ret = -1;
+            break;
         }
 
-        if (!r->all_headers_done)
-        {
-            unsigned char advance = 4;
-
-            // Write the rest of the headers without chunking
-            char *end = getearliestbreak(outptr, r->in_len, &advance);
-            if (!end)
-            {
-                swrite(socket, outptr, r->in_len);
-                r->in_len = 0;
-                mk_api->event_socket_change_mode(socket, MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
-                return MK_PLUGIN_RET_EVENT_OWNED;
+        /* Nobody waits for the app anymore */
+        if (!r->sr) {
+            if (pid >= 0) {
+                close(in_fd);
+                close(out_fd);
             }
+            cgi_req_del(r);
+            continue;
+        }
+
+        if (pid < 0 || cgi_req_start(r, in_fd, out_fd) != 0) {
+            spawn_fail(r);
+            if (!r->sr)
+                cgi_req_del(r);
+        }
+    }
+
+    if (ret < 0)
+        spawn_lost(w);
 
-            end += advance;
+    return MK_PLUGIN_RET_EVENT_OWNED;
+}
 
-            int len = end - outptr;
+static int hangup(const int socket)
+{
+    struct cgi_worker *w = cgi_worker_get();
+    struct cgi_request *r = cgi_req_get_by_fd(socket);
 
-            swrite(socket, outptr, len);
-            outptr += len;
-            r->in_len -= len;
+    if (socket == w->channel) {
+        /* Answers sent before the helper went away are still readable */
+        return spawn_replies(w);
 
-            r->all_headers_done = 1;
+    } else if (r) {
 
-            if (r->in_len == 0)
-            {
-                mk_api->event_socket_change_mode(socket, MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
-                return MK_PLUGIN_RET_EVENT_OWNED;
-            }
-        }
+        /* This kind of sucks, but epoll can give a hangup while
+           we still have a lot of data to read. Once streaming,
+           the core reads the pipe until its end. */
 
-        int ret;
+        if (!r->sr) {
+            cgi_req_cleanup(r, socket);
+            return MK_PLUGIN_RET_EVENT_OWNED;
+        }
 
-        if (r->chunked)
-        {
-            char tmp[16];
-            int len = snprintf(tmp, 16, "%x%s", r->in_len, MK_CRLF);
-            ret = swrite(socket, tmp, len);
-            if (ret < 0)
-                return MK_PLUGIN_RET_EVENT_CLOSE;
+        if (r->streaming) {
+            mk_api->stream_resume(r->cs);
+            return MK_PLUGIN_RET_EVENT_OWNED;
         }
 
-        ret = swrite(socket, outptr, r->in_len);
-        if (ret < 0)
-            return MK_PLUGIN_RET_EVENT_CLOSE;
+        while (pull(r) == 0 && !r->streaming);
 
-        r->in_len = 0;
-        mk_api->event_socket_change_mode(socket, MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
-        mk_api->event_socket_change_mode(r->fd, MK_EPOLL_READ, MK_EPOLL_LEVEL_TRIGGERED);
+        if (!r->sr)
+            cgi_req_cleanup(r, socket);
 
-        if (r->chunked)
-        {
-            swrite(socket, MK_CRLF, 2);
+        return MK_PLUGIN_RET_EVENT_OWNED;
+
+    } else if ((r = cgi_req_get_by_post_fd(socket))) {
+
+        if (!r->sr)
+            cgi_req_cleanup(r, socket);
+        else
+            cgi_req_close_post(r);
+
+        return MK_PLUGIN_RET_EVENT_OWNED;
+    }
+
+    /* A client going away is handled by the core, the session data slot
+       detaches its CGI */
+    return MK_PLUGIN_RET_EVENT_CONTINUE;
+}
+
+int _mkp_event_write(int socket)
+{
+    struct cgi_request *r = cgi_req_get(socket);
+    if (!r) {
+        r = cgi_req_get_by_post_fd(socket);
+        if (r && !r->sr) {
+            cgi_req_cleanup(r, socket);
+            return MK_PLUGIN_RET_EVENT_OWNED;
         }
+        if (r)
+            return write_post(r);
 
-        mk_api->socket_cork_flag(socket, TCP_CORK_OFF);
+        return MK_PLUGIN_RET_EVENT_NEXT;
     }
 
+    /* The core drives the body stream */
+    if (r->streaming)
+        return MK_PLUGIN_RET_EVENT_CONTINUE;
+
+    /* Nothing to send before the headers are complete */
+    mk_api->event_socket_change_mode(socket, MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
     return MK_PLUGIN_RET_EVENT_OWNED;
 }
 
 int _mkp_event_read(int fd)
 {
-    struct cgi_request *r = cgi_req_get_by_fd(fd);
-    if (!r) return MK_PLUGIN_RET_EVENT_NEXT;
-
-    size_t count = PATHLEN - r->in_len;
+    struct cgi_worker *w = cgi_worker_get();
+    struct cgi_request *r;
 
-    /* Too much to read? Start writing. */
-    if (count < 1)
-    {
-        mk_api->event_socket_change_mode(r->fd, MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
-        goto out;
-    }
+    if (fd == w->channel)
+        return spawn_replies(w);
 
-    int n = read(r->fd, r->in_buf + r->in_len, count);
+    r = cgi_req_get_by_fd(fd);
+    if (!r) return MK_PLUGIN_RET_EVENT_NEXT;
 
-    if (n <=0)
-        return MK_PLUGIN_RET_EVENT_CLOSE;
+    /* Nobody waits for the app anymore */
+    if (!r->sr) {
+        cgi_req_cleanup(r, fd);
+        return MK_PLUGIN_RET_EVENT_OWNED;
+    }
 
-    r->in_len += n;
+    /* The pipe has data for the stream */
+    if (r->streaming) {
+        mk_api->stream_resume(r->cs);
+        return MK_PLUGIN_RET_EVENT_OWNED;
+    }
 
-out:
-    /* Now we do have something to write */
-    mk_api->event_socket_change_mode(r->socket, MK_EPOLL_WRITE, MK_EPOLL_LEVEL_TRIGGERED);
+    /* A failed request was detached at its end */
+    pull(r);
+    if (!r->sr)
+        cgi_req_cleanup(r, fd);
 
     return MK_PLUGIN_RET_EVENT_OWNED;
 }
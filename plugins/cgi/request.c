@@ -18,6 +18,7 @@
  *  MA 02110-1301  USA.
  */
 
+#include <fcntl.h>
 #include "cgi.h"
 
 struct cgi_request *cgi_req_create(int fd, int socket, struct session_request *sr,
@@ -27,6 +28,7 @@ struct cgi_request *cgi_req_create(int fd, int socket, struct session_request *s
     if (!newcgi) return NULL;
 
     newcgi->fd = fd;
+    newcgi->post_fd = -1;
     newcgi->socket = socket;
     newcgi->sr = sr;
     newcgi->cs = cs;
@@ -34,20 +36,132 @@ struct cgi_request *cgi_req_create(int fd, int socket, struct session_request *s
     return newcgi;
 }
 
-void cgi_req_add(struct cgi_request *r)
+/* Point the worker's fd table at the request, growing it as needed */
+static int cgi_req_index(struct cgi_request *r, int fd)
 {
-    struct mk_list *list = pthread_getspecific(cgi_request_list);
+    struct cgi_worker *w = cgi_worker_get();
+    struct cgi_request **fds;
+    int size;
 
-    mk_bug(!list);
-    mk_list_add(&r->_head, list);
+    if (fd >= w->size) {
+        size = w->size;
+        while (size <= fd)
+            size *= 2;
+
+        fds = mk_api->mem_realloc(w->fds, sizeof(struct cgi_request *) * size);
+        if (!fds)
+            return -1;
+
+        memset(fds + w->size, 0, sizeof(struct cgi_request *) * (size - w->size));
+        w->fds = fds;
+        w->size = size;
+    }
+
+    w->fds[fd] = r;
+    return 0;
+}
+
+static void cgi_req_unindex(int fd)
+{
+    struct cgi_worker *w = cgi_worker_get();
+
+    if (fd >= 0 && fd < w->size)
+        w->fds[fd] = NULL;
+}
+
+/* The app is running, hook its pipes to the worker's event loop */
+int cgi_req_start(struct cgi_request *r, int in_fd, int out_fd)
+{
+    struct plugin *plugin = _plugin_info.plugin;
+
+    if (cgi_req_index(r, out_fd) != 0 ||
+        (r->sr->data.len && cgi_req_index(r, in_fd) != 0)) {
+        cgi_req_unindex(out_fd);
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+    r->fd = out_fd;
+
+    /* POST data is written from the event loop, as the app reads it */
+    if (r->sr->data.len) {
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL, 0) | O_NONBLOCK);
+        r->post_fd = in_fd;
+        mk_api->event_add(in_fd, MK_EPOLL_WRITE, plugin, MK_EPOLL_LEVEL_TRIGGERED);
+    }
+    else {
+        close(in_fd);
+    }
+
+    /* The body is streamed from the pipe by the core, it must not block */
+    fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL, 0) | O_NONBLOCK);
+    mk_api->event_add(out_fd, MK_EPOLL_READ, plugin, MK_EPOLL_LEVEL_TRIGGERED);
+
+    return 0;
 }
 
 int cgi_req_del(struct cgi_request *r)
 {
     if (!r) return 1;
 
-    mk_list_del(&r->_head);
+    if (r->spawning)
+        mk_list_del(&r->_head);
+
     free(r);
 
     return 0;
 }
+
+/*
+ * Close the pipe of a detached CGI the event came from, each pipe is
+ * closed by its own event. The request is freed with the last of them.
+ */
+void cgi_req_cleanup(struct cgi_request *r, int fd)
+{
+    if (fd == r->post_fd) {
+        cgi_req_close_post(r);
+    }
+    else {
+        cgi_req_unindex(r->fd);
+        mk_api->event_del(r->fd);
+        mk_api->socket_close(r->fd);
+        r->fd = -1;
+    }
+
+    if (r->fd < 0 && r->post_fd < 0)
+        cgi_req_del(r);
+}
+
+/*
+ * The request is over or its session went away. An event of the pipes
+ * may still be due in the current epoll round, closing them here would
+ * hand it to whoever gets the fd number next, so they are closed by
+ * their next event: the pipe is put back to level triggered mode, it
+ * fires as soon as the app writes or exits.
+ */
+void cgi_req_detach(void *data)
+{
+    struct cgi_request *r = data;
+
+    r->sr = NULL;
+    r->cs = NULL;
+    r->socket = -1;
+
+    /* Still spawning, the request is freed when the spawner answers */
+    if (r->fd < 0)
+        return;
+
+    mk_api->event_socket_change_mode(r->fd, MK_EPOLL_READ, MK_EPOLL_LEVEL_TRIGGERED);
+}
+
+/* Stop writing POST data, the app gets EOF on its stdin */
+void cgi_req_close_post(struct cgi_request *r)
+{
+    if (r->post_fd < 0)
+        return;
+
+    cgi_req_unindex(r->post_fd);
+    mk_api->event_del(r->post_fd);
+    close(r->post_fd);
+    r->post_fd = -1;
+}
@@ -0,0 +1,544 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2012-2013, Lauri Kasanen
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA.
+ */
+
+/*
+ * CGI apps are not forked from the workers: one helper process per
+ * worker is forked when the plugin loads, while Monkey is still single
+ * threaded and small, and it runs the apps of its worker with
+ * posix_spawn(). Each worker owns one end of a socketpair to its helper;
+ * it sends the path, arguments and environment of the app and goes on
+ * with other connections. The helper answers with the pipes to the app
+ * stdin and stdout as SCM_RIGHTS, the reply is read from the worker's
+ * event loop. If the helper is not there, the app is forked from the
+ * worker like it used to be.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "cgi.h"
+
+/* Largest spawn request: path, directory, arguments and environment */
+#define CGI_SPAWN_MSG_MAX  (PATHLEN * 24)
+#define CGI_SPAWN_ENV_MAX  32
+
+struct cgi_spawn_msg {
+    unsigned short argc;
+    unsigned short envc;
+};
+
+struct cgi_spawn_reply {
+    int err;
+    pid_t pid;
+};
+
+/* Worker ends of the socketpairs, claimed by each worker on startup */
+static int *spawner_channels;
+static int spawner_count;
+static int spawner_next;
+
+/* Copy the strings of a spawn request into ptrs, NULL terminated */
+static char *spawner_unpack(char **p, char *end, char **ptrs, int n)
+{
+    int i;
+    char *nul;
+
+    for (i = 0; i < n; i++) {
+        nul = memchr(*p, '\0', end - *p);
+        if (!nul) {
+            return NULL;
+        }
+        ptrs[i] = *p;
+        *p = nul + 1;
+    }
+    ptrs[n] = NULL;
+
+    return *p;
+}
+
+static void spawner_handle(int channel, char *buf, int len)
+{
+    int ret;
+    int in[2] = { -1, -1 }, out[2] = { -1, -1 };
+    char *p, *end = buf + len;
+    char *path[2], *dir[2];
+    char *argv[4], *env[CGI_SPAWN_ENV_MAX + 1];
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cgi_spawn_msg *msg = (struct cgi_spawn_msg *) buf;
+    struct cgi_spawn_reply reply;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t set;
+
+    reply.err = EINVAL;
+    reply.pid = -1;
+    p = buf + sizeof(struct cgi_spawn_msg);
+
+    if (len < (int) sizeof(struct cgi_spawn_msg) ||
+        msg->argc < 1 || msg->argc > 3 || msg->envc > CGI_SPAWN_ENV_MAX ||
+        !spawner_unpack(&p, end, path, 1) ||
+        !spawner_unpack(&p, end, dir, 1) ||
+        !spawner_unpack(&p, end, argv, msg->argc) ||
+        !spawner_unpack(&p, end, env, msg->envc)) {
+        goto reply;
+    }
+
+    /* The helper has no threads, the app inherits its directory */
+    if (chdir(dir[0]) != 0) {
+        reply.err = errno;
+        goto reply;
+    }
+
+    if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0) {
+        reply.err = errno;
+        goto reply;
+    }
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+    posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+
+    /* Restore signals for the child */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                             POSIX_SPAWN_SETSIGDEF);
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&attr, &set);
+    sigfillset(&set);
+    posix_spawnattr_setsigdefault(&attr, &set);
+
+    ret = posix_spawn(&reply.pid, path[0], &fa, &attr, argv, env);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+
+    close(in[0]);
+    close(out[1]);
+    in[0] = out[1] = -1;
+
+    if (ret != 0) {
+        reply.err = ret;
+        reply.pid = -1;
+        goto reply;
+    }
+    reply.err = 0;
+
+ reply:
+    iov.iov_base = &reply;
+    iov.iov_len = sizeof(reply);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (reply.err == 0) {
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof(cbuf);
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        memcpy(CMSG_DATA(cmsg), &in[1], sizeof(int));
+        memcpy(CMSG_DATA(cmsg) + sizeof(int), &out[0], sizeof(int));
+    }
+
+    sendmsg(channel, &mh, MSG_NOSIGNAL);
+
+    if (in[0] >= 0) close(in[0]);
+    if (in[1] >= 0) close(in[1]);
+    if (out[0] >= 0) close(out[0]);
+    if (out[1] >= 0) close(out[1]);
+}
+
+/* Close everything inherited from Monkey but stdio and the channels */
+static void spawner_close_fds(int *channels, int n)
+{
+    int i, fd;
+    DIR *dir;
+    struct dirent *ent;
+
+    dir = opendir("/proc/self/fd");
+    if (!dir) {
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        fd = atoi(ent->d_name);
+        if (fd <= 2 || fd == dirfd(dir)) {
+            continue;
+        }
+        for (i = 0; i < n && channels[i] != fd; i++);
+        if (i == n) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+/* Same as the core does for the workers, but never run apps as root */
+static void spawner_set_uidgid()
+{
+    struct passwd *usr;
+    char *user = mk_api->config->user;
+
+    if (geteuid() != 0 || !user) {
+        return;
+    }
+
+    if ((usr = getpwnam(user)) == NULL) {
+        mk_err("CGI: Invalid user '%s'", user);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (initgroups(user, usr->pw_gid) != 0 ||
+        setgid(usr->pw_gid) == -1 || setuid(usr->pw_uid) == -1) {
+        mk_err("CGI: Cannot change to user '%s'", user);
+        _exit(EXIT_FAILURE);
+    }
+}
+
+static void spawner_run(int *channels, int n)
+{
+    int i, len, alive = n;
+    int devnull;
+    char buf[CGI_SPAWN_MSG_MAX];
+    struct pollfd *pfd;
+
+    setsid();
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGHUP,  SIG_DFL);
+
+    devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, 0);
+        dup2(devnull, 1);
+        if (devnull > 2) close(devnull);
+    }
+
+    spawner_close_fds(channels, n);
+    spawner_set_uidgid();
+
+    pfd = malloc(sizeof(struct pollfd) * n);
+    if (!pfd) {
+        _exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++) {
+        pfd[i].fd = channels[i];
+        pfd[i].events = POLLIN;
+    }
+
+    /* Serve until Monkey goes away and the channels are closed */
+    while (alive > 0) {
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (pfd[i].fd < 0 || !pfd[i].revents) {
+                continue;
+            }
+
+            len = recv(pfd[i].fd, buf, sizeof(buf), 0);
+            if (len > 0) {
+                spawner_handle(pfd[i].fd, buf, len);
+                continue;
+            }
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+
+            close(pfd[i].fd);
+            pfd[i].fd = -1;
+            alive--;
+        }
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+int cgi_spawner_init(int workers)
+{
+    int i;
+    int sv[2];
+    int *helper;
+    pid_t pid;
+
+    spawner_channels = mk_api->mem_alloc_z(sizeof(int) * workers);
+    helper = mk_api->mem_alloc_z(sizeof(int) * workers);
+    if (!spawner_channels || !helper) {
+        return -1;
+    }
+
+    for (i = 0; i < workers; i++) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+            mk_err("CGI: Failed to create spawner socket");
+            goto error;
+        }
+        spawner_channels[i] = sv[0];
+        helper[i] = sv[1];
+        spawner_count++;
+    }
+
+    /* One helper per worker, a worker never waits behind the others */
+    for (i = 0; i < workers; i++) {
+        pid = fork();
+        if (pid < 0) {
+            mk_err("CGI: Failed to fork the spawner");
+            goto error;
+        }
+
+        if (pid == 0) {
+            spawner_run(&helper[i], 1);
+        }
+    }
+
+    for (i = 0; i < workers; i++) {
+        close(helper[i]);
+    }
+    mk_api->mem_free(helper);
+
+    return 0;
+
+ error:
+    /* Helpers already running exit once their channel is closed */
+    for (i = 0; i < spawner_count; i++) {
+        close(spawner_channels[i]);
+        close(helper[i]);
+    }
+    spawner_count = 0;
+    mk_api->mem_free(helper);
+
+    return -1;
+}
+
+/* Called from each worker thread, the replies come on its event loop */
+void cgi_spawner_attach(struct cgi_worker *w)
+{
+    int i = __sync_fetch_and_add(&spawner_next, 1);
+
+    w->channel = -1;
+    if (i >= spawner_count) {
+        return;
+    }
+
+    w->channel = spawner_channels[i];
+    fcntl(w->channel, F_SETFL, fcntl(w->channel, F_GETFL, 0) | O_NONBLOCK);
+    if (mk_api->event_add(w->channel, MK_EPOLL_READ, _plugin_info.plugin,
+                          MK_EPOLL_LEVEL_TRIGGERED) != 0) {
+        close(w->channel);
+        w->channel = -1;
+    }
+}
+
+/* The helper went away, apps are forked from the worker from now on */
+void cgi_spawner_close(struct cgi_worker *w)
+{
+    mk_warn("CGI: Lost the spawner, forking from the worker");
+    mk_api->event_del(w->channel);
+    close(w->channel);
+    w->channel = -1;
+}
+
+/* Fallback, fork the app from the worker */
+pid_t cgi_spawn_fork(const char *path, const char *dir,
+                        char *const argv[], char *const env[],
+                        int *in_fd, int *out_fd)
+{
+    /* pipes, from monkey's POV */
+    int writepipe[2], readpipe[2];
+    if (pipe2(writepipe, O_CLOEXEC)) {
+        return -1;
+    }
+    if (pipe2(readpipe, O_CLOEXEC)) {
+        close(writepipe[0]);
+        close(writepipe[1]);
+        return -1;
+    }
+
+    pid_t pid = vfork();
+    if (pid < 0) {
+        close(writepipe[0]);
+        close(writepipe[1]);
+        close(readpipe[0]);
+        close(readpipe[1]);
+        return -1;
+    }
+
+    /* Child */
+    if (pid == 0) {
+        /* Our stdin is the read end of monkey's writing */
+        if (dup2(writepipe[0], 0) < 0) {
+            _exit(1);
+        }
+
+        /* Our stdout is the write end of monkey's reading */
+        if (dup2(readpipe[1], 1) < 0) {
+            _exit(1);
+        }
+
+        /* Our stderr goes to /dev/null */
+        const int devnull = open("/dev/null", O_WRONLY);
+        if (dup2(devnull, 2) < 0) {
+            _exit(1);
+        }
+        close(devnull);
+
+        if (chdir(dir))
+            _exit(1);
+
+        /* Restore signals for the child */
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        execve(path, argv, env);
+
+        /* Exec failed, return */
+        _exit(1);
+    }
+
+    close(writepipe[0]);
+    close(readpipe[1]);
+
+    *in_fd = writepipe[1];
+    *out_fd = readpipe[0];
+
+    return pid;
+}
+
+static int spawn_pack(char **p, char *end, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (*p + len > end) {
+        return -1;
+    }
+    memcpy(*p, str, len);
+    *p += len;
+
+    return 0;
+}
+
+/*
+ * Ask the helper to run an app, the reply is read by cgi_spawn_reply()
+ * once the channel is readable. Returns -1 if the request could not be
+ * sent, the caller forks the app itself then.
+ */
+int cgi_spawn_request(struct cgi_worker *w, const char *path, const char *dir,
+                      char *const argv[], char *const env[])
+{
+    int i;
+    char buf[CGI_SPAWN_MSG_MAX];
+    char *p, *end = buf + sizeof(buf);
+    struct cgi_spawn_msg *msg = (struct cgi_spawn_msg *) buf;
+
+    if (w->channel < 0) {
+        return -1;
+    }
+
+    p = buf + sizeof(struct cgi_spawn_msg);
+    msg->argc = 0;
+    msg->envc = 0;
+
+    if (spawn_pack(&p, end, path) || spawn_pack(&p, end, dir)) {
+        return -1;
+    }
+    for (i = 0; argv[i]; i++, msg->argc++) {
+        if (spawn_pack(&p, end, argv[i])) return -1;
+    }
+    for (i = 0; env[i]; i++, msg->envc++) {
+        if (spawn_pack(&p, end, env[i])) return -1;
+    }
+
+    /* A full channel or a dead helper, the hangup event tells which */
+    if (send(w->channel, buf, p - buf, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the next reply of the helper. Returns 1 with the app pid and
+ * pipes (pid is -1 and errno set if it could not be run), 0 if there is
+ * no reply yet or -1 if the helper is gone.
+ */
+int cgi_spawn_reply(struct cgi_worker *w, pid_t *pid, int *in_fd, int *out_fd)
+{
+    int len;
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cgi_spawn_reply reply;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+
+    iov.iov_base = &reply;
+    iov.iov_len = sizeof(reply);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    do {
+        len = recvmsg(w->channel, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if (len != (int) sizeof(reply)) {
+        return -1;
+    }
+
+    *pid = -1;
+    if (reply.err != 0) {
+        errno = reply.err;
+        return 1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        errno = EINVAL;
+        return 1;
+    }
+    memcpy(in_fd, CMSG_DATA(cmsg), sizeof(int));
+    memcpy(out_fd, CMSG_DATA(cmsg) + sizeof(int), sizeof(int));
+    *pid = reply.pid;
+
+    return 1;
+}
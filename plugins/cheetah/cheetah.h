@@ -41,6 +41,9 @@
 #define MK_CHEETAH_CONFIG "config"
 #define MK_CHEETAH_CONFIG_SC "\\f"
 
+#define MK_CHEETAH_COUNTERS "counters"
+#define MK_CHEETAH_COUNTERS_SC "\\k"
+
 #define MK_CHEETAH_STATUS "status"
 #define MK_CHEETAH_STATUS_SC "\\s"
 
@@ -72,6 +75,9 @@
 #define MK_CHEETAH_ONEHOUR  3600
 #define MK_CHEETAH_ONEMINUTE  60
 
+/* Optional plugin symbol printing its counters */
+#define MK_CHEETAH_COUNTERS_SYM "_mkp_cheetah_counters"
+
 /* Configurarion: Listen */
 #define LISTEN_STDIN_STR "STDIN"
 #define LISTEN_SERVER_STR "SERVER"
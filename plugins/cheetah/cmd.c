@@ -56,6 +56,10 @@ int mk_cheetah_cmd(char *raw_cmd)
         strcmp(cmd, MK_CHEETAH_CONFIG_SC) == 0) {
         mk_cheetah_cmd_config();
     }
+    else if (strcmp(cmd, MK_CHEETAH_COUNTERS) == 0 ||
+             strcmp(cmd, MK_CHEETAH_COUNTERS_SC) == 0) {
+        mk_cheetah_cmd_counters();
+    }
     else if (strcmp(cmd, MK_CHEETAH_STATUS) == 0 ||
         strcmp(cmd, MK_CHEETAH_STATUS_SC) == 0) {
         mk_cheetah_cmd_status();
@@ -229,6 +233,49 @@ void mk_cheetah_cmd_plugins()
     CHEETAH_WRITE("\n");
 }
 
+/*
+ * Plugins may export _mkp_cheetah_counters(), it gets a printf like
+ * function to write its own counters on the shell. The core ones go
+ * first, if the response cache is enabled.
+ */
+void mk_cheetah_cmd_counters()
+{
+    int n = 0;
+    struct plugin *p;
+    struct mk_list *head;
+    void (*counters) (int (*)(const char *, ...));
+
+    if (mk_api->config->rcache_size > 0) {
+        CHEETAH_WRITE("%s[core]%s\n", ANSI_BOLD ANSI_YELLOW, ANSI_RESET);
+        mk_api->rcache_counters(mk_cheetah_write);
+        CHEETAH_WRITE("\n");
+        n++;
+    }
+
+    if (!mk_api->plugins) {
+        return;
+    }
+
+    mk_list_foreach(head, mk_api->plugins) {
+        p = mk_list_entry(head, struct plugin, _head);
+        counters = mk_api->plugin_load_symbol(p->handler,
+                                              MK_CHEETAH_COUNTERS_SYM);
+        if (!counters) {
+            continue;
+        }
+
+        CHEETAH_WRITE("%s[%s]%s\n", ANSI_BOLD ANSI_YELLOW, p->shortname,
+                      ANSI_RESET);
+        counters(mk_cheetah_write);
+        CHEETAH_WRITE("\n");
+        n++;
+    }
+
+    if (n == 0) {
+        CHEETAH_WRITE("No counters available\n\n");
+    }
+}
+
 void mk_cheetah_cmd_vhosts()
 {
     struct host *entry_host;
@@ -317,6 +364,7 @@ void mk_cheetah_cmd_help()
     CHEETAH_WRITE("\n----------------------------------------------------");
     CHEETAH_WRITE("\n?          (\\?)    Synonym for 'help'");
     CHEETAH_WRITE("\nconfig     (\\f)    Display global configuration");
+    CHEETAH_WRITE("\ncounters   (\\k)    Display response cache and plugins counters");
     CHEETAH_WRITE("\nplugins    (\\g)    List loaded plugins and associated stages");
     CHEETAH_WRITE("\nstatus     (\\s)    Display general web server information");
     CHEETAH_WRITE("\nuptime     (\\u)    Display how long the web server has been running");
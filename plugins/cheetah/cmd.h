@@ -35,6 +35,7 @@ void mk_cheetah_cmd_plugins_print_core(struct mk_list *list);
 void mk_cheetah_cmd_plugins_print_network(struct mk_list *list);
 void mk_cheetah_cmd_plugins();
 
+void mk_cheetah_cmd_counters();
 void mk_cheetah_cmd_vhosts();
 void mk_cheetah_cmd_workers();
 
@@ -106,7 +106,7 @@ static struct mk_f_list *mk_dirhtml_create_element(char *file,
                                             unsigned long *list_len)
 {
     int n;
-    struct tm *st_time;
+    struct tm st_time;
     struct mk_f_list *entry;
 
     entry = mk_api->mem_alloc_z(sizeof(struct mk_f_list));
@@ -120,8 +120,8 @@ static struct mk_f_list *mk_dirhtml_create_element(char *file,
     entry->type = type;
     entry->next = NULL;
 
-    st_time = localtime((time_t *) & entry->info.last_modification);
-    n = strftime(entry->ft_modif, MK_DIRHTML_FMOD_LEN, "%d-%b-%G %H:%M", st_time);
+    localtime_r((time_t *) &entry->info.last_modification, &st_time);
+    n = strftime(entry->ft_modif, MK_DIRHTML_FMOD_LEN, "%d-%b-%G %H:%M", &st_time);
     if (n == 0) {
         mk_mem_free(entry);
         return NULL;
@@ -192,6 +192,21 @@ static struct mk_f_list *mk_dirhtml_create_list(DIR * dir, char *path,
     return list;
 }
 
+static void mk_dirhtml_cache_init(size_t budget)
+{
+    int i;
+
+    dirhtml_cache.budget = budget;
+    dirhtml_cache.used = 0;
+    mk_list_init(&dirhtml_cache.lru);
+    mk_list_init(&dirhtml_cache.jobs);
+    for (i = 0; i < MK_DIRHTML_CACHE_SLOTS; i++) {
+        mk_list_init(&dirhtml_cache.slots[i]);
+    }
+    pthread_mutex_init(&dirhtml_cache.mutex, NULL);
+    pthread_cond_init(&dirhtml_cache.cond, NULL);
+}
+
 /* Read dirhtml config and themes */
 int mk_dirhtml_conf(char *confdir)
 {
@@ -219,6 +234,7 @@ int mk_dirhtml_conf(char *confdir)
 */
 int mk_dirhtml_read_config(char *path)
 {
+    long cache_size;
     unsigned long len;
     char *default_file = NULL;
     struct mk_config *conf;
@@ -243,6 +259,15 @@ int mk_dirhtml_read_config(char *path)
     mk_api->str_build(&dirhtml_conf->theme_path, &len,
                       "%sthemes/%s/", path, dirhtml_conf->theme);
 
+    /* Rendered listings cache, size in MB */
+    cache_size = (long) mk_api->config_section_getval(section, "CacheSize",
+                                                      MK_CONFIG_VAL_NUM);
+    if (cache_size < 0) {
+        mk_warn("Dirlisting: invalid CacheSize, cache disabled");
+        cache_size = 0;
+    }
+    mk_dirhtml_cache_init(cache_size * 1024 * 1024);
+
     mk_api->mem_free(default_file);
 
     if (mk_api->file_get_info(dirhtml_conf->theme_path, &finfo) != 0) {
@@ -600,31 +625,6 @@ static int mk_dirhtml_entry_cmp(const void *a, const void *b)
     return strcasecmp((*f_a)->name, (*f_b)->name);
 }
 
-static int mk_dirhtml_send(int fd, struct session_request *sr, struct mk_iov *data)
-{
-    int n;
-    unsigned long len;
-    char *buf = 0;
-
-    if (sr->protocol >= HTTP_PROTOCOL_11) {
-        /* Chunk header */
-        mk_api->str_build(&buf, &len, "%lx\r\n", data->total_len - 2);
-
-        /* Add chunked information */
-        mk_api->iov_set_entry(data, buf, len, MK_IOV_FREE_BUF, 0);
-    }
-    n = (int) mk_api->socket_sendv(fd, data);
-    return n;
-}
-
-static int mk_dirhtml_send_chunked_end(int fd)
-{
-    char *_end = "0\r\n\r\n";
-    int len = 5;
-
-    return mk_api->socket_send(fd, _end, len);
-}
-
 static void mk_dirhtml_free_list(struct mk_f_list **toc, unsigned long len)
 {
     unsigned int i;
@@ -642,12 +642,48 @@ static void mk_dirhtml_free_list(struct mk_f_list **toc, unsigned long len)
     mk_api->mem_free(toc);
 }
 
-int mk_dirhtml_init(struct client_session *cs, struct session_request *sr)
+/* Append the content of an iov to the page buffer */
+static int mk_dirhtml_page_append(struct dirhtml_page *page, struct mk_iov *iov)
+{
+    int i;
+    size_t size;
+    char *tmp;
+
+    if (page->len + iov->total_len > page->size) {
+        size = page->size;
+        while (page->len + iov->total_len > size) {
+            size += MK_DIRHTML_PAGE_CHUNK;
+        }
+
+        tmp = mk_api->mem_realloc(page->buf, size);
+        if (!tmp) {
+            return -1;
+        }
+        page->buf = tmp;
+        page->size = size;
+    }
+
+    for (i = 0; i < iov->iov_idx; i++) {
+        if (!iov->io[i].iov_base) {
+            continue;
+        }
+        memcpy(page->buf + page->len, iov->io[i].iov_base, iov->io[i].iov_len);
+        page->len += iov->io[i].iov_len;
+    }
+
+    return 0;
+}
+
+/*
+ * Render the listing of 'path' into a single contiguous buffer, so it
+ * can be cached and sent with a known Content-Length. It's also invoked
+ * from the cache thread, so it must not touch any request context.
+ */
+static int mk_dirhtml_render(char *path, char *title, struct dirhtml_page *page)
 {
     DIR *dir;
     unsigned int i = 0;
-    int is_chunked = MK_FALSE, n;
-    char *title = 0;
+    int ret = 0;
     mk_pointer sep;
 
     /* file info */
@@ -658,30 +694,22 @@ int mk_dirhtml_init(struct client_session *cs, struct session_request *sr)
     struct dirhtml_value *values_global = 0;
     struct dirhtml_value *values_entry = 0;
 
-    if (!(dir = opendir(sr->real_path.data))) {
+    if (!(dir = opendir(path))) {
         return -1;
     }
 
-    file_list = mk_dirhtml_create_list(dir, sr->real_path.data, &list_len);
-
-    /* Building headers */
-    mk_api->header_set_http_status(sr, MK_HTTP_OK);
-    sr->headers.cgi = SH_CGI;
-    sr->headers.breakline = MK_HEADER_BREAKLINE;
-    sr->headers.content_type = mk_dirhtml_default_mime;
-    sr->headers.content_length = -1;
+    file_list = mk_dirhtml_create_list(dir, path, &list_len);
+    closedir(dir);
 
-    if (sr->protocol >= HTTP_PROTOCOL_11) {
-        sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-        is_chunked = MK_TRUE;
-    }
+    page->buf = NULL;
+    page->len = 0;
+    page->size = 0;
 
     /*
      * Creating response template
      */
 
     /* Set %_html_title_% */
-    title = mk_api->pointer_to_buf(sr->uri_processed);
     values_global = mk_dirhtml_tag_assign(NULL, 0, mk_iov_none,
                                           title,
                                           (char **) _tags_global);
@@ -692,11 +720,11 @@ int mk_dirhtml_init(struct client_session *cs, struct session_request *sr)
 
     /* HTML Header */
     iov_header = mk_dirhtml_theme_compose(mk_dirhtml_tpl_header,
-                                          values_global, is_chunked);
+                                          values_global, MK_FALSE);
 
     /* HTML Footer */
     iov_footer = mk_dirhtml_theme_compose(mk_dirhtml_tpl_footer,
-                                          values_global, is_chunked);
+                                          values_global, MK_FALSE);
 
     /* Creating table of contents and sorting */
     toc = mk_api->mem_alloc(sizeof(struct mk_f_list *) * list_len);
@@ -709,19 +737,12 @@ int mk_dirhtml_init(struct client_session *cs, struct session_request *sr)
     }
     qsort(toc, list_len, sizeof(*toc), mk_dirhtml_entry_cmp);
 
-    /* Sending headers */
-    n = mk_api->header_send(cs->socket, cs, sr);
-    if (n < 0) {
-        goto exit;
-    }
-
-    n = mk_dirhtml_send(cs->socket, sr, iov_header);
-
-    if (n < 0) {
+    if (mk_dirhtml_page_append(page, iov_header) < 0) {
+        ret = -1;
         goto exit;
     }
 
-    /* sending TOC */
+    /* TOC */
     for (i = 0; i < list_len; i++) {
         /* %_target_title_% */
         if (toc[i]->type == DT_DIR) {
@@ -753,42 +774,330 @@ int mk_dirhtml_init(struct client_session *cs, struct session_request *sr)
                               toc[i]->size, (char **) _tags_entry);
 
         iov_entry = mk_dirhtml_theme_compose(mk_dirhtml_tpl_entry,
-                                             values_entry, is_chunked);
+                                             values_entry, MK_FALSE);
 
-        /* send entry */
-        n = mk_dirhtml_send(cs->socket, sr, iov_entry);
-
-        if ((i % 20) == 0) {
-            mk_api->socket_cork_flag(cs->socket, TCP_CORK_OFF);
-            mk_api->socket_cork_flag(cs->socket, TCP_CORK_ON);
-        }
-
-        if (n < 0) {
-            break;
-        }
+        ret = mk_dirhtml_page_append(page, iov_entry);
 
         /* free entry list */
         mk_dirhtml_tag_free_list(&values_entry);
         mk_api->iov_free(iov_entry);
-    }
 
-    n = mk_dirhtml_send(cs->socket, sr, iov_footer);
-    mk_api->socket_cork_flag(cs->socket, TCP_CORK_OFF);
-
-    if (sr->protocol >= HTTP_PROTOCOL_11 && n >= 0) {
-        mk_dirhtml_send_chunked_end(cs->socket);
+        if (ret < 0) {
+            goto exit;
+        }
     }
 
- exit:
-    closedir(dir);
+    ret = mk_dirhtml_page_append(page, iov_footer);
 
-    mk_api->mem_free(title);
+ exit:
     mk_dirhtml_tag_free_list(&values_global);
     mk_api->iov_free(iov_header);
     mk_api->iov_free(iov_footer);
     mk_dirhtml_free_list(toc, list_len);
 
-    return 0;
+    if (ret < 0) {
+        mk_api->mem_free(page->buf);
+        page->buf = NULL;
+    }
+
+    return ret;
+}
+
+/*
+ * Rendered listings cache
+ * -----------------------
+ * Entries are keyed by the directory path and the page title (the
+ * requested URI), and validated against the directory mtime reported by
+ * the core in sr->file_info, so a hit costs no extra syscall. When the
+ * directory changes the cached page is still served while the cache
+ * thread renders the new one. Entries are evicted in LRU order to keep
+ * the total size under the configured budget.
+ */
+static unsigned int mk_dirhtml_cache_hash(const char *path)
+{
+    unsigned int hash = 5381;
+
+    while (*path) {
+        hash = ((hash << 5) + hash) + (unsigned char) *path++;
+    }
+
+    return hash & (MK_DIRHTML_CACHE_SLOTS - 1);
+}
+
+static void mk_dirhtml_cache_entry_free(struct dirhtml_cache_entry *entry)
+{
+    mk_api->mem_free(entry->path);
+    mk_api->mem_free(entry->title);
+    mk_api->mem_free(entry->page.buf);
+    mk_api->mem_free(entry);
+}
+
+/* Unlink an entry, it's released once its last reader is done */
+static void mk_dirhtml_cache_unlink(struct dirhtml_cache_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    mk_list_del(&entry->_lru);
+    dirhtml_cache.used -= entry->page.len;
+    entry->unlinked = MK_TRUE;
+
+    if (entry->refs == 0) {
+        mk_dirhtml_cache_entry_free(entry);
+    }
+}
+
+static struct dirhtml_cache_entry *mk_dirhtml_cache_lookup(char *path,
+                                                           char *title)
+{
+    struct mk_list *head;
+    struct mk_list *slot;
+    struct dirhtml_cache_entry *entry;
+
+    slot = &dirhtml_cache.slots[mk_dirhtml_cache_hash(path)];
+    mk_list_foreach(head, slot) {
+        entry = mk_list_entry(head, struct dirhtml_cache_entry, _head);
+        if (strcmp(entry->path, path) == 0 && strcmp(entry->title, title) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Store a rendered page, replacing any previous version. The cache
+ * takes ownership of the strings and page buffer. Caller holds the lock.
+ */
+static struct dirhtml_cache_entry *mk_dirhtml_cache_put(char *path, char *title,
+                                                        time_t mtime,
+                                                        time_t rendered,
+                                                        struct dirhtml_page *page)
+{
+    struct dirhtml_cache_entry *entry, *old;
+
+    old = mk_dirhtml_cache_lookup(path, title);
+    if (old) {
+        mk_dirhtml_cache_unlink(old);
+    }
+
+    if (page->len > dirhtml_cache.budget) {
+        return NULL;
+    }
+
+    /* Evict least recently used entries until the page fits */
+    while (dirhtml_cache.used + page->len > dirhtml_cache.budget &&
+           mk_list_is_empty(&dirhtml_cache.lru) != 0) {
+        old = mk_list_entry_first(&dirhtml_cache.lru,
+                                  struct dirhtml_cache_entry, _lru);
+        PLUGIN_TRACE("cache evict '%s'", old->path);
+        mk_dirhtml_cache_unlink(old);
+    }
+
+    entry = mk_api->mem_alloc_z(sizeof(struct dirhtml_cache_entry));
+    entry->path = path;
+    entry->title = title;
+    entry->mtime = mtime;
+    entry->page = *page;
+
+    /*
+     * mtime has a one second resolution: if the directory changed in the
+     * same second we rendered it, a later change in that second would go
+     * unnoticed, so this entry must be rendered again.
+     */
+    entry->unsure = (mtime >= rendered);
+
+    mk_list_add(&entry->_head,
+                &dirhtml_cache.slots[mk_dirhtml_cache_hash(path)]);
+    mk_list_add(&entry->_lru, &dirhtml_cache.lru);
+    dirhtml_cache.used += page->len;
+
+    return entry;
+}
+
+static void mk_dirhtml_cache_release(void *data)
+{
+    struct dirhtml_cache_entry *entry = data;
+
+    pthread_mutex_lock(&dirhtml_cache.mutex);
+    entry->refs--;
+    if (entry->refs == 0 && entry->unlinked == MK_TRUE) {
+        mk_dirhtml_cache_entry_free(entry);
+    }
+    pthread_mutex_unlock(&dirhtml_cache.mutex);
+}
+
+/* Queue a background render for a stale entry. Caller holds the lock. */
+static void mk_dirhtml_cache_refresh(struct dirhtml_cache_entry *entry)
+{
+    struct dirhtml_cache_job *job;
+
+    if (entry->refreshing == MK_TRUE) {
+        return;
+    }
+
+    job = mk_api->mem_alloc(sizeof(struct dirhtml_cache_job));
+    job->path = mk_api->str_dup(entry->path);
+    job->title = mk_api->str_dup(entry->title);
+    mk_list_add(&job->_head, &dirhtml_cache.jobs);
+    entry->refreshing = MK_TRUE;
+
+    pthread_cond_signal(&dirhtml_cache.cond);
+}
+
+/* Cache thread: render stale entries out of the workers */
+static void mk_dirhtml_cache_worker(void *data)
+{
+    time_t rendered;
+    struct file_info finfo;
+    struct dirhtml_page page;
+    struct dirhtml_cache_job *job;
+    struct dirhtml_cache_entry *entry;
+
+    (void) data;
+    mk_api->worker_rename("monkey: dirlisting");
+
+    while (1) {
+        pthread_mutex_lock(&dirhtml_cache.mutex);
+        while (mk_list_is_empty(&dirhtml_cache.jobs) == 0) {
+            pthread_cond_wait(&dirhtml_cache.cond, &dirhtml_cache.mutex);
+        }
+        job = mk_list_entry_first(&dirhtml_cache.jobs,
+                                  struct dirhtml_cache_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&dirhtml_cache.mutex);
+
+        PLUGIN_TRACE("cache refresh '%s'", job->path);
+
+        rendered = time(NULL);
+        if (mk_api->file_get_info(job->path, &finfo) != 0 ||
+            mk_dirhtml_render(job->path, job->title, &page) != 0) {
+            /* The directory is gone, drop the cached page */
+            pthread_mutex_lock(&dirhtml_cache.mutex);
+            entry = mk_dirhtml_cache_lookup(job->path, job->title);
+            if (entry) {
+                mk_dirhtml_cache_unlink(entry);
+            }
+            pthread_mutex_unlock(&dirhtml_cache.mutex);
+
+            mk_api->mem_free(job->path);
+            mk_api->mem_free(job->title);
+        }
+        else {
+            pthread_mutex_lock(&dirhtml_cache.mutex);
+            if (!mk_dirhtml_cache_put(job->path, job->title,
+                                      finfo.last_modification, rendered,
+                                      &page)) {
+                mk_api->mem_free(job->path);
+                mk_api->mem_free(job->title);
+                mk_api->mem_free(page.buf);
+            }
+            pthread_mutex_unlock(&dirhtml_cache.mutex);
+        }
+
+        mk_api->mem_free(job);
+    }
+}
+
+/*
+ * Send the headers and queue the page as the response body, 'release'
+ * is invoked with 'priv' once the page has been written out.
+ */
+static int mk_dirhtml_send_page(struct client_session *cs,
+                                struct session_request *sr,
+                                struct dirhtml_page *page,
+                                void (*release) (void *), void *priv)
+{
+    int n;
+    struct mk_stream *stream;
+    struct mk_output_buf *buf;
+
+    /* Building headers */
+    mk_api->header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_type = mk_dirhtml_default_mime;
+    sr->headers.content_length = page->len;
+
+    n = mk_api->header_send(cs->socket, cs, sr);
+    if (n < 0 || sr->method == HTTP_METHOD_HEAD) {
+        mk_api->socket_cork_flag(cs->socket, TCP_CORK_OFF);
+        release(priv);
+        return (n < 0) ? -1 : 0;
+    }
+
+    /* The body leaves from the output queue, without copying the page */
+    buf = mk_api->output_buf_create(page->buf, page->len, release, priv);
+    if (!buf) {
+        release(priv);
+        return -1;
+    }
+
+    stream = mk_api->stream_buf(cs, sr, buf, 0, page->len);
+    mk_api->output_buf_release(buf);
+
+    return (stream) ? 0 : -1;
+}
+
+int mk_dirhtml_init(struct client_session *cs, struct session_request *sr)
+{
+    char *path;
+    char *title;
+    time_t rendered;
+    struct dirhtml_page page;
+    struct dirhtml_cache_entry *entry = NULL;
+
+    title = mk_api->pointer_to_buf(sr->uri_processed);
+
+    if (dirhtml_cache.budget > 0) {
+        pthread_mutex_lock(&dirhtml_cache.mutex);
+        entry = mk_dirhtml_cache_lookup(sr->real_path.data, title);
+        if (entry) {
+            if (entry->mtime != sr->file_info.last_modification ||
+                entry->unsure == MK_TRUE) {
+                mk_dirhtml_cache_refresh(entry);
+            }
+
+            /* Move to the most recently used end */
+            mk_list_del(&entry->_lru);
+            mk_list_add(&entry->_lru, &dirhtml_cache.lru);
+            entry->refs++;
+        }
+        pthread_mutex_unlock(&dirhtml_cache.mutex);
+    }
+
+    if (entry) {
+        PLUGIN_TRACE("[FD %i] cache hit '%s'", cs->socket, entry->path);
+        mk_api->mem_free(title);
+        return mk_dirhtml_send_page(cs, sr, &entry->page,
+                                    mk_dirhtml_cache_release, entry);
+    }
+
+    /* Cache miss: render in place */
+    rendered = time(NULL);
+    if (mk_dirhtml_render(sr->real_path.data, title, &page) != 0) {
+        mk_api->mem_free(title);
+        return -1;
+    }
+
+    if (dirhtml_cache.budget > 0) {
+        path = mk_api->str_dup(sr->real_path.data);
+
+        pthread_mutex_lock(&dirhtml_cache.mutex);
+        entry = mk_dirhtml_cache_put(path, title,
+                                     sr->file_info.last_modification,
+                                     rendered, &page);
+        if (entry) {
+            entry->refs++;
+        }
+        pthread_mutex_unlock(&dirhtml_cache.mutex);
+
+        if (entry) {
+            return mk_dirhtml_send_page(cs, sr, &entry->page,
+                                        mk_dirhtml_cache_release, entry);
+        }
+        mk_api->mem_free(path);
+    }
+
+    /* Not cached, the page buffer goes away with the response */
+    mk_api->mem_free(title);
+    return mk_dirhtml_send_page(cs, sr, &page, mk_api->mem_free, page.buf);
 }
 
 int _mkp_init(struct plugin_api **api, char *confdir)
@@ -798,6 +1107,18 @@ int _mkp_init(struct plugin_api **api, char *confdir)
     return mk_dirhtml_conf(confdir);
 }
 
+int _mkp_core_prctx(struct server_config *config)
+{
+    (void) config;
+
+    /* Launch the thread which renders stale cache entries */
+    if (dirhtml_cache.budget > 0) {
+        mk_api->worker_spawn(mk_dirhtml_cache_worker, NULL);
+    }
+
+    return 0;
+}
+
 void _mkp_exit()
 {
 }
@@ -805,6 +1126,7 @@ void _mkp_exit()
 int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
                   struct session_request *sr)
 {
+    int ret;
     (void) plugin;
 
     /* validate file_info */
@@ -817,16 +1139,14 @@ int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
         return MK_PLUGIN_RET_NOT_ME;
     }
 
-    /*
-     * We cannot return to this request later if it fails,
-     * so change to blocking and back.
-     */
-    fcntl(cs->socket, F_SETFL, fcntl(cs->socket, F_GETFL, 0) & ~O_NONBLOCK);
-
+    /* The page is streamed by the core, the socket stays non-blocking */
     PLUGIN_TRACE("Dirlisting attending socket %i", cs->socket);
-    mk_dirhtml_init(cs, sr);
+    ret = mk_dirhtml_init(cs, sr);
 
-    mk_api->socket_set_nonblocking(cs->socket);
+    if (ret < 0 && sr->headers.sent == MK_FALSE) {
+        mk_api->header_set_http_status(sr, MK_CLIENT_FORBIDDEN);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
 
     return MK_PLUGIN_RET_END;
 }
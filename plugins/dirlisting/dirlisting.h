@@ -21,6 +21,7 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
 
 /* dir_html.c */
 #ifndef MK_DIRHTML_H
@@ -38,6 +39,12 @@
 #define MK_HEADER_CHUNKED "Transfer-Encoding: Chunked\r\n\r\n"
 #define MK_DIRHTML_FMOD_LEN 24
 
+/* Rendered pages grow in chunks of 16KB */
+#define MK_DIRHTML_PAGE_CHUNK 16384
+
+/* Number of hash slots of the rendered listings cache (power of 2) */
+#define MK_DIRHTML_CACHE_SLOTS 256
+
 /* Theme files */
 #define MK_DIRHTML_FILE_HEADER "header.theme"
 #define MK_DIRHTML_FILE_ENTRY "entry.theme"
@@ -121,6 +128,52 @@ struct dirhtml_value *mk_dirhtml_value_global;
 /* Configuration struct */
 struct mk_config *conf;
 
+/* A rendered listing: contiguous buffer with a known length */
+struct dirhtml_page
+{
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+struct dirhtml_cache_entry
+{
+    char *path;                 /* directory real path            */
+    char *title;                /* requested URI, used as title   */
+    time_t mtime;               /* directory mtime when rendered  */
+    int unsure;                 /* rendered in the mtime second   */
+    int refreshing;             /* queued for background render   */
+    int unlinked;               /* removed, free on last release  */
+    int refs;                   /* workers sending this page      */
+
+    struct dirhtml_page page;
+
+    struct mk_list _head;       /* hash slot */
+    struct mk_list _lru;        /* LRU list  */
+};
+
+struct dirhtml_cache_job
+{
+    char *path;
+    char *title;
+    struct mk_list _head;
+};
+
+struct dirhtml_cache
+{
+    size_t budget;              /* max bytes of rendered pages */
+    size_t used;
+
+    struct mk_list slots[MK_DIRHTML_CACHE_SLOTS];
+    struct mk_list lru;         /* least recently used first   */
+    struct mk_list jobs;        /* pending background renders  */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct dirhtml_cache dirhtml_cache;
+
 char *check_string(char *str);
 char *read_header_footer_file(char *file_path);
 
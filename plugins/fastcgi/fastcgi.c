@@ -18,14 +18,22 @@
  *  MA 02110-1301  USA.
  */
 
+#include <errno.h> /* errno, EINPROGRESS */
+#include <fcntl.h> /* fcntl, O_NONBLOCK */
+#include <netdb.h> /* getaddrinfo */
+#include <poll.h> /* poll */
 #include <stdio.h> /* sscanf */
 #include <string.h> /* memcpy */
+#include <unistd.h> /* sleep */
+#include <sys/socket.h> /* setsockopt */
+#include <sys/time.h> /* struct timeval */
 #include <sys/un.h> /* sockaddr_un */
 #include <regex.h> /* regex_t, regcomp */
 
 #include "MKPlugin.h"
 
 #include "dbg.h"
+#include "fcgi_balancer.h"
 #include "fcgi_config.h"
 #include "fcgi_context.h"
 #include "fcgi_env.h"
@@ -47,12 +55,57 @@ const mk_pointer mk_iov_none = {
 static struct plugin * fcgi_global_plugin;
 
 static struct fcgi_config fcgi_global_config;
+static struct fcgi_balancer fcgi_global_balancer;
 static struct fcgi_context_list fcgi_global_context_list;
 
 static pthread_key_t fcgi_local_context;
 
 #define UNUSED_VARIABLE(var) (void)(var)
 
+/*
+ * The request serving a client socket lives in the session data slot,
+ * the event hooks get it back without scanning the request list.
+ */
+static struct request *fcgi_request_get(int socket)
+{
+	struct client_session *cs = mk_api->session_get(socket);
+
+	if (!cs) {
+		return NULL;
+	}
+	return mk_api->session_data_get(fcgi_global_plugin, cs);
+}
+
+/* The client is done with the request, the server may not be yet */
+static void fcgi_request_detach(struct request *req)
+{
+	if (req->fd != -1 && req->cs) {
+		mk_api->session_data_set(fcgi_global_plugin, req->cs,
+				NULL, NULL);
+	}
+	req->fd = -1;
+	req->cs = NULL;
+	req->sr = NULL;
+}
+
+/* Called by the core when the session goes away with a request running */
+static void fcgi_request_cleanup(void *data)
+{
+	struct request *req = data;
+
+	if (req->state != REQ_FAILED) {
+		request_set_state(req, REQ_FAILED);
+	}
+
+	if (req->fcgi_fd == -1) {
+		request_recycle(req);
+	} else {
+		req->fd = -1;
+		req->cs = NULL;
+		req->sr = NULL;
+	}
+}
+
 static int fcgi_handle_cgi_header(struct session_request *sr,
 		char *entry,
 		size_t len)
@@ -123,9 +176,12 @@ static size_t fcgi_parse_cgi_headers(struct session_request *sr,
 	}
 	return cnt;
 }
+static int fcgi_connect_fd(struct fcgi_fd *fd);
+
 /**
  * Will return 0 if there are any connections available to handle a
- * request. If such a connection is sleeping, wake it.
+ * request. If such a connection is sleeping, wake it. The balancer may
+ * also pick a server without connections, a new one is opened then.
  */
 int fcgi_wake_connection(int location_id)
 {
@@ -137,17 +193,21 @@ int fcgi_wake_connection(int location_id)
 	check(cntx, "No fcgi context on thread.");
 	fdl = &cntx->fdl;
 
-	fd = fcgi_fd_list_get(fdl,
-			FCGI_FD_SLEEPING | FCGI_FD_READY,
+	fd = fcgi_balancer_get_fd(&fcgi_global_balancer, fdl,
+			FCGI_FD_SLEEPING | FCGI_FD_READY | FCGI_FD_AVAILABLE,
 			location_id);
 	if (!fd) {
 		return -1;
 	}
+	else if (fd->state == FCGI_FD_AVAILABLE) {
+		return fcgi_connect_fd(fd);
+	}
 	else if (fd->state == FCGI_FD_SLEEPING) {
 
 		PLUGIN_TRACE("[FCGI_FD %d] Waking up connection.", fd->fd);
+		/* Multiplexed connections never stop reading */
 		mk_api->event_socket_change_mode(fd->fd,
-				MK_EPOLL_WAKEUP,
+				fd->mpx ? MK_EPOLL_RW : MK_EPOLL_WAKEUP,
 				MK_EPOLL_LEVEL_TRIGGERED);
 		check(!fcgi_fd_set_state(fd, FCGI_FD_READY),
                         "[FCGI_FD %d]  State change failed.", fd->fd);
@@ -189,28 +249,142 @@ error:
 	return -1;
 }
 
-int fcgi_new_connection(int location_id)
+/*
+ * Ask the server if it accepts several requests on one connection. Also
+ * used as a cheap health probe, any answer will do.
+ */
+static int fcgi_write_get_values(int sock)
 {
-	struct plugin *plugin = fcgi_global_plugin;
-	struct fcgi_context *cntx;
-	struct fcgi_fd_list *fdl;
-	struct fcgi_fd *fd;
+	struct fcgi_header h = {
+		.version  = FCGI_VERSION_1,
+		.type     = FCGI_GET_VALUES,
+		.req_id   = 0,
+		.body_len = 0,
+		.body_pad = 0,
+	};
+	uint8_t buf[64];
+	mk_pointer key, value;
+	size_t pos = sizeof(h);
+	ssize_t ret;
+
+	mk_api->pointer_set(&value, "");
+
+	mk_api->pointer_set(&key, FCGI_MPXS_CONNS);
+	pos += fcgi_param_write(buf + pos, key, value);
+	mk_api->pointer_set(&key, FCGI_MAX_REQS);
+	pos += fcgi_param_write(buf + pos, key, value);
+
+	h.body_len = pos - sizeof(h);
+	h.body_pad = ~(h.body_len - 1) & 7;
+	fcgi_write_header(buf, &h);
+	memset(buf + pos, 0, h.body_pad);
+	pos += h.body_pad;
+
+	ret = write(sock, buf, pos);
+	check(ret == (ssize_t)pos, "[FD %d] Failed to send get values.", sock);
+
+	return 0;
+error:
+	return -1;
+}
+
+static void fcgi_handle_get_values_result(struct fcgi_fd *fd,
+		struct fcgi_header h,
+		struct chunk_ptr read)
+{
+	struct fcgi_param_entry e;
 	struct fcgi_server *server;
+	mk_pointer key, value;
+	char tmp[16];
+	long mpxs_conns = 0;
+	long max_reqs = 1;
 
-	cntx = pthread_getspecific(fcgi_local_context);
-	check(cntx, "No fcgi context on thread.");
-	fdl = &cntx->fdl;
+	if (h.body_len == 0) {
+		return;
+	}
 
-	fd = fcgi_fd_list_get(fdl, FCGI_FD_AVAILABLE, location_id);
-	if (!fd) {
-		PLUGIN_TRACE("Connection limit reached.");
-		return 0;
+	fcgi_param_entry_init(&e, (uint8_t *)read.data + sizeof(h), h.body_len);
+	do {
+		key = fcgi_param_entry_key(&e);
+		value = fcgi_param_entry_value(&e);
+		if (value.len == 0 || value.len >= sizeof(tmp)) {
+			continue;
+		}
+		memcpy(tmp, value.data, value.len);
+		tmp[value.len] = '\0';
+
+		if (key.len == sizeof(FCGI_MPXS_CONNS) - 1 &&
+				!memcmp(key.data, FCGI_MPXS_CONNS, key.len)) {
+			mpxs_conns = strtol(tmp, NULL, 10);
+		}
+		else if (key.len == sizeof(FCGI_MAX_REQS) - 1 &&
+				!memcmp(key.data, FCGI_MAX_REQS, key.len)) {
+			max_reqs = strtol(tmp, NULL, 10);
+		}
+	} while (fcgi_param_entry_next(&e) != -1);
+
+	if (mpxs_conns != 1 || max_reqs < 2) {
+		PLUGIN_TRACE("[FCGI_FD %d] No multiplexing.", fd->fd);
+		return;
 	}
 
+	server = fcgi_config_get_server(&fcgi_global_config, fd->server_id);
+	if (server && server->max_requests > 0 &&
+			(long)server->max_requests < max_reqs) {
+		max_reqs = server->max_requests;
+	}
+	if (max_reqs > FCGI_MPX_MAX_REQS) {
+		max_reqs = FCGI_MPX_MAX_REQS;
+	}
+
+	fd->mpx = 1;
+	fd->max_reqs = max_reqs;
+
+	PLUGIN_TRACE("[FCGI_FD %d] Multiplexing up to %d requests.",
+		fd->fd, fd->max_reqs);
+
+	/* Room for more requests right now */
+	if (fd->state == FCGI_FD_RECEIVING && fd->active < fd->max_reqs) {
+		fcgi_fd_set_state(fd, FCGI_FD_READY);
+		mk_api->event_socket_change_mode(fd->fd,
+				MK_EPOLL_RW,
+				MK_EPOLL_LEVEL_TRIGGERED);
+	}
+}
+
+/* Records with request id 0 are management records */
+static void fcgi_handle_mgmt_pkg(struct fcgi_fd *fd,
+		struct fcgi_header h,
+		struct chunk_ptr read)
+{
+	switch (h.type) {
+	case FCGI_GET_VALUES_RESULT:
+		fcgi_handle_get_values_result(fd, h, read);
+		break;
+	case FCGI_UNKNOWN_TYPE:
+		PLUGIN_TRACE("[FCGI_FD %d] Management record not supported.",
+			fd->fd);
+		break;
+	default:
+		log_info("[FCGI_FD %d] Ignore management package type: %s",
+			fd->fd,
+			FCGI_MSG_TYPE_STR(h.type));
+	}
+}
+
+static int fcgi_connect_fd(struct fcgi_fd *fd)
+{
+	struct plugin *plugin = fcgi_global_plugin;
+	struct fcgi_server *server;
+	struct fcgi_location *location;
+
 	server = fcgi_config_get_server(&fcgi_global_config, fd->server_id);
 	check(server, "Server for this fcgi_fd does not exist.");
 
 	fd->fd = fcgi_server_connect(server);
+	if (fd->fd == -1) {
+		fcgi_balancer_fail(&fcgi_global_balancer, fd->server_id);
+	}
 	check_debug(fd->fd != -1, "Failed to connect to server.");
 
 	mk_api->socket_set_nonblocking(fd->fd);
@@ -222,11 +396,243 @@ int fcgi_new_connection(int location_id)
 
 	fcgi_fd_set_state(fd, FCGI_FD_READY);
 
+	/*
+	 * Multiplexing needs the connection to be kept open. It is used one
+	 * request at a time until the answer arrives, servers which ignore
+	 * the query are never multiplexed.
+	 */
+	location = fcgi_config_get_location(&fcgi_global_config,
+			fd->location_id);
+	if (server->mpx_connection && location && location->keep_alive) {
+		fcgi_write_get_values(fd->fd);
+	}
+
 	return 0;
 error:
 	return -1;
 }
 
+/*
+ * Failed connects count against the server, once ejected the balancer
+ * moves on to the next one. Give every server of the location a chance.
+ */
+int fcgi_new_connection(int location_id)
+{
+	struct fcgi_context *cntx;
+	struct fcgi_fd_list *fdl;
+	struct fcgi_fd *fd;
+	struct fcgi_location *location;
+	unsigned int tries;
+
+	cntx = pthread_getspecific(fcgi_local_context);
+	check(cntx, "No fcgi context on thread.");
+	fdl = &cntx->fdl;
+
+	location = fcgi_config_get_location(&fcgi_global_config, location_id);
+	check(location, "No location with id %d.", location_id);
+
+	for (tries = 0; tries < location->server_count; tries++) {
+		fd = fcgi_balancer_get_fd(&fcgi_global_balancer, fdl,
+				FCGI_FD_AVAILABLE,
+				location_id);
+		if (!fd) {
+			PLUGIN_TRACE("Connection limit reached.");
+			return 0;
+		}
+		if (!fcgi_connect_fd(fd)) {
+			return 0;
+		}
+	}
+error:
+	return -1;
+}
+
+/* Seconds a health probe may wait for connect, write or answer */
+#define FCGI_PROBE_TIMEOUT 2
+
+/*
+ * Connect without blocking and wait for the handshake at most
+ * FCGI_PROBE_TIMEOUT, a server that lost its SYNs would otherwise hold
+ * the probe for the whole kernel connect timeout. The socket is back in
+ * blocking mode on return.
+ */
+static int fcgi_probe_connect_addr(const struct sockaddr *addr,
+		socklen_t addr_len)
+{
+	struct pollfd pfd;
+	socklen_t err_len = sizeof(int);
+	int sock, flags, err = 0;
+
+	sock = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return -1;
+	}
+
+	flags = fcntl(sock, F_GETFL);
+	check(flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) != -1,
+		"[FD %d] Failed to set non-blocking mode.", sock);
+
+	if (connect(sock, addr, addr_len) == -1) {
+		check_debug(errno == EINPROGRESS, "Probe connect failed.");
+
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+		check_debug(poll(&pfd, 1, FCGI_PROBE_TIMEOUT * 1000) == 1,
+			"Probe connect timed out.");
+		check(!getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len),
+			"[FD %d] Failed to get socket error.", sock);
+		check_debug(err == 0, "Probe connect failed.");
+	}
+
+	check(fcntl(sock, F_SETFL, flags) != -1,
+		"[FD %d] Failed to set blocking mode.", sock);
+	return sock;
+error:
+	mk_api->socket_close(sock);
+	return -1;
+}
+
+static int fcgi_probe_connect(const struct fcgi_server *server)
+{
+	struct sockaddr_un addr;
+	struct addrinfo hints, *res, *rp;
+	char port[8];
+	int sock = -1;
+
+	if (server->path) {
+		if (strlen(server->path) + 1 >= sizeof(addr.sun_path)) {
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, server->path);
+		return fcgi_probe_connect_addr((struct sockaddr *)&addr,
+				sizeof(addr));
+	}
+	if (!server->addr) {
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", server->port);
+
+	if (getaddrinfo(server->addr, port, &hints, &res) != 0) {
+		return -1;
+	}
+	for (rp = res; rp && sock == -1; rp = rp->ai_next) {
+		sock = fcgi_probe_connect_addr(rp->ai_addr, rp->ai_addrlen);
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+/* Returns 1 if the server answered a FCGI_GET_VALUES record */
+static int fcgi_health_probe(const struct fcgi_server *server)
+{
+	struct timeval tv = { .tv_sec = FCGI_PROBE_TIMEOUT, .tv_usec = 0 };
+	struct fcgi_header h;
+	uint8_t buf[sizeof(h)];
+	int sock, ok = 0;
+
+	sock = fcgi_probe_connect(server);
+	if (sock == -1) {
+		return 0;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (!fcgi_write_get_values(sock) &&
+			recv(sock, buf, sizeof(buf), MSG_WAITALL) == sizeof(buf)) {
+		fcgi_read_header(buf, &h);
+		ok = h.type == FCGI_GET_VALUES_RESULT ||
+			h.type == FCGI_UNKNOWN_TYPE;
+	}
+
+	mk_api->socket_close(sock);
+	return ok;
+}
+
+/*
+ * Active health checks. Probes are blocking and run on their own
+ * thread, workers only see the result through the balancer.
+ */
+static void fcgi_health_check_loop(void *data)
+{
+	const struct fcgi_server *server;
+	time_t *next, now;
+	unsigned int i;
+	int ok;
+
+	UNUSED_VARIABLE(data);
+
+	mk_api->worker_rename("monkey: fastcgi/health");
+
+	next = mk_api->mem_alloc_z(fcgi_global_config.server_count *
+			sizeof(*next));
+	check_mem(next);
+
+	while (1) {
+		for (i = 0; i < fcgi_global_config.server_count; i++) {
+			server = fcgi_config_get_server(&fcgi_global_config, i);
+			now = time(NULL);
+			if (server->health_check == 0 || now < next[i]) {
+				continue;
+			}
+
+			ok = fcgi_health_probe(server);
+			PLUGIN_TRACE("[SRV %s] Health probe %s.",
+				server->name, ok ? "ok" : "failed");
+			fcgi_balancer_probe(&fcgi_global_balancer, i, ok);
+
+			next[i] = time(NULL) + server->health_check;
+		}
+		sleep(1);
+	}
+error:
+	log_err("Health checks disabled.");
+}
+
+/* Per server counters, listed by the cheetah 'counters' command */
+void _mkp_cheetah_counters(int (*print)(const char *, ...))
+{
+	const struct fcgi_server *server;
+	const struct fcgi_server_stats *st;
+	time_t now = fcgi_balancer_now() / 1000000;
+	unsigned int i;
+
+	for (i = 0; i < fcgi_global_balancer.server_count; i++) {
+		server = fcgi_config_get_server(&fcgi_global_config, i);
+		st = fcgi_global_balancer.stats + i;
+
+		if (server->path) {
+			print("  [%s] %s", server->name, server->path);
+		} else {
+			print("  [%s] %s:%d", server->name,
+				server->addr, server->port);
+		}
+		if (st->ejected_until > now) {
+			print(" (ejected, %lus left)\n",
+				(unsigned long)(st->ejected_until - now));
+		} else {
+			print("\n");
+		}
+
+		print("      - Requests      : %llu (%u in flight)\n",
+			(unsigned long long)st->requests, st->outstanding);
+		print("      - Latency       : %u.%03u ms\n",
+			st->latency / 1000, st->latency % 1000);
+		print("      - Failures      : %llu (%llu ejections)\n",
+			(unsigned long long)st->failures,
+			(unsigned long long)st->ejections);
+		print("      - Health probes : %llu (%llu failed)\n",
+			(unsigned long long)st->probes,
+			(unsigned long long)st->probe_failures);
+	}
+}
+
 int fcgi_prepare_request(struct request *req)
 {
 	struct fcgi_context *cntx;
@@ -241,6 +647,7 @@ int fcgi_prepare_request(struct request *req)
 		.body_pad = 0,
 	};
 	struct fcgi_location *location;
+	const struct fcgi_env_block *env;
 
 	size_t len = 4096, pos = 0, tmp;
 	ssize_t ret;
@@ -275,8 +682,16 @@ int fcgi_prepare_request(struct request *req)
 	tmp = pos;
 	pos += sizeof(h);
 
-	ret = fcgi_env_write(buffer + pos, len - pos, req->cs, req->sr);
+	// Constant params of the virtual host, then the request ones.
+	env = fcgi_context_env_get(cntx, req->sr->host_conf);
+	check(env, "[REQ_ID %d] Failed to get static env.", req_id);
+	check(len - pos > env->len, "Not enough space left.");
+	memcpy(buffer + pos, env->data, env->len);
+
+	ret = fcgi_env_write(buffer + pos + env->len, len - pos - env->len,
+			req->cs, req->sr);
 	check(ret != -1, "Failed to write env.");
+	ret += env->len;
 
 	h.type = FCGI_PARAMS;
 	h.body_len = ret;
@@ -366,6 +781,24 @@ error:
 	return -1;
 }
 
+/*
+ * If this request was elected to fill the response cache, hand it the
+ * response. The whole body is in req->iov at this point.
+ */
+static void fcgi_cache_store(struct request *req)
+{
+	int i;
+
+	if (!mk_api->rcache_store_headers(req->sr, NULL, 0)) {
+		for (i = 0; i < req->iov.index; i++) {
+			mk_api->rcache_store_body(req->sr,
+					req->iov.io[i].iov_base,
+					req->iov.io[i].iov_len);
+		}
+	}
+	mk_api->rcache_store_end(req->sr);
+}
+
 int fcgi_send_response_headers(struct request *req)
 {
 	ssize_t headers_offset;
@@ -385,6 +818,8 @@ int fcgi_send_response_headers(struct request *req)
 		"Failed to drop from req->iov.");
 	req->sr->headers.content_length = chunk_iov_length(&req->iov);
 
+	fcgi_cache_store(req);
+
 	mk_api->header_send(req->fd, req->cs, req->sr);
 	req->sr->headers.location = NULL;
 
@@ -395,36 +830,59 @@ error:
 	return -1;
 }
 
+/* The output buffers keep the chunk their data was read into */
+static void fcgi_chunk_release(void *data)
+{
+	chunk_release(data);
+}
+
+/*
+ * Hand the body over to the core as buffer streams, one for each
+ * FCGI_STDOUT record and sharing the chunk it was read into. The core
+ * writes them out on the client write events, the request is done
+ * with here.
+ */
 int fcgi_send_response(struct request *req)
 {
-	int fd = req->fd;
-	ssize_t ret;
-	struct mk_iov mkiov;
+	int i;
+	struct iovec *io;
+	struct chunk_ref *cr;
+	struct mk_output_buf *buf;
+	struct mk_stream *stream;
 
 	check(request_get_flag(req, REQ_HEADERS_SENT),
 		"Headers not yet sent for request.");
 
-        memset(&mkiov, 0, sizeof(mkiov));
-        mkiov.io = req->iov.io;
-        mkiov.iov_idx = req->iov.index;
-        mkiov.total_len = chunk_iov_length(&req->iov);
-	ret = mk_api->socket_sendv(fd, &mkiov);
+	for (i = 0; i < req->iov.index; i++) {
+		io = req->iov.io + i;
+		cr = req->iov.held_refs + i;
 
-	PLUGIN_TRACE("[FD %d] Wrote %ld bytes.", fd, ret);
-	check(ret != -1, "[FD %d] Failed to send request response.", fd);
+		/* Emptied when the headers were dropped */
+		if (io->iov_len == 0) {
+			continue;
+		}
+		check(cr->t == CHUNK_REF_CHUNK,
+			"[FD %d] Response data outside of a chunk.", req->fd);
+
+		buf = mk_api->output_buf_create(io->iov_base, io->iov_len,
+				fcgi_chunk_release, cr->u.chunk);
+		check_mem(buf);
+		chunk_retain(cr->u.chunk);
+
+		stream = mk_api->stream_buf(req->cs, req->sr, buf, 0,
+				io->iov_len);
+		mk_api->output_buf_release(buf);
+		check(stream, "[FD %d] Failed to attach response stream.",
+			req->fd);
+	}
 
-	if (ret == (ssize_t)chunk_iov_length(&req->iov)) {
-		check(!request_set_state(req, REQ_FINISHED),
-			"Failed to set request state.");
-		request_recycle(req);
+	PLUGIN_TRACE("[FD %d] Streaming %ld bytes.", req->fd,
+		chunk_iov_length(&req->iov));
 
-		mk_api->socket_cork_flag(fd, TCP_CORK_OFF);
-		mk_api->http_request_end(fd);
-	}
-	else {
-		check(!chunk_iov_drop(&req->iov, ret),
-			"Failed to drop data from chunk.");
-	}
+	check(!request_set_state(req, REQ_FINISHED),
+		"Failed to set request state.");
+	fcgi_request_detach(req);
+	request_recycle(req);
 
 	return 0;
 error:
@@ -493,9 +951,24 @@ static int fcgi_handle_pkg(struct fcgi_fd *fd,
 
 		request_set_fcgi_fd(req, -1);
 
-		check(!fcgi_fd_set_state(fd, FCGI_FD_READY),
-			"[FCGI_FD %d] Failed to set FCGI_FD_READY state.",
-			fd->fd);
+		if (b.protocol_status == FCGI_REQUEST_COMPLETE) {
+			fcgi_balancer_request_end(&fcgi_global_balancer,
+				fd->server_id,
+				fcgi_balancer_now() - req->sent_at);
+		} else {
+			fcgi_balancer_request_drop(&fcgi_global_balancer,
+				fd->server_id);
+			fcgi_balancer_fail(&fcgi_global_balancer, fd->server_id);
+		}
+
+		if (fd->active > 0) {
+			fd->active--;
+		}
+		if (!fd->mpx || fd->state == FCGI_FD_RECEIVING) {
+			check(!fcgi_fd_set_state(fd, FCGI_FD_READY),
+				"[FCGI_FD %d] Failed to set FCGI_FD_READY state.",
+				fd->fd);
+		}
 
 		if (req->fd == -1) {
 			request_recycle(req);
@@ -613,6 +1086,9 @@ int fcgi_recv_response(struct fcgi_fd *fd,
 			if (rcp.len < pkg_size) {
 				inherit = rcp.len;
 				ret     = inherit;
+			} else if (h.req_id == 0) {
+				fcgi_handle_mgmt_pkg(fd, h, rcp);
+				ret = pkg_size;
 			} else {
 				req = request_list_get(rl, h.req_id);
 				check_debug(!handle_pkg(fd, req, h, rcp),
@@ -639,38 +1115,20 @@ error:
 	return -1;
 }
 
-static int regex_match_location(const struct fcgi_config *config,
-		const char *uri)
-{
-	unsigned int i;
-	regex_t *regp;
-
-	for (i = 0; i < config->location_count; i++) {
-		regp = &config->locations[i].match_regex;
-		if (!regexec(regp, uri, 0, NULL, 0)) {
-			return i;
-		}
-	}
-	return -1;
-}
-
 int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
 		struct session_request *sr)
 {
-	char *uri = NULL;
 	struct fcgi_context *cntx;
 	struct request_list *rl;
 	struct request *req = NULL;
 	uint16_t req_id;
 	int location_id;
 
-	UNUSED_VARIABLE(plugin);
-
 	cntx = pthread_getspecific(fcgi_local_context);
 	check(cntx, "No fcgi context on thread.");
 	rl = &cntx->rl;
 
-	req = request_list_get_by_fd(rl, cs->socket);
+	req = mk_api->session_data_get(plugin, cs);
 	if (req) {
 #ifdef TRACE
 		req_id = request_list_index_of(rl, req);
@@ -680,16 +1138,30 @@ int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
 		return MK_PLUGIN_RET_CONTINUE;
 	}
 
-	uri = mk_api->mem_alloc_z(sr->real_path.len + 1);
-	memcpy(uri, sr->real_path.data, sr->real_path.len);
-
-	location_id = regex_match_location(&fcgi_global_config, uri);
-	mk_api->mem_free(uri);
+	/*
+	 * The vhost routes this URI to us. With a single location there is
+	 * nothing left to choose, its patterns are not checked.
+	 */
+	if (sr->route == plugin && fcgi_global_config.location_count == 1) {
+		location_id = 0;
+	}
+	else {
+		location_id = fcgi_context_match_location(cntx,
+				&fcgi_global_config,
+				sr->real_path.data, sr->real_path.len);
+	}
 	if (location_id == -1) {
 		PLUGIN_TRACE("[FD %d] Did not match any location.", cs->socket);
 		return MK_PLUGIN_RET_NOT_ME;
 	}
 
+	switch (mk_api->rcache_lookup(cs, sr)) {
+	case MK_RCACHE_HIT:
+		return MK_PLUGIN_RET_END;
+	case MK_RCACHE_PARKED:
+		return MK_PLUGIN_RET_CONTINUE;
+	}
+
 	req = request_list_next_available(rl, location_id);
 	check(req, "[FD %d] No available request structs.", cs->socket);
 	req_id = request_list_index_of(rl, req);
@@ -697,6 +1169,7 @@ int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
 	check(!request_assign(req, cs->socket, location_id, cs, sr),
 		"[REQ_ID %d] Failed to assign request for fd %d.",
 		req_id, cs->socket);
+	mk_api->session_data_set(plugin, cs, req, fcgi_request_cleanup);
 	check(!fcgi_prepare_request(req),
 		"[REQ_ID %d] Failed to prepare request.", req_id);
 
@@ -739,11 +1212,14 @@ int _mkp_init(struct plugin_api **api, char *confdir)
 	request_module_init(mk_api->mem_alloc, mk_api->mem_free);
 	fcgi_fd_module_init(mk_api->mem_alloc, mk_api->mem_free);
 	fcgi_context_module_init(mk_api->mem_alloc, mk_api->mem_free);
+	fcgi_balancer_module_init(mk_api->mem_alloc, mk_api->mem_free);
 
 	check(!fcgi_validate_struct_sizes(),
 		"Validating struct sizes failed.");
 	check(!fcgi_config_read(&fcgi_global_config, confdir),
 		"Failed to read config.");
+	check(!fcgi_balancer_init(&fcgi_global_balancer, &fcgi_global_config),
+		"Failed to init balancer.");
 
 	return 0;
 error:
@@ -753,6 +1229,7 @@ error:
 void _mkp_exit()
 {
 	fcgi_context_list_free(&fcgi_global_context_list);
+	fcgi_balancer_free(&fcgi_global_balancer);
 	fcgi_config_free(&fcgi_global_config);
 }
 
@@ -760,6 +1237,7 @@ int _mkp_core_prctx(struct server_config *config)
 {
 	struct mk_list *h;
 	struct plugin *p;
+	unsigned int i;
 
 	check(!fcgi_context_list_init(&fcgi_global_context_list,
 				&fcgi_global_config,
@@ -776,6 +1254,13 @@ int _mkp_core_prctx(struct server_config *config)
 		}
 	}
 
+	for (i = 0; i < fcgi_global_config.server_count; i++) {
+		if (fcgi_global_config.servers[i].health_check > 0) {
+			mk_api->worker_spawn(fcgi_health_check_loop, NULL);
+			break;
+		}
+	}
+
 	return 0;
 error:
 	return -1;
@@ -819,7 +1304,7 @@ static int hangup(int socket)
 	rl = &cntx->rl;
 
 	fd  = fcgi_fd_list_get_by_fd(fdl, socket);
-	req = fd ? NULL : request_list_get_by_fd(rl, socket);
+	req = fd ? NULL : fcgi_request_get(socket);
 
 	if (!fd && !req) {
 		return MK_PLUGIN_RET_EVENT_NEXT;
@@ -830,10 +1315,29 @@ static int hangup(int socket)
 		mk_api->event_del(fd->fd);
 		close(fd->fd);
 
-		state = fd->state;
+		/* Requests still waiting for a response will never get it */
+		if (fd->active > 0) {
+			fcgi_balancer_fail(&fcgi_global_balancer, fd->server_id);
+		}
+		while ((req = request_list_get_by_fcgi_fd(rl, fd->fd))) {
+			fcgi_balancer_request_drop(&fcgi_global_balancer,
+				fd->server_id);
+			request_set_fcgi_fd(req, -1);
+			if (req->fd == -1) {
+				request_recycle(req);
+				continue;
+			}
+			request_set_state(req, REQ_FAILED);
+			if (request_get_flag(req, REQ_SLEEPING)) {
+				mk_api->event_socket_change_mode(req->fd,
+						MK_EPOLL_WAKEUP,
+						MK_EPOLL_LEVEL_TRIGGERED);
+				request_unset_flag(req, REQ_SLEEPING);
+			}
+		}
 
-		fd->fd     = -1;
-		fd->state  = FCGI_FD_AVAILABLE;
+		state = fd->state;
+		fcgi_fd_reset(fd);
 
 		if (state & FCGI_FD_CLOSING) {
 			fcgi_new_connection(fd->location_id);
@@ -847,17 +1351,9 @@ static int hangup(int socket)
 		PLUGIN_TRACE("[REQ_ID %d] Hangup event.", req_id);
 #endif
 
-		if (req->state != REQ_FAILED) {
-			request_set_state(req, REQ_FAILED);
-		}
-
-		if (req->fcgi_fd == -1) {
-			request_recycle(req);
-		} else {
-			req->fd = -1;
-			req->cs = NULL;
-			req->sr = NULL;
-		}
+		mk_api->session_data_set(fcgi_global_plugin, req->cs,
+				NULL, NULL);
+		fcgi_request_cleanup(req);
 
 		return MK_PLUGIN_RET_EVENT_CONTINUE;
 	}
@@ -882,7 +1378,7 @@ int _mkp_event_write(int socket)
 	fdl = &cntx->fdl;
 
 	fd  = fcgi_fd_list_get_by_fd(fdl, socket);
-	req = fd ? NULL : request_list_get_by_fd(rl, socket);
+	req = fd ? NULL : fcgi_request_get(socket);
 
 	if (!fd && !req) {
 		return MK_PLUGIN_RET_EVENT_NEXT;
@@ -897,7 +1393,8 @@ int _mkp_event_write(int socket)
 		check(!fcgi_send_response(req),
 			"[REQ_ID %d] Failed to send response.", req_id);
 
-		return MK_PLUGIN_RET_EVENT_OWNED;
+		/* The core drives the body streams */
+		return MK_PLUGIN_RET_EVENT_CONTINUE;
 	}
 	else if (req && req->state == REQ_FAILED) {
 #ifdef TRACE
@@ -907,6 +1404,7 @@ int _mkp_event_write(int socket)
 		mk_api->http_request_error(MK_SERVER_INTERNAL_ERROR,
 				req->cs, req->sr);
 
+		fcgi_request_detach(req);
 		if (req->fcgi_fd == -1) {
 			request_recycle(req);
 		}
@@ -915,11 +1413,18 @@ int _mkp_event_write(int socket)
 		return MK_PLUGIN_RET_EVENT_OWNED;
 	}
 	else if (fd && fd->state == FCGI_FD_READY) {
-		req = request_list_next_assigned(rl, fd->location_id);
+		/* Leave the requests to other servers while ejected */
+		if (fcgi_balancer_usable(&fcgi_global_balancer,
+				fd->location_id, fd->server_id)) {
+			req = request_list_next_assigned(rl, fd->location_id);
+		}
 
 		if (req) {
 			req_id = request_list_index_of(rl, req);
 			request_set_fcgi_fd(req, fd->fd);
+			req->sent_at = fcgi_balancer_now();
+			fcgi_balancer_request_start(&fcgi_global_balancer,
+				fd->server_id);
 
 			check(!request_set_state(req, REQ_SENT),
 				"[REQ_ID %d] Failed to set sent state.",
@@ -930,6 +1435,7 @@ int _mkp_event_write(int socket)
 			check(!fcgi_fd_set_state(fd, FCGI_FD_SENDING),
 				"[FCGI_FD %d] Failed to set sending state.",
 				fd->fd);
+			fd->active++;
 
 			if (fd->type == FCGI_FD_INET) {
 				mk_api->socket_cork_flag(fd->fd, TCP_CORK_ON);
@@ -937,6 +1443,18 @@ int _mkp_event_write(int socket)
 
 			return _mkp_event_write(fd->fd);
 		}
+		else if (fd->mpx && fd->active > 0) {
+			PLUGIN_TRACE("[FCGI_FD %d] Nothing to send, read only.",
+				fd->fd);
+
+			mk_api->event_socket_change_mode(fd->fd,
+				MK_EPOLL_READ,
+				MK_EPOLL_LEVEL_TRIGGERED);
+			check(!fcgi_fd_set_state(fd, FCGI_FD_SLEEPING),
+				"Failed to set fd state.");
+
+			return MK_PLUGIN_RET_EVENT_OWNED;
+		}
 		else {
 			PLUGIN_TRACE("[FCGI_FD %d] Sleep.", fd->fd);
 
@@ -971,13 +1489,22 @@ int _mkp_event_write(int socket)
 			if (fd->type == FCGI_FD_INET) {
 				mk_api->socket_cork_flag(fd->fd, TCP_CORK_OFF);
 			}
-			fcgi_fd_set_state(fd, FCGI_FD_RECEIVING);
 			chunk_iov_reset(fd->begin_req);
 			fd->begin_req = NULL;
 
-			mk_api->event_socket_change_mode(fd->fd,
-					MK_EPOLL_READ,
-					MK_EPOLL_LEVEL_TRIGGERED);
+			if (fd->mpx && fd->active < fd->max_reqs) {
+				/* Keep sending while reading responses */
+				fcgi_fd_set_state(fd, FCGI_FD_READY);
+				mk_api->event_socket_change_mode(fd->fd,
+						MK_EPOLL_RW,
+						MK_EPOLL_LEVEL_TRIGGERED);
+			}
+			else {
+				fcgi_fd_set_state(fd, FCGI_FD_RECEIVING);
+				mk_api->event_socket_change_mode(fd->fd,
+						MK_EPOLL_READ,
+						MK_EPOLL_LEVEL_TRIGGERED);
+			}
 		} else {
 			chunk_iov_drop(fd->begin_req, ret);
 		}
@@ -1031,7 +1558,12 @@ int _mkp_event_read(int socket)
 		PLUGIN_TRACE("[FCGI_FD %d] Data received.", fd->fd);
 
 		if (fd->state == FCGI_FD_READY) {
-			if (loc->keep_alive) {
+			if (fd->mpx) {
+				mk_api->event_socket_change_mode(fd->fd,
+						MK_EPOLL_RW,
+						MK_EPOLL_LEVEL_TRIGGERED);
+			}
+			else if (loc->keep_alive) {
 				mk_api->event_socket_change_mode(fd->fd,
 						MK_EPOLL_WRITE,
 						MK_EPOLL_LEVEL_TRIGGERED);
@@ -0,0 +1,282 @@
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2012, Sonny Karlsson
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+#include "fcgi_balancer.h"
+
+static void *(*mem_alloc)(const size_t) = &malloc;
+static void (*mem_free)(void *) = free;
+
+void fcgi_balancer_module_init(void *(*mem_alloc_p)(const size_t),
+		void (*mem_free_p)(void *))
+{
+	mem_alloc = mem_alloc_p;
+	mem_free  = mem_free_p;
+}
+
+int fcgi_balancer_init(struct fcgi_balancer *b,
+		const struct fcgi_config *config)
+{
+	const struct fcgi_server *srv;
+	unsigned int i;
+
+	b->config = config;
+	b->server_count = config->server_count;
+	b->stats = mem_alloc(b->server_count * sizeof(*b->stats));
+	check_mem(b->stats);
+	memset(b->stats, 0, b->server_count * sizeof(*b->stats));
+
+	for (i = 0; i < b->server_count; i++) {
+		srv = fcgi_config_get_server(config, i);
+		b->stats[i].backoff = srv->fail_timeout;
+	}
+
+	pthread_mutex_init(&b->mutex, NULL);
+	return 0;
+error:
+	b->server_count = 0;
+	return -1;
+}
+
+void fcgi_balancer_free(struct fcgi_balancer *b)
+{
+	if (b->stats) {
+		mem_free(b->stats);
+		b->stats = NULL;
+	}
+	b->server_count = 0;
+}
+
+uint64_t fcgi_balancer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int fcgi_balancer_ejected(const struct fcgi_server_stats *s,
+		time_t now)
+{
+	return s->ejected_until > now;
+}
+
+int fcgi_balancer_usable(struct fcgi_balancer *b,
+		int location_id,
+		int server_id)
+{
+	const struct fcgi_location *loc;
+	time_t now = fcgi_balancer_now() / 1000000;
+	unsigned int i;
+
+	if (!fcgi_balancer_ejected(b->stats + server_id, now)) {
+		return 1;
+	}
+
+	loc = fcgi_config_get_location(b->config, location_id);
+	for (i = 0; loc && i < loc->server_count; i++) {
+		if (!fcgi_balancer_ejected(b->stats + loc->server_ids[i], now)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static uint64_t fcgi_balancer_score(const struct fcgi_server_stats *s,
+		enum fcgi_balance balance)
+{
+	uint64_t outstanding = s->outstanding;
+
+	switch (balance) {
+	case FCGI_BALANCE_LATENCY:
+		/* Servers never measured are tried first */
+		return (outstanding + 1) * s->latency;
+	case FCGI_BALANCE_LEAST_REQS:
+	default:
+		return outstanding;
+	}
+}
+
+struct fcgi_fd *fcgi_balancer_get_fd(struct fcgi_balancer *b,
+		struct fcgi_fd_list *fdl,
+		enum fcgi_fd_state state,
+		int location_id)
+{
+	const struct fcgi_location *loc;
+	const struct fcgi_server_stats *s;
+	struct fcgi_fd *fd, *best = NULL, *fallback = NULL;
+	uint64_t score, best_score = 0;
+	time_t now;
+	int i, start, open, best_open = 0;
+
+	loc = fcgi_config_get_location(b->config, location_id);
+	check(loc, "No location with id %d.", location_id);
+
+	if (fdl->n == 0) {
+		return NULL;
+	}
+	now = fcgi_balancer_now() / 1000000;
+	start = fdl->clock++ % fdl->n;
+
+	for (i = 0; i < fdl->n; i++) {
+		fd = fdl->fds + (start + i) % fdl->n;
+		if (!(fd->state & state) || fd->location_id != location_id) {
+			continue;
+		}
+
+		s = b->stats + fd->server_id;
+		if (fcgi_balancer_ejected(s, now)) {
+			if (!fallback) {
+				fallback = fd;
+			}
+			continue;
+		}
+
+		/* On equal terms open connections beat new ones */
+		score = fcgi_balancer_score(s, loc->balance);
+		open = fd->state != FCGI_FD_AVAILABLE;
+		if (!best || score < best_score ||
+				(score == best_score && open > best_open)) {
+			best = fd;
+			best_score = score;
+			best_open = open;
+		}
+	}
+
+	return best ? best : fallback;
+error:
+	return NULL;
+}
+
+void fcgi_balancer_request_start(struct fcgi_balancer *b, int server_id)
+{
+	struct fcgi_server_stats *s = b->stats + server_id;
+
+	__sync_fetch_and_add(&s->requests, 1);
+	__sync_fetch_and_add(&s->outstanding, 1);
+}
+
+static void fcgi_balancer_success(struct fcgi_balancer *b, int server_id)
+{
+	struct fcgi_server_stats *s = b->stats + server_id;
+	const struct fcgi_server *srv;
+
+	if (s->fails == 0 && s->ejected_until == 0) {
+		return;
+	}
+
+	srv = fcgi_config_get_server(b->config, server_id);
+
+	pthread_mutex_lock(&b->mutex);
+	s->fails = 0;
+	s->backoff = srv->fail_timeout;
+	s->ejected_until = 0;
+	pthread_mutex_unlock(&b->mutex);
+}
+
+void fcgi_balancer_request_end(struct fcgi_balancer *b,
+		int server_id,
+		uint64_t usec)
+{
+	struct fcgi_server_stats *s = b->stats + server_id;
+	uint32_t latency;
+
+	__sync_fetch_and_sub(&s->outstanding, 1);
+
+	/* Weight 1/8, races between workers only lose a sample */
+	latency = s->latency;
+	if (latency == 0) {
+		latency = usec > 0 ? usec : 1;
+	}
+	else {
+		latency = latency - (latency >> 3) + (usec >> 3);
+	}
+	s->latency = latency;
+
+	fcgi_balancer_success(b, server_id);
+}
+
+void fcgi_balancer_request_drop(struct fcgi_balancer *b, int server_id)
+{
+	__sync_fetch_and_sub(&b->stats[server_id].outstanding, 1);
+}
+
+void fcgi_balancer_fail(struct fcgi_balancer *b, int server_id)
+{
+	struct fcgi_server_stats *s = b->stats + server_id;
+	const struct fcgi_server *srv;
+	time_t now;
+
+	srv = fcgi_config_get_server(b->config, server_id);
+	__sync_fetch_and_add(&s->failures, 1);
+
+	if (srv->max_fails == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&b->mutex);
+	now = fcgi_balancer_now() / 1000000;
+	s->fails += 1;
+
+	if (s->fails >= srv->max_fails && !fcgi_balancer_ejected(s, now)) {
+		log_warn("[SRV %s] Ejected for %u seconds after %u failures.",
+			srv->name, s->backoff, s->fails);
+
+		s->ejected_until = now + s->backoff;
+		s->ejections += 1;
+		if (s->backoff < srv->fail_timeout * FCGI_BALANCER_MAX_BACKOFF) {
+			s->backoff *= 2;
+		}
+		/* Back in rotation, one more failure ejects it again */
+		s->fails = srv->max_fails - 1;
+	}
+	pthread_mutex_unlock(&b->mutex);
+}
+
+void fcgi_balancer_probe(struct fcgi_balancer *b, int server_id, int ok)
+{
+	struct fcgi_server_stats *s = b->stats + server_id;
+	const struct fcgi_server *srv;
+
+	__sync_fetch_and_add(&s->probes, 1);
+
+	if (!ok) {
+		__sync_fetch_and_add(&s->probe_failures, 1);
+		fcgi_balancer_fail(b, server_id);
+		return;
+	}
+
+	if (s->ejected_until == 0) {
+		return;
+	}
+
+	/* Answering again, no need to wait for the back-off */
+	srv = fcgi_config_get_server(b->config, server_id);
+	pthread_mutex_lock(&b->mutex);
+	if (s->ejected_until != 0) {
+		log_info("[SRV %s] Health probe answered, back in rotation.",
+			srv->name);
+		s->ejected_until = 0;
+	}
+	pthread_mutex_unlock(&b->mutex);
+}
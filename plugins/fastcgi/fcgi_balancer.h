@@ -0,0 +1,115 @@
+#ifndef _FCGI_BALANCER_H_
+#define _FCGI_BALANCER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fcgi_config.h"
+#include "fcgi_fd.h"
+
+/* Longest ejection, in multiples of the server FailTimeout */
+#define FCGI_BALANCER_MAX_BACKOFF 16
+
+/**
+ * struct fcgi_server_stats - Shared state of one server.
+ * @requests: Requests sent.
+ * @failures: Failed connects, lost connections and overloads.
+ * @ejections: Times the server has been taken out of rotation.
+ * @probes: Health probes sent.
+ * @probe_failures: Health probes without a valid answer.
+ *
+ * @outstanding: Requests in flight, on all workers.
+ * @latency: Moving average of response times, usec.
+ *
+ * @fails: Failures in a row.
+ * @backoff: Length of next ejection, seconds.
+ * @ejected_until: Monotonic time at which the server is used again.
+ *
+ * Updated from every worker thread, counters with atomic operations
+ * and ejection state under the balancer mutex.
+ */
+struct fcgi_server_stats {
+	uint64_t requests;
+	uint64_t failures;
+	uint64_t ejections;
+	uint64_t probes;
+	uint64_t probe_failures;
+
+	uint32_t outstanding;
+	uint32_t latency;
+
+	uint32_t fails;
+	uint32_t backoff;
+	time_t ejected_until;
+};
+
+/**
+ * struct fcgi_balancer - Server selection and passive health checks.
+ *
+ * Connections are distributed on workers at startup, the balancer
+ * decides which of them to use for a new request. Servers failing
+ * MaxFails times in a row are ejected for FailTimeout seconds,
+ * doubling on each ejection, until a request or health probe succeeds.
+ */
+struct fcgi_balancer {
+	const struct fcgi_config *config;
+	unsigned int server_count;
+	struct fcgi_server_stats *stats;
+	pthread_mutex_t mutex;
+};
+
+void fcgi_balancer_module_init(void *(*mem_alloc_p)(const size_t),
+		void (*mem_free_p)(void *));
+
+int fcgi_balancer_init(struct fcgi_balancer *b,
+		const struct fcgi_config *config);
+
+void fcgi_balancer_free(struct fcgi_balancer *b);
+
+/**
+ * fcgi_balancer_now - Monotonic clock, usec.
+ */
+uint64_t fcgi_balancer_now(void);
+
+/**
+ * fcgi_balancer_usable - Returns 1 if requests may be sent to server.
+ *
+ * Ejected servers are still used when every server of the location is
+ * ejected, failing over to nothing would not help.
+ */
+int fcgi_balancer_usable(struct fcgi_balancer *b,
+		int location_id,
+		int server_id);
+
+/**
+ * fcgi_balancer_get_fd - Best fcgi_fd in state for location.
+ *
+ * Like fcgi_fd_list_get() but choosing between the servers of the
+ * location with its balance policy. If state includes
+ * FCGI_FD_AVAILABLE, a server without open connections may win.
+ */
+struct fcgi_fd *fcgi_balancer_get_fd(struct fcgi_balancer *b,
+		struct fcgi_fd_list *fdl,
+		enum fcgi_fd_state state,
+		int location_id);
+
+void fcgi_balancer_request_start(struct fcgi_balancer *b, int server_id);
+
+/**
+ * fcgi_balancer_request_end - Request ended with response time usec.
+ */
+void fcgi_balancer_request_end(struct fcgi_balancer *b,
+		int server_id,
+		uint64_t usec);
+
+/**
+ * fcgi_balancer_request_drop - Request lost with its connection.
+ */
+void fcgi_balancer_request_drop(struct fcgi_balancer *b, int server_id);
+
+void fcgi_balancer_fail(struct fcgi_balancer *b, int server_id);
+
+void fcgi_balancer_probe(struct fcgi_balancer *b, int server_id, int ok);
+
+#endif // _FCGI_BALANCER_H_
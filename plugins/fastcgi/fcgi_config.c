@@ -18,6 +18,8 @@
  *  MA 02110-1301  USA.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -27,6 +29,203 @@
 #include "fcgi_config.h"
 #include "MKPlugin.h"
 
+static void fcgi_match_literals_free(struct fcgi_location *loc)
+{
+	unsigned int i;
+
+	for (i = 0; i < loc->literal_count; i++) {
+		mk_api->mem_free(loc->literals[i].head);
+	}
+	if (loc->literals) {
+		mk_api->mem_free(loc->literals);
+	}
+	loc->literals = NULL;
+	loc->literal_count = 0;
+}
+
+/*
+ * Try to reduce a Match alternative to string comparisons. Accepted
+ * patterns are literal characters (metacharacters escaped with a
+ * backslash), an optional leading ^, an optional trailing $ and at most
+ * one .* or (.*) wildcard. Returns -1 if the pattern needs regexec().
+ */
+static int fcgi_match_literal_parse(struct fcgi_match_literal *lit,
+		const char *pat)
+{
+	const char *p = pat;
+	const char *end = pat + strlen(pat);
+	const char *q;
+	char *buf, *out;
+	int escapes;
+
+	memset(lit, 0, sizeof(*lit));
+
+	if (*p == '^') {
+		lit->flags |= FCGI_MATCH_START;
+		p++;
+	}
+
+	if (end > p && end[-1] == '$') {
+		/* A $ preceded by an odd number of backslashes is a literal */
+		escapes = 0;
+		for (q = end - 2; q >= p && *q == '\\'; q--) {
+			escapes++;
+		}
+		if (escapes % 2 == 0) {
+			lit->flags |= FCGI_MATCH_END;
+			end--;
+		}
+	}
+
+	buf = mk_api->mem_alloc(end - p + 2);
+	check_mem(buf);
+	out = buf;
+	lit->head = buf;
+
+	while (p < end) {
+		if (*p == '\\') {
+			if (p + 1 >= end || !strchr(".[]()*+?{}|^$\\/", p[1])) {
+				goto error;
+			}
+			*out++ = p[1];
+			p += 2;
+		}
+		else if ((end - p >= 2 && !strncmp(p, ".*", 2)) ||
+			 (end - p >= 4 && !strncmp(p, "(.*)", 4))) {
+			if (lit->flags & FCGI_MATCH_WILD) {
+				goto error;
+			}
+			lit->flags |= FCGI_MATCH_WILD;
+			lit->head_len = out - buf;
+			*out++ = '\0';
+			lit->tail = out;
+			p += (*p == '(') ? 4 : 2;
+		}
+		else if (strchr(".[]()*+?{}|^$", *p)) {
+			goto error;
+		}
+		else {
+			*out++ = *p++;
+		}
+	}
+
+	if (lit->flags & FCGI_MATCH_WILD) {
+		lit->tail_len = out - lit->tail;
+	}
+	else {
+		lit->head_len = out - buf;
+	}
+	*out = '\0';
+	return 0;
+error:
+	if (buf) mk_api->mem_free(buf);
+	lit->head = NULL;
+	return -1;
+}
+
+static int fcgi_match_literal_exec(const struct fcgi_match_literal *lit,
+		const char *path,
+		size_t len)
+{
+	const char *p;
+	size_t off;
+
+	if (!(lit->flags & FCGI_MATCH_WILD)) {
+		switch (lit->flags) {
+		case FCGI_MATCH_START | FCGI_MATCH_END:
+			return len == lit->head_len &&
+				!memcmp(path, lit->head, len);
+		case FCGI_MATCH_START:
+			return len >= lit->head_len &&
+				!memcmp(path, lit->head, lit->head_len);
+		case FCGI_MATCH_END:
+			return len >= lit->head_len &&
+				!memcmp(path + len - lit->head_len,
+					lit->head, lit->head_len);
+		default:
+			return memmem(path, len, lit->head, lit->head_len) != NULL;
+		}
+	}
+
+	if (lit->flags & FCGI_MATCH_START) {
+		if (len < lit->head_len || memcmp(path, lit->head, lit->head_len)) {
+			return 0;
+		}
+		off = lit->head_len;
+	}
+	else {
+		p = memmem(path, len, lit->head, lit->head_len);
+		if (!p) {
+			return 0;
+		}
+		off = (p - path) + lit->head_len;
+	}
+
+	if (lit->flags & FCGI_MATCH_END) {
+		return len - off >= lit->tail_len &&
+			!memcmp(path + len - lit->tail_len,
+				lit->tail, lit->tail_len);
+	}
+	return memmem(path + off, len - off, lit->tail, lit->tail_len) != NULL;
+}
+
+/*
+ * Split the space separated Match value, literal alternatives go to the
+ * fast path and the rest are joined into a single regex.
+ */
+static int fcgi_match_compile(struct fcgi_location *loc, char *match)
+{
+	int ret;
+	int n = 1;
+	size_t pos = 0;
+	char error_str[80];
+	char *regex = NULL;
+	char *tok, *save;
+	struct fcgi_match_literal lit;
+
+	for (tok = match; *tok != '\0'; tok++) {
+		if (*tok == ' ') n++;
+	}
+
+	loc->literals = mk_api->mem_alloc_z(n * sizeof(*loc->literals));
+	check_mem(loc->literals);
+
+	regex = mk_api->mem_alloc_z(strlen(match) + 1);
+	check_mem(regex);
+
+	for (tok = strtok_r(match, " ", &save); tok;
+	     tok = strtok_r(NULL, " ", &save)) {
+		if (!fcgi_match_literal_parse(&lit, tok)) {
+			loc->literals[loc->literal_count++] = lit;
+			continue;
+		}
+		if (pos > 0) {
+			regex[pos++] = '|';
+		}
+		memcpy(regex + pos, tok, strlen(tok));
+		pos += strlen(tok);
+	}
+
+	if (pos > 0) {
+		ret = regcomp(&loc->match_regex, regex, REG_EXTENDED|REG_NOSUB);
+		if (ret) {
+			regerror(ret, &loc->match_regex, error_str, 80);
+			sentinel("Regex compile failed: %s", error_str);
+		}
+		loc->has_regex = MK_TRUE;
+	}
+
+	PLUGIN_TRACE("[LOC %s] %d literal matches, regex '%s'.",
+		loc->name, loc->literal_count, regex);
+
+	mk_api->mem_free(regex);
+	return 0;
+error:
+	if (regex) mk_api->mem_free(regex);
+	fcgi_match_literals_free(loc);
+	return -1;
+}
+
 void fcgi_config_free(struct fcgi_config *config)
 {
 	unsigned int i;
@@ -37,7 +236,10 @@ void fcgi_config_free(struct fcgi_config *config)
 		for (i = 0; i < config->location_count; i++) {
 			locp = config->locations + i;
 
-			regfree(&locp->match_regex);
+			fcgi_match_literals_free(locp);
+			if (locp->has_regex) {
+				regfree(&locp->match_regex);
+			}
 
 			if (locp->name) {
 				mk_api->mem_free(locp->name);
@@ -160,7 +362,7 @@ int fcgi_config_read_server(struct fcgi_server *srv,
 	}
 
 	tmp = mk_api->config_section_getval(section,
-		"Multiplexing", MK_CONFIG_VAL_BOOL);
+		"Multiplexing", MK_CONFIG_VAL_STR);
 	if (tmp) {
 		srv->mpx_connection = !strcasecmp(tmp, VALUE_ON);
 		mk_api->mem_free(tmp);
@@ -177,6 +379,28 @@ int fcgi_config_read_server(struct fcgi_server *srv,
 	srv->max_requests = (long int)mk_api->config_section_getval(section,
 		"MaxRequests", MK_CONFIG_VAL_NUM);
 
+	tmp = mk_api->config_section_getval(section,
+		"MaxFails", MK_CONFIG_VAL_STR);
+	if (tmp) {
+		srv->max_fails = strtoul(tmp, NULL, 10);
+		mk_api->mem_free(tmp);
+	} else {
+		srv->max_fails = 3;
+	}
+
+	srv->fail_timeout = (long int)mk_api->config_section_getval(section,
+		"FailTimeout", MK_CONFIG_VAL_NUM);
+	if ((int)srv->fail_timeout <= 0) {
+		srv->fail_timeout = 10;
+	}
+
+	srv->health_check = (long int)mk_api->config_section_getval(section,
+		"HealthCheck", MK_CONFIG_VAL_NUM);
+	if ((int)srv->health_check < 0) {
+		srv->health_check = 0;
+	}
+	tmp = NULL;
+
 	check(srv->addr || srv->path,
 		"[SRV %s] No ServerAddr or ServerPath.", srv->name);
 	return 0;
@@ -191,14 +415,13 @@ int fcgi_config_read_location(struct fcgi_location *loc,
 		struct mk_config_section *section)
 {
 	static int unamed_loc_count = 0;
-	int ret = 0;
-	char error_str[80];
 	int loc_server_n = 0;
 	int loc_server_i = 0;
 	int i;
 	char *regex = NULL;
 	char *server_names = NULL;
 	char *keep_alive = NULL;
+	char *balance = NULL;
 	char *tok;
 
 	loc->name = mk_api->config_section_getval(section, "LocationName",
@@ -209,6 +432,8 @@ int fcgi_config_read_location(struct fcgi_location *loc,
 			MK_CONFIG_VAL_STR);
 	server_names = mk_api->config_section_getval(section, "ServerNames",
 			MK_CONFIG_VAL_STR);
+	balance = mk_api->config_section_getval(section, "Balance",
+			MK_CONFIG_VAL_STR);
 
         if (!loc->name) {
             loc->name = mk_api->mem_alloc_z(24);
@@ -217,11 +442,7 @@ int fcgi_config_read_location(struct fcgi_location *loc,
         }
 
 	check(regex, "No match regex defined for this location.");
-	for (tok = regex; *tok != '\0'; tok++) {
-		*tok = (*tok == ' ') ? '|' : *tok;
-	}
-	ret = regcomp(&loc->match_regex, regex, REG_EXTENDED|REG_NOSUB);
-	check(!ret, "Regex failure on location.");
+	check(!fcgi_match_compile(loc, regex), "Regex failure on location.");
 	mk_api->mem_free(regex);
 	regex = NULL;
 
@@ -232,6 +453,19 @@ int fcgi_config_read_location(struct fcgi_location *loc,
 		loc->keep_alive = MK_FALSE;
 	}
 
+	loc->balance = FCGI_BALANCE_LEAST_REQS;
+	if (balance) {
+		if (!strcasecmp(balance, "Latency")) {
+			loc->balance = FCGI_BALANCE_LATENCY;
+		}
+		else if (strcasecmp(balance, "LeastRequests")) {
+			log_warn("[LOC %s] Unknown Balance %s, "
+				"using LeastRequests.", loc->name, balance);
+		}
+		mk_api->mem_free(balance);
+		balance = NULL;
+	}
+
 	check(server_names, "No servers for this location.");
 	for (i = 0; i < (int)strlen(server_names); i++) {
 		if (server_names[i] == ' ')
@@ -259,14 +493,15 @@ int fcgi_config_read_location(struct fcgi_location *loc,
 
 	return 0;
 error:
-	if (ret) {
-		regerror(ret, &loc->match_regex, error_str, 80);
-		log_err("Regex compile failed: %s", error_str);
+	fcgi_match_literals_free(loc);
+	if (loc->has_regex) {
+		regfree(&loc->match_regex);
+		loc->has_regex = MK_FALSE;
 	}
-	regfree(&loc->match_regex);
 	if (loc->server_ids) mk_api->mem_free(loc->server_ids);
 	if (server_names) mk_api->mem_free(server_names);
 	if (keep_alive) mk_api->mem_free(keep_alive);
+	if (balance) mk_api->mem_free(balance);
 	if (regex) mk_api->mem_free(regex);
 	return -1;
 }
@@ -363,6 +598,37 @@ error:
 	return NULL;
 }
 
+/* Returns the id of the first location matching the path, or -1 */
+int fcgi_config_match_location(const struct fcgi_config *config,
+		const char *path,
+		size_t len)
+{
+	unsigned int i, j;
+	regmatch_t match;
+	struct fcgi_location *loc;
+
+	for (i = 0; i < config->location_count; i++) {
+		loc = config->locations + i;
+
+		for (j = 0; j < loc->literal_count; j++) {
+			if (fcgi_match_literal_exec(loc->literals + j, path, len)) {
+				return i;
+			}
+		}
+
+		/* The path is not NUL terminated, REG_STARTEND sets its bounds */
+		if (loc->has_regex) {
+			match.rm_so = 0;
+			match.rm_eo = len;
+			if (!regexec(&loc->match_regex, path, 1, &match,
+					REG_STARTEND)) {
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
 struct fcgi_server *fcgi_config_get_server(const struct fcgi_config *config,
 		unsigned int server_id)
 {
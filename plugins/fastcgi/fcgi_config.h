@@ -14,13 +14,55 @@ struct fcgi_server {
 
 	unsigned int max_connections;
 	unsigned int max_requests;
+
+	/* Failures in a row before ejection and first ejection length */
+	unsigned int max_fails;
+	unsigned int fail_timeout;
+	/* Seconds between health probes, 0 to disable */
+	unsigned int health_check;
+};
+
+/**
+ * enum fcgi_balance - Server selection on locations with many servers.
+ *
+ * FCGI_BALANCE_LEAST_REQS: Fewest requests in flight.
+ * FCGI_BALANCE_LATENCY: Lowest response time average, scaled by the
+ *	requests in flight.
+ */
+enum fcgi_balance {
+	FCGI_BALANCE_LEAST_REQS = 0,
+	FCGI_BALANCE_LATENCY    = 1,
+};
+
+/*
+ * Match alternatives made only of literal characters, optionally anchored
+ * and with a single .* in the middle, are checked with plain string
+ * comparisons instead of regexec().
+ */
+#define FCGI_MATCH_START (1 << 0) /* ^head */
+#define FCGI_MATCH_END   (1 << 1) /* tail$ */
+#define FCGI_MATCH_WILD  (1 << 2) /* head.*tail */
+
+struct fcgi_match_literal {
+	int flags;
+	char *head;
+	size_t head_len;
+	char *tail;
+	size_t tail_len;
 };
 
 struct fcgi_location {
 	char *name;
+
+	unsigned int literal_count;
+	struct fcgi_match_literal *literals;
+
+	/* Remaining alternatives, only valid if has_regex */
+	int has_regex;
 	regex_t match_regex;
 
 	int keep_alive;
+	enum fcgi_balance balance;
 
 	unsigned int server_count;
 	unsigned int *server_ids;
@@ -40,6 +82,10 @@ int fcgi_config_read(struct fcgi_config *config, char *confdir);
 struct fcgi_location *fcgi_config_get_location(const struct fcgi_config *config,
 		unsigned int location_id);
 
+int fcgi_config_match_location(const struct fcgi_config *config,
+		const char *path,
+		size_t len);
+
 struct fcgi_server *fcgi_config_get_server(const struct fcgi_config *config,
 		unsigned int server_id);
 
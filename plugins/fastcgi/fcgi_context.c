@@ -20,9 +20,11 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "fcgi_context.h"
+#include "fcgi_env.h"
 
 #include "dbg.h"
 
@@ -38,9 +40,25 @@ void fcgi_context_module_init(void *(*mem_alloc_p)(const size_t),
 
 void fcgi_context_free(struct fcgi_context *tdata)
 {
+	unsigned int i;
+
 	request_list_free(&tdata->rl);
 	fcgi_fd_list_free(&tdata->fdl);
 	chunk_list_free_chunks(&tdata->cl);
+
+	if (tdata->match_cache) {
+		mem_free(tdata->match_cache);
+		tdata->match_cache = NULL;
+	}
+
+	for (i = 0; i < tdata->env_count; i++) {
+		mem_free(tdata->env[i].data);
+	}
+	if (tdata->env) {
+		mem_free(tdata->env);
+		tdata->env = NULL;
+	}
+	tdata->env_count = 0;
 }
 
 int fcgi_context_init(struct fcgi_context *tdata,
@@ -63,6 +81,15 @@ int fcgi_context_init(struct fcgi_context *tdata,
 			"Failed to init fd list.");
 	chunk_list_init(&tdata->cl);
 
+	tdata->match_cache = mem_alloc(FCGI_MATCH_CACHE_SIZE *
+			sizeof(*tdata->match_cache));
+	check_mem(tdata->match_cache);
+	memset(tdata->match_cache, 0, FCGI_MATCH_CACHE_SIZE *
+			sizeof(*tdata->match_cache));
+
+	tdata->env_count = 0;
+	tdata->env = NULL;
+
 	return 0;
 error:
 	fcgi_context_free(tdata);
@@ -144,6 +171,86 @@ error:
 	return -1;
 }
 
+static inline uint32_t fcgi_path_hash(const char *path, size_t len)
+{
+	size_t i;
+	uint32_t hash = 2166136261u;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Location lookup going through the worker cache of recent paths */
+int fcgi_context_match_location(struct fcgi_context *cntx,
+		const struct fcgi_config *config,
+		const char *path,
+		size_t len)
+{
+	uint32_t hash;
+	struct fcgi_match_cache_entry *e;
+	int location_id;
+
+	if (len >= FCGI_MATCH_CACHE_PATH) {
+		return fcgi_config_match_location(config, path, len);
+	}
+
+	hash = fcgi_path_hash(path, len);
+	e = cntx->match_cache + (hash & (FCGI_MATCH_CACHE_SIZE - 1));
+
+	if (e->len == len && e->hash == hash && len > 0 &&
+			!memcmp(e->path, path, len)) {
+		return e->location_id;
+	}
+
+	location_id = fcgi_config_match_location(config, path, len);
+
+	e->hash = hash;
+	e->len = len;
+	e->location_id = location_id;
+	memcpy(e->path, path, len);
+
+	return location_id;
+}
+
+/* Get the pre-encoded params for a virtual host, built on first use */
+const struct fcgi_env_block *fcgi_context_env_get(struct fcgi_context *cntx,
+		const struct host *host)
+{
+	unsigned int i;
+	size_t len;
+	struct fcgi_env_block *env, *block;
+
+	for (i = 0; i < cntx->env_count; i++) {
+		if (cntx->env[i].host == host) {
+			return cntx->env + i;
+		}
+	}
+
+	env = mem_alloc((cntx->env_count + 1) * sizeof(*env));
+	check_mem(env);
+	if (cntx->env) {
+		memcpy(env, cntx->env, cntx->env_count * sizeof(*env));
+		mem_free(cntx->env);
+	}
+	cntx->env = env;
+
+	/* The writer asks for 8 spare bytes, the worst case length fields */
+	len = fcgi_env_static_write(NULL, 0, host) + 8;
+	block = cntx->env + cntx->env_count;
+	block->host = host;
+	block->data = mem_alloc(len);
+	check_mem(block->data);
+	block->len = fcgi_env_static_write(block->data, len, host);
+	cntx->env_count++;
+
+	return block;
+error:
+	return NULL;
+}
+
 struct fcgi_context *fcgi_context_list_get(
 		struct fcgi_context_list *tdlist,
 		int thread_id)
@@ -2,18 +2,45 @@
 #define _FCGI_CONTEXT_H_
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include "fcgi_config.h"
 #include "request.h"
 #include "chunk.h"
 #include "fcgi_fd.h"
 
+/*
+ * Recently matched paths and their location id (-1 if none), direct
+ * mapped by hash. Longer paths are not cached.
+ */
+#define FCGI_MATCH_CACHE_SIZE 128
+#define FCGI_MATCH_CACHE_PATH 236
+
+struct fcgi_match_cache_entry {
+	uint32_t hash;
+	int location_id;
+	uint16_t len;
+	char path[FCGI_MATCH_CACHE_PATH];
+};
+
+/* FCGI_PARAMS which only depend on the virtual host, encoded once */
+struct fcgi_env_block {
+	const struct host *host;
+	size_t len;
+	uint8_t *data;
+};
+
 struct fcgi_context {
 	int thread_id;
 
 	struct chunk_list cl;
 	struct request_list rl;
 	struct fcgi_fd_list fdl;
+
+	struct fcgi_match_cache_entry *match_cache;
+
+	unsigned int env_count;
+	struct fcgi_env_block *env;
 };
 
 struct fcgi_context_list {
@@ -37,6 +64,14 @@ int fcgi_context_list_init(struct fcgi_context_list *tdlist,
 int fcgi_context_list_assign_thread_id(
 		struct fcgi_context_list *tdlist);
 
+int fcgi_context_match_location(struct fcgi_context *cntx,
+		const struct fcgi_config *config,
+		const char *path,
+		size_t len);
+
+const struct fcgi_env_block *fcgi_context_env_get(struct fcgi_context *cntx,
+		const struct host *host);
+
 struct fcgi_context *fcgi_context_list_get(
 		struct fcgi_context_list *tdlist,
 		int thread_id);
@@ -34,6 +34,53 @@
 		pos += fcgi_param_write(env + pos, key, value); \
 	} while (0)
 
+/*
+ * Params which only depend on the virtual host. If ptr is NULL the
+ * required buffer size is returned.
+ */
+size_t fcgi_env_static_write(uint8_t *ptr,
+		const size_t len,
+		const struct host *host)
+{
+	unsigned int i;
+	size_t pos = 0;
+	mk_pointer params[5][2];
+	unsigned int n = 0;
+
+	mk_api->pointer_set(&params[n][0], "GATEWAY_INTERFACE");
+	mk_api->pointer_set(&params[n][1], "CGI/1.1");
+	n++;
+
+	mk_api->pointer_set(&params[n][0], "REDIRECT_STATUS");
+	mk_api->pointer_set(&params[n][1], "200");
+	n++;
+
+	mk_api->pointer_set(&params[n][0], "SERVER_SOFTWARE");
+	mk_api->pointer_set(&params[n][1], host->host_signature);
+	n++;
+
+	mk_api->pointer_set(&params[n][0], "DOCUMENT_ROOT");
+	params[n][1] = host->documentroot;
+	n++;
+
+	if (!strcmp(mk_api->config->transport, MK_TRANSPORT_HTTPS)) {
+		mk_api->pointer_set(&params[n][0], "HTTPS");
+		mk_api->pointer_set(&params[n][1], "on");
+		n++;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!ptr) {
+			pos += fcgi_param_write(NULL, params[i][0], params[i][1]);
+			continue;
+		}
+		__write_param(ptr, len, pos, params[i][0], params[i][1]);
+	}
+	return pos;
+error:
+	return pos;
+}
+
 size_t fcgi_env_write(uint8_t *ptr,
 		const size_t len,
 		struct client_session *cs,
@@ -45,26 +92,12 @@ size_t fcgi_env_write(uint8_t *ptr,
 	size_t pos = 0;
 	struct sockaddr_in addr;
 	socklen_t addr_len;
+	struct sched_connection *conx;
+	unsigned int port = 0;
 	unsigned int i, j;
 	char *hinit, *hend;
 	size_t hlen;
 
-	mk_api->pointer_set(&key,   "GATEWAY_INTERFACE");
-	mk_api->pointer_set(&value, "CGI/1.1");
-	__write_param(ptr, len, pos, key, value);
-
-	mk_api->pointer_set(&key,   "REDIRECT_STATUS");
-	mk_api->pointer_set(&value, "200");
-	__write_param(ptr, len, pos, key, value);
-
-	mk_api->pointer_set(&key,   "SERVER_SOFTWARE");
-	mk_api->pointer_set(&value, sr->host_conf->host_signature);
-	__write_param(ptr, len, pos, key, value);
-
-	mk_api->pointer_set(&key,   "DOCUMENT_ROOT");
-	value = sr->host_conf->documentroot;
-	__write_param(ptr, len, pos, key, value);
-
 	mk_api->pointer_set(&key,   "SERVER_PROTOCOL");
 	value = sr->protocol_p;
 	__write_param(ptr, len, pos, key, value);
@@ -105,20 +138,25 @@ size_t fcgi_env_write(uint8_t *ptr,
 	value = sr->method_p;
 	__write_param(ptr, len, pos, key, value);
 
-	addr_len = sizeof(addr);
-	if (!getpeername(cs->socket, (struct sockaddr *)&addr, &addr_len)) {
-		inet_ntop(AF_INET, &addr.sin_addr, buffer, 128);
+	/* Peer address stored by the server when it accepted the client. */
+	conx = mk_api->sched_conn_get(cs->socket);
+	if (conx && conx->ip_str_len > 0) {
 		mk_api->pointer_set(&key,   "REMOTE_ADDR");
-		mk_api->pointer_set(&value, buffer);
+		value.data = conx->ip_str;
+		value.len  = conx->ip_str_len;
 		__write_param(ptr, len, pos, key, value);
 
-		snprintf(buffer, 128, "%d", ntohs(addr.sin_port));
+		if (conx->addr.sa.sa_family == AF_INET6) {
+			port = ntohs(conx->addr.in6.sin6_port);
+		} else {
+			port = ntohs(conx->addr.in.sin_port);
+		}
+		snprintf(buffer, 128, "%u", port);
 		mk_api->pointer_set(&key,   "REMOTE_PORT");
 		mk_api->pointer_set(&value, buffer);
 		__write_param(ptr, len, pos, key, value);
 	} else {
-		log_warn("%s", clean_errno());
-		errno = 0;
+		log_warn("No peer address for socket %d.", cs->socket);
 	}
 
 	mk_api->pointer_set(&key,   "REQUEST_URI");
@@ -150,12 +188,6 @@ size_t fcgi_env_write(uint8_t *ptr,
 		__write_param(ptr, len, pos, key, value);
 	}
 
-	if (!strcmp(mk_api->config->transport, MK_TRANSPORT_HTTPS)) {
-		mk_api->pointer_set(&key, "HTTPS");
-		mk_api->pointer_set(&value, "on");
-		__write_param(ptr, len, pos, key, value);
-	}
-
 	strcpy(buffer, "HTTP_");
 
 	for (i = 0; i < (unsigned int)sr->headers_toc.length; i++) {
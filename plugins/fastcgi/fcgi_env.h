@@ -3,6 +3,11 @@
 
 #include <stdint.h>
 
+size_t fcgi_env_static_write(uint8_t *ptr,
+		const size_t len,
+		const struct host *host);
+
+/* Params specific to the request, the static ones are not included */
 size_t fcgi_env_write(uint8_t *ptr,
 		const size_t len,
 		struct client_session *cs,
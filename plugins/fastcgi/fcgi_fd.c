@@ -50,9 +50,24 @@ void fcgi_fd_init(struct fcgi_fd *fd,
 	fd->begin_req_remain = 0;
 	fd->begin_req = NULL;
 
+	fd->mpx = 0;
+	fd->max_reqs = 1;
+	fd->active = 0;
+
 	fd->chunk = NULL;
 }
 
+/* Forget the connection, the fd struct may be used for a new one */
+void fcgi_fd_reset(struct fcgi_fd *fd)
+{
+	fd->fd = -1;
+	fd->state = FCGI_FD_AVAILABLE;
+
+	fd->mpx = 0;
+	fd->max_reqs = 1;
+	fd->active = 0;
+}
+
 int fcgi_fd_set_state(struct fcgi_fd *fd, enum fcgi_fd_state state)
 {
 	switch (state) {
@@ -64,7 +79,8 @@ int fcgi_fd_set_state(struct fcgi_fd *fd, enum fcgi_fd_state state)
 	case FCGI_FD_READY:
 		check(fd->state & (FCGI_FD_AVAILABLE
 				| FCGI_FD_RECEIVING
-				| FCGI_FD_SLEEPING),
+				| FCGI_FD_SLEEPING)
+			|| (fd->mpx && fd->state == FCGI_FD_SENDING),
 			"Bad state transition. (A|Re|S) -> R");
 		fd->state = FCGI_FD_READY;
 		break;
@@ -79,7 +95,9 @@ int fcgi_fd_set_state(struct fcgi_fd *fd, enum fcgi_fd_state state)
 		fd->state = FCGI_FD_RECEIVING;
 		break;
 	case FCGI_FD_CLOSING:
-		check(fd->state & (FCGI_FD_READY | FCGI_FD_RECEIVING),
+		check(fd->state & (FCGI_FD_READY | FCGI_FD_RECEIVING)
+			|| (fd->mpx && fd->state & (FCGI_FD_SENDING
+					| FCGI_FD_SLEEPING)),
 			"Bad state transition. R -> C");
 		fd->state = FCGI_FD_CLOSING;
 		break;
@@ -185,6 +203,7 @@ int fcgi_fd_list_init(struct fcgi_fd_list *fdl,
 	}
 
 	fdl->n = fd_count;
+	fdl->clock = 0;
 	fdl->fds = NULL;
 
 	fdl->fds = mem_alloc(fd_count * sizeof(*fdl->fds));
@@ -4,6 +4,9 @@
 #include "chunk.h"
 #include "fcgi_config.h"
 
+/* Upper bound of requests multiplexed on a single connection */
+#define FCGI_MPX_MAX_REQS 256
+
 /**
  * enum fcgi_fd_type - The FastCGI file descriptor socket type.
  */
@@ -43,10 +46,16 @@ enum fcgi_fd_state {
  * @begin_req_remain: Remaining bytes on begin request message.
  * @begin_req: Begin request message container.
  *
+ * @mpx: Server accepted multiplexed requests on this connection.
+ * @max_reqs: Concurrent requests allowed on this connection.
+ * @active: Requests sent and not yet ended.
+ *
  * @chunk: Currently attached chunk.
  *
  * Used on non-blocking FastCGI connection to track their state and
- * context.
+ * context. A multiplexed connection goes back to FCGI_FD_READY as soon
+ * as a request has been written, as long as it has room for another
+ * one, and keeps reading responses in every state.
  */
 struct fcgi_fd {
 	enum fcgi_fd_type type;
@@ -58,11 +67,21 @@ struct fcgi_fd {
 	size_t begin_req_remain;
 	struct chunk_iov *begin_req;
 
+	int mpx;
+	unsigned int max_reqs;
+	unsigned int active;
+
 	struct chunk *chunk;
 };
 
+/**
+ * struct fcgi_fd_list - FastCGI connections owned by a worker.
+ * @n: Number of entries in list.
+ * @clock: Where the next balancer scan starts, rotates among equals.
+ */
 struct fcgi_fd_list {
 	int n;
+	unsigned int clock;
 	struct fcgi_fd *fds;
 };
 
@@ -86,6 +105,8 @@ void fcgi_fd_init(struct fcgi_fd *fd,
 		int server_id,
 		int location_id);
 
+void fcgi_fd_reset(struct fcgi_fd *fd);
+
 int fcgi_fd_set_state(struct fcgi_fd *fd, enum fcgi_fd_state state);
 
 int fcgi_fd_set_begin_req_iov(struct fcgi_fd *fd, struct chunk_iov *iov);
@@ -8,6 +8,11 @@
 #define FCGI_MAX_LENGTH 0xffff
 #define FCGI_VERSION_1 1
 
+/* Management variables, see FCGI_GET_VALUES */
+#define FCGI_MAX_CONNS  "FCGI_MAX_CONNS"
+#define FCGI_MAX_REQS   "FCGI_MAX_REQS"
+#define FCGI_MPXS_CONNS "FCGI_MPXS_CONNS"
+
 #define FCGI_HEADER_LEN 8
 #define FCGI_BEGIN_BODY_LEN 8
 #define FCGI_END_BODY_LEN 8
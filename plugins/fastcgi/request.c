@@ -68,6 +68,7 @@ int request_init(struct request *req, int iov_n)
 		.fcgi_fd = -1,
 
 		.clock_id = 0,
+		.sent_at = 0,
 		.cs = NULL,
 		.sr = NULL,
 
@@ -93,6 +94,7 @@ static void request_reset(struct request *req)
 	req->fd            = -1;
 	req->fcgi_fd       = -1;
 	req->clock_id      = 0;
+	req->sent_at       = 0;
 
 	chunk_iov_reset(&req->iov);
 }
@@ -318,31 +320,6 @@ struct request *request_cache_search_fcgi_fd(struct request_cache *cache, int fd
 	return NULL;
 }
 
-struct request *request_cache_search(struct request_cache *cache, int fd)
-{
-	uint16_t i, mask = cache->mask, clock = cache->clock_hand;
-	struct req_cache_entry *e;
-
-	i = clock;
-	do {
-		i = (i + 1) & mask;
-		e = cache->entries + i;
-
-		if (e->fd == fd) {
-			if (e->req->fd == fd) {
-				e->counter += 1;
-				return e->req;
-			} else {
-				e->counter = 0;
-				e->fd = -1;
-				return NULL;
-			}
-		}
-	} while (i != clock);
-
-	return NULL;
-}
-
 int request_list_init(struct request_list *rl,
 		uint16_t clock_count,
 		uint16_t id_offset,
@@ -448,29 +425,6 @@ struct request *request_list_next_assigned(struct request_list *rl,
 	return NULL;
 }
 
-struct request *request_list_get_by_fd(struct request_list *rl, int fd)
-{
-	uint16_t i, mask = rl->size -1, clock = get_clock_hand(rl, 0);
-	struct request *r;
-
-	r = request_cache_search(&rl->cache, fd);
-	if (r != NULL) {
-		return r;
-	}
-
-	i = clock;
-	do {
-		i = (i + 1) & mask;
-		r = rl->rs + i;
-		if (r->fd == fd) {
-			request_cache_add(&rl->cache, r);
-			return r;
-		}
-	} while (i != clock);
-
-	return NULL;
-}
-
 struct request *request_list_get_by_fcgi_fd(struct request_list *rl, int fd)
 {
 	uint16_t i, mask = rl->size -1, clock = get_clock_hand(rl, 0);
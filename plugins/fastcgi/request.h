@@ -46,6 +46,7 @@ enum request_flags {
  * @fcgi_fd: FastCGI server fd.
  *
  * @clock_id: Index of request_list clock.
+ * @sent_at: Time the request was handed to a fcgi_fd, usec.
  *
  * @cs: Client session struct.
  * @sr: Session request struct.
@@ -60,6 +61,7 @@ struct request {
 	int fcgi_fd;
 
 	uint16_t clock_id;
+	uint64_t sent_at;
 
 	struct client_session *cs;
 	struct session_request *sr;
@@ -164,8 +166,6 @@ struct request *request_list_next_available(struct request_list *rl,
 struct request *request_list_next_assigned(struct request_list *rl,
 		uint16_t clock_id);
 
-struct request *request_list_get_by_fd(struct request_list *rl, int fd);
-
 struct request *request_list_get_by_fcgi_fd(struct request_list *rl, int fd);
 
 struct request *request_list_get(struct request_list *rl, uint16_t req_id);
@@ -51,17 +51,15 @@ void _mkp_exit()
 {
 }
 
-int _mkp_network_io_accept(int server_fd)
+int _mkp_network_io_accept(int server_fd, struct sockaddr *addr, socklen_t *len)
 {
     int remote_fd;
-    struct sockaddr sock_addr;
-    socklen_t socket_size = sizeof(struct sockaddr);
 
 #ifdef ACCEPT_GENERIC
-    remote_fd = accept(server_fd, &sock_addr, &socket_size);
+    remote_fd = accept(server_fd, addr, len);
     mk_api->socket_set_nonblocking(remote_fd);
 #else
-    remote_fd = accept4(server_fd, &sock_addr, &socket_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    remote_fd = accept4(server_fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 #endif
 
     return remote_fd;
@@ -0,0 +1,309 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+
+#include "logger.h"
+#include "binary.h"
+
+static inline void entry_string(struct log_entry *entry, struct iovec *io,
+                                int field, char *data, unsigned long len)
+{
+    if (!data || len > UINT16_MAX) {
+        len = 0;
+    }
+
+    /* Header values keep the blank after the colon */
+    while (len > 0 && (*data == ' ' || *data == '\t')) {
+        data++;
+        len--;
+    }
+
+    entry->len[field] = len;
+    io[field + 1].iov_base = data;
+    io[field + 1].iov_len = len;
+}
+
+/*
+ * mk_api->header_get() flags the rows it returns and skips the flagged
+ * ones, a header already read by another plugin (mandril reads Referer)
+ * would be missing. Look the row up without touching it.
+ */
+static mk_pointer entry_header(struct session_request *sr,
+                               const char *name, int len)
+{
+    int i;
+    mk_pointer var = {NULL, 0};
+    struct header_toc_row *row;
+
+    for (i = 0; i < sr->headers_toc.length; i++) {
+        row = &sr->headers_toc.rows[i];
+        if (row->end - row->init <= len || row->init[len] != ':' ||
+            strncasecmp(row->init, name, len) != 0) {
+            continue;
+        }
+
+        var.data = row->init + len + 1;
+        var.len = row->end - var.data;
+        break;
+    }
+
+    return var;
+}
+
+/*
+ * Worker side: fill the fixed fields and point the iovec to the strings,
+ * no formatting takes place here. Returns the number of iovec entries.
+ */
+int mk_logger_binary_entry(struct client_session *cs,
+                           struct session_request *sr,
+                           struct log_entry *entry, struct iovec *io)
+{
+    mk_pointer referer;
+    mk_pointer user_agent;
+    struct sched_connection *conx;
+
+    memset(entry, '\0', sizeof(struct log_entry));
+    entry->time = mk_api->time_unix();
+    entry->status = sr->headers.status;
+
+    if (sr->method == HTTP_METHOD_HEAD) {
+        entry->head = MK_TRUE;
+    }
+    else if (sr->headers.content_length > 0) {
+        entry->length = sr->headers.content_length;
+    }
+
+    conx = mk_api->sched_conn_get(cs->socket);
+    if (conx && conx->addr.sa.sa_family == AF_INET) {
+        entry->family = 4;
+        memcpy(entry->addr, &conx->addr.in.sin_addr, 4);
+    }
+    else if (conx && conx->addr.sa.sa_family == AF_INET6) {
+        if (IN6_IS_ADDR_V4MAPPED(&conx->addr.in6.sin6_addr)) {
+            entry->family = 4;
+            memcpy(entry->addr, conx->addr.in6.sin6_addr.s6_addr + 12, 4);
+        }
+        else {
+            entry->family = 6;
+            memcpy(entry->addr, conx->addr.in6.sin6_addr.s6_addr, 16);
+        }
+    }
+
+    referer = entry_header(sr, "Referer", 7);
+    user_agent = entry_header(sr, "User-Agent", 10);
+
+    io[0].iov_base = entry;
+    io[0].iov_len = sizeof(struct log_entry);
+
+    entry_string(entry, io, MK_LOGGER_BIN_VHOST,
+                 sr->host_alias ? sr->host_alias->name : NULL,
+                 sr->host_alias ? sr->host_alias->len : 0);
+    entry_string(entry, io, MK_LOGGER_BIN_METHOD,
+                 sr->method_p.data, sr->method_p.len);
+    entry_string(entry, io, MK_LOGGER_BIN_URI, sr->uri.data, sr->uri.len);
+    entry_string(entry, io, MK_LOGGER_BIN_PROTOCOL,
+                 sr->protocol_p.data, sr->protocol_p.len);
+    entry_string(entry, io, MK_LOGGER_BIN_REFERER,
+                 referer.data, referer.len);
+    entry_string(entry, io, MK_LOGGER_BIN_USER_AGENT,
+                 user_agent.data, user_agent.len);
+
+    return MK_LOGGER_BIN_FIELDS + 1;
+}
+
+static inline char *put_varint(char *p, uint64_t val)
+{
+    while (val >= 0x80) {
+        *p++ = (char) (val | 0x80);
+        val >>= 7;
+    }
+    *p++ = (char) val;
+
+    return p;
+}
+
+static char *put_sync(struct log_file *file, char *p, uint32_t now)
+{
+    memcpy(p, MK_LOGGER_BIN_MAGIC, 4);
+    p += 4;
+    *p++ = MK_LOGGER_BIN_VERSION;
+    p = put_varint(p, now);
+
+    file->synced = MK_TRUE;
+    file->last_time = now;
+
+    return p;
+}
+
+static uint32_t dict_hash(const char *str, unsigned long len)
+{
+    unsigned long i;
+    uint32_t hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Reference to a string. A string seen for the first time is added to the
+ * dictionary and its STRING record written at 'p'.
+ */
+static uint64_t dict_ref(struct log_dict *dict, char **p,
+                         const char *str, unsigned long len)
+{
+    uint32_t hash;
+    unsigned int i;
+    struct log_dict_slot *slot;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (len > MK_LOGGER_DICT_MAXLEN) {
+        return (len << 1) | 1;
+    }
+
+    hash = dict_hash(str, len);
+    i = hash & (MK_LOGGER_DICT_SLOTS - 1);
+    while ((slot = &dict->slots[i])->str) {
+        if (slot->hash == hash && slot->len == len &&
+            memcmp(slot->str, str, len) == 0) {
+            return (uint64_t) (slot->id + 1) << 1;
+        }
+        i = (i + 1) & (MK_LOGGER_DICT_SLOTS - 1);
+    }
+
+    slot->hash = hash;
+    slot->id = dict->count++;
+    slot->len = len;
+    slot->str = mk_api->mem_alloc(len);
+    memcpy(slot->str, str, len);
+
+    *(*p)++ = MK_LOGGER_BIN_STRING;
+    *p = put_varint(*p, len);
+    memcpy(*p, str, len);
+    *p += len;
+
+    return (uint64_t) (slot->id + 1) << 1;
+}
+
+/* Largest output of mk_logger_binary_encode() for a queued entry */
+unsigned long mk_logger_binary_bound(unsigned long len)
+{
+    return (len * 2) + 128;
+}
+
+/*
+ * Logger thread side: turn a queued entry into records. It runs in file
+ * order, so time deltas and dictionary indexes follow what the decoder
+ * reads.
+ */
+unsigned long mk_logger_binary_encode(struct log_file *file, char *out,
+                                      const char *data, unsigned long len)
+{
+    int i;
+    int64_t delta;
+    uint64_t ref[MK_LOGGER_BIN_FIELDS];
+    char *p = out;
+    const char *str;
+    struct log_entry entry;
+
+    if (len < sizeof(entry)) {
+        return 0;
+    }
+    memcpy(&entry, data, sizeof(entry));
+
+    if (!file->dict) {
+        file->dict = mk_api->mem_alloc_z(sizeof(struct log_dict));
+    }
+
+    /* A full dictionary starts again, so it follows the current traffic */
+    if (file->dict->count + MK_LOGGER_BIN_FIELDS > MK_LOGGER_DICT_SIZE) {
+        mk_logger_binary_reset(file);
+    }
+    if (file->synced == MK_FALSE) {
+        p = put_sync(file, p, entry.time);
+    }
+
+    /* Strings are defined ahead of the entry using them */
+    str = data + sizeof(entry);
+    for (i = 0; i < MK_LOGGER_BIN_FIELDS; i++) {
+        ref[i] = dict_ref(file->dict, &p, str, entry.len[i]);
+        str += entry.len[i];
+    }
+
+    *p++ = MK_LOGGER_BIN_ENTRY;
+
+    /* Workers queue in parallel, time may go back a little: zigzag */
+    delta = (int64_t) entry.time - (int64_t) file->last_time;
+    file->last_time = entry.time;
+    p = put_varint(p, (uint64_t) ((delta << 1) ^ (delta >> 63)));
+
+    p = put_varint(p, entry.status);
+    *p++ = entry.family;
+    if (entry.family == 4) {
+        memcpy(p, entry.addr, 4);
+        p += 4;
+    }
+    else if (entry.family == 6) {
+        memcpy(p, entry.addr, 16);
+        p += 16;
+    }
+    p = put_varint(p, entry.head ? 0 : entry.length + 1);
+
+    str = data + sizeof(entry);
+    for (i = 0; i < MK_LOGGER_BIN_FIELDS; i++) {
+        p = put_varint(p, ref[i]);
+        if (ref[i] & 1) {
+            memcpy(p, str, entry.len[i]);
+            p += entry.len[i];
+        }
+        str += entry.len[i];
+    }
+
+    return p - out;
+}
+
+void mk_logger_binary_reset(struct log_file *file)
+{
+    int i;
+    struct log_dict *dict = file->dict;
+
+    file->synced = MK_FALSE;
+    if (!dict) {
+        return;
+    }
+
+    for (i = 0; i < MK_LOGGER_DICT_SLOTS; i++) {
+        if (dict->slots[i].str) {
+            mk_api->mem_free(dict->slots[i].str);
+        }
+    }
+    memset(dict, '\0', sizeof(struct log_dict));
+}
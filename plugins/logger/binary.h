@@ -0,0 +1,113 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifndef MK_LOGGER_BINARY_H
+#define MK_LOGGER_BINARY_H
+
+/*
+ * Binary log format
+ * -----------------
+ * A log file is a sequence of records, the first byte tells the type:
+ *
+ *  SYNC   'M' 'K' 'L' 'B' version, varint unix time
+ *         Written every time the file is opened. Clears the dictionary and
+ *         sets the time the next entry is relative to.
+ *
+ *  STRING 0x02, varint length, bytes
+ *         Adds a string to the dictionary, the first one after a SYNC
+ *         gets the index 0.
+ *
+ *  ENTRY  0x01, zigzag varint seconds since the previous entry, varint
+ *         status, address family (0, 4 or 6) followed by 0, 4 or 16 bytes
+ *         of address, varint response length plus one (0 if unknown) and
+ *         a reference for each string field: virtual host, method, URI,
+ *         protocol, referer and user agent.
+ *
+ * A string reference is a varint: 0 for a missing field, an odd value
+ * (len << 1 | 1) followed by 'len' bytes for a literal string, or an even
+ * value ((index + 1) << 1) for a dictionary string.
+ *
+ * plugins/logger/bin/mk_logdec decodes the files.
+ */
+#define MK_LOGGER_BIN_VERSION    1
+#define MK_LOGGER_BIN_MAGIC      "MKLB"
+#define MK_LOGGER_BIN_ENTRY      0x01
+#define MK_LOGGER_BIN_STRING     0x02
+
+/* Interned strings per file and the longest string interned */
+#define MK_LOGGER_DICT_SIZE      4096
+#define MK_LOGGER_DICT_SLOTS     (MK_LOGGER_DICT_SIZE * 2)
+#define MK_LOGGER_DICT_MAXLEN    256
+
+enum {
+    MK_LOGGER_BIN_VHOST = 0,
+    MK_LOGGER_BIN_METHOD,
+    MK_LOGGER_BIN_URI,
+    MK_LOGGER_BIN_PROTOCOL,
+    MK_LOGGER_BIN_REFERER,
+    MK_LOGGER_BIN_USER_AGENT,
+    MK_LOGGER_BIN_FIELDS
+};
+
+/*
+ * Request as a worker queues it, fixed fields followed by the strings.
+ * The logger thread turns it into an ENTRY record.
+ */
+struct log_entry
+{
+    uint64_t length;
+    uint32_t time;
+    uint16_t status;
+    uint8_t  family;
+    uint8_t  head;
+    unsigned char addr[16];
+    uint16_t len[MK_LOGGER_BIN_FIELDS];
+};
+
+struct log_dict_slot
+{
+    uint32_t hash;
+    uint32_t id;
+    uint16_t len;
+    char *str;
+};
+
+struct log_dict
+{
+    unsigned int count;
+    struct log_dict_slot slots[MK_LOGGER_DICT_SLOTS];
+};
+
+struct log_file;
+
+int mk_logger_binary_entry(struct client_session *cs,
+                           struct session_request *sr,
+                           struct log_entry *entry, struct iovec *io);
+unsigned long mk_logger_binary_bound(unsigned long len);
+unsigned long mk_logger_binary_encode(struct log_file *file, char *out,
+                                      const char *data, unsigned long len);
+void mk_logger_binary_reset(struct log_file *file);
+
+#endif
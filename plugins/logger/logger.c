@@ -25,17 +25,20 @@
 /* System Headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <unistd.h>
 
 /* Local Headers */
 #include "logger.h"
+#include "binary.h"
 #include "pointers.h"
 
 MONKEY_PLUGIN("logger", /* shortname */
@@ -68,169 +71,327 @@ static struct status_response response_codes[] = {
 };
 
 
-static char *mk_logger_match_by_fd(int fd)
+static struct log_target *mk_logger_match_by_host(struct host *host)
 {
     struct mk_list *head;
     struct log_target *entry;
 
     mk_list_foreach(head, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
-
-        if (entry->fd_access[0] == fd) {
-            return entry->file_access;
-        }
-        if (entry->fd_error[0] == fd) {
-            return entry->file_error;
+        if (entry->host == host) {
+            return entry;
         }
     }
 
     return NULL;
 }
 
-static struct log_target *mk_logger_match_by_host(struct host *host)
+static struct iov *mk_logger_get_cache()
 {
-    struct mk_list *head;
-    struct log_target *entry;
+    return pthread_getspecific(_mkp_data);
+}
 
-    mk_list_foreach(head, &targets_list) {
-        entry = mk_list_entry(head, struct log_target, _head);
-        if (entry->host == host) {
-            return entry;
-        }
+/* Copy in or out of the ring, the position wraps around its end */
+static void mk_logger_ring_write(struct log_ring *ring, unsigned long pos,
+                                 const void *data, unsigned long len)
+{
+    unsigned long off = pos & (ring->size - 1);
+    unsigned long chunk = ring->size - off;
+
+    if (chunk > len) {
+        chunk = len;
     }
+    memcpy(ring->data + off, data, chunk);
+    memcpy(ring->data, (const char *) data + chunk, len - chunk);
+}
 
-    return NULL;
+static void mk_logger_ring_read(struct log_ring *ring, unsigned long pos,
+                                void *data, unsigned long len)
+{
+    unsigned long off = pos & (ring->size - 1);
+    unsigned long chunk = ring->size - off;
+
+    if (chunk > len) {
+        chunk = len;
+    }
+    memcpy(data, ring->data + off, chunk);
+    memcpy((char *) data + chunk, ring->data, len - chunk);
 }
 
-static struct iov *mk_logger_get_cache()
+static void mk_logger_kick(struct log_ring *ring)
 {
-    return pthread_getspecific(_mkp_data);
+    uint64_t val = 1;
+
+    if (ring->kicked) {
+        return;
+    }
+
+    ring->kicked = MK_TRUE;
+    if (write(mk_logger_efd, &val, sizeof(val)) < 0) {
+        ring->kicked = MK_FALSE;
+    }
 }
 
-static void mk_logger_worker_init(void *args)
+/*
+ * Append the line composed in the iovec to the ring of the calling worker.
+ * When the ring is full the line is counted as dropped, the logger
+ * thread reports it.
+ */
+static int mk_logger_push(struct log_file *file, struct iovec *io, int count,
+                          unsigned long total)
 {
-    int efd, max_events = mk_api->config->nhosts;
-    int i, bytes, err;
-    int flog;
-    int clk;
-    long slen;
-    int timeout;
-    char *target;
-    (void) args;
-    struct mk_list *head;
-    struct log_target *entry;
+    int i;
+    unsigned long tail;
+    unsigned long head;
+    unsigned long need;
+    struct log_ring *ring;
+    struct log_record rec;
+
+    ring = pthread_getspecific(cache_ring);
+    if (mk_unlikely(!ring)) {
+        return -1;
+    }
 
-    /* pipe_size:
-     * ----------
-     * Linux set a pipe size usingto the PAGE_SIZE,
-     * check linux/include/pipe_fs_i.h for details:
-     *
-     *       #define PIPE_SIZE               PAGE_SIZE
-     *
-     * In the same header file we can found that every
-     * pipe has 16 pages, so our real memory allocation
-     * is: (PAGE_SIZE*PIPE_BUFFERS)
-     */
-    long pipe_size;
+    need = sizeof(rec) + total;
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 
-    /* buffer_limit:
-     * -------------
-     * it means the maximum data that a monkey log pipe can contain.
-     */
-    long buffer_limit;
+    if (mk_unlikely(head + need - tail > ring->size)) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        mk_logger_kick(ring);
+        return -1;
+    }
 
-    mk_api->worker_rename("monkey: logger");
+    rec.file = file;
+    rec.len = total;
+    mk_logger_ring_write(ring, head, &rec, sizeof(rec));
+    head += sizeof(rec);
 
-    /* Monkey allow just 75% of a pipe capacity */
-    pipe_size = sysconf(_SC_PAGESIZE) * 16;
-    buffer_limit = (pipe_size * MK_LOGGER_PIPE_LIMIT);
+    for (i = 0; i < count; i++) {
+        mk_logger_ring_write(ring, head, io[i].iov_base, io[i].iov_len);
+        head += io[i].iov_len;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
 
-    /* Creating poll */
-    efd = mk_api->epoll_create(max_events);
+    if (head - tail > ring->size * MK_LOGGER_RING_LIMIT) {
+        mk_logger_kick(ring);
+    }
 
-    /* Registering targets for virtualhosts */
-    mk_list_foreach(head, &targets_list) {
-        entry = mk_list_entry(head, struct log_target, _head);
+    return 0;
+}
 
-        /* Add access log file */
-        if (entry->fd_access[0] > 0) {
-            mk_api->epoll_add(efd, entry->fd_access[0],
-                              MK_EPOLL_READ, MK_EPOLL_LEVEL_TRIGGERED);
-        }
-        /* Add error log file */
-        if (entry->fd_error[0] > 0) {
-            mk_api->epoll_add(efd, entry->fd_error[0],
-                              MK_EPOLL_READ, MK_EPOLL_LEVEL_TRIGGERED);
-        }
+static void mk_logger_file_open(struct log_file *file)
+{
+    struct stat st;
+
+    /* A binary file starts with a SYNC record and a new dictionary */
+    mk_logger_binary_reset(file);
+
+    file->fd = open(file->path,
+                    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (file->fd == -1) {
+        mk_warn("Could not open logfile '%s' (%s)", file->path, strerror(errno));
+        return;
     }
 
-    /* Set initial timeout */
-    timeout = time(NULL) + mk_logger_timeout;
+    if (fstat(file->fd, &st) == 0) {
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+    }
+}
 
-    /* Reading pipe buffer */
-    while (1) {
-        usleep(1200);
+/* The file was moved or removed by a log rotation, start a new one */
+static void mk_logger_file_check(struct log_file *file)
+{
+    struct stat st;
 
-        struct epoll_event events[max_events];
-        int num_fds = epoll_wait(efd, events, max_events, -1);
+    if (!file->path) {
+        return;
+    }
 
-        clk = mk_api->time_unix();
+    if (file->fd != -1 && stat(file->path, &st) == 0 &&
+        st.st_dev == file->dev && st.st_ino == file->ino) {
+        return;
+    }
 
-        for (i = 0; i < num_fds; i++) {
-            target = mk_logger_match_by_fd(events[i].data.fd);
+    if (file->fd != -1) {
+        PLUGIN_TRACE("reopening '%s'", file->path);
+        close(file->fd);
+    }
+    mk_logger_file_open(file);
+}
 
-            if (!target) {
-                mk_warn("Could not match host/epoll_fd");
+static void mk_logger_file_flush(struct log_file *file)
+{
+    ssize_t bytes;
+    unsigned long done = 0;
+
+    if (file->len == 0) {
+        return;
+    }
+
+    if (file->fd == -1) {
+        mk_logger_file_open(file);
+    }
+
+    while (file->fd != -1 && done < file->len) {
+        bytes = write(file->fd, file->buf + done, file->len - done);
+        if (bytes == -1) {
+            if (errno == EINTR) {
                 continue;
             }
+            mk_warn("Could not write to log file '%s' (%s)",
+                    file->path, strerror(errno));
+            break;
+        }
+        done += bytes;
+    }
 
-            err = ioctl(events[i].data.fd, FIONREAD, &bytes);
-            if (mk_unlikely(err == -1)){
-                perror("ioctl");
+    /* The dictionary strings may be lost with the data */
+    if (done < file->len) {
+        mk_logger_binary_reset(file);
+    }
+
+    PLUGIN_TRACE("written %lu bytes", done);
+    file->len = 0;
+}
+
+/* Move the lines of a ring to the buffers of their files */
+static void mk_logger_drain(struct log_ring *ring)
+{
+    unsigned long head;
+    unsigned long tail;
+    unsigned long size;
+    unsigned long dropped;
+    unsigned long need;
+    struct log_record rec;
+    struct log_file *file;
+    static char *entry = NULL;
+    static unsigned long entry_size = 0;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+
+    while (tail != head) {
+        mk_logger_ring_read(ring, tail, &rec, sizeof(rec));
+        tail += sizeof(rec);
+        file = rec.file;
+
+        need = rec.len;
+        if (mk_logger_format == MK_LOGGER_BINARY) {
+            need = mk_logger_binary_bound(rec.len);
+        }
+
+        if (file->len + need > file->size) {
+            mk_logger_file_flush(file);
+            if (need > file->size) {
+                size = need;
+                file->buf = mk_api->mem_realloc(file->buf, size);
+                file->size = size;
             }
+        }
 
-            if (bytes < buffer_limit && clk <= timeout) {
-                continue;
+        if (mk_logger_format == MK_LOGGER_BINARY) {
+            if (rec.len > entry_size) {
+                entry_size = rec.len;
+                entry = mk_api->mem_realloc(entry, entry_size);
             }
+            mk_logger_ring_read(ring, tail, entry, rec.len);
+            file->len += mk_logger_binary_encode(file, file->buf + file->len,
+                                                 entry, rec.len);
+        }
+        else {
+            mk_logger_ring_read(ring, tail, file->buf + file->len, rec.len);
+            file->len += rec.len;
+        }
+        tail += rec.len;
+    }
 
-            timeout = clk + mk_logger_timeout;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    ring->kicked = MK_FALSE;
 
-            flog = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
-            if (mk_unlikely(flog == -1)) {
-                mk_warn("Could not open logfile '%s' (%s)", target, strerror(errno));
+    dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (mk_unlikely(dropped > 0)) {
+        mk_warn("Logger: %lu lines dropped, log buffer full", dropped);
+    }
+}
 
-                int consumed = 0;
-                char buf[255];
-                do {
-                    slen = read(events[i].data.fd, buf, 255);
-                    if (slen > 0) {
-                        consumed += slen;
-                    }
-                    else {
-                        break;
-                    }
-                } while (consumed < bytes);
+/* Drain every ring and write the pending lines, one write per file */
+static void mk_logger_flush_all(int check)
+{
+    struct mk_list *head;
+    struct log_ring *ring;
+    struct log_target *entry;
+    static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-                continue;
-            }
+    pthread_mutex_lock(&flush_mutex);
+
+    for (ring = __atomic_load_n(&rings_list, __ATOMIC_ACQUIRE);
+         ring; ring = ring->next) {
+        mk_logger_drain(ring);
+    }
+
+    mk_list_foreach(head, &targets_list) {
+        entry = mk_list_entry(head, struct log_target, _head);
+        mk_logger_file_flush(&entry->access);
+        mk_logger_file_flush(&entry->error);
+
+        /* After the flush, lines queued before a rotation end in the old file */
+        if (check == MK_TRUE) {
+            mk_logger_file_check(&entry->access);
+            mk_logger_file_check(&entry->error);
+        }
+    }
+
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+static void mk_logger_worker_init(void *args)
+{
+    int ret;
+    time_t now;
+    time_t checked = 0;
+    time_t timeout;
+    uint64_t val;
+    struct pollfd pfd;
+    (void) args;
 
-            lseek(flog, 0, SEEK_END);
-            slen = splice(events[i].data.fd, NULL, flog,
-                          NULL, bytes, SPLICE_F_MOVE);
-            if (mk_unlikely(slen == -1)) {
-                mk_warn("Could not write to log file: splice() = %ld", slen);
+    mk_api->worker_rename("monkey: logger");
+
+    pfd.fd = mk_logger_efd;
+    pfd.events = POLLIN;
+    timeout = time(NULL) + mk_logger_timeout;
+
+    /*
+     * Lines are written every FlushTimeout seconds, or earlier when a
+     * worker ring is getting full.
+     */
+    while (1) {
+        now = time(NULL);
+        ret = poll(&pfd, 1, (timeout > now ? timeout - now : 0) * 1000);
+        if (ret > 0) {
+            if (read(mk_logger_efd, &val, sizeof(val)) < 0) {
+                PLUGIN_TRACE("could not read event fd");
             }
+        }
 
-            PLUGIN_TRACE("written %i bytes", bytes);
-            close(flog);
+        now = time(NULL);
+        if (ret <= 0) {
+            timeout = now + mk_logger_timeout;
         }
+
+        /* Look for rotated files at most once per second */
+        mk_logger_flush_all(now != checked ? MK_TRUE : MK_FALSE);
+        checked = now;
     }
 }
 
 static int mk_logger_read_config(char *path)
 {
     int timeout;
+    long ring_size;
     char *logfilename = NULL;
+    char *format;
     unsigned long len;
     char *default_file = NULL;
     struct mk_config *conf;
@@ -257,6 +418,37 @@ static int mk_logger_read_config(char *path)
         mk_logger_timeout = timeout;
         PLUGIN_TRACE("FlushTimeout %i seconds", mk_logger_timeout);
 
+        /* BufferSize, rounded up to a power of two */
+        ring_size = (long) mk_api->config_section_getval(section,
+                                                         "BufferSize",
+                                                         MK_CONFIG_VAL_NUM);
+        if (ring_size < 0) {
+            mk_err("BufferSize does not have a proper value");
+            exit(EXIT_FAILURE);
+        }
+        if (ring_size > 0) {
+            mk_logger_ring_size = 1024;
+            while (mk_logger_ring_size < (unsigned long) ring_size * 1024) {
+                mk_logger_ring_size <<= 1;
+            }
+        }
+        PLUGIN_TRACE("BufferSize %lu bytes", mk_logger_ring_size);
+
+        /* Format */
+        format = mk_api->config_section_getval(section,
+                                               "Format",
+                                               MK_CONFIG_VAL_STR);
+        if (format) {
+            if (strcasecmp(format, "binary") == 0) {
+                mk_logger_format = MK_LOGGER_BINARY;
+            }
+            else if (strcasecmp(format, "text") != 0) {
+                mk_err("Format does not have a proper value");
+                exit(EXIT_FAILURE);
+            }
+            mk_api->mem_free(format);
+        }
+
         /* MasterLog */
         logfilename = mk_api->config_section_getval(section,
                                                     "MasterLog",
@@ -305,9 +497,12 @@ int _mkp_init(struct plugin_api **api, char *confdir)
     pthread_key_create(&cache_content_length, NULL);
     pthread_key_create(&cache_status, NULL);
     pthread_key_create(&cache_ip_str, NULL);
+    pthread_key_create(&cache_ring, NULL);
 
     /* Global configuration */
     mk_logger_timeout = MK_LOGGER_TIMEOUT_DEFAULT;
+    mk_logger_format = MK_LOGGER_TEXT;
+    mk_logger_ring_size = MK_LOGGER_RING_DEFAULT * 1024;
     mk_logger_master_path = NULL;
     mk_logger_read_config(confdir);
 
@@ -333,11 +528,26 @@ void _mkp_exit()
     struct mk_list *head, *tmp;
     struct log_target *entry;
 
+    /* Write what the workers logged since the last flush */
+    mk_logger_flush_all(MK_FALSE);
+
     mk_list_foreach_safe(head, tmp, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
         mk_list_del(&entry->_head);
-        mk_api->mem_free(entry->file_access);
-        mk_api->mem_free(entry->file_error);
+        if (entry->access.fd != -1) {
+            close(entry->access.fd);
+        }
+        if (entry->error.fd != -1) {
+            close(entry->error.fd);
+        }
+        mk_logger_binary_reset(&entry->access);
+        mk_logger_binary_reset(&entry->error);
+        mk_api->mem_free(entry->access.path);
+        mk_api->mem_free(entry->access.buf);
+        mk_api->mem_free(entry->access.dict);
+        mk_api->mem_free(entry->error.path);
+        mk_api->mem_free(entry->error.buf);
+        mk_api->mem_free(entry->error.dict);
         mk_api->mem_free(entry);
     }
 
@@ -381,28 +591,23 @@ int _mkp_core_prctx(struct server_config *config)
                                                                      MK_CONFIG_VAL_STR);
 
             if (access_file_name || error_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                /* Set access pipe */
+                new = mk_api->mem_alloc_z(sizeof(struct log_target));
+                new->access.fd = -1;
+                new->error.fd = -1;
+
+                /* Set access file */
                 if (access_file_name) {
-                    if (pipe(new->fd_access) < 0) {
-                        mk_err("Could not create pipe");
-                        exit(EXIT_FAILURE);
-                    }
-                    fcntl(new->fd_access[1], F_SETFL, O_NONBLOCK);
-                    fcntl(new->fd_access[0], F_SETFD, FD_CLOEXEC);
-                    fcntl(new->fd_access[1], F_SETFD, FD_CLOEXEC);
-                    new->file_access = access_file_name;
+                    new->access.path = access_file_name;
+                    new->access.size = MK_LOGGER_FILE_BUFFER;
+                    new->access.buf = mk_api->mem_alloc(new->access.size);
+                    mk_logger_file_open(&new->access);
                 }
-                /* Set error pipe */
+                /* Set error file */
                 if (error_file_name) {
-                    if (pipe(new->fd_error) < 0) {
-                        mk_err("Could not create pipe");
-                        exit(EXIT_FAILURE);
-                    }
-                    fcntl(new->fd_error[1], F_SETFL, O_NONBLOCK);
-                    fcntl(new->fd_error[0], F_SETFD, FD_CLOEXEC);
-                    fcntl(new->fd_error[1], F_SETFD, FD_CLOEXEC);
-                    new->file_error = error_file_name;
+                    new->error.path = error_file_name;
+                    new->error.size = MK_LOGGER_FILE_BUFFER;
+                    new->error.buf = mk_api->mem_alloc(new->error.size);
+                    mk_logger_file_open(&new->error);
                 }
 
                 new->host = entry_host;
@@ -411,6 +616,12 @@ int _mkp_core_prctx(struct server_config *config)
         }
     }
 
+    mk_logger_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mk_logger_efd == -1) {
+        mk_err("Logger: could not create event fd");
+        exit(EXIT_FAILURE);
+    }
+
     mk_api->worker_spawn((void *) mk_logger_worker_init, NULL);
     return 0;
 }
@@ -421,9 +632,19 @@ void _mkp_core_thctx()
     mk_pointer *content_length;
     mk_pointer *status;
     mk_pointer *ip_str;
+    struct log_ring *ring;
 
     PLUGIN_TRACE("Creating thread cache");
 
+    /* Lines of this worker, registered for the logger thread */
+    ring = mk_api->mem_alloc_z(sizeof(struct log_ring));
+    ring->size = mk_logger_ring_size;
+    ring->data = mk_api->mem_alloc(ring->size);
+    do {
+        ring->next = rings_list;
+    } while (!__sync_bool_compare_and_swap(&rings_list, ring->next, ring));
+    pthread_setspecific(cache_ring, (void *) ring);
+
     /* Cache iov log struct */
     iov_log = mk_api->iov_create(15, 0);
     pthread_setspecific(_mkp_data, (void *) iov_log);
@@ -457,6 +678,12 @@ int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
     mk_pointer *content_length;
     mk_pointer *ip_str;
     mk_pointer status;
+    char status_buf[16];
+    int count;
+    unsigned long len;
+    struct log_file *file;
+    struct log_entry entry;
+    struct iovec bin_io[MK_LOGGER_BIN_FIELDS + 1];
 
     /* Set response status */
     http_status = sr->headers.status;
@@ -468,6 +695,21 @@ int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
         return 0;
     }
 
+    /* Binary format, the logger thread encodes the entry */
+    if (mk_logger_format == MK_LOGGER_BINARY) {
+        file = (http_status < 400) ? &target->access : &target->error;
+        if (!file->path) {
+            return 0;
+        }
+
+        count = mk_logger_binary_entry(cs, sr, &entry, bin_io);
+        for (i = 0, len = 0; i < count; i++) {
+            len += bin_io[i].iov_len;
+        }
+        mk_logger_push(file, bin_io, count, len);
+        return 0;
+    }
+
     /* Get iov cache struct and reset indexes */
     iov = (struct mk_iov *) mk_logger_get_cache();
     iov->iov_idx = 0;
@@ -501,7 +743,7 @@ int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
     /* Access Log */
     if (http_status < 400) {
         /* No access file defined */
-        if (!target->file_access) {
+        if (!target->access.path) {
             return 0;
         }
 
@@ -527,6 +769,7 @@ int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
         }
 
         if (array_len == i) {
+            status.data = status_buf;
             mk_api->str_itop(http_status, &status);
             status.len -= 2;
         }
@@ -562,15 +805,16 @@ int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
                                   mk_logger_iov_lf, MK_IOV_NOT_FREE_BUF);
         }
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->fd_access[1], iov);
+        /* Queue the line for the logger thread */
+        mk_logger_push(&target->access, iov->io, iov->iov_idx,
+                       iov->total_len);
     }
     else {
-        if (mk_unlikely(!target->file_error)) {
+        if (mk_unlikely(!target->error.path)) {
             return 0;
         }
 
-        /* For unknown errors. Needs to exist until iov_send. */
+        /* For unknown errors. Needs to exist until the line is queued. */
         char err_str[80];
 
         switch (http_status) {
@@ -670,8 +914,9 @@ int _mkp_stage_40(struct client_session *cs, struct session_request *sr)
             break;
         }
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->fd_error[1], iov);
+        /* Queue the line for the logger thread */
+        mk_logger_push(&target->error, iov->io, iov->iov_idx,
+                       iov->total_len);
     }
 
     return 0;
@@ -26,11 +26,27 @@
 
 #include "MKPlugin.h"
 #include <stdio.h>
+#include <stdint.h>
 
-#define MK_LOGGER_PIPE_LIMIT 0.75
 #define MK_LOGGER_TIMEOUT_DEFAULT 3
 
+/* Per worker ring size in KB and the fill ratio which wakes the logger up */
+#define MK_LOGGER_RING_DEFAULT    256
+#define MK_LOGGER_RING_LIMIT      0.75
+
+/* Initial size of the write buffer of a log file */
+#define MK_LOGGER_FILE_BUFFER     65536
+
+/* Format of the log files, see binary.h */
+#define MK_LOGGER_TEXT            0
+#define MK_LOGGER_BINARY          1
+
 int mk_logger_timeout;
+int mk_logger_format;
+unsigned long mk_logger_ring_size;
+
+/* Wakes up the logger thread before the flush timeout */
+int mk_logger_efd;
 
 /* MasterLog variables */
 char *mk_logger_master_path;
@@ -40,21 +56,63 @@ FILE *mk_logger_master_stderr;
 pthread_key_t cache_content_length;
 pthread_key_t cache_status;
 pthread_key_t cache_ip_str;
+pthread_key_t cache_ring;
 
-struct log_target
+struct log_dict;
+
+/* A log file kept open by the logger thread */
+struct log_file
 {
-    /* Pipes */
-    int fd_access[2];
-    int fd_error[2];
+    char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+
+    /* Lines waiting to be written */
+    char *buf;
+    unsigned long len;
+    unsigned long size;
 
-    /* File paths */
-    char *file_access;
-    char *file_error;
+    /* Binary format state, what the decoder knows about the file */
+    int synced;
+    uint32_t last_time;
+    struct log_dict *dict;
+};
+
+struct log_target
+{
+    struct log_file access;
+    struct log_file error;
 
     struct host *host;
     struct mk_list _head;
 };
 
+/*
+ * Lines formatted by a worker, only the worker moves the head and only
+ * the logger thread moves the tail. Every line is preceded by a record
+ * header telling the file it belongs to.
+ */
+struct log_record
+{
+    struct log_file *file;
+    unsigned long len;
+};
+
+struct log_ring
+{
+    char *data;
+    unsigned long size;
+    unsigned long head __attribute__ ((aligned (64)));
+    unsigned long tail __attribute__ ((aligned (64)));
+    unsigned long dropped;
+    int kicked;
+    struct log_ring *next;
+};
+
+/* Rings of every worker, new rings are pushed without locking */
+struct log_ring *rings_list;
+
 struct mk_list targets_list;
 
 
@@ -0,0 +1,363 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA
+ */
+
+
+/*
+ * Per client address limits: open connections, checked when the
+ * connection is accepted, and a token bucket of requests, checked when
+ * each request arrives. The state lives in an open addressing table
+ * updated with atomic operations only; an address idle long enough for
+ * its bucket to be full again and without connections gives its slot to
+ * the next address hashed there, so the table never needs a sweep.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "MKPlugin.h"
+#include "limit.h"
+
+static long limit_conns;          /* per address, 0 for no limit */
+static long limit_rate;           /* requests per second          */
+static long limit_burst;
+static uint32_t limit_idle;       /* ms before a slot is reused   */
+
+static struct mk_limit_slot *limit_table;
+static unsigned long limit_mask;
+
+/* Slot charged by each connection, indexed by socket */
+static int *limit_conn_slot;
+static int limit_conn_max;
+
+static struct mk_limit_stats limit_stats;
+static struct timespec limit_start;
+
+static const char limit_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+/* Milliseconds since the plugin started, wraps after 49 days */
+static inline uint32_t limit_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec - limit_start.tv_sec) * 1000 +
+        (ts.tv_nsec - limit_start.tv_nsec) / 1000000;
+}
+
+/* IPv4 clients are tracked by address, IPv6 ones by their /64 network */
+static uint64_t limit_key(const struct sockaddr *addr)
+{
+    int i;
+    uint32_t v4;
+    uint64_t key;
+    const unsigned char *p;
+
+    if (addr->sa_family == AF_INET) {
+        memcpy(&v4, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+        return (1ULL << 32) | v4;
+    }
+    else if (addr->sa_family == AF_INET6) {
+        p = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *) p)) {
+            memcpy(&v4, p + 12, 4);
+            return (1ULL << 32) | v4;
+        }
+
+        key = 14695981039346656037ULL;
+        for (i = 0; i < 8; i++) {
+            key ^= p[i];
+            key *= 1099511628211ULL;
+        }
+        return key | (1ULL << 63);
+    }
+
+    return 0;
+}
+
+static inline uint64_t limit_bucket_full(uint32_t now)
+{
+    return ((uint64_t) now << 32) | (uint64_t) (limit_burst * 1000);
+}
+
+/* Find the slot of the address, or take a free or expired one */
+static int limit_slot_get(uint64_t key, uint32_t now)
+{
+    int i;
+    unsigned long pos;
+    uint64_t cur;
+    struct mk_limit_slot *slot;
+
+    pos = (key * 0x9E3779B97F4A7C15ULL) >> 32;
+
+    for (i = 0; i < MK_LIMIT_PROBES; i++) {
+        slot = &limit_table[(pos + i) & limit_mask];
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key) {
+            return (pos + i) & limit_mask;
+        }
+    }
+
+    for (i = 0; i < MK_LIMIT_PROBES; i++) {
+        slot = &limit_table[(pos + i) & limit_mask];
+        cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (cur != 0 &&
+            (__atomic_load_n(&slot->conns, __ATOMIC_RELAXED) > 0 ||
+             now - __atomic_load_n(&slot->seen, __ATOMIC_RELAXED) <
+             limit_idle)) {
+            continue;
+        }
+
+        if (__sync_bool_compare_and_swap(&slot->key, cur, key)) {
+            __atomic_store_n(&slot->bucket, limit_bucket_full(now),
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->seen, now, __ATOMIC_RELAXED);
+            return (pos + i) & limit_mask;
+        }
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key) {
+            return (pos + i) & limit_mask;
+        }
+    }
+
+    return -1;
+}
+
+/* Take one request from the bucket, returns -1 if it is empty */
+static int limit_bucket_take(struct mk_limit_slot *slot, uint32_t now)
+{
+    uint32_t last;
+    uint64_t tokens;
+    uint64_t old;
+    uint64_t new;
+    uint64_t max = limit_burst * 1000;
+
+    old = __atomic_load_n(&slot->bucket, __ATOMIC_RELAXED);
+    do {
+        last = old >> 32;
+        tokens = old & 0xffffffff;
+
+        /* A request costs 1000, the rate refills that much per second */
+        tokens += (uint64_t) (uint32_t) (now - last) * limit_rate;
+        if (tokens > max) {
+            tokens = max;
+        }
+        if (tokens < 1000) {
+            return -1;
+        }
+        new = ((uint64_t) now << 32) | (tokens - 1000);
+    } while (!__atomic_compare_exchange_n(&slot->bucket, &old, new, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+/* Read the [LIMITS] section, returns the number of limits enabled */
+int mk_security_limit_conf(struct mk_config *conf)
+{
+    long size;
+    struct mk_config_section *section;
+
+    section = mk_api->config_section_get(conf, "LIMITS");
+    if (!section) {
+        return 0;
+    }
+
+    limit_conns = (long) mk_api->config_section_getval(section, "Connections",
+                                                       MK_CONFIG_VAL_NUM);
+    limit_rate = (long) mk_api->config_section_getval(section, "Requests",
+                                                      MK_CONFIG_VAL_NUM);
+    limit_burst = (long) mk_api->config_section_getval(section, "Burst",
+                                                       MK_CONFIG_VAL_NUM);
+    size = (long) mk_api->config_section_getval(section, "Addresses",
+                                                MK_CONFIG_VAL_NUM);
+
+    if (limit_conns < 0 || limit_rate < 0 || limit_burst < 0 || size < 0) {
+        mk_warn("Mandril: invalid value in LIMITS section, limits disabled");
+        limit_conns = limit_rate = 0;
+        return 0;
+    }
+
+    if (limit_rate > 1000000) {
+        limit_rate = 1000000;
+    }
+    if (limit_burst == 0 || limit_burst > 1000000) {
+        limit_burst = limit_rate > 0 ? limit_rate : 1;
+    }
+
+    /* Keep an address until its bucket would be full again */
+    limit_idle = 1000;
+    if (limit_rate > 0) {
+        limit_idle += (limit_burst * 1000) / limit_rate;
+    }
+
+    limit_mask = MK_LIMIT_TABLE_SIZE - 1;
+    if (size > 0) {
+        limit_mask = 1;
+        while (limit_mask < (unsigned long) size) {
+            limit_mask <<= 1;
+        }
+        limit_mask--;
+    }
+
+    return (limit_conns > 0) + (limit_rate > 0);
+}
+
+int mk_security_limit_init()
+{
+    int i;
+    struct rlimit rl;
+
+    if (limit_conns == 0 && limit_rate == 0) {
+        return 0;
+    }
+
+    /* Sockets above the limit are not tracked */
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur > (1 << 20)) {
+        rl.rlim_cur = 1 << 20;
+    }
+
+    limit_table = mk_api->mem_alloc_z(sizeof(struct mk_limit_slot) *
+                                      (limit_mask + 1));
+    limit_conn_slot = mk_api->mem_alloc(sizeof(int) * rl.rlim_cur);
+    if (!limit_table || !limit_conn_slot) {
+        mk_err("Mandril: cannot allocate the limits table");
+        limit_conns = limit_rate = 0;
+        return -1;
+    }
+
+    for (i = 0; i < (int) rl.rlim_cur; i++) {
+        limit_conn_slot[i] = -1;
+    }
+    limit_conn_max = rl.rlim_cur;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &limit_start);
+
+    mk_info("Mandril: limits %ld connections, %ld requests/s (burst %ld) "
+            "per address", limit_conns, limit_rate, limit_burst);
+    return 0;
+}
+
+/* Stage 10: account the connection, returns -1 if over the limit */
+int mk_security_limit_connect(int socket, const struct sockaddr *addr)
+{
+    int i;
+    uint32_t now;
+    uint64_t key;
+    struct mk_limit_slot *slot;
+
+    if (!limit_table || socket >= limit_conn_max) {
+        return 0;
+    }
+
+    key = limit_key(addr);
+    if (key == 0) {
+        return 0;
+    }
+
+    now = limit_now();
+    i = limit_slot_get(key, now);
+    if (i < 0) {
+        /* Table full of busy addresses, let the client in */
+        __sync_fetch_and_add(&limit_stats.untracked, 1);
+        return 0;
+    }
+
+    slot = &limit_table[i];
+    if (__sync_add_and_fetch(&slot->conns, 1) > (uint32_t) limit_conns &&
+        limit_conns > 0) {
+        __sync_fetch_and_sub(&slot->conns, 1);
+        __sync_fetch_and_add(&limit_stats.conns_rejected, 1);
+        return -1;
+    }
+    __atomic_store_n(&slot->seen, now, __ATOMIC_RELAXED);
+
+    /* A previous connection on this socket was not released */
+    i = __atomic_exchange_n(&limit_conn_slot[socket], i, __ATOMIC_ACQ_REL);
+    if (i >= 0) {
+        __sync_fetch_and_sub(&limit_table[i].conns, 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Stage 20: take a request from the bucket of the connection address. If
+ * it is empty the pre-rendered 429 response is sent and -1 returned, the
+ * connection must be closed.
+ */
+int mk_security_limit_request(int socket)
+{
+    int i;
+
+    if (limit_rate == 0 || socket >= limit_conn_max) {
+        return 0;
+    }
+
+    i = __atomic_load_n(&limit_conn_slot[socket], __ATOMIC_ACQUIRE);
+    if (i < 0) {
+        return 0;
+    }
+
+    if (limit_bucket_take(&limit_table[i], limit_now()) == 0) {
+        return 0;
+    }
+
+    __sync_fetch_and_add(&limit_stats.requests_rejected, 1);
+    mk_api->socket_send(socket, limit_response, sizeof(limit_response) - 1);
+    return -1;
+}
+
+/* Stage 50: release the connection, it can run twice for a socket */
+void mk_security_limit_close(int socket)
+{
+    int i;
+
+    if (!limit_table || socket >= limit_conn_max) {
+        return;
+    }
+
+    i = __atomic_exchange_n(&limit_conn_slot[socket], -1, __ATOMIC_ACQ_REL);
+    if (i < 0) {
+        return;
+    }
+
+    __atomic_store_n(&limit_table[i].seen, limit_now(), __ATOMIC_RELAXED);
+    __sync_fetch_and_sub(&limit_table[i].conns, 1);
+}
+
+void mk_security_limit_counters(int (*print) (const char *, ...))
+{
+    if (!limit_table) {
+        return;
+    }
+
+    print("Limits: %lu connections rejected, %lu requests rejected, "
+          "%lu untracked\n",
+          (unsigned long) limit_stats.conns_rejected,
+          (unsigned long) limit_stats.requests_rejected,
+          (unsigned long) limit_stats.untracked);
+}
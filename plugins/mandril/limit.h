@@ -0,0 +1,67 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA
+ */
+
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef MK_SECURITY_LIMIT_H
+#define MK_SECURITY_LIMIT_H
+
+/* Default number of addresses tracked, a power of two */
+#define MK_LIMIT_TABLE_SIZE   65536
+
+/* Status of the response to a client over the requests rate */
+#define MK_LIMIT_HTTP_STATUS  429
+
+/* Slots probed from the hash position of an address */
+#define MK_LIMIT_PROBES       8
+
+/*
+ * State of a client address. 'bucket' holds the time of the last refill
+ * in the high 32 bits, in milliseconds, and the available tokens in the
+ * low 32 bits, in thousandths of a request, so it is updated with a
+ * single compare and swap.
+ */
+struct mk_limit_slot
+{
+    uint64_t key;               /* address, 0 when the slot is free */
+    uint64_t bucket;
+    uint32_t conns;             /* open connections */
+    uint32_t seen;              /* last use, milliseconds */
+};
+
+struct mk_limit_stats
+{
+    uint64_t conns_rejected;
+    uint64_t requests_rejected;
+    uint64_t untracked;
+};
+
+int mk_security_limit_conf(struct mk_config *conf);
+int mk_security_limit_init();
+int mk_security_limit_connect(int socket, const struct sockaddr *addr);
+int mk_security_limit_request(int socket);
+void mk_security_limit_close(int socket);
+void mk_security_limit_counters(int (*print) (const char *, ...));
+
+#endif
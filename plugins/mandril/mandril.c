@@ -21,7 +21,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -33,26 +37,34 @@
 /* Monkey API */
 #include "MKPlugin.h"
 #include "mandril.h"
+#include "limit.h"
 
 MONKEY_PLUGIN("mandril",  /* shortname */
               "Mandril",  /* name */
               VERSION,    /* version */
-              MK_PLUGIN_STAGE_10 | MK_PLUGIN_STAGE_30); /* hooks */
+              MK_PLUGIN_STAGE_10 | MK_PLUGIN_STAGE_20 |
+              MK_PLUGIN_STAGE_30 | MK_PLUGIN_STAGE_50); /* hooks */
 
 static struct mk_config *conf;
+static char *ip_conf_path;
+
+/* IP rule set and the workers reading it */
+static struct mk_secure_ip_table *ip_table;
+static struct mk_secure_ip_reader *ip_readers;
+static int ip_readers_count;
+static int ip_readers_next;
+static pthread_key_t ip_reader;
+static pthread_mutex_t ip_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Read database configuration parameters */
 static int mk_security_conf(char *confdir)
 {
-    int n;
     int ret = 0;
     unsigned long len;
     char *conf_path = NULL;
-    char *_net, *_mask;
 
-    struct mk_secure_ip_t *new_ip;
     struct mk_secure_url_t *new_url;
-    struct mk_secure_deny_hotlink_t *new_deny_hotlink;
+    struct mk_secure_url_t *new_deny_hotlink;
 
     struct mk_config_section *section;
     struct mk_config_entry *entry;
@@ -67,78 +79,8 @@ static int mk_security_conf(char *confdir)
     mk_list_foreach(head, &section->entries) {
         entry = mk_list_entry(head, struct mk_config_entry, _head);
 
-        /* Passing to internal struct */
-        if (strcasecmp(entry->key, "IP") == 0) {
-            new_ip = mk_api->mem_alloc(sizeof(struct mk_secure_ip_t));
-            n = mk_api->str_search(entry->val, "/", 1);
-
-            /* subnet */
-            if (n > 0) {
-                /* split network addr and netmask */
-                _net  = mk_api->str_copy_substr(entry->val, 0, n);
-                _mask = mk_api->str_copy_substr(entry->val,
-                                                n + 1,
-                                                strlen(entry->val));
-
-                /* validations... */
-                if (!_net ||  !_mask) {
-                    mk_warn("Mandril: cannot parse entry '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                mk_info("network: '%s' mask: '%s'", _net, _mask);
-
-                /* convert ip string to network address */
-                if (inet_aton(_net, &new_ip->ip) == 0) {
-                    mk_warn("Mandril: invalid ip address '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* parse mask */
-                new_ip->netmask = strtol(_mask, (char **) NULL, 10);
-                if (new_ip->netmask <= 0 || new_ip->netmask >= 32) {
-                    mk_warn("Mandril: invalid mask value '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* complete struct data */
-                new_ip->is_subnet = MK_TRUE;
-                new_ip->network = MK_NET_NETWORK(new_ip->ip.s_addr, new_ip->netmask);
-                new_ip->hostmin = MK_NET_HOSTMIN(new_ip->ip.s_addr, new_ip->netmask);
-                new_ip->hostmax = MK_NET_HOSTMAX(new_ip->ip.s_addr, new_ip->netmask);
-
-                /* link node with main list */
-                mk_list_add(&new_ip->_head, &mk_secure_ip);
-
-            /*
-             * I know, you were instructed to hate 'goto' statements!, ok, show this
-             * code to your teacher and let him blame :P
-             */
-            ip_next:
-                if (_net) {
-                    mk_api->mem_free(_net);
-                }
-                if (_mask) {
-                    mk_api->mem_free(_mask);
-                }
-            }
-            else { /* normal IP address */
-
-                /* convert ip string to network address */
-                if (inet_aton(entry->val, &new_ip->ip) == 0) {
-                    mk_warn("Mandril: invalid ip address '%s' in RULES section",
-                            entry->val);
-                }
-                else {
-                    new_ip->is_subnet = MK_FALSE;
-                    mk_list_add(&new_ip->_head, &mk_secure_ip);
-                }
-            }
-        }
-        else if (strcasecmp(entry->key, "URL") == 0) {
+        /* Passing to internal struct, IP rules are loaded apart */
+        if (strcasecmp(entry->key, "URL") == 0) {
             /* simple allcotion and data association */
             new_url = mk_api->mem_alloc(sizeof(struct mk_secure_url_t));
             new_url->criteria = entry->val;
@@ -147,71 +89,606 @@ static int mk_security_conf(char *confdir)
             mk_list_add(&new_url->_head, &mk_secure_url);
         }
         else if (strcasecmp(entry->key, "deny_hotlink") == 0) {
-            new_deny_hotlink = mk_api->mem_alloc(sizeof(*new_deny_hotlink));
+            new_deny_hotlink = mk_api->mem_alloc(sizeof(struct mk_secure_url_t));
             new_deny_hotlink->criteria = entry->val;
 
             mk_list_add(&new_deny_hotlink->_head, &mk_secure_deny_hotlink);
         }
     }
 
-    mk_api->mem_free(conf_path);
+    mk_security_limit_conf(conf);
+
+    ip_conf_path = conf_path;
     return ret;
 }
 
-static int mk_security_check_ip(int socket)
+static inline int ip_bit(const unsigned char *key, int n)
+{
+    return (key[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/* Number of leading bits, up to 'max', shared by both keys */
+static int ip_common(const unsigned char *a, const unsigned char *b, int max)
+{
+    int n = 0;
+    unsigned char diff;
+
+    while (n < max) {
+        diff = a[n >> 3] ^ b[n >> 3];
+        if (diff == 0) {
+            n += 8;
+            continue;
+        }
+        while (!(diff & 0x80)) {
+            diff <<= 1;
+            n++;
+        }
+        break;
+    }
+
+    return n < max ? n : max;
+}
+
+static struct mk_secure_ip_node *ip_node(const unsigned char *key, int bits,
+                                         int action)
+{
+    struct mk_secure_ip_node *node;
+
+    node = mk_api->mem_alloc_z(sizeof(struct mk_secure_ip_node));
+    memcpy(node->key, key, (bits + 7) >> 3);
+    if (bits & 7) {
+        node->key[bits >> 3] &= 0xff << (8 - (bits & 7));
+    }
+    node->bits = bits;
+    node->action = action;
+
+    return node;
+}
+
+/* Add a rule, a later rule for the same prefix replaces the previous one */
+static void mk_security_ip_insert(struct mk_secure_ip_node **root,
+                                  const unsigned char *key, int bits,
+                                  int action)
+{
+    int common;
+    struct mk_secure_ip_node *node;
+    struct mk_secure_ip_node *split;
+
+    while ((node = *root)) {
+        common = ip_common(node->key, key,
+                           node->bits < bits ? node->bits : bits);
+
+        /* The rule ends inside the node prefix, split it */
+        if (common < node->bits) {
+            split = ip_node(key, common, MK_SECURE_IP_NONE);
+            split->child[ip_bit(node->key, common)] = node;
+            if (common == bits) {
+                split->action = action;
+            }
+            else {
+                split->child[ip_bit(key, common)] = ip_node(key, bits, action);
+            }
+            *root = split;
+            return;
+        }
+
+        if (node->bits == bits) {
+            node->action = action;
+            return;
+        }
+        root = &node->child[ip_bit(key, node->bits)];
+    }
+
+    *root = ip_node(key, bits, action);
+}
+
+/* Action of the most specific rule matching the address */
+static int mk_security_ip_match(struct mk_secure_ip_node *node,
+                                const unsigned char *addr, int max)
+{
+    int action = MK_SECURE_IP_NONE;
+
+    while (node) {
+        if (ip_common(node->key, addr, node->bits) < node->bits) {
+            break;
+        }
+        if (node->action != MK_SECURE_IP_NONE) {
+            action = node->action;
+        }
+        if (node->bits == max) {
+            break;
+        }
+        node = node->child[ip_bit(addr, node->bits)];
+    }
+
+    return action;
+}
+
+static void mk_security_ip_free_node(struct mk_secure_ip_node *node)
 {
-    int network;
-    struct mk_secure_ip_t *entry;
+    if (!node) {
+        return;
+    }
+
+    mk_security_ip_free_node(node->child[0]);
+    mk_security_ip_free_node(node->child[1]);
+    mk_api->mem_free(node);
+}
+
+static void mk_security_ip_free(struct mk_secure_ip_table *table)
+{
+    struct mk_list *head, *tmp;
+    struct mk_secure_ip_file *file;
+
+    mk_security_ip_free_node(table->v4);
+    mk_security_ip_free_node(table->v6);
+
+    mk_list_foreach_safe(head, tmp, &table->files) {
+        file = mk_list_entry(head, struct mk_secure_ip_file, _head);
+        mk_list_del(&file->_head);
+        mk_api->mem_free(file->path);
+        mk_api->mem_free(file);
+    }
+    mk_api->mem_free(table);
+}
+
+/* Parse an IPv4 or IPv6 address with an optional /bits network mask */
+static int mk_security_ip_add(struct mk_secure_ip_table *table,
+                              const char *val, int action)
+{
+    int max;
+    long bits;
+    char *end;
+    char addr[INET6_ADDRSTRLEN];
+    const char *mask;
+    unsigned char key[16];
+    size_t len;
+
+    mask = strchr(val, '/');
+    len = mask ? (size_t) (mask - val) : strlen(val);
+    if (len >= sizeof(addr)) {
+        goto error;
+    }
+    memcpy(addr, val, len);
+    addr[len] = '\0';
+
+    if (inet_pton(AF_INET, addr, key) == 1) {
+        max = 32;
+    }
+    else if (inet_pton(AF_INET6, addr, key) == 1) {
+        max = 128;
+    }
+    else {
+        goto error;
+    }
+
+    bits = max;
+    if (mask) {
+        bits = strtol(mask + 1, &end, 10);
+        if (end == mask + 1 || *end != '\0' || bits < 0 || bits > max) {
+            goto error;
+        }
+    }
+
+    if (max == 32) {
+        mk_security_ip_insert(&table->v4, key, bits, action);
+    }
+    else {
+        mk_security_ip_insert(&table->v6, key, bits, action);
+    }
+    table->rules++;
+    return 0;
+
+ error:
+    mk_warn("Mandril: invalid IP rule '%s'", val);
+    return -1;
+}
+
+static void mk_security_ip_watch_file(struct mk_secure_ip_table *table,
+                                      const char *path)
+{
+    struct stat st;
+    struct mk_secure_ip_file *file;
+
+    file = mk_api->mem_alloc(sizeof(struct mk_secure_ip_file));
+    file->path = mk_api->str_dup(path);
+    file->mtime = (stat(path, &st) == 0) ? st.st_mtime : 0;
+    mk_list_add(&file->_head, &table->files);
+}
+
+/* Deny every address or network listed in the file, one per line */
+static void mk_security_ip_list(struct mk_secure_ip_table *table,
+                                const char *path)
+{
+    char *p;
+    char *end;
+    char line[256];
+    FILE *f;
+
+    mk_security_ip_watch_file(table, path);
+
+    f = fopen(path, "r");
+    if (!f) {
+        mk_warn("Mandril: cannot read IP list '%s'", path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        p = line;
+        while (isspace((unsigned char) *p)) {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        end = p;
+        while (*end && !isspace((unsigned char) *end) && *end != '#') {
+            end++;
+        }
+        *end = '\0';
+
+        mk_security_ip_add(table, p, MK_SECURE_IP_DENY);
+    }
+
+    fclose(f);
+}
+
+/* Build the IP rule set from the [RULES] section and the files it lists */
+static struct mk_secure_ip_table *mk_security_ip_load(const char *path)
+{
+    struct mk_config *cnf;
+    struct mk_config_section *section;
+    struct mk_config_entry *entry;
+    struct mk_secure_ip_table *table;
     struct mk_list *head;
-    struct in_addr addr_t, *addr = &addr_t;
-    socklen_t len = sizeof(addr);
 
-    if (getpeername(socket, (struct sockaddr *)&addr_t, &len) < 0) {
-        return -1;
+    cnf = mk_api->config_create(path);
+    if (!cnf) {
+        return NULL;
+    }
+
+    table = mk_api->mem_alloc_z(sizeof(struct mk_secure_ip_table));
+    mk_list_init(&table->files);
+    mk_security_ip_watch_file(table, path);
+
+    section = mk_api->config_section_get(cnf, "RULES");
+    if (section) {
+        mk_list_foreach(head, &section->entries) {
+            entry = mk_list_entry(head, struct mk_config_entry, _head);
+
+            if (strcasecmp(entry->key, "IP") == 0) {
+                mk_security_ip_add(table, entry->val, MK_SECURE_IP_DENY);
+            }
+            else if (strcasecmp(entry->key, "allow_ip") == 0) {
+                mk_security_ip_add(table, entry->val, MK_SECURE_IP_ALLOW);
+            }
+            else if (strcasecmp(entry->key, "ip_list") == 0) {
+                mk_security_ip_list(table, entry->val);
+            }
+        }
+    }
+    mk_api->config_free(cnf);
+
+    return table;
+}
+
+static int mk_security_ip_changed(struct mk_secure_ip_table *table)
+{
+    time_t mtime;
+    struct stat st;
+    struct mk_list *head;
+    struct mk_secure_ip_file *file;
+
+    mk_list_foreach(head, &table->files) {
+        file = mk_list_entry(head, struct mk_secure_ip_file, _head);
+        mtime = (stat(file->path, &st) == 0) ? st.st_mtime : 0;
+        if (mtime != file->mtime) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Publish a new rule set. Workers which were reading when the pointer was
+ * replaced may still hold the old one, wait until each of them is done
+ * before releasing it.
+ */
+static void mk_security_ip_swap(struct mk_secure_ip_table *table)
+{
+    int i;
+    unsigned long seq;
+    struct mk_secure_ip_table *old;
+
+    old = __atomic_exchange_n(&ip_table, table, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < ip_readers_count; i++) {
+        seq = __atomic_load_n(&ip_readers[i].seq, __ATOMIC_SEQ_CST);
+        if (!(seq & 1)) {
+            continue;
+        }
+        while (__atomic_load_n(&ip_readers[i].seq, __ATOMIC_SEQ_CST) == seq) {
+            sched_yield();
+        }
+    }
+
+    /* Threads without a sequence read under the mutex */
+    pthread_mutex_lock(&ip_mutex);
+    pthread_mutex_unlock(&ip_mutex);
+
+    mk_security_ip_free(old);
+}
+
+/* Thread: reload the IP rules when mandril.conf or a listed file changes */
+static void mk_security_ip_watch(void *data)
+{
+    struct mk_secure_ip_table *table;
+
+    (void) data;
+    mk_api->worker_rename("monkey: mandril");
+
+    while (1) {
+        sleep(MK_SECURE_IP_CHECK);
+
+        if (mk_security_ip_changed(ip_table) == MK_FALSE) {
+            continue;
+        }
+
+        table = mk_security_ip_load(ip_conf_path);
+        if (!table) {
+            continue;
+        }
+
+        mk_info("Mandril: %u IP rules loaded", table->rules);
+        mk_security_ip_swap(table);
     }
+}
+
+static int mk_security_ip_lookup(struct mk_secure_ip_table *table,
+                                 const struct sockaddr *addr)
+{
+    const struct sockaddr_in *in4;
+    const struct sockaddr_in6 *in6;
+
+    if (addr->sa_family == AF_INET) {
+        in4 = (const struct sockaddr_in *) addr;
+        return mk_security_ip_match(table->v4,
+                                    (unsigned char *) &in4->sin_addr, 32);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        in6 = (const struct sockaddr_in6 *) addr;
+
+        /* IPv4 clients on an IPv6 socket */
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            return mk_security_ip_match(table->v4,
+                                        in6->sin6_addr.s6_addr + 12, 32);
+        }
+        return mk_security_ip_match(table->v6,
+                                    in6->sin6_addr.s6_addr, 128);
+    }
+
+    return MK_SECURE_IP_NONE;
+}
+
+static int mk_security_check_ip(int socket, const struct sockaddr *addr)
+{
+    int action;
+    struct mk_secure_ip_table *table;
+    struct mk_secure_ip_reader *reader;
+    (void) socket;
 
     PLUGIN_TRACE("[FD %i] Mandril validating IP address", socket);
-    mk_list_foreach(head, &mk_secure_ip) {
-        entry = mk_list_entry(head, struct mk_secure_ip_t, _head);
 
-        if (entry->is_subnet == MK_TRUE) {
-            /* Validate network */
-            network = MK_NET_NETWORK(addr->s_addr, entry->netmask);
-            if (network != entry->network) {
-                continue;
+    reader = pthread_getspecific(ip_reader);
+    if (reader) {
+        __atomic_add_fetch(&reader->seq, 1, __ATOMIC_SEQ_CST);
+        table = __atomic_load_n(&ip_table, __ATOMIC_SEQ_CST);
+        action = mk_security_ip_lookup(table, addr);
+        __atomic_add_fetch(&reader->seq, 1, __ATOMIC_RELEASE);
+    }
+    else {
+        pthread_mutex_lock(&ip_mutex);
+        table = __atomic_load_n(&ip_table, __ATOMIC_SEQ_CST);
+        action = mk_security_ip_lookup(table, addr);
+        pthread_mutex_unlock(&ip_mutex);
+    }
+
+    if (action == MK_SECURE_IP_DENY) {
+        PLUGIN_TRACE("[FD %i] Mandril closing by IP rule", socket);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compile the patterns in a single automaton: an Aho-Corasick trie whose
+ * failure links are resolved into a full transition table, so matching
+ * costs one lookup per byte of the URL. Bytes are case folded and mapped
+ * to the columns of the table, bytes not used by any pattern share the
+ * column 0 which always leads back to the root.
+ */
+static struct mk_secure_ac *mk_security_ac_create(struct mk_list *patterns)
+{
+    int c;
+    int s;
+    int u;
+    int len;
+    int head = 0;
+    int tail = 0;
+    int total = 1;
+    int *fail;
+    int *queue;
+    unsigned char *p;
+    struct mk_list *list;
+    struct mk_secure_url_t *entry;
+    struct mk_secure_ac *ac;
+
+    ac = mk_api->mem_alloc_z(sizeof(struct mk_secure_ac));
+    ac->classes = 1;
+
+    mk_list_foreach(list, patterns) {
+        entry = mk_list_entry(list, struct mk_secure_url_t, _head);
+        for (p = (unsigned char *) entry->criteria; *p; p++) {
+            c = tolower(*p);
+            if (ac->map[c] == 0) {
+                ac->map[c] = ac->map[toupper(c)] = ac->classes++;
             }
+            total++;
+        }
+    }
+
+    ac->next = mk_api->mem_alloc_z(sizeof(int) * total * ac->classes);
+    ac->match = mk_api->mem_alloc_z(total);
+    fail = mk_api->mem_alloc_z(sizeof(int) * total);
+    queue = mk_api->mem_alloc(sizeof(int) * total);
+    ac->states = 1;
+
+    /* Trie, 0 is both the root and 'no transition' */
+    mk_list_foreach(list, patterns) {
+        entry = mk_list_entry(list, struct mk_secure_url_t, _head);
+        len = strlen(entry->criteria);
+        if (len == 0) {
+            continue;
+        }
 
-            /* Validate host range */
-            if (addr->s_addr <= entry->hostmax && addr->s_addr >= entry->hostmin) {
-                PLUGIN_TRACE("[FD %i] Mandril closing by rule in ranges", socket);
-                return -1;
+        s = 0;
+        for (p = (unsigned char *) entry->criteria; *p; p++) {
+            c = ac->map[*p];
+            if (ac->next[s * ac->classes + c] == 0) {
+                ac->next[s * ac->classes + c] = ac->states++;
             }
+            s = ac->next[s * ac->classes + c];
+        }
+        ac->match[s] = MK_TRUE;
+    }
+
+    /* Breadth first, a state fails over to the longest suffix in the trie */
+    for (c = 1; c < ac->classes; c++) {
+        u = ac->next[c];
+        if (u) {
+            queue[tail++] = u;
         }
-        else {
-            if (addr->s_addr == entry->ip.s_addr) {
-                PLUGIN_TRACE("[FD %i] Mandril closing by rule in IP match", socket);
-                return -1;
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+        for (c = 1; c < ac->classes; c++) {
+            u = ac->next[s * ac->classes + c];
+            if (u == 0) {
+                ac->next[s * ac->classes + c] =
+                    ac->next[fail[s] * ac->classes + c];
+                continue;
             }
+            fail[u] = ac->next[fail[s] * ac->classes + c];
+            ac->match[u] |= ac->match[fail[u]];
+            queue[tail++] = u;
         }
     }
-    return 0;
+
+    mk_api->mem_free(fail);
+    mk_api->mem_free(queue);
+
+    return ac;
 }
 
-/* Check if the incoming URL is restricted for some rule */
-static int mk_security_check_url(mk_pointer url)
+/* Return MK_TRUE if any pattern is found in the buffer */
+static int mk_security_ac_search(struct mk_secure_ac *ac,
+                                 const char *data, unsigned long len)
 {
-    int n;
-    struct mk_list *head;
-    struct mk_secure_url_t *entry;
+    int s = 0;
+    unsigned long i;
+    const unsigned char *p = (const unsigned char *) data;
+
+    if (!ac || ac->states == 1) {
+        return MK_FALSE;
+    }
 
-    mk_list_foreach(head, &mk_secure_url) {
-        entry = mk_list_entry(head, struct mk_secure_url_t, _head);
-        n = mk_api->str_search_n(url.data, entry->criteria, MK_STR_INSENSITIVE, url.len);
-        if (n >= 0) {
-            return -1;
+    for (i = 0; i < len; i++) {
+        s = ac->next[s * ac->classes + ac->map[p[i]]];
+        if (ac->match[s]) {
+            return MK_TRUE;
         }
     }
 
+    return MK_FALSE;
+}
+
+/* Last two labels of a host name, the part shared by its subdomains */
+static mk_pointer mk_security_domain(const char *name, unsigned long len)
+{
+    int dots = 0;
+    unsigned long i;
+    mk_pointer domain;
+
+    if (len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+
+    for (i = len; i > 0; i--) {
+        if (name[i - 1] == '.' && ++dots == 2) {
+            break;
+        }
+    }
+
+    domain.data = (char *) name + i;
+    domain.len = len - i;
+    return domain;
+}
+
+static uint32_t mk_security_domain_hash(mk_pointer domain)
+{
+    unsigned long i;
+    uint32_t hash = 2166136261u;
+
+    for (i = 0; i < domain.len; i++) {
+        hash ^= (unsigned char) tolower(domain.data[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Register the domain of every name of the virtual hosts */
+static void mk_security_domains_init()
+{
+    int i;
+    mk_pointer domain;
+    struct host *host;
+    struct host_alias *alias;
+    struct mk_list *h_head;
+    struct mk_list *a_head;
+    struct mk_secure_domain *entry;
+
+    for (i = 0; i < MK_SECURE_DOMAIN_BUCKETS; i++) {
+        mk_list_init(&mk_secure_domains[i]);
+    }
+
+    mk_list_foreach(h_head, &mk_api->config->hosts) {
+        host = mk_list_entry(h_head, struct host, _head);
+        mk_list_foreach(a_head, &host->server_names) {
+            alias = mk_list_entry(a_head, struct host_alias, _head);
+            domain = mk_security_domain(alias->name, alias->len);
+
+            entry = mk_api->mem_alloc(sizeof(struct mk_secure_domain));
+            entry->host = host;
+            entry->hash = mk_security_domain_hash(domain);
+            entry->domain = domain;
+            mk_list_add(&entry->_head,
+                        &mk_secure_domains[entry->hash &
+                                           (MK_SECURE_DOMAIN_BUCKETS - 1)]);
+        }
+    }
+}
+
+/* Check if the incoming URL is restricted for some rule */
+static int mk_security_check_url(mk_pointer url)
+{
+    if (mk_security_ac_search(mk_secure_url_ac, url.data, url.len)) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -249,67 +726,66 @@ error:
     return host;
 }
 
-static int mk_security_check_hotlink(mk_pointer url, mk_pointer host,
-        mk_pointer referer)
+/*
+ * A referer is allowed when its domain is the one of the requested host
+ * or of any name of the virtual host, subdomains included.
+ */
+static int mk_security_check_hotlink(mk_pointer url, struct host *host_conf,
+                                     mk_pointer host, mk_pointer referer)
 {
-    mk_pointer ref_host = parse_referer_host(referer);
-    unsigned int domains_matched = 0;
-    int i = 0;
-    const char *curA, *curB;
+    uint32_t hash;
+    unsigned long i;
+    mk_pointer ref_host;
+    mk_pointer ref_domain;
+    mk_pointer domain;
     struct mk_list *head;
-    struct mk_secure_deny_hotlink_t *entry;
+    struct mk_secure_domain *entry;
+
+    if (mk_security_ac_search(mk_secure_hotlink_ac, url.data, url.len)
+        == MK_FALSE) {
+        return 0;
+    }
 
+    ref_host = parse_referer_host(referer);
     if (ref_host.data == NULL) {
         return 0;
     }
-    else if (host.data == NULL) {
-        mk_err("No host data.");
+
+    ref_domain = mk_security_domain(ref_host.data, ref_host.len);
+    if (ref_domain.len == 0) {
         return -1;
     }
 
-    mk_list_foreach(head, &mk_secure_url) {
-        entry = mk_list_entry(head, struct mk_secure_deny_hotlink_t, _head);
-        i = mk_api->str_search_n(url.data, entry->criteria, MK_STR_INSENSITIVE, url.len);
-        if (i >= 0) {
-            break;
+    hash = mk_security_domain_hash(ref_domain);
+    mk_list_foreach(head, &mk_secure_domains[hash &
+                                             (MK_SECURE_DOMAIN_BUCKETS - 1)]) {
+        entry = mk_list_entry(head, struct mk_secure_domain, _head);
+        if (entry->host == host_conf && entry->hash == hash &&
+            entry->domain.len == ref_domain.len &&
+            strncasecmp(entry->domain.data, ref_domain.data,
+                        ref_domain.len) == 0) {
+            return 0;
         }
     }
-    if (i < 0) {
-        return 0;
-    }
-
-    curA = host.data + host.len;
-    curB = ref_host.data + ref_host.len;
 
-    // Match backwards from root domain.
-    while (curA > host.data && curB > ref_host.data) {
-        i++;
-        curA--;
-        curB--;
-
-        if ((*curA == '.' && *curB == '.') ||
-                curA == host.data || curB == ref_host.data) {
-            if (i < 1) {
-                break;
-            }
-            else if (curA == host.data &&
-                    !(curB == ref_host.data || *(curB - 1) == '.')) {
-                break;
-            }
-            else if (curB == ref_host.data &&
-                    !(curA == host.data || *(curA - 1) == '.')) {
-                break;
-            }
-            else if (strncasecmp(curA, curB, i)) {
-                break;
-            }
-            domains_matched += 1;
-            i = 0;
+    /* Host header not listed in the virtual host, strip the port */
+    if (host.data == NULL) {
+        return -1;
+    }
+    for (i = host.len; i > 0 && host.data[0] != '['; i--) {
+        if (host.data[i - 1] == ':') {
+            host.len = i - 1;
+            break;
         }
     }
 
-    // Block connection if none or only top domain matched.
-    return domains_matched >= 2 ? 0 : -1;
+    domain = mk_security_domain(host.data, host.len);
+    if (domain.len == ref_domain.len &&
+        strncasecmp(domain.data, ref_domain.data, domain.len) == 0) {
+        return 0;
+    }
+
+    return -1;
 }
 
 int _mkp_init(struct plugin_api **api, char *confdir)
@@ -317,28 +793,83 @@ int _mkp_init(struct plugin_api **api, char *confdir)
     mk_api = *api;
 
     /* Init security lists */
-    mk_list_init(&mk_secure_ip);
     mk_list_init(&mk_secure_url);
     mk_list_init(&mk_secure_deny_hotlink);
 
     /* Read configuration */
     mk_security_conf(confdir);
+
+    mk_secure_url_ac = mk_security_ac_create(&mk_secure_url);
+    mk_secure_hotlink_ac = mk_security_ac_create(&mk_secure_deny_hotlink);
+    mk_security_domains_init();
+
+    ip_table = mk_security_ip_load(ip_conf_path);
+    if (!ip_table) {
+        return -1;
+    }
+
+    pthread_key_create(&ip_reader, NULL);
+    ip_readers = mk_api->mem_alloc_z(sizeof(struct mk_secure_ip_reader) *
+                                     mk_api->config->workers);
+    if (ip_readers) {
+        ip_readers_count = mk_api->config->workers;
+    }
+
     return 0;
 }
 
+int _mkp_core_prctx(struct server_config *config)
+{
+    (void) config;
+
+    /* Launch the thread which reloads the IP rules */
+    mk_api->worker_spawn(mk_security_ip_watch, NULL);
+
+    return mk_security_limit_init();
+}
+
+void _mkp_core_thctx()
+{
+    int i = __sync_fetch_and_add(&ip_readers_next, 1);
+
+    if (i < ip_readers_count) {
+        pthread_setspecific(ip_reader, &ip_readers[i]);
+    }
+}
+
 void _mkp_exit()
 {
 }
 
 int _mkp_stage_10(unsigned int socket, struct sched_connection *conx)
 {
-    (void) conx;
+    /* Peer address captured by the server when the connection was accepted */
+    if (conx->addr_len == 0) {
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
 
     /* Validate ip address with Mandril rules */
-    if (mk_security_check_ip(socket) != 0) {
+    if (mk_security_check_ip(socket, &conx->addr.sa) != 0) {
         PLUGIN_TRACE("[FD %i] Mandril close connection", socket);
         return MK_PLUGIN_RET_CLOSE_CONX;
     }
+
+    /* Connections of the address */
+    if (mk_security_limit_connect(socket, &conx->addr.sa) != 0) {
+        PLUGIN_TRACE("[FD %i] Mandril closing, too many connections", socket);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+    return MK_PLUGIN_RET_CONTINUE;
+}
+
+int _mkp_stage_20(struct client_session *cs, struct session_request *sr)
+{
+    /* Request rate of the address */
+    if (mk_security_limit_request(cs->socket) != 0) {
+        PLUGIN_TRACE("[FD %i] Mandril closing, too many requests", cs->socket);
+        sr->headers.status = MK_LIMIT_HTTP_STATUS;
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
     return MK_PLUGIN_RET_CONTINUE;
 }
 
@@ -351,7 +882,7 @@ int _mkp_stage_30(struct plugin *p,
     (void) cs;
 
     PLUGIN_TRACE("[FD %i] Mandril validating URL", cs->socket);
-    if (mk_security_check_url(sr->uri) < 0) {
+    if (mk_security_check_url(sr->uri_processed) < 0) {
         PLUGIN_TRACE("[FD %i] Close connection, blocked URL", cs->socket);
         mk_api->header_set_http_status(sr, MK_CLIENT_FORBIDDEN);
         return MK_PLUGIN_RET_CLOSE_CONX;
@@ -359,7 +890,8 @@ int _mkp_stage_30(struct plugin *p,
 
     PLUGIN_TRACE("[FD %d] Mandril validating hotlinking", cs->socket);
     referer = mk_api->header_get(&sr->headers_toc, "Referer", strlen("Referer"));
-    if (mk_security_check_hotlink(sr->uri_processed, sr->host, referer) < 0) {
+    if (mk_security_check_hotlink(sr->uri_processed, sr->host_conf,
+                                  sr->host, referer) < 0) {
         PLUGIN_TRACE("[FD %i] Close connection, deny hotlinking.", cs->socket);
         mk_api->header_set_http_status(sr, MK_CLIENT_FORBIDDEN);
         return MK_PLUGIN_RET_CLOSE_CONX;
@@ -367,3 +899,14 @@ int _mkp_stage_30(struct plugin *p,
 
     return MK_PLUGIN_RET_NOT_ME;
 }
+
+int _mkp_stage_50(int socket)
+{
+    mk_security_limit_close(socket);
+    return MK_PLUGIN_RET_NOT_ME;
+}
+
+void _mkp_cheetah_counters(int (*print)(const char *, ...))
+{
+    mk_security_limit_counters(print);
+}
@@ -25,36 +25,90 @@
 #ifndef MK_SECURITY_H
 #define MK_SECURITY_H
 
-struct mk_secure_ip_t
+/* Action of an IP rule */
+#define MK_SECURE_IP_NONE   0
+#define MK_SECURE_IP_DENY   1
+#define MK_SECURE_IP_ALLOW  2
+
+/* Seconds between checks of the IP rule files for changes */
+#define MK_SECURE_IP_CHECK  2
+
+/*
+ * IP rules are stored in a path compressed binary trie for each address
+ * family, the most specific rule matching the peer address wins.
+ */
+struct mk_secure_ip_node
 {
-    struct in_addr ip;
+    unsigned char key[16];      /* prefix, bits after 'bits' are zero */
+    unsigned char bits;
+    unsigned char action;
 
-    /* if subnet is true, next fields are populated */
-    int is_subnet;
+    struct mk_secure_ip_node *child[2];
+};
 
-    int network;
-    int netmask;
-    unsigned int hostmin;
-    unsigned int hostmax;
+/* A file the rules were read from, checked for changes */
+struct mk_secure_ip_file
+{
+    char *path;
+    time_t mtime;
 
-    /* list head linker */
     struct mk_list _head;
 };
 
+/*
+ * The rule set in use, replaced as a whole when the files change. Workers
+ * read it without locks, the old one is freed once no worker uses it.
+ */
+struct mk_secure_ip_table
+{
+    struct mk_secure_ip_node *v4;
+    struct mk_secure_ip_node *v6;
+    unsigned int rules;
+
+    struct mk_list files;
+};
+
+/* Sequence of a worker, odd while it reads the rule set */
+struct mk_secure_ip_reader
+{
+    unsigned long seq;
+    char pad[64 - sizeof(unsigned long)];
+};
+
+/* URL criteria, for both URL and deny_hotlink rules */
 struct mk_secure_url_t
 {
     char *criteria;
     struct mk_list _head;
 };
 
-struct mk_secure_deny_hotlink_t
+/* Criteria compiled in a case insensitive Aho-Corasick automaton */
+struct mk_secure_ac
 {
-    char *criteria;
+    int classes;                /* columns of the transition table */
+    int states;
+    unsigned char map[256];     /* byte to column */
+    int *next;                  /* states x classes transitions */
+    unsigned char *match;       /* a pattern ends in the state */
+};
+
+/* Domains of the virtual host names, allowed to link their content */
+#define MK_SECURE_DOMAIN_BUCKETS  64
+
+struct mk_secure_domain
+{
+    struct host *host;
+    uint32_t hash;
+    mk_pointer domain;
+
     struct mk_list _head;
 };
 
-struct mk_list mk_secure_ip;
 struct mk_list mk_secure_url;
 struct mk_list mk_secure_deny_hotlink;
+struct mk_list mk_secure_domains[MK_SECURE_DOMAIN_BUCKETS];
+
+struct mk_secure_ac *mk_secure_url_ac;
+struct mk_secure_ac *mk_secure_hotlink_ac;
 
 #endif
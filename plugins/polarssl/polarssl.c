@@ -32,6 +32,15 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(HAVE_KTLS)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <linux/tls.h>
+#endif
 
 #include <polarssl/version.h>
 #include <polarssl/error.h>
@@ -43,9 +52,9 @@
 #include <polarssl/certs.h>
 #include <polarssl/x509.h>
 
-#if (POLARSSL_VERSION_NUMBER > 0x01020000)
-#include <polarssl/ssl_cache.h>
-#endif // POLARSSL_VERSION_NUMBER
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+#include <polarssl/aes.h>
+#endif
 
 #include "MKPlugin.h"
 
@@ -61,6 +70,20 @@
 #error "Require polarssl 1.1 or higher."
 #endif
 
+/* Session cache callbacks appeared in 1.2 */
+#if (POLARSSL_VERSION_NUMBER >= 0x01020000)
+#define POLAR_SESSION_CACHE
+#endif
+
+/* Kernel TLS takes over the transmit side of AES-GCM connections */
+#if (defined(HAVE_KTLS) && defined(POLARSSL_GCM_C) && \
+        (POLARSSL_VERSION_NUMBER >= 0x01030000))
+#define POLAR_KTLS
+#endif
+
+#define POLAR_CACHE_SHARDS  16
+#define POLAR_CACHE_BUCKETS 64
+
 #if (!defined(POLARSSL_BIGNUM_C) || !defined(POLARSSL_ENTROPY_C) || \
         !defined(POLARSSL_SSL_TLS_C) || !defined(POLARSSL_SSL_SRV_C) || \
         !defined(POLARSSL_NET_C) || !defined(POLARSSL_RSA_C) || \
@@ -78,15 +101,97 @@ struct polar_config {
     char *cert_chain_file;
     char *key_file;
     char *dh_param_file;
+
+    int session_cache;
+    int session_timeout;
+    int session_tickets;
+    int ticket_rotation;
+
+    int kernel_tls;
+};
+
+/* Handshake and resumption counters, updated from every worker */
+struct polar_stats {
+    uint64_t handshakes;
+    uint64_t resumed;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_stores;
+    uint64_t cache_evictions;
+    uint64_t ticket_rotations;
+    uint64_t ktls;
+    uint64_t ktls_failures;
+};
+
+static struct polar_stats stats;
+
+#if defined(POLAR_KTLS)
+static int global_ktls;
+#endif
+
+#if defined(POLAR_SESSION_CACHE)
+struct polar_cache_entry {
+    time_t start;
+    int ciphersuite;
+    int compression;
+    size_t length;
+    unsigned char id[32];
+    unsigned char master[48];
+
+    struct mk_list _bucket;
+    struct mk_list _head;
+};
+
+/*
+ * Session IDs are random, the first byte picks the shard and the next
+ * two the bucket. Entries share the same timeout, so the oldest one is
+ * always at the head of the shard list, where expiry and eviction
+ * happen.
+ */
+struct polar_cache_shard {
+    pthread_mutex_t _mutex;
+    int count;
+    struct mk_list entries;
+    struct mk_list buckets[POLAR_CACHE_BUCKETS];
 };
 
-#if defined(POLARSSL_SSL_CACHE_C)
 struct polar_sessions {
+    int max_entries;            /* per shard, 0 disables the cache */
+    int timeout;
+    struct polar_cache_shard shards[POLAR_CACHE_SHARDS];
+};
+
+static struct polar_sessions global_sessions;
+#endif
+
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+/*
+ * Ticket keys shared by every context, each context copies them when
+ * it starts a handshake and the generation changed. PolarSSL checks a
+ * single key, so the key a ticket was issued with is picked from the
+ * ClientHello before PolarSSL parses it: tickets of the previous key
+ * keep resuming until the next rotation, new tickets always get the
+ * current key.
+ */
+struct polar_ticket_key {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char mac_key[16];
+};
+
+struct polar_tickets {
     pthread_mutex_t _mutex;
-    ssl_cache_context cache;
+    int enabled;
+    int rotation;
+    unsigned int generation;    /* read with __atomic_load_n() */
+    time_t rotate_at;           /* read with __atomic_load_n() */
+
+    int has_previous;
+    struct polar_ticket_key current;
+    struct polar_ticket_key previous;
 };
 
-static struct polar_sessions global_sessions = {
+static struct polar_tickets global_tickets = {
     ._mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 #endif
@@ -97,6 +202,18 @@ struct polar_context_head {
     ssl_session session;
 #endif
     int fd;
+    int handshake_done;
+    int resumed;
+#if defined(POLAR_KTLS)
+    int ktls;                   /* records are sent by the kernel */
+    int ktls_keylen;            /* key captured, 0 if not usable */
+    unsigned char ktls_key[32];
+    unsigned char ktls_salt[4];
+#endif
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+    unsigned int ticket_generation;
+    int ticket_previous;        /* previous key set for this ClientHello */
+#endif
     struct polar_context_head *_next;
 };
 
@@ -230,6 +347,38 @@ static int handle_return(int ret)
     }
 }
 
+static int config_getnum(struct mk_config_section *section, char *key,
+        int def)
+{
+    char *val;
+    int ret;
+
+    val = mk_api->config_section_getval(section, key, MK_CONFIG_VAL_STR);
+    if (val == NULL) {
+        return def;
+    }
+    ret = atoi(val);
+    mk_api->mem_free(val);
+
+    return ret;
+}
+
+static int config_getbool(struct mk_config_section *section, char *key,
+        int def)
+{
+    char *val;
+    int ret;
+
+    val = mk_api->config_section_getval(section, key, MK_CONFIG_VAL_STR);
+    if (val == NULL) {
+        return def;
+    }
+    ret = strcasecmp(val, VALUE_ON) == 0;
+    mk_api->mem_free(val);
+
+    return ret;
+}
+
 static int config_parse(const char *confdir, struct polar_config *conf)
 {
     long unsigned int len;
@@ -238,6 +387,12 @@ static int config_parse(const char *confdir, struct polar_config *conf)
     struct mk_config *conf_head;
     struct mk_list *head;
 
+    conf->session_cache = 20000;
+    conf->session_timeout = 300;
+    conf->session_tickets = 1;
+    conf->ticket_rotation = 3600;
+    conf->kernel_tls = 1;
+
     mk_api->str_build(&conf_path, &len, "%spolarssl.conf", confdir);
     conf_head = mk_api->config_create(conf_path);
     free(conf_path);
@@ -264,6 +419,16 @@ static int config_parse(const char *confdir, struct polar_config *conf)
         conf->dh_param_file = mk_api->config_section_getval(section,
                 "DHParameterFile",
                 MK_CONFIG_VAL_STR);
+        conf->session_cache = config_getnum(section,
+                "SessionCache", conf->session_cache);
+        conf->session_timeout = config_getnum(section,
+                "SessionTimeout", conf->session_timeout);
+        conf->session_tickets = config_getbool(section,
+                "SessionTickets", conf->session_tickets);
+        conf->ticket_rotation = config_getnum(section,
+                "TicketKeyRotation", conf->ticket_rotation);
+        conf->kernel_tls = config_getbool(section,
+                "KernelTLS", conf->kernel_tls);
     }
     mk_api->config_free(conf_head);
 
@@ -403,14 +568,363 @@ static int polar_load_dh_param(const struct polar_config *conf)
     return 0;
 }
 
+#if defined(POLAR_SESSION_CACHE)
+static struct polar_cache_shard *cache_shard(const unsigned char *id)
+{
+    return &global_sessions.shards[id[0] % POLAR_CACHE_SHARDS];
+}
+
+static struct mk_list *cache_bucket(struct polar_cache_shard *shard,
+        const unsigned char *id)
+{
+    return &shard->buckets[(id[1] | id[2] << 8) % POLAR_CACHE_BUCKETS];
+}
+
+static void cache_entry_del(struct polar_cache_shard *shard,
+        struct polar_cache_entry *entry)
+{
+    mk_list_del(&entry->_bucket);
+    mk_list_del(&entry->_head);
+    memset(entry, 0, sizeof(*entry));
+    free(entry);
+    shard->count--;
+}
+
+/* Callback for PolarSSL, resume the session if its ID is known */
+static int cache_get(void *data, ssl_session *session)
+{
+    struct polar_sessions *sessions = data;
+    struct polar_cache_shard *shard;
+    struct polar_cache_entry *entry;
+    struct mk_list *head;
+    time_t now = time(NULL);
+    int ret = 1;
+
+    if (session->length < 3 || session->length > sizeof(entry->id)) {
+        return 1;
+    }
+
+    shard = cache_shard(session->id);
+    pthread_mutex_lock(&shard->_mutex);
+
+    mk_list_foreach(head, cache_bucket(shard, session->id)) {
+        entry = mk_list_entry(head, struct polar_cache_entry, _bucket);
+
+        if (entry->length != session->length ||
+                memcmp(entry->id, session->id, entry->length)) {
+            continue;
+        }
+        if (now - entry->start > sessions->timeout) {
+            cache_entry_del(shard, entry);
+            break;
+        }
+        if (entry->ciphersuite != session->ciphersuite ||
+                entry->compression != session->compression) {
+            break;
+        }
+
+        memcpy(session->master, entry->master, sizeof(entry->master));
+        ret = 0;
+        break;
+    }
+
+    pthread_mutex_unlock(&shard->_mutex);
+
+    if (ret == 0) {
+        __sync_fetch_and_add(&stats.cache_hits, 1);
+    }
+    else {
+        __sync_fetch_and_add(&stats.cache_misses, 1);
+    }
+    return ret;
+}
+
+/* Callback for PolarSSL, store the session after a full handshake */
+static int cache_set(void *data, const ssl_session *session)
+{
+    struct polar_sessions *sessions = data;
+    struct polar_cache_shard *shard;
+    struct polar_cache_entry *entry;
+    time_t now = time(NULL);
+
+    if (session->length < 3 || session->length > sizeof(entry->id)) {
+        return 1;
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        return 1;
+    }
+    entry->start = now;
+    entry->ciphersuite = session->ciphersuite;
+    entry->compression = session->compression;
+    entry->length = session->length;
+    memcpy(entry->id, session->id, session->length);
+    memcpy(entry->master, session->master, sizeof(entry->master));
+
+    shard = cache_shard(session->id);
+    pthread_mutex_lock(&shard->_mutex);
+
+    /* Drop what expired and, if still full, the oldest session */
+    while (mk_list_is_empty(&shard->entries) != 0) {
+        struct polar_cache_entry *old;
+
+        old = mk_list_entry_first(&shard->entries,
+                struct polar_cache_entry, _head);
+        if (now - old->start <= sessions->timeout &&
+                shard->count < sessions->max_entries) {
+            break;
+        }
+        if (now - old->start <= sessions->timeout) {
+            __sync_fetch_and_add(&stats.cache_evictions, 1);
+        }
+        cache_entry_del(shard, old);
+    }
+
+    mk_list_add(&entry->_bucket, cache_bucket(shard, entry->id));
+    mk_list_add(&entry->_head, &shard->entries);
+    shard->count++;
+
+    pthread_mutex_unlock(&shard->_mutex);
+
+    __sync_fetch_and_add(&stats.cache_stores, 1);
+    return 0;
+}
+
+static void cache_init(const struct polar_config *conf)
+{
+    int i, j;
+    struct polar_cache_shard *shard;
+
+    global_sessions.timeout = conf->session_timeout;
+    global_sessions.max_entries = 0;
+    if (conf->session_cache > 0) {
+        global_sessions.max_entries = conf->session_cache / POLAR_CACHE_SHARDS;
+        if (global_sessions.max_entries < 1) {
+            global_sessions.max_entries = 1;
+        }
+    }
+
+    for (i = 0; i < POLAR_CACHE_SHARDS; i++) {
+        shard = &global_sessions.shards[i];
+        pthread_mutex_init(&shard->_mutex, NULL);
+        shard->count = 0;
+        mk_list_init(&shard->entries);
+        for (j = 0; j < POLAR_CACHE_BUCKETS; j++) {
+            mk_list_init(&shard->buckets[j]);
+        }
+    }
+}
+
+static void cache_free(void)
+{
+    int i;
+    struct mk_list *cur, *tmp;
+    struct polar_cache_shard *shard;
+
+    for (i = 0; i < POLAR_CACHE_SHARDS; i++) {
+        shard = &global_sessions.shards[i];
+        mk_list_foreach_safe(cur, tmp, &shard->entries) {
+            cache_entry_del(shard,
+                    mk_list_entry(cur, struct polar_cache_entry, _head));
+        }
+        pthread_mutex_destroy(&shard->_mutex);
+    }
+}
+
+static int cache_entries(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < POLAR_CACHE_SHARDS; i++) {
+        n += global_sessions.shards[i].count;
+    }
+    return n;
+}
+#endif // POLAR_SESSION_CACHE
+
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+/* New ticket keys once the rotation period is over, the first thread
+ * to notice generates them. The replaced key is kept for decryption.
+ */
+static void tickets_rotate(time_t now)
+{
+    ctr_drbg_context *drbg = local_drbg_context();
+    struct polar_ticket_key key;
+    int ret = 0;
+
+    pthread_mutex_lock(&global_tickets._mutex);
+
+    if (now >= global_tickets.rotate_at) {
+        ret |= ctr_drbg_random(drbg, key.name, sizeof(key.name));
+        ret |= ctr_drbg_random(drbg, key.aes_key, sizeof(key.aes_key));
+        ret |= ctr_drbg_random(drbg, key.mac_key, sizeof(key.mac_key));
+
+        if (ret) {
+            mk_err("[polarssl] Failed to generate ticket keys.");
+        }
+        else {
+            if (global_tickets.generation > 0) {
+                global_tickets.previous = global_tickets.current;
+                global_tickets.has_previous = 1;
+            }
+            global_tickets.current = key;
+            __atomic_store_n(&global_tickets.generation,
+                    global_tickets.generation + 1, __ATOMIC_RELEASE);
+            stats.ticket_rotations++;
+        }
+        __atomic_store_n(&global_tickets.rotate_at,
+                now + global_tickets.rotation, __ATOMIC_RELEASE);
+        memset(&key, 0, sizeof(key));
+    }
+
+    pthread_mutex_unlock(&global_tickets._mutex);
+}
+
+/* Load a key in the context, called with the tickets mutex held */
+static void tickets_load(struct polar_context_head *head,
+        const struct polar_ticket_key *key)
+{
+    ssl_ticket_keys *keys = head->context.ticket_keys;
+
+    memcpy(keys->key_name, key->name, sizeof(keys->key_name));
+    memcpy(keys->mac_key, key->mac_key, sizeof(keys->mac_key));
+    aes_setkey_enc(&keys->enc, key->aes_key, 256);
+    aes_setkey_dec(&keys->dec, key->aes_key, 256);
+}
+
+static void tickets_apply(struct polar_context_head *head)
+{
+    time_t now = time(NULL);
+    unsigned int generation;
+
+    if (!global_tickets.enabled || head->context.ticket_keys == NULL) {
+        return;
+    }
+    if (now >= __atomic_load_n(&global_tickets.rotate_at, __ATOMIC_ACQUIRE)) {
+        tickets_rotate(now);
+    }
+
+    generation = __atomic_load_n(&global_tickets.generation, __ATOMIC_ACQUIRE);
+    if (head->ticket_generation == generation && !head->ticket_previous) {
+        return;
+    }
+
+    pthread_mutex_lock(&global_tickets._mutex);
+
+    tickets_load(head, &global_tickets.current);
+    head->ticket_generation = global_tickets.generation;
+    head->ticket_previous = 0;
+
+    pthread_mutex_unlock(&global_tickets._mutex);
+}
+
+/*
+ * Key name of the ticket carried by the ClientHello waiting on the
+ * socket, read with MSG_PEEK so PolarSSL still gets the whole record.
+ * Returns 0 when there is none or the record is not complete yet.
+ */
+static int tickets_peek_name(int fd, unsigned char *name)
+{
+    unsigned char buf[2048];
+    ssize_t n;
+    size_t p, end, len, ext_end;
+    unsigned int type;
+
+    n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+
+    /* Handshake record holding a ClientHello */
+    if (n < 9 || buf[0] != 0x16 || buf[1] != 0x03 || buf[5] != 0x01) {
+        return 0;
+    }
+    end = 5 + ((buf[3] << 8) | buf[4]);
+    if (end > (size_t) n) {
+        return 0;
+    }
+
+    /* Version and random, then session id, cipher suites, compression */
+    p = 5 + 4 + 2 + 32;
+    if (p + 1 > end) {
+        return 0;
+    }
+    p += 1 + buf[p];
+    if (p + 2 > end) {
+        return 0;
+    }
+    p += 2 + ((buf[p] << 8) | buf[p + 1]);
+    if (p + 1 > end) {
+        return 0;
+    }
+    p += 1 + buf[p];
+    if (p + 2 > end) {
+        return 0;
+    }
+
+    ext_end = p + 2 + ((buf[p] << 8) | buf[p + 1]);
+    if (ext_end > end) {
+        return 0;
+    }
+    p += 2;
+
+    while (p + 4 <= ext_end) {
+        type = (buf[p] << 8) | buf[p + 1];
+        len = (buf[p + 2] << 8) | buf[p + 3];
+        p += 4;
+        if (p + len > ext_end) {
+            return 0;
+        }
+        /* session_ticket, the key name opens the ticket */
+        if (type == 0x0023) {
+            if (len < 16) {
+                return 0;
+            }
+            memcpy(name, buf + p, 16);
+            return 1;
+        }
+        p += len;
+    }
+
+    return 0;
+}
+
+/* Before PolarSSL parses the ClientHello: if its ticket was issued with
+ * the previous key, decrypt it with that key.
+ */
+static void tickets_client_hello(struct polar_context_head *head)
+{
+    unsigned char name[16];
+
+    if (!global_tickets.enabled || head->context.ticket_keys == NULL ||
+            !tickets_peek_name(head->fd, name)) {
+        return;
+    }
+
+    pthread_mutex_lock(&global_tickets._mutex);
+
+    if (global_tickets.has_previous &&
+            memcmp(name, global_tickets.previous.name, sizeof(name)) == 0) {
+        tickets_load(head, &global_tickets.previous);
+        head->ticket_previous = 1;
+    }
+
+    pthread_mutex_unlock(&global_tickets._mutex);
+}
+#endif // POLARSSL_SSL_SESSION_TICKETS
+
 static int polar_init(const struct polar_config *conf)
 {
     pthread_key_create(&local_context, NULL);
 
-#if defined(POLARSSL_SSL_CACHE_C)
-    pthread_mutex_lock(&global_sessions._mutex);
-    ssl_cache_init(&global_sessions.cache);
-    pthread_mutex_unlock(&global_sessions._mutex);
+#if defined(POLAR_SESSION_CACHE)
+    cache_init(conf);
+#endif
+#if defined(POLAR_KTLS)
+    global_ktls = conf->kernel_tls;
+#endif
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+    global_tickets.enabled = conf->session_tickets;
+    global_tickets.rotation = conf->ticket_rotation > 0 ?
+        conf->ticket_rotation : 3600;
 #endif
 
     pthread_mutex_lock(&server_context._mutex);
@@ -516,9 +1030,8 @@ static void polar_exit(void)
     }
     pthread_mutex_destroy(&server_context._mutex);
 
-#if defined(POLARSSL_SSL_CACHE_C)
-    ssl_cache_free(&global_sessions.cache);
-    pthread_mutex_destroy(&global_sessions._mutex);
+#if defined(POLAR_SESSION_CACHE)
+    cache_free();
 #endif
 }
 
@@ -542,6 +1055,132 @@ static ssl_context *context_get(int fd)
     return NULL;
 }
 
+#if defined(POLAR_KTLS)
+/* Once the kernel numbers the records PolarSSL must not send any */
+static int ktls_net_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct polar_context_head *head;
+
+    head = container_of((int *)ctx, struct polar_context_head, fd);
+    if (head->ktls) {
+        return POLARSSL_ERR_NET_SEND_FAILED;
+    }
+    return net_send(ctx, buf, len);
+}
+
+/*
+ * Called right before the handshake wrap-up, while the handshake
+ * parameters are still around: derive the key block again like
+ * ssl_derive_keys() did (the random values are already swapped) and
+ * keep the server write key. With GCM there are no MAC keys and the
+ * salt is the implicit part of the IV.
+ */
+static void ktls_capture(struct polar_context_head *head)
+{
+    ssl_context *ssl = &head->context;
+    const ssl_transform *t = ssl->transform_negotiate;
+    unsigned char keyblk[256];
+    int type;
+
+    head->ktls_keylen = 0;
+
+    if (!global_ktls || t == NULL || ssl->handshake == NULL ||
+            ssl->minor_ver != SSL_MINOR_VERSION_3 ||
+            t->fixed_ivlen != sizeof(head->ktls_salt)) {
+        return;
+    }
+
+    type = t->ciphersuite_info->cipher;
+    if (type != POLARSSL_CIPHER_AES_128_GCM &&
+            type != POLARSSL_CIPHER_AES_256_GCM) {
+        return;
+    }
+
+    if (ssl->handshake->tls_prf(ssl->session_negotiate->master, 48,
+                "key expansion", ssl->handshake->randbytes, 64,
+                keyblk, sizeof(keyblk)) != 0) {
+        return;
+    }
+
+    memcpy(head->ktls_key, keyblk + t->maclen * 2 + t->keylen, t->keylen);
+    memcpy(head->ktls_salt, t->iv_enc, sizeof(head->ktls_salt));
+    head->ktls_keylen = t->keylen;
+
+    memset(keyblk, 0, sizeof(keyblk));
+}
+
+/* Handshake is over, hand the transmit keys and sequence to the kernel */
+static void ktls_enable(struct polar_context_head *head)
+{
+    ssl_context *ssl = &head->context;
+    struct tls12_crypto_info_aes_gcm_128 ci128;
+    struct tls12_crypto_info_aes_gcm_256 ci256;
+    void *ci;
+    socklen_t ci_len;
+
+    if (head->ktls_keylen == 0 || ssl->out_left != 0) {
+        goto out;
+    }
+
+    if (head->ktls_keylen == 16) {
+        memset(&ci128, 0, sizeof(ci128));
+        ci128.info.version = TLS_1_2_VERSION;
+        ci128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(ci128.key, head->ktls_key, sizeof(ci128.key));
+        memcpy(ci128.salt, head->ktls_salt, sizeof(ci128.salt));
+        memcpy(ci128.iv, ssl->out_ctr, sizeof(ci128.iv));
+        memcpy(ci128.rec_seq, ssl->out_ctr, sizeof(ci128.rec_seq));
+        ci = &ci128;
+        ci_len = sizeof(ci128);
+    }
+    else {
+        memset(&ci256, 0, sizeof(ci256));
+        ci256.info.version = TLS_1_2_VERSION;
+        ci256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(ci256.key, head->ktls_key, sizeof(ci256.key));
+        memcpy(ci256.salt, head->ktls_salt, sizeof(ci256.salt));
+        memcpy(ci256.iv, ssl->out_ctr, sizeof(ci256.iv));
+        memcpy(ci256.rec_seq, ssl->out_ctr, sizeof(ci256.rec_seq));
+        ci = &ci256;
+        ci_len = sizeof(ci256);
+    }
+
+    if (setsockopt(head->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+        if (errno == ENOENT || errno == ENOPROTOOPT) {
+            mk_warn("[polarssl] Kernel TLS not available: %s",
+                    strerror(errno));
+            global_ktls = 0;
+        }
+        __sync_fetch_and_add(&stats.ktls_failures, 1);
+        goto wipe;
+    }
+
+    /* Without TLS_TX the socket keeps working as plain TCP */
+    if (setsockopt(head->fd, SOL_TLS, TLS_TX, ci, ci_len)) {
+        PLUGIN_TRACE("[polarssl %d] TLS_TX failed: %s", head->fd,
+                strerror(errno));
+        __sync_fetch_and_add(&stats.ktls_failures, 1);
+        goto wipe;
+    }
+
+    PLUGIN_TRACE("[polarssl %d] Kernel TLS enabled.", head->fd);
+    head->ktls = 1;
+    __sync_fetch_and_add(&stats.ktls, 1);
+
+wipe:
+    memset(&ci128, 0, sizeof(ci128));
+    memset(&ci256, 0, sizeof(ci256));
+out:
+    memset(head->ktls_key, 0, sizeof(head->ktls_key));
+    head->ktls_keylen = 0;
+}
+
+static int context_ktls(ssl_context *ssl)
+{
+    return container_of(ssl, struct polar_context_head, context)->ktls;
+}
+#endif // POLAR_KTLS
+
 static ssl_context *context_new(int fd)
 {
     struct polar_context_head **cur = local_contexts();
@@ -586,7 +1225,26 @@ static ssl_context *context_new(int fd)
         ssl_set_own_cert(ssl, &server_context.srvcert, &server_context.rsa);
         ssl_set_dh_param_ctx(ssl, &server_context.dhm);
 
+#if defined(POLAR_KTLS)
+        ssl_set_bio(ssl, net_recv, &(*cur)->fd, ktls_net_send, &(*cur)->fd);
+#else
         ssl_set_bio(ssl, net_recv, &(*cur)->fd, net_send, &(*cur)->fd);
+#endif
+
+#if defined(POLAR_SESSION_CACHE)
+        if (global_sessions.max_entries > 0) {
+            ssl_set_session_cache(ssl, cache_get, &global_sessions,
+                    cache_set, &global_sessions);
+        }
+#endif
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+        (*cur)->ticket_generation = 0;
+        (*cur)->ticket_previous = 0;
+        if (global_tickets.enabled) {
+            ssl_set_session_tickets(ssl, SSL_SESSION_TICKETS_ENABLED);
+            ssl_set_session_ticket_lifetime(ssl, global_sessions.timeout);
+        }
+#endif
     }
     else {
         PLUGIN_TRACE("[polarssl %d] Reuse ssl context.", fd);
@@ -594,10 +1252,94 @@ static ssl_context *context_new(int fd)
     }
 
     (*cur)->fd = fd;
+    (*cur)->handshake_done = 0;
+    (*cur)->resumed = 0;
+#if defined(POLAR_KTLS)
+    (*cur)->ktls = 0;
+    (*cur)->ktls_keylen = 0;
+#endif
+
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+    tickets_apply(*cur);
+#endif
 
     return ssl;
 }
 
+/* Count the handshake once it's over, and whether it was resumed from
+ * the session cache or a ticket.
+ */
+static void context_handshake_stats(ssl_context *ssl)
+{
+    struct polar_context_head *head;
+
+    head = container_of(ssl, struct polar_context_head, context);
+    if (head->handshake_done) {
+        return;
+    }
+
+#if (POLARSSL_VERSION_NUMBER >= 0x01020000)
+    if (ssl->handshake && ssl->handshake->resume) {
+        head->resumed = 1;
+    }
+#endif
+
+    if (ssl->state == SSL_HANDSHAKE_OVER) {
+        head->handshake_done = 1;
+        __sync_fetch_and_add(&stats.handshakes, 1);
+        if (head->resumed) {
+            __sync_fetch_and_add(&stats.resumed, 1);
+        }
+    }
+}
+
+/* Drive the handshake one step at a time, the kernel TLS keys have to
+ * be taken before the wrap-up frees the handshake parameters.
+ */
+static int context_handshake(ssl_context *ssl)
+{
+    int ret = 0;
+
+#if (POLARSSL_VERSION_NUMBER >= 0x01020000)
+    struct polar_context_head *head;
+
+    head = container_of(ssl, struct polar_context_head, context);
+
+    while (ssl->state != SSL_HANDSHAKE_OVER) {
+#if defined(POLAR_KTLS)
+        if (ssl->state == SSL_HANDSHAKE_WRAPUP) {
+            ktls_capture(head);
+        }
+#endif
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+        if (ssl->state == SSL_CLIENT_HELLO) {
+            tickets_client_hello(head);
+        }
+#endif
+        ret = ssl_handshake_step(ssl);
+        context_handshake_stats(ssl);
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+        /* The ticket is decrypted, new tickets get the current key */
+        if (head->ticket_previous && ssl->state > SSL_CLIENT_HELLO) {
+            tickets_apply(head);
+        }
+#endif
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+#if defined(POLAR_KTLS)
+    ktls_enable(head);
+#endif
+#else
+    ret = ssl_handshake(ssl);
+    context_handshake_stats(ssl);
+#endif
+
+    return ret;
+}
+
 static int context_unset(int fd, ssl_context *ssl)
 {
     struct polar_context_head *head;
@@ -617,11 +1359,19 @@ static int context_unset(int fd, ssl_context *ssl)
 
 int _mkp_network_io_read(int fd, void *buf, int count)
 {
+    int ret;
     ssl_context *ssl = context_get(fd);
     if (!ssl) {
         ssl = context_new(fd);
     }
 
+    if (ssl->state != SSL_HANDSHAKE_OVER) {
+        ret = context_handshake(ssl);
+        if (ret != 0) {
+            return handle_return(ret);
+        }
+    }
+
     return handle_return(ssl_read(ssl, buf, count));
 }
 
@@ -632,6 +1382,12 @@ int _mkp_network_io_write(int fd, const void *buf, size_t count)
         ssl = context_new(fd);
     }
 
+#if defined(POLAR_KTLS)
+    if (context_ktls(ssl)) {
+        return write(fd, buf, count);
+    }
+#endif
+
     return handle_return(ssl_write(ssl, buf, count));
 }
 
@@ -649,6 +1405,12 @@ int _mkp_network_io_writev(int fd, struct mk_iov *mk_io)
         ssl = context_new(fd);
     }
 
+#if defined(POLAR_KTLS)
+    if (context_ktls(ssl)) {
+        return mk_api->iov_send(fd, mk_io);
+    }
+#endif
+
     buf = malloc(len);
     if (buf == NULL) {
         mk_err("malloc failed: %s", strerror(errno));
@@ -682,6 +1444,12 @@ int _mkp_network_io_send_file(int fd, int file_fd, off_t *file_offset,
         ssl = context_new(fd);
     }
 
+#if defined(POLAR_KTLS)
+    if (context_ktls(ssl)) {
+        return sendfile(fd, file_fd, file_offset, file_count);
+    }
+#endif
+
     buf = malloc(SENDFILE_BUF_SIZE);
     if (buf == NULL) {
         return -1;
@@ -742,6 +1510,10 @@ int _mkp_network_io_close(int fd)
     PLUGIN_TRACE("[fd %d] Closing connection", fd);
 
     if (ssl) {
+#if defined(POLAR_KTLS)
+        /* The alert would need a record from the kernel, skip it */
+        if (!context_ktls(ssl))
+#endif
         ssl_close_notify(ssl);
         context_unset(fd, ssl);
     }
@@ -751,17 +1523,17 @@ int _mkp_network_io_close(int fd)
     return 0;
 }
 
-int _mkp_network_io_accept(int server_fd)
+int _mkp_network_io_accept(int server_fd, struct sockaddr *addr, socklen_t *len)
 {
     int remote_fd;
 
 #ifdef ACCEPT_GENERIC
-    remote_fd = accept(server_fd, NULL, NULL);
+    remote_fd = accept(server_fd, addr, len);
     if (remote_fd != -1) {
         mk_api->socket_set_nonblocking(remote_fd);
     }
 #else
-    remote_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+    remote_fd = accept4(server_fd, addr, len, SOCK_NONBLOCK);
 #endif
 
     return remote_fd;
@@ -948,3 +1720,41 @@ void _mkp_exit()
     polar_exit();
 }
 
+void _mkp_cheetah_counters(int (*print)(const char *, ...))
+{
+    uint64_t handshakes = stats.handshakes;
+    uint64_t resumed = stats.resumed;
+
+    print("Handshakes: %lu, resumed %lu (%.1f%%)\n",
+          (unsigned long) handshakes, (unsigned long) resumed,
+          handshakes ? (100.0 * resumed) / handshakes : 0.0);
+
+#if defined(POLAR_SESSION_CACHE)
+    if (global_sessions.max_entries > 0) {
+        print("  session cache %d entries (limit %d), timeout %ds\n",
+              cache_entries(),
+              global_sessions.max_entries * POLAR_CACHE_SHARDS,
+              global_sessions.timeout);
+        print("  hits %lu, misses %lu, stores %lu, evictions %lu\n",
+              (unsigned long) stats.cache_hits,
+              (unsigned long) stats.cache_misses,
+              (unsigned long) stats.cache_stores,
+              (unsigned long) stats.cache_evictions);
+    }
+#endif
+#if defined(POLAR_KTLS)
+    print("  kernel TLS: %lu connections, %lu failed%s\n",
+          (unsigned long) stats.ktls, (unsigned long) stats.ktls_failures,
+          global_ktls ? "" : " (disabled)");
+#endif
+#if defined(POLARSSL_SSL_SESSION_TICKETS)
+    if (global_tickets.enabled) {
+        print("  tickets: resumed %lu, key rotations %lu (every %ds)\n",
+              (unsigned long) (resumed > stats.cache_hits ?
+                               resumed - stats.cache_hits : 0),
+              (unsigned long) stats.ticket_rotations,
+              global_tickets.rotation);
+    }
+#endif
+}
+
@@ -0,0 +1,482 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA
+ */
+
+/*
+ * The counters are kept by the core (src/mk_stats.c), every worker owns
+ * its own block. This plugin adds them up when the page is requested and
+ * renders them, nothing runs on the other requests but a URI compare.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "MKPlugin.h"
+#include "stats.h"
+
+MONKEY_PLUGIN("stats",              /* shortname */
+              "Statistics",         /* name */
+              VERSION,              /* version */
+              MK_PLUGIN_STAGE_30);  /* hooks */
+
+static mk_pointer stats_path;
+static char *stats_vhost;
+static struct mk_list stats_allow_list;
+
+static const mk_pointer stats_mime_text = mk_pointer_init(MK_STATS_MIME_TEXT);
+static const mk_pointer stats_mime_json = mk_pointer_init(MK_STATS_MIME_JSON);
+
+static int mk_stats_conf(char *confdir)
+{
+    char *path;
+    unsigned long len;
+    char *conf_file = NULL;
+    struct mk_config *conf;
+    struct mk_config_section *section;
+    struct mk_config_entry *entry;
+    struct mk_list *head;
+    struct stats_allow *allow;
+
+    mk_list_init(&stats_allow_list);
+    mk_api->pointer_set(&stats_path, MK_STATS_PATH_DEFAULT);
+
+    mk_api->str_build(&conf_file, &len, "%sstats.conf", confdir);
+    conf = mk_api->config_create(conf_file);
+    mk_api->mem_free(conf_file);
+    if (!conf) {
+        return 0;
+    }
+
+    section = mk_api->config_section_get(conf, "STATS");
+    if (section) {
+        path = mk_api->config_section_getval(section, "Path",
+                                             MK_CONFIG_VAL_STR);
+        if (path) {
+            if (path[0] != '/') {
+                mk_err("Stats: Path must start with '/'");
+                exit(EXIT_FAILURE);
+            }
+            mk_api->pointer_set(&stats_path, path);
+        }
+
+        stats_vhost = mk_api->config_section_getval(section, "VHost",
+                                                    MK_CONFIG_VAL_STR);
+
+        mk_list_foreach(head, &section->entries) {
+            entry = mk_list_entry(head, struct mk_config_entry, _head);
+            if (strcasecmp(entry->key, "Allow") != 0) {
+                continue;
+            }
+
+            allow = mk_api->mem_alloc(sizeof(struct stats_allow));
+            allow->addr = mk_api->str_dup(entry->val);
+            allow->len = strlen(allow->addr);
+            mk_list_add(&allow->_head, &stats_allow_list);
+        }
+    }
+
+    mk_api->config_free(conf);
+    return 0;
+}
+
+static int mk_stats_allowed(int socket)
+{
+    char *ip;
+    unsigned int len;
+    struct mk_list *head;
+    struct stats_allow *allow;
+    struct sched_connection *conx;
+
+    if (mk_list_is_empty(&stats_allow_list) == 0) {
+        return MK_TRUE;
+    }
+
+    conx = mk_api->sched_conn_get(socket);
+    if (!conx || conx->ip_str_len == 0) {
+        return MK_FALSE;
+    }
+
+    ip = conx->ip_str;
+    len = conx->ip_str_len;
+
+    /* IPv4 clients of an IPv6 socket */
+    if (len > 7 && strncmp(ip, "::ffff:", 7) == 0 && strchr(ip, '.')) {
+        ip += 7;
+        len -= 7;
+    }
+
+    mk_list_foreach(head, &stats_allow_list) {
+        allow = mk_list_entry(head, struct stats_allow, _head);
+        if (allow->len == len && strncmp(allow->addr, ip, len) == 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+static void page_printf(struct stats_page *page, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(page->buf + page->len, page->size - page->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0) {
+            return;
+        }
+        if ((unsigned long) n < page->size - page->len) {
+            page->len += n;
+            return;
+        }
+
+        page->size = (page->size * 2) + n;
+        page->buf = mk_api->mem_realloc(page->buf, page->size);
+    }
+}
+
+/* Quoted label or JSON string value */
+static void page_string(struct stats_page *page, const char *str)
+{
+    page_printf(page, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            page_printf(page, "\\%c", *str);
+        }
+        else if (*str == '\n') {
+            page_printf(page, "\\n");
+        }
+        else {
+            page_printf(page, "%c", *str);
+        }
+    }
+    page_printf(page, "\"");
+}
+
+static char *mk_stats_vhost_name(struct host *host)
+{
+    struct host_alias *alias;
+
+    alias = mk_list_entry_first(&host->server_names, struct host_alias, _head);
+    return alias->name;
+}
+
+static void mk_stats_connections(uint64_t *accepted, uint64_t *closed)
+{
+    int i;
+
+    *accepted = 0;
+    *closed = 0;
+    for (i = 0; i < mk_api->config->workers; i++) {
+        *accepted += mk_api->sched_list[i].accepted_connections;
+        *closed += mk_api->sched_list[i].closed_connections;
+    }
+}
+
+static void mk_stats_render_text(struct stats_page *page, struct mk_stats *st,
+                                 struct mk_stats_vhost *vhosts)
+{
+    int i;
+    uint64_t le;
+    uint64_t count = 0;
+    uint64_t accepted, closed;
+    struct host *host;
+    struct mk_list *head;
+
+    page_printf(page,
+                "# HELP monkey_requests_total Requests served.\n"
+                "# TYPE monkey_requests_total counter\n"
+                "monkey_requests_total %lu\n",
+                (unsigned long) st->requests);
+
+    page_printf(page,
+                "# HELP monkey_response_bytes_total Bytes of response bodies.\n"
+                "# TYPE monkey_response_bytes_total counter\n"
+                "monkey_response_bytes_total %lu\n",
+                (unsigned long) st->bytes);
+
+    page_printf(page,
+                "# HELP monkey_responses_total Responses by status code.\n"
+                "# TYPE monkey_responses_total counter\n");
+    for (i = 0; i <= MK_STATS_STATUS_MAX - MK_STATS_STATUS_MIN; i++) {
+        if (st->status[i] > 0) {
+            page_printf(page, "monkey_responses_total{code=\"%i\"} %lu\n",
+                        i + MK_STATS_STATUS_MIN,
+                        (unsigned long) st->status[i]);
+        }
+    }
+    if (st->status_other > 0) {
+        page_printf(page, "monkey_responses_total{code=\"other\"} %lu\n",
+                    (unsigned long) st->status_other);
+    }
+
+    mk_stats_connections(&accepted, &closed);
+    page_printf(page,
+                "# HELP monkey_connections_total Connections accepted.\n"
+                "# TYPE monkey_connections_total counter\n"
+                "monkey_connections_total %lu\n"
+                "# HELP monkey_connections_active Connections open.\n"
+                "# TYPE monkey_connections_active gauge\n"
+                "monkey_connections_active %lu\n",
+                (unsigned long) accepted, (unsigned long) (accepted - closed));
+
+    page_printf(page,
+                "# HELP monkey_vhost_requests_total Requests by virtual host.\n"
+                "# TYPE monkey_vhost_requests_total counter\n");
+    i = 0;
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        page_printf(page, "monkey_vhost_requests_total{vhost=");
+        page_string(page, mk_stats_vhost_name(host));
+        page_printf(page, "} %lu\n", (unsigned long) vhosts[i++].requests);
+    }
+
+    page_printf(page,
+                "# HELP monkey_vhost_response_bytes_total Bytes of response "
+                "bodies by virtual host.\n"
+                "# TYPE monkey_vhost_response_bytes_total counter\n");
+    i = 0;
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        page_printf(page, "monkey_vhost_response_bytes_total{vhost=");
+        page_string(page, mk_stats_vhost_name(host));
+        page_printf(page, "} %lu\n", (unsigned long) vhosts[i++].bytes);
+    }
+
+    page_printf(page,
+                "# HELP monkey_request_duration_seconds Time from the request "
+                "being read to the end of its response.\n"
+                "# TYPE monkey_request_duration_seconds histogram\n");
+    for (i = 0; i < MK_STATS_BUCKETS - 1; i++) {
+        count += st->latency[i];
+        le = mk_api->stats_bucket_limit(i) + 1;
+        page_printf(page,
+                    "monkey_request_duration_seconds_bucket{le=\"%g\"} %lu\n",
+                    le / 1000000.0, (unsigned long) count);
+    }
+    page_printf(page,
+                "monkey_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+                "monkey_request_duration_seconds_sum %.6f\n"
+                "monkey_request_duration_seconds_count %lu\n",
+                (unsigned long) st->latency_count,
+                st->latency_sum / 1000000.0,
+                (unsigned long) st->latency_count);
+}
+
+/* Upper bound of the bucket holding the given quantile, in microseconds */
+static uint64_t mk_stats_quantile(struct mk_stats *st, double q)
+{
+    int i;
+    uint64_t count = 0;
+    uint64_t rank;
+
+    if (st->latency_count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) (q * st->latency_count);
+    for (i = 0; i < MK_STATS_BUCKETS - 1; i++) {
+        count += st->latency[i];
+        if (count > rank) {
+            break;
+        }
+    }
+
+    return mk_api->stats_bucket_limit(i);
+}
+
+static void mk_stats_render_json(struct stats_page *page, struct mk_stats *st,
+                                 struct mk_stats_vhost *vhosts)
+{
+    int i;
+    int n = 0;
+    uint64_t accepted, closed;
+    double quantiles[] = MK_STATS_QUANTILES;
+    struct host *host;
+    struct mk_list *head;
+
+    mk_stats_connections(&accepted, &closed);
+    page_printf(page,
+                "{\"requests\": %lu, \"bytes\": %lu, "
+                "\"connections\": {\"accepted\": %lu, \"active\": %lu}, "
+                "\"responses\": {",
+                (unsigned long) st->requests, (unsigned long) st->bytes,
+                (unsigned long) accepted,
+                (unsigned long) (accepted - closed));
+
+    for (i = 0; i <= MK_STATS_STATUS_MAX - MK_STATS_STATUS_MIN; i++) {
+        if (st->status[i] > 0) {
+            page_printf(page, "%s\"%i\": %lu", n++ ? ", " : "",
+                        i + MK_STATS_STATUS_MIN,
+                        (unsigned long) st->status[i]);
+        }
+    }
+    if (st->status_other > 0) {
+        page_printf(page, "%s\"other\": %lu", n ? ", " : "",
+                    (unsigned long) st->status_other);
+    }
+
+    page_printf(page, "}, \"vhosts\": {");
+    i = 0;
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        page_printf(page, "%s", i ? ", " : "");
+        page_string(page, mk_stats_vhost_name(host));
+        page_printf(page, ": {\"requests\": %lu, \"bytes\": %lu}",
+                    (unsigned long) vhosts[i].requests,
+                    (unsigned long) vhosts[i].bytes);
+        i++;
+    }
+
+    page_printf(page,
+                "}, \"latency_us\": {\"count\": %lu, \"sum\": %lu",
+                (unsigned long) st->latency_count,
+                (unsigned long) st->latency_sum);
+    for (i = 0; i < (int) (sizeof(quantiles) / sizeof(double)); i++) {
+        page_printf(page, ", \"p%g\": %lu", quantiles[i] * 100,
+                    (unsigned long) mk_stats_quantile(st, quantiles[i]));
+    }
+
+    /* Only the buckets in use, as [upper bound, count] */
+    page_printf(page, ", \"buckets\": [");
+    n = 0;
+    for (i = 0; i < MK_STATS_BUCKETS; i++) {
+        if (st->latency[i] == 0) {
+            continue;
+        }
+        if (i == MK_STATS_BUCKETS - 1) {
+            page_printf(page, "%s[null, %lu]", n++ ? ", " : "",
+                        (unsigned long) st->latency[i]);
+        }
+        else {
+            page_printf(page, "%s[%lu, %lu]", n++ ? ", " : "",
+                        (unsigned long) mk_api->stats_bucket_limit(i),
+                        (unsigned long) st->latency[i]);
+        }
+    }
+    page_printf(page, "]}}\n");
+}
+
+static void mk_stats_page_free(void *data)
+{
+    mk_api->mem_free(data);
+}
+
+static int mk_stats_send(struct client_session *cs, struct session_request *sr)
+{
+    int n;
+    int json = MK_FALSE;
+    struct mk_stats st;
+    struct mk_stats_vhost *vhosts;
+    struct stats_page page;
+    struct mk_stream *stream;
+    struct mk_output_buf *buf;
+
+    if (sr->query_string.len == 11 &&
+        strncmp(sr->query_string.data, "format=json", 11) == 0) {
+        json = MK_TRUE;
+    }
+
+    vhosts = mk_api->mem_alloc_z(sizeof(struct mk_stats_vhost) *
+                                 (mk_api->config->nhosts + 1));
+    mk_api->stats_read(&st, vhosts);
+
+    page.len = 0;
+    page.size = MK_STATS_PAGE_SIZE;
+    page.buf = mk_api->mem_alloc(page.size);
+
+    if (json == MK_TRUE) {
+        mk_stats_render_json(&page, &st, vhosts);
+    }
+    else {
+        mk_stats_render_text(&page, &st, vhosts);
+    }
+    mk_api->mem_free(vhosts);
+
+    mk_api->header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_type = (json == MK_TRUE) ?
+        stats_mime_json : stats_mime_text;
+    sr->headers.content_length = page.len;
+    sr->headers.cgi = SH_NOCGI;
+
+    n = mk_api->header_send(cs->socket, cs, sr);
+    if (n < 0 || sr->method == HTTP_METHOD_HEAD) {
+        mk_api->mem_free(page.buf);
+        return (n < 0) ? -1 : 0;
+    }
+
+    buf = mk_api->output_buf_create(page.buf, page.len,
+                                    mk_stats_page_free, page.buf);
+    if (!buf) {
+        mk_api->mem_free(page.buf);
+        return -1;
+    }
+
+    stream = mk_api->stream_buf(cs, sr, buf, 0, page.len);
+    mk_api->output_buf_release(buf);
+
+    return (stream) ? 0 : -1;
+}
+
+int _mkp_init(struct plugin_api **api, char *confdir)
+{
+    mk_api = *api;
+
+    return mk_stats_conf(confdir);
+}
+
+void _mkp_exit()
+{
+}
+
+int _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
+                  struct session_request *sr)
+{
+    (void) plugin;
+
+    if (sr->uri_processed.len != stats_path.len ||
+        strncmp(sr->uri_processed.data, stats_path.data, stats_path.len) != 0) {
+        return MK_PLUGIN_RET_NOT_ME;
+    }
+
+    if (stats_vhost && (!sr->host_alias ||
+                        strcasecmp(sr->host_alias->name, stats_vhost) != 0)) {
+        return MK_PLUGIN_RET_NOT_ME;
+    }
+
+    if (mk_stats_allowed(cs->socket) == MK_FALSE) {
+        PLUGIN_TRACE("[FD %i] stats not allowed", cs->socket);
+        mk_api->header_set_http_status(sr, MK_CLIENT_FORBIDDEN);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    if (mk_stats_send(cs, sr) < 0 && sr->headers.sent == MK_FALSE) {
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    return MK_PLUGIN_RET_END;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301  USA
+ */
+
+#ifndef MK_STATS_PLUGIN_H
+#define MK_STATS_PLUGIN_H
+
+#define MK_STATS_PATH_DEFAULT  "/server-stats"
+
+#define MK_STATS_MIME_TEXT     "text/plain; version=0.0.4\r\n"
+#define MK_STATS_MIME_JSON     "application/json\r\n"
+
+/* Initial size of a rendered page */
+#define MK_STATS_PAGE_SIZE     16384
+
+/* Quantiles of the JSON output */
+#define MK_STATS_QUANTILES     { 0.5, 0.9, 0.99, 0.999 }
+
+struct stats_allow
+{
+    char *addr;
+    unsigned int len;
+    struct mk_list _head;
+};
+
+struct stats_page
+{
+    char *buf;
+    unsigned long len;
+    unsigned long size;
+};
+
+#endif
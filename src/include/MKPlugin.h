@@ -40,7 +40,7 @@ struct plugin_info MK_EXPORT _plugin_info;
 pthread_key_t MK_EXPORT _mkp_data;
 
 #define MONKEY_PLUGIN(a, b, c, d)                   \
-    struct plugin_info MK_EXPORT _plugin_info = {a, b, c, d}
+    struct plugin_info MK_EXPORT _plugin_info = {a, b, c, d, NULL}
 
 #ifdef TRACE
 #define PLUGIN_TRACE(...) \
@@ -65,7 +65,8 @@ int MK_EXPORT _mkp_stage_30(struct plugin *plugin, struct client_session *cs,
                             struct session_request *sr);
 int MK_EXPORT _mkp_stage_40(struct client_session *cs, struct session_request *sr);
 int MK_EXPORT _mkp_stage_50(int sockfd);
-int MK_EXPORT _mkp_network_io_accept(int server_fd);
+int MK_EXPORT _mkp_network_io_accept(int server_fd, struct sockaddr *addr,
+                                     socklen_t *len);
 int MK_EXPORT _mkp_network_io_read(int socket_fd, void *buf, int count);
 int MK_EXPORT _mkp_network_io_write(int socket_fd, const void *buf, size_t count);
 int MK_EXPORT _mkp_network_io_writev(int socket_fd, struct mk_iov *mk_io);
@@ -83,6 +84,9 @@ int MK_EXPORT _mkp_event_error(int sockfd);
 int MK_EXPORT _mkp_event_close(int sockfd);
 int MK_EXPORT _mkp_event_timeout(int sockfd);
 
+/* Optional, listed by the cheetah 'counters' command */
+void MK_EXPORT _mkp_cheetah_counters(int (*print)(const char *, ...));
+
 
 /*
  * Redefine messages macros
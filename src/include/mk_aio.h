@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mk_list.h"
+#include "mk_request.h"
+#include "mk_scheduler.h"
+
+#ifndef MK_AIO_H
+#define MK_AIO_H
+
+/*
+ * Size of the file window that an I/O thread pulls into the page
+ * cache for a parked connection: 512KB
+ */
+#define MK_AIO_WINDOW         (512 * 1024)
+
+/* Files smaller than this are never probed */
+#define MK_AIO_MIN_SIZE       (64 * 1024)
+
+/*
+ * Paths looked up by the I/O threads are remembered by each worker in a
+ * direct mapped table, an entry is taken as still in the dentry and
+ * inode caches while the path keeps being requested within the TTL.
+ */
+#define MK_AIO_PATHS          4096
+#define MK_AIO_PATH_TTL       60
+
+/* Return values of mk_aio_file_check() and mk_aio_path_check() */
+#define MK_AIO_READY          0
+#define MK_AIO_PARKED         1
+
+struct mk_aio_path
+{
+    uint32_t hash;
+    time_t seen;
+};
+
+/*
+ * A job is created by a worker when the next window of a file is not
+ * resident in the page cache, or when a path has not been looked up
+ * lately. The file descriptor is a dup() of the request one and the
+ * path a copy, so the I/O thread never races with mk_request_free().
+ */
+struct mk_aio_job
+{
+    int fd;                        /* private copy of sr->fd_file */
+    int socket;                    /* parked client socket        */
+    unsigned int id;               /* token stored in the session */
+    off_t offset;
+    size_t len;
+
+    char *path;                    /* path to look up, or NULL    */
+    uint32_t hash;
+
+    struct sched_list_node *sched; /* worker owning the socket    */
+    struct mk_list _head;
+};
+
+int mk_aio_init(int threads);
+int mk_aio_worker_init(struct sched_list_node *sched);
+int mk_aio_worker_events(struct sched_list_node *sched);
+
+void mk_aio_file_open(struct session_request *sr);
+int mk_aio_file_check(struct client_session *cs, struct session_request *sr);
+int mk_aio_path_check(struct client_session *cs, struct session_request *sr);
+
+#endif
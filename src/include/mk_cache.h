@@ -22,11 +22,9 @@
 #ifndef MK_CACHE_H
 #define MK_CACHE_H
 
-extern pthread_key_t mk_cache_iov_header;
+extern pthread_key_t mk_cache_header_buf;
 extern pthread_key_t mk_cache_header_lm;
-extern pthread_key_t mk_cache_header_cl;
 extern pthread_key_t mk_cache_header_ka;
-extern pthread_key_t mk_cache_header_ka_max;
 extern pthread_key_t mk_cache_utils_gmtime;
 extern pthread_key_t mk_cache_utils_gmt_text;
 
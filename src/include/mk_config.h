@@ -113,6 +113,20 @@ struct server_config
 
     int max_request_size;
 
+    /* number of threads reading cold files from disk (0 = disabled) */
+    int aio_threads;
+
+    /* dynamic response cache, bytes (0 = disabled) */
+    size_t rcache_size;
+    int rcache_ttl;
+    int rcache_stale;
+    struct mk_list *rcache_key_headers;
+
+    /* slow requests log, NULL if disabled */
+    char *slowlog;
+    int slowlog_threshold;      /* milliseconds */
+    int slowlog_sample;         /* time one of every N requests */
+
     struct mk_list *index_files;
 
     /* configured host quantity */
@@ -159,12 +173,21 @@ struct host
     char *host_signature;
     mk_pointer header_host_signature;
 
+    /* status line + server signature + 'Date: ', indexed by status */
+    mk_pointer *header_prefix;
+
     /* source configuration */
     struct mk_config *config;
 
     /* custom error pages */
     struct mk_list error_pages;
 
+    /* URI to handler plugin routes, NULL if not defined */
+    struct mk_route_table *routes;
+
+    /* position in config->hosts, index of its counters in mk_stats */
+    int stats_idx;
+
     /* link node */
     struct mk_list _head;
 };
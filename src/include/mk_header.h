@@ -82,10 +82,18 @@
 #define MK_RH_SERVER_GATEWAY_TIMEOUT "HTTP/1.1 504 Gateway Timeout\r\n"
 #define MK_RH_SERVER_HTTP_VERSION_UNSUP "HTTP/1.1 505 HTTP Version Not Supported\r\n"
 
-struct header_status_response {
-    int   status;
-    int   length;
-    char *response;
+/* Range of status codes handled by the status table */
+#define MK_HEADER_STATUS_MIN 100
+#define MK_HEADER_STATUS_MAX 506
+
+/* Per worker buffer where the response headers are composed */
+#define MK_HEADER_BUF_SIZE  2048
+#define MK_HEADER_BUF_CHUNK 1024
+
+struct mk_header_buf {
+    char *data;
+    int len;
+    int size;
 };
 
 /* Short header values */
@@ -109,6 +117,7 @@ struct header_status_response {
 #define MK_HEADER_TE_CHUNKED "Transfer-Encoding: Chunked" MK_CRLF
 
 #define MK_HEADER_LAST_MODIFIED "Last-Modified: "
+#define MK_HEADER_CONTENT_RANGE "Content-Range: bytes "
 
 extern const mk_pointer mk_header_short_date;
 extern const mk_pointer mk_header_short_location;
@@ -122,8 +131,14 @@ extern const mk_pointer mk_header_content_encoding;
 extern const mk_pointer mk_header_accept_ranges;
 extern const mk_pointer mk_header_te_chunked;
 extern const mk_pointer mk_header_last_modified;
+extern const mk_pointer mk_header_content_range;
 
+struct host;
+
+struct mk_header_buf *mk_header_build(struct client_session *cs,
+                                      struct session_request *sr);
 int mk_header_send(int fd, struct client_session *cs, struct session_request *sr);
+void mk_header_host_prefix_init(struct host *host);
 void mk_header_response_reset(struct response_headers *header);
 void mk_header_set_http_status(struct session_request *sr, int status);
 void mk_header_set_content_length(struct session_request *sr, long len);
@@ -79,6 +79,7 @@ int mk_http_protocol_check(char *protocol, int len);
 mk_pointer mk_http_protocol_check_str(int protocol);
 
 int mk_http_init(struct client_session *cs, struct session_request *sr);
+int mk_http_init_file(struct client_session *cs, struct session_request *sr);
 int mk_http_keepalive_check(struct client_session *cs);
 
 int mk_http_pending_request(struct client_session *cs);
@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <sys/types.h>
+
+#include "mk_list.h"
+#include "mk_macros.h"
+
+#ifndef MK_OUTPUT_H
+#define MK_OUTPUT_H
+
+/* Output entry types */
+#define MK_OUTPUT_BUF         0    /* range of a refcounted buffer     */
+#define MK_OUTPUT_FILE        1    /* range of a file, sent by sendfile */
+#define MK_OUTPUT_FRAME       2    /* small inline data, chunk framing  */
+
+/* Room for a chunk size line: 16 hex digits + CRLF */
+#define MK_OUTPUT_FRAME_SIZE  24
+
+/* Max number of memory entries gathered in one writev(2) */
+#define MK_OUTPUT_IOV         64
+
+/*
+ * Producers are expected to stop queueing data once the connection has
+ * this amount of bytes pending and resume on the next write event.
+ */
+#define MK_OUTPUT_HIGH_WATER  (256 * 1024)
+
+/*
+ * A buffer can be referenced by many entries and many connections, the
+ * release callback is invoked with 'priv' once the last reference is
+ * dropped. A NULL release means the data is not owned by the buffer.
+ */
+struct mk_output_buf
+{
+    char *data;
+    size_t len;
+    int refs;
+    void (*release) (void *);
+    void *priv;
+};
+
+struct mk_output_entry
+{
+    int type;
+    size_t len;                      /* bytes left to send */
+
+    /* MK_OUTPUT_BUF */
+    struct mk_output_buf *buf;
+    size_t offset;
+
+    /* MK_OUTPUT_FILE */
+    int fd;
+    int fd_close;
+    off_t fd_offset;
+
+    /* MK_OUTPUT_FRAME */
+    char frame[MK_OUTPUT_FRAME_SIZE];
+
+    struct mk_list _head;
+};
+
+/* Per connection output queue */
+struct mk_output
+{
+    size_t pending;
+    struct mk_list entries;
+};
+
+void mk_output_init(struct mk_output *out);
+void mk_output_free(struct mk_output *out);
+
+struct mk_output_buf *mk_output_buf_create(char *data, size_t len,
+                                           void (*release) (void *),
+                                           void *priv);
+void mk_output_buf_get(struct mk_output_buf *buf);
+void mk_output_buf_release(struct mk_output_buf *buf);
+
+int mk_output_add_buf(struct mk_output *out, struct mk_output_buf *buf,
+                      size_t offset, size_t len);
+int mk_output_add_copy(struct mk_output *out, const void *data, size_t len);
+int mk_output_add_file(struct mk_output *out, int fd, off_t offset,
+                       size_t len, int close_fd);
+int mk_output_add_chunk(struct mk_output *out, struct mk_output_buf *buf,
+                        size_t offset, size_t len);
+int mk_output_send(int socket, struct mk_output *out,
+                   const void *data, size_t len);
+
+ssize_t mk_output_flush(int socket, struct mk_output *out);
+
+static inline size_t mk_output_pending(struct mk_output *out)
+{
+    return out->pending;
+}
+
+static inline int mk_output_full(struct mk_output *out)
+{
+    return (out->pending >= MK_OUTPUT_HIGH_WATER);
+}
+
+#endif
@@ -35,6 +35,10 @@
 #include "mk_string.h"
 #include "mk_list.h"
 #include "mk_info.h"
+#include "mk_output.h"
+#include "mk_stream.h"
+#include "mk_rcache.h"
+#include "mk_stats.h"
 
 #define MK_PLUGIN_LOAD "plugins.load"
 
@@ -103,7 +107,7 @@ struct plugin_stage
 
 struct plugin_network_io
 {
-    int (*accept) (int);
+    int (*accept) (int, struct sockaddr *, socklen_t *);
     int (*read) (int, void *, int);
     int (*write) (int, const void *, size_t);
     int (*writev) (int, struct mk_iov *);
@@ -124,6 +128,9 @@ struct plugin
     void *handler;
     unsigned int hooks;
 
+    /* Index in the request and session data slots, -1 if none */
+    int slot;
+
     /* Mandatory calls */
     int (*init) (void *, char *);
     int  (*exit) ();
@@ -251,6 +258,61 @@ struct plugin_api
     int (*socket_send_file) (int, int, off_t *, size_t);
     int (*socket_ip_str) (int, char **, int, unsigned long *);
 
+    /* output queue */
+    struct mk_output_buf *(*output_buf_create) (char *, size_t,
+                                                void (*) (void *), void *);
+    void (*output_buf_get) (struct mk_output_buf *);
+    void (*output_buf_release) (struct mk_output_buf *);
+    int (*output_add_buf) (struct mk_output *, struct mk_output_buf *,
+                           size_t, size_t);
+    int (*output_add_copy) (struct mk_output *, const void *, size_t);
+    int (*output_add_file) (struct mk_output *, int, off_t, size_t, int);
+    int (*output_add_chunk) (struct mk_output *, struct mk_output_buf *,
+                             size_t, size_t);
+    ssize_t (*output_flush) (int, struct mk_output *);
+    int (*output_full) (struct mk_output *);
+
+    /* streams */
+    struct mk_stream *(*stream_buf) (struct client_session *,
+                                     struct session_request *,
+                                     struct mk_output_buf *, size_t, size_t);
+    struct mk_stream *(*stream_fd) (struct client_session *,
+                                    struct session_request *, int, int);
+    struct mk_stream *(*stream_func) (struct client_session *,
+                                      struct session_request *,
+                                      int (*) (struct mk_stream *, void *),
+                                      void *);
+    int (*stream_filter_add) (struct mk_stream *, struct mk_stream_filter *);
+    int (*stream_filter_next) (struct mk_stream *, struct mk_stream_filter *,
+                               struct mk_output_buf *, size_t, size_t);
+    int (*stream_filter_chunked) (struct mk_stream *);
+    int (*stream_write) (struct mk_stream *, struct mk_output_buf *,
+                         size_t, size_t);
+    int (*stream_write_copy) (struct mk_stream *, const void *, size_t);
+    void (*stream_resume) (struct client_session *);
+
+    /* plugin data slots */
+    int (*request_data_set) (struct plugin *, struct session_request *,
+                             void *, void (*) (void *));
+    void *(*request_data_get) (struct plugin *, struct session_request *);
+    int (*session_data_set) (struct plugin *, struct client_session *,
+                             void *, void (*) (void *));
+    void *(*session_data_get) (struct plugin *, struct client_session *);
+    struct client_session *(*session_get) (int);
+
+    /* response cache */
+    int (*rcache_lookup) (struct client_session *, struct session_request *);
+    int (*rcache_store_headers) (struct session_request *, const char *,
+                                 size_t);
+    int (*rcache_store_body) (struct session_request *, const void *, size_t);
+    void (*rcache_store_end) (struct session_request *);
+    void (*rcache_abort) (struct session_request *);
+    void (*rcache_counters) (int (*) (const char *, ...));
+
+    /* server statistics */
+    int (*stats_read) (struct mk_stats *, struct mk_stats_vhost *);
+    uint64_t (*stats_bucket_limit) (int);
+
     /* red-black tree */
     void (*rb_insert_color) (struct rb_node *, struct rb_root *);
     void (*rb_erase) (struct rb_node *, struct rb_root *);
@@ -269,6 +331,7 @@ struct plugin_api
     struct sched_connection *(*sched_get_connection) (struct sched_list_node *,
                                                       int);
     struct sched_list_node *(*sched_worker_info)();
+    struct sched_connection *(*sched_conn_get) (int);
 
     /* worker's functions */
     pthread_t (*worker_spawn) (void (*func) (void *), void *);
@@ -298,13 +361,14 @@ extern struct plugin_api *api;
 /* Plugin events thread key */
 extern pthread_key_t mk_plugin_event_k;
 
-struct plugin_event
-{
-    int socket;
-
-    struct plugin *handler;
+/* Initial size of the per worker table of plugin owned fds */
+#define MK_PLUGIN_EVENT_TABLE  256
 
-    struct mk_list _head;
+/* File descriptors registered by plugins, indexed by fd (thread level) */
+struct plugin_event_table
+{
+    int size;
+    struct plugin **handlers;
 };
 
 struct plugin_info {
@@ -312,13 +376,17 @@ struct plugin_info {
     const char *name;
     const char *version;
     unsigned int hooks;
+
+    /* Filled by the core once the plugin has been loaded */
+    struct plugin *plugin;
 };
 
 void mk_plugin_init();
 void mk_plugin_read_config();
 void mk_plugin_exit_all();
 
-void mk_plugin_event_init_list();
+void mk_plugin_event_init_table();
+struct plugin *mk_plugin_event_get(int socket);
 
 int mk_plugin_stage_run(unsigned int stage,
                         unsigned int socket,
@@ -359,6 +427,15 @@ void mk_plugin_free(struct plugin *p);
 
 int mk_plugin_time_now_unix();
 mk_pointer *mk_plugin_time_now_human();
+int mk_plugin_output_full(struct mk_output *out);
+
+int mk_plugin_request_data_set(struct plugin *p, struct session_request *sr,
+                               void *data, void (*cleanup) (void *));
+void *mk_plugin_request_data_get(struct plugin *p, struct session_request *sr);
+int mk_plugin_session_data_set(struct plugin *p, struct client_session *cs,
+                               void *data, void (*cleanup) (void *));
+void *mk_plugin_session_data_get(struct plugin *p, struct client_session *cs);
+void mk_plugin_data_release(struct mk_plugin_slot *slots);
 
 int mk_plugin_sched_remove_client(int socket);
 
@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mk_list.h"
+#include "mk_output.h"
+#include "mk_request.h"
+
+#ifndef MK_RCACHE_H
+#define MK_RCACHE_H
+
+/* Number of independent locks/LRU lists the store is split in */
+#define MK_RCACHE_SHARDS       16
+#define MK_RCACHE_BUCKETS      256
+
+/* Requests with a longer key are never cached */
+#define MK_RCACHE_KEY_MAX      1024
+
+/* Seconds an uncacheable URL skips the cache (hit-for-pass) */
+#define MK_RCACHE_PASS_TTL     10
+
+/* Return values of mk_rcache_lookup() */
+#define MK_RCACHE_MISS         0    /* run the handler                */
+#define MK_RCACHE_HIT          1    /* response sent from the cache   */
+#define MK_RCACHE_PARKED       2    /* waiting for another request    */
+
+/* Entry states */
+#define MK_RCACHE_FILLING      0
+#define MK_RCACHE_READY        1
+#define MK_RCACHE_PASS         2
+
+/* A request parked on an entry which is being filled */
+struct mk_rcache_waiter
+{
+    int socket;
+    unsigned int id;                /* token stored in the session    */
+    struct sched_list_node *sched;  /* worker owning the socket       */
+
+    struct mk_list _head;
+};
+
+/*
+ * A cached response: the header rows to be sent after the ones generated
+ * by Monkey, followed by the body, in a single refcounted buffer so a hit
+ * keeps the data alive while it is sent even if the entry is evicted.
+ */
+struct mk_rcache_entry
+{
+    uint32_t hash;
+    char *key;
+    int key_len;
+
+    int state;
+    int status;
+    int refreshing;                 /* a stale revalidation is running */
+    time_t stored;
+    time_t expires;                 /* fresh until                     */
+    time_t stale_until;             /* may be served while refreshing  */
+
+    struct mk_output_buf *buf;
+    size_t headers_len;
+    size_t body_len;
+    size_t size;                    /* bytes charged to the shard      */
+
+    struct mk_list waiters;
+    struct mk_list _hash;
+    struct mk_list _lru;
+};
+
+/*
+ * Response being captured by the request elected to go to the backend,
+ * 'entry' is the placeholder other requests park on, NULL when the
+ * request is refreshing a stale entry which is still being served.
+ */
+struct mk_rcache_fill
+{
+    uint32_t hash;
+    char *key;
+    int key_len;
+    struct mk_rcache_entry *entry;
+
+    int status;
+    int cacheable;
+    time_t expires;
+
+    char *data;
+    size_t headers_len;
+    size_t len;
+    size_t size;
+};
+
+struct mk_rcache_shard
+{
+    pthread_mutex_t mutex;
+    size_t bytes;
+    struct mk_list buckets[MK_RCACHE_BUCKETS];
+    struct mk_list lru;
+};
+
+/* Counters, updated with atomic operations from every worker */
+struct mk_rcache_stats
+{
+    uint64_t hits;
+    uint64_t stale;
+    uint64_t misses;
+    uint64_t collapsed;
+    uint64_t passes;
+    uint64_t stores;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+int mk_rcache_init();
+int mk_rcache_worker_init(struct sched_list_node *sched);
+int mk_rcache_worker_events(struct sched_list_node *sched);
+
+int mk_rcache_lookup(struct client_session *cs, struct session_request *sr);
+int mk_rcache_resume(struct client_session *cs, struct session_request *sr);
+
+int mk_rcache_store_headers(struct session_request *sr,
+                            const char *rows, size_t len);
+int mk_rcache_store_body(struct session_request *sr,
+                         const void *data, size_t len);
+void mk_rcache_store_end(struct session_request *sr);
+void mk_rcache_abort(struct session_request *sr);
+
+void mk_rcache_counters(int (*print) (const char *, ...));
+
+#endif
@@ -25,6 +25,8 @@
 #include "mk_memory.h"
 #include "mk_scheduler.h"
 #include "mk_limits.h"
+#include "mk_output.h"
+#include "mk_slowlog.h"
 
 #ifndef MK_REQUEST_H
 #define MK_REQUEST_H
@@ -144,6 +146,20 @@ struct headers_toc
     struct header_toc_row rows[MK_HEADERS_TOC_LEN];
 };
 
+/*
+ * Plugins keep their per request and per connection state in a fixed
+ * array indexed by the slot the core assigned to them when they were
+ * registered, the optional cleanup callback is invoked when the owner
+ * structure is released.
+ */
+#define MK_PLUGIN_SLOTS 16
+
+struct mk_plugin_slot
+{
+    void *data;
+    void (*cleanup) (void *);
+};
+
 struct session_request
 {
     int status;
@@ -231,13 +247,37 @@ struct session_request
     off_t bytes_offset;
     struct file_info file_info;
 
+    /* Asynchronous disk I/O: probe the page cache, checked up to offset */
+    int aio_probe;
+    off_t aio_ahead;
+    int aio_parked;               /* path being looked up by an I/O thread */
+
+    /* Request clock time the request was parsed at, see mk_stats */
+    uint64_t stats_start;
+
+    /* Time of each phase when sampled by the slow log, see mk_slowlog */
+    struct mk_phases phases;
+
+    /* Response cache: fill in progress, or parked waiting for one */
+    struct mk_rcache_fill *rcache;
+    int rcache_parked;
+
     /* Vhost */
     struct host       *host_conf;     /* root vhost config */
     struct host_alias *host_alias;    /* specific vhost matched */
 
+    /* Plugin the vhost routes the URI to, see mk_route.h */
+    struct plugin *route;
+
     /* Response headers */
     struct response_headers headers;
 
+    /* Response body sources, see mk_stream.h */
+    struct mk_list streams;
+
+    /* Plugins data, see mk_plugin_request_data_set() */
+    struct mk_plugin_slot plugin_data[MK_PLUGIN_SLOTS];
+
     struct mk_list _head;
 };
 
@@ -262,6 +302,22 @@ struct client_session
 
     time_t init_time;
 
+    /* Phase clock when the first byte of the request was read, only
+     * taken if the slow log is enabled */
+    uint64_t phase_start;
+
+    /* Token of the pending disk I/O job, zero if none */
+    unsigned int aio_id;
+
+    /* Token of the response cache fill being waited, zero if none */
+    unsigned int rcache_id;
+
+    /* Data waiting for the socket to become writable */
+    struct mk_output output;
+
+    /* Plugins data, see mk_plugin_session_data_set() */
+    struct mk_plugin_slot plugin_data[MK_PLUGIN_SLOTS];
+
     struct session_request sr_fixed;
     struct mk_list request_list;
 
@@ -300,4 +356,5 @@ int mk_handler_read(int socket, struct client_session *cs);
 int mk_handler_write(int socket, struct client_session *cs);
 
 void mk_request_ka_next(struct client_session *cs);
+void mk_request_finished(struct client_session *cs, struct session_request *sr);
 #endif
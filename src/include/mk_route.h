@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <regex.h>
+
+#include "mk_list.h"
+#include "mk_config.h"
+#include "mk_macros.h"
+
+#ifndef MK_ROUTE_H
+#define MK_ROUTE_H
+
+/* Virtual host section where the routes are defined */
+#define MK_ROUTE_SECTION   "HANDLERS"
+
+/* Route types, as written in the configuration */
+#define MK_ROUTE_PREFIX    "Prefix"
+#define MK_ROUTE_SUFFIX    "Suffix"
+#define MK_ROUTE_REGEX     "Regex"
+
+struct plugin;
+
+/*
+ * A routed plugin and its place among the unrouted stage 30 plugins: it
+ * runs right before stage_30[at], or after all of them when 'at' equals
+ * n_stage_30. It is -1 if the plugin has no stage 30 handler.
+ */
+struct mk_route_handler
+{
+    struct plugin *p;
+    int at;
+};
+
+/*
+ * Byte trie node: prefixes are stored as they are, suffixes are stored
+ * reversed so both can be matched walking the URI once.
+ */
+struct mk_route_node
+{
+    unsigned char c;
+    char *name;                         /* handler plugin shortname */
+    struct mk_route_handler *handler;   /* resolved once plugins are loaded */
+
+    struct mk_route_node *child;
+    struct mk_route_node *next;
+};
+
+struct mk_route_regex
+{
+    regex_t re;
+    char *name;
+    struct mk_route_handler *handler;
+
+    struct mk_list _head;
+};
+
+struct mk_route_table
+{
+    struct mk_route_node prefix;
+    struct mk_route_node suffix;
+    struct mk_list regex;
+
+    /* plugins which only run when one of their routes matches */
+    int n_handlers;
+    struct mk_route_handler **handlers;
+
+    /* stage 30 plugins without routes, which run for every request */
+    int n_stage_30;
+    struct plugin **stage_30;
+};
+
+struct mk_route_table *mk_route_create(struct mk_config *cnf, const char *path);
+void mk_route_resolve(struct mk_route_table *table);
+void mk_route_resolve_all(void);
+void mk_route_free(struct mk_route_table *table);
+
+struct mk_route_handler *mk_route_lookup(struct mk_route_table *table,
+                                         const char *uri, int len);
+
+#endif
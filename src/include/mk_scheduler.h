@@ -35,6 +35,14 @@
 #define MK_SCHEDULER_CONN_PENDING 0
 #define MK_SCHEDULER_CONN_PROCESS 1
 
+/* Peer address of a connection, as returned by accept() */
+union sched_addr
+{
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
 struct sched_connection
 {
     int socket;              /* file descriptor     */
@@ -42,6 +50,11 @@ struct sched_connection
     uint32_t events;         /* epoll events        */
     time_t arrive_time;      /* arrived time        */
 
+    union sched_addr addr;   /* peer address        */
+    socklen_t addr_len;
+    char ip_str[INET6_ADDRSTRLEN]; /* address text form */
+    unsigned int ip_str_len;
+
     struct rb_node _rb_head; /* red-black tree head */
     struct mk_list _head;    /* list head           */
 };
@@ -69,6 +82,20 @@ struct sched_list_node
     unsigned char initialized;
 
     struct client_session *request_handler;
+
+    /* Asynchronous disk I/O: finished jobs and notification channel */
+    int aio_fd;
+    unsigned int aio_seq;
+    pthread_mutex_t aio_mutex;
+    struct mk_list aio_done;
+    struct mk_aio_path *aio_paths;  /* paths looked up lately */
+
+    /* Response cache: requests woken up after a fill */
+    int rcache_fd;
+    unsigned int rcache_seq;
+    pthread_mutex_t rcache_mutex;
+    struct mk_list rcache_woken;
+
 #ifdef SHAREDLIB
     mklib_ctx ctx;
 #endif
@@ -116,11 +143,13 @@ void mk_sched_update_thread_status(struct sched_list_node *sched,
 
 
 int mk_sched_check_timeouts(struct sched_list_node *sched);
-int mk_sched_add_client(int remote_fd);
+int mk_sched_add_client(int remote_fd, union sched_addr *addr,
+                        socklen_t addr_len);
 int mk_sched_register_client(int remote_fd, struct sched_list_node *sched);
 int mk_sched_remove_client(struct sched_list_node *sched, int remote_fd);
 struct sched_connection *mk_sched_get_connection(struct sched_list_node
                                                      *sched, int remote_fd);
+struct sched_connection *mk_sched_conn_get(int remote_fd);
 int mk_sched_update_conn_status(struct sched_list_node *sched, int remote_fd,
                                 int status);
 struct sched_list_node *mk_sched_worker_info();
@@ -0,0 +1,124 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "mk_stats.h"
+#include "mk_macros.h"
+
+#ifndef MK_SLOWLOG_H
+#define MK_SLOWLOG_H
+
+/* Default threshold in milliseconds */
+#define MK_SLOWLOG_THRESHOLD   500
+
+/* Slow requests a worker can queue between two flushes */
+#define MK_SLOWLOG_RING        64
+
+#define MK_SLOWLOG_URI         256
+
+/*
+ * Phases of a request. Each stamp is taken when the phase ends, the
+ * time spent in a phase is the distance to the previous stamp taken.
+ */
+enum mk_phase {
+    MK_PHASE_START = 0,     /* first byte of the request read */
+    MK_PHASE_READ,          /* request complete */
+    MK_PHASE_PARSE,         /* headers parsed */
+    MK_PHASE_STAGE_20,      /* stage 20 plugins */
+    MK_PHASE_FILE,          /* file lookup */
+    MK_PHASE_STAGE_30,      /* stage 30 handler */
+    MK_PHASE_HEADERS,       /* response headers sent */
+    MK_PHASE_END,           /* response body sent */
+    MK_PHASE_MAX
+};
+
+/* Slowest plugin callback of a stage */
+struct mk_phase_plugin
+{
+    const char *name;
+    uint64_t ticks;
+};
+
+/* Timing of a request, kept in its session_request */
+struct mk_phases
+{
+    int on;
+    uint64_t stamp[MK_PHASE_MAX];
+    struct mk_phase_plugin stage_20;
+    struct mk_phase_plugin stage_30;
+};
+
+/* A slow request waiting to be written */
+struct mk_slowlog_record
+{
+    time_t time;
+    int status;
+    char method[16];
+    char ip[48];
+    const char *vhost;
+    char uri[MK_SLOWLOG_URI];
+    struct mk_phases phases;
+};
+
+/* Slow requests of a worker: it is the single producer, the clock thread
+ * the single consumer */
+struct mk_slowlog_ring
+{
+    unsigned int head __attribute__ ((aligned (64)));
+    unsigned int tail __attribute__ ((aligned (64)));
+    unsigned int dropped;
+    unsigned int sample;
+    struct mk_slowlog_record records[MK_SLOWLOG_RING];
+} __attribute__ ((aligned (64)));
+
+struct client_session;
+struct session_request;
+struct plugin;
+
+extern int mk_slowlog_on;
+
+void mk_slowlog_init();
+void mk_slowlog_begin(struct client_session *cs, struct session_request *sr);
+void mk_slowlog_end(struct client_session *cs, struct session_request *sr);
+void mk_slowlog_plugin(struct mk_phase_plugin *slowest, struct plugin *p,
+                       uint64_t start);
+void mk_slowlog_flush();
+
+/*
+ * Phase clock: the request clock of the stats counters. Converted to
+ * microseconds only when a slow request is written.
+ */
+static inline uint64_t mk_phase_now()
+{
+    return mk_stats_ticks();
+}
+
+/* Stamp the end of a phase if the request is being timed */
+#define MK_PHASE(sr, phase)                                  \
+    do {                                                     \
+        if (mk_unlikely((sr)->phases.on)) {                  \
+            (sr)->phases.stamp[phase] = mk_phase_now();      \
+        }                                                    \
+    } while (0)
+
+#endif
@@ -59,7 +59,7 @@ int mk_socket_connect(char *host, int port);
 int mk_socket_reset(int socket);
 int mk_socket_server(int port, char *listen_addr);
 
-int mk_socket_accept(int server_fd);
+int mk_socket_accept(int server_fd, struct sockaddr *addr, socklen_t *len);
 int mk_socket_sendv(int socket_fd, struct mk_iov *mk_io);
 int mk_socket_send(int socket_fd, const void *buf, size_t count);
 int mk_socket_read(int socket_fd, void *buf, int count);
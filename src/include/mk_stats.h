@@ -0,0 +1,120 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef MK_STATS_H
+#define MK_STATS_H
+
+struct session_request;
+
+/*
+ * Request latency histogram: log-linear buckets of microseconds, every
+ * power of two is split in MK_STATS_SUB buckets, so a bucket is at most
+ * 25% wide. The last bucket takes anything above ~17 minutes.
+ */
+#define MK_STATS_SUB_BITS    2
+#define MK_STATS_SUB         (1 << MK_STATS_SUB_BITS)
+#define MK_STATS_MAX_EXP     30
+#define MK_STATS_BUCKETS     ((MK_STATS_MAX_EXP - MK_STATS_SUB_BITS + 2) * \
+                              MK_STATS_SUB)
+
+/* Status codes counted one by one, others go to 'status_other' */
+#define MK_STATS_STATUS_MIN  100
+#define MK_STATS_STATUS_MAX  599
+
+/* Counters of a virtual host */
+struct mk_stats_vhost
+{
+    uint64_t requests;
+    uint64_t bytes;
+};
+
+/*
+ * Counters of a worker. Only its worker writes them, so they are bumped
+ * with plain stores; readers sum every worker and may see a value a few
+ * requests old. Each worker block starts on its own cache line.
+ */
+struct mk_stats
+{
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t status[MK_STATS_STATUS_MAX - MK_STATS_STATUS_MIN + 1];
+    uint64_t status_other;
+
+    /* Latency in microseconds */
+    uint64_t latency[MK_STATS_BUCKETS];
+    uint64_t latency_sum;
+    uint64_t latency_count;
+} __attribute__ ((aligned (64)));
+
+int mk_stats_init();
+void mk_stats_request(struct session_request *sr);
+int mk_stats_read(struct mk_stats *total, struct mk_stats_vhost *vhosts);
+uint64_t mk_stats_bucket_limit(int bucket);
+double mk_stats_ticks_us();
+
+/* Monotonic time in nanoseconds, the request clock is calibrated with it */
+static inline uint64_t mk_stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Request clock: the time stamp counter where there is one, which costs
+ * half a clock_gettime() call, nanoseconds elsewhere. Requests are timed
+ * with it, see mk_stats_ticks_us().
+ */
+static inline uint64_t mk_stats_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return mk_stats_now();
+#endif
+}
+
+static inline int mk_stats_bucket(uint64_t usec)
+{
+    int exp;
+
+    if (usec < MK_STATS_SUB) {
+        return usec;
+    }
+
+    exp = 63 - __builtin_clzll(usec);
+    if (exp > MK_STATS_MAX_EXP) {
+        return MK_STATS_BUCKETS - 1;
+    }
+
+    return ((exp - MK_STATS_SUB_BITS + 1) << MK_STATS_SUB_BITS) +
+        ((usec >> (exp - MK_STATS_SUB_BITS)) & (MK_STATS_SUB - 1));
+}
+
+#endif
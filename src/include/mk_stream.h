@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <sys/types.h>
+
+#include "mk_list.h"
+#include "mk_output.h"
+#include "mk_request.h"
+
+#ifndef MK_STREAM_H
+#define MK_STREAM_H
+
+/* Stream sources */
+#define MK_STREAM_BUF      0    /* range of a refcounted buffer    */
+#define MK_STREAM_FD       1    /* pipe or socket, read until EOF  */
+#define MK_STREAM_FUNC     2    /* generator callback              */
+
+/* Return values of a source and of the generator callbacks */
+#define MK_STREAM_ERROR   -1
+#define MK_STREAM_EOF      0    /* no more data                    */
+#define MK_STREAM_MORE     1    /* data produced, call again       */
+#define MK_STREAM_AGAIN    2    /* source would block              */
+#define MK_STREAM_FULL     3    /* socket would block              */
+
+/* Read size for descriptor sources */
+#define MK_STREAM_BLOCK    (64 * 1024)
+
+/* Max number of pieces produced for a connection on each write event */
+#define MK_STREAM_ROUNDS   16
+
+struct mk_stream;
+
+/*
+ * Filters sit between the source and the output queue, they get every
+ * piece of data produced and pass it (or a transformed version) to the
+ * next one with mk_stream_filter_next(). The 'end' callback is invoked
+ * once the source reached its end, to emit any trailer.
+ */
+struct mk_stream_filter
+{
+    int (*write) (struct mk_stream *, struct mk_stream_filter *,
+                  struct mk_output_buf *, size_t, size_t);
+    int (*end) (struct mk_stream *, struct mk_stream_filter *);
+    void (*free) (struct mk_stream_filter *);
+    void *data;
+
+    struct mk_list _head;
+};
+
+struct mk_stream
+{
+    int type;
+
+    /* MK_STREAM_BUF */
+    struct mk_output_buf *buf;
+    size_t offset;
+
+    /* MK_STREAM_FD */
+    int fd;
+    int fd_close;
+
+    /* bytes left on buffer sources */
+    size_t len;
+
+    /* MK_STREAM_FUNC */
+    int (*func) (struct mk_stream *, void *);
+    void *data;
+
+    struct client_session *cs;
+    struct session_request *sr;
+
+    struct mk_list filters;
+    struct mk_list _head;
+};
+
+struct mk_stream *mk_stream_buf(struct client_session *cs,
+                                struct session_request *sr,
+                                struct mk_output_buf *buf,
+                                size_t offset, size_t len);
+struct mk_stream *mk_stream_fd(struct client_session *cs,
+                               struct session_request *sr,
+                               int fd, int close_fd);
+struct mk_stream *mk_stream_func(struct client_session *cs,
+                                 struct session_request *sr,
+                                 int (*func) (struct mk_stream *, void *),
+                                 void *data);
+
+int mk_stream_filter_add(struct mk_stream *stream,
+                         struct mk_stream_filter *filter);
+int mk_stream_filter_next(struct mk_stream *stream,
+                          struct mk_stream_filter *filter,
+                          struct mk_output_buf *buf,
+                          size_t offset, size_t len);
+int mk_stream_filter_chunked(struct mk_stream *stream);
+
+int mk_stream_write(struct mk_stream *stream, struct mk_output_buf *buf,
+                    size_t offset, size_t len);
+int mk_stream_write_copy(struct mk_stream *stream, const void *data,
+                         size_t len);
+
+int mk_stream_run(struct client_session *cs, struct session_request *sr);
+void mk_stream_resume(struct client_session *cs);
+void mk_stream_free_all(struct session_request *sr);
+
+static inline int mk_stream_pending(struct session_request *sr)
+{
+    return (mk_list_is_empty(&sr->streams) != 0);
+}
+
+#endif
@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef MK_USDT_H
+#define MK_USDT_H
+
+/*
+ * User space static probes of the 'monkey' provider, built with
+ * './configure --enable-usdt'. A probe is a single nop in the binary
+ * plus the ELF note that tracers (bpftrace, perf, systemtap) use to find
+ * it; without the flag the macros below expand to nothing and their
+ * arguments are not evaluated. See examples/bpftrace.
+ *
+ * Probes and arguments:
+ *
+ *   conn__balance         (fd, worker, active connections of the worker)
+ *   conn__accept          (fd, worker, peer address string)
+ *   conn__close           (fd, worker)
+ *   conn__timeout         (fd, worker)
+ *   request__start        (fd, request)
+ *   request__parse__start (fd, request)
+ *   request__parse__end   (fd, request, result, uri, uri length)
+ *   request__end          (fd, request, status, body bytes)
+ *   stage__entry          (stage, plugin name, fd)
+ *   stage__exit           (stage, plugin name, fd, plugin return)
+ *   header__send          (fd, request, status, content length)
+ *   sendfile              (fd, request, bytes sent, bytes left)
+ *
+ * 'request' is the address of the session_request, it identifies a
+ * request from its start to its end. Strings are not NUL terminated
+ * when a length follows them.
+ */
+
+#ifdef MK_USDT
+
+#include <sys/sdt.h>
+
+#define MK_PROBE2(name, a, b)                                   \
+    DTRACE_PROBE2(monkey, name, a, b)
+#define MK_PROBE3(name, a, b, c)                                \
+    DTRACE_PROBE3(monkey, name, a, b, c)
+#define MK_PROBE4(name, a, b, c, d)                             \
+    DTRACE_PROBE4(monkey, name, a, b, c, d)
+#define MK_PROBE5(name, a, b, c, d, e)                          \
+    DTRACE_PROBE5(monkey, name, a, b, c, d, e)
+
+#else
+
+#define MK_PROBE2(name, a, b)               do {} while (0)
+#define MK_PROBE3(name, a, b, c)            do {} while (0)
+#define MK_PROBE4(name, a, b, c, d)         do {} while (0)
+#define MK_PROBE5(name, a, b, c, d, e)      do {} while (0)
+
+#endif
+
+#endif
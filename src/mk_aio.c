@@ -0,0 +1,447 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Asynchronous disk I/O
+ * ---------------------
+ * sendfile(2) blocks the calling thread when the file pages are not in
+ * the page cache, and a blocked worker stops serving every other client
+ * it owns. Before sending a new window of a file the worker probes the
+ * page cache with preadv2(RWF_NOWAIT); if the data is cold the request
+ * is handed to a small pool of I/O threads and the client socket is put
+ * to sleep. Once the window has been read from disk the I/O thread
+ * notifies the worker through an eventfd and the connection is woken
+ * up, so the following sendfile(2) is served from memory.
+ *
+ * The lstat(2) and open(2) of a path block the same way on a cold dentry
+ * or inode. The first time a worker sees a path, or when it has not seen
+ * it for a while, the lookup is done by an I/O thread and the connection
+ * is parked until the metadata is cached.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "monkey.h"
+#include "mk_aio.h"
+#include "mk_config.h"
+#include "mk_clock.h"
+#include "mk_epoll.h"
+#include "mk_file.h"
+#include "mk_memory.h"
+#include "mk_string.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+static int aio_threads = 0;
+static struct mk_list aio_queue;
+static pthread_mutex_t aio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+
+/* Hand a finished job back to the worker which owns the socket */
+static void mk_aio_job_done(struct mk_aio_job *job)
+{
+    uint64_t val = 1;
+    struct sched_list_node *sched = job->sched;
+
+    if (job->fd != -1) {
+        close(job->fd);
+        job->fd = -1;
+    }
+
+    pthread_mutex_lock(&sched->aio_mutex);
+    mk_list_add(&job->_head, &sched->aio_done);
+    pthread_mutex_unlock(&sched->aio_mutex);
+
+    if (write(sched->aio_fd, &val, sizeof(val)) != sizeof(val)) {
+        mk_warn("AIO: could not notify worker %i", sched->idx);
+    }
+}
+
+/* Pull the metadata of a path into the dentry and inode caches */
+static void mk_aio_path_lookup(struct mk_aio_job *job)
+{
+    int fd;
+    char index[MAX_PATH];
+    struct file_info finfo;
+
+    MK_TRACE("[FD %i] AIO lookup '%s'", job->socket, job->path);
+
+    if (mk_file_get_info(job->path, &finfo) != 0) {
+        return;
+    }
+
+    /* The worker looks for an index file next */
+    if (finfo.is_directory == MK_TRUE) {
+        mk_request_index(job->path, index, MAX_PATH);
+        return;
+    }
+
+    if (finfo.read_access == MK_TRUE && finfo.size > 0) {
+        fd = open(job->path, finfo.flags_read_only);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+}
+
+static void *mk_aio_thread(void *data)
+{
+    int idx = (long) data;
+    char *buf;
+    char *thread_name = 0;
+    unsigned long len;
+    ssize_t n;
+    size_t done;
+    struct mk_aio_job *job;
+
+    mk_string_build(&thread_name, &len, "monkey: aio/%i", idx);
+    mk_utils_worker_rename(thread_name);
+    mk_mem_free(thread_name);
+
+    /*
+     * readahead(2) only queues the I/O, reading the window into a scratch
+     * buffer is what guarantees the pages are up to date when the worker
+     * calls sendfile(2) again.
+     */
+    buf = mk_mem_malloc(MK_AIO_WINDOW);
+
+    while (1) {
+        pthread_mutex_lock(&aio_mutex);
+        while (mk_list_is_empty(&aio_queue) == 0) {
+            pthread_cond_wait(&aio_cond, &aio_mutex);
+        }
+        job = mk_list_entry_first(&aio_queue, struct mk_aio_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&aio_mutex);
+
+        if (job->path) {
+            mk_aio_path_lookup(job);
+            mk_aio_job_done(job);
+            continue;
+        }
+
+        MK_TRACE("[FD %i] AIO read window offset=%lu len=%lu",
+                 job->socket, job->offset, job->len);
+
+        readahead(job->fd, job->offset, job->len);
+        done = 0;
+        while (done < job->len) {
+            n = pread(job->fd, buf, job->len - done, job->offset + done);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            done += n;
+        }
+
+        mk_aio_job_done(job);
+    }
+
+    return NULL;
+}
+
+/* Launch the I/O threads, called once from the main process */
+int mk_aio_init(int threads)
+{
+    long i;
+
+    mk_list_init(&aio_queue);
+    if (threads <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < threads; i++) {
+        mk_utils_worker_spawn((void *) mk_aio_thread, (void *) i);
+    }
+    aio_threads = threads;
+
+    return 0;
+}
+
+/*
+ * Per worker setup: the eventfd used by the I/O threads to signal
+ * finished jobs is registered in the worker epoll queue.
+ */
+int mk_aio_worker_init(struct sched_list_node *sched)
+{
+    sched->aio_fd = -1;
+    sched->aio_seq = 0;
+    sched->aio_paths = NULL;
+    mk_list_init(&sched->aio_done);
+    pthread_mutex_init(&sched->aio_mutex, NULL);
+
+    if (aio_threads == 0) {
+        return 0;
+    }
+
+    sched->aio_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sched->aio_fd == -1) {
+        mk_warn("AIO: eventfd() failed, worker %i will block on disk I/O",
+                sched->idx);
+        return -1;
+    }
+
+    sched->aio_paths = mk_mem_malloc_z(sizeof(struct mk_aio_path) *
+                                       MK_AIO_PATHS);
+
+    return mk_epoll_add(sched->epoll_fd, sched->aio_fd,
+                        MK_EPOLL_READ, MK_EPOLL_LEVEL_TRIGGERED);
+}
+
+/* Wake up the connections whose jobs have finished */
+int mk_aio_worker_events(struct sched_list_node *sched)
+{
+    uint64_t val;
+    struct mk_list done;
+    struct mk_list *head, *tmp;
+    struct mk_aio_job *job;
+    struct mk_aio_path *slot;
+    struct client_session *cs;
+
+    if (read(sched->aio_fd, &val, sizeof(val)) != sizeof(val)) {
+        return 0;
+    }
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&sched->aio_mutex);
+    mk_list_foreach_safe(head, tmp, &sched->aio_done) {
+        mk_list_del(head);
+        mk_list_add(head, &done);
+    }
+    pthread_mutex_unlock(&sched->aio_mutex);
+
+    mk_list_foreach_safe(head, tmp, &done) {
+        job = mk_list_entry(head, struct mk_aio_job, _head);
+
+        /* The path is cached now, whoever asked for it */
+        if (job->path) {
+            slot = &sched->aio_paths[job->hash % MK_AIO_PATHS];
+            slot->hash = job->hash;
+            slot->seen = log_current_utime;
+            mk_mem_free(job->path);
+        }
+
+        /*
+         * The connection could have been closed while the job was in
+         * progress and its file descriptor reused by a new client, the
+         * token tells us if the session is still the one that parked.
+         */
+        cs = mk_session_get(job->socket);
+        if (cs && cs->aio_id == job->id) {
+            MK_TRACE("[FD %i] AIO window ready, wake up", job->socket);
+            cs->aio_id = 0;
+            mk_epoll_change_mode(sched->epoll_fd, job->socket,
+                                 MK_EPOLL_WAKEUP, MK_EPOLL_LEVEL_TRIGGERED);
+        }
+
+        mk_list_del(&job->_head);
+        mk_mem_free(job);
+    }
+
+    return 0;
+}
+
+/* Hint the kernel about the access pattern of a file about to be sent */
+void mk_aio_file_open(struct session_request *sr)
+{
+    if (sr->file_info.size < MK_AIO_MIN_SIZE) {
+        sr->aio_probe = MK_FALSE;
+        return;
+    }
+
+    posix_fadvise(sr->fd_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+    sr->aio_probe = (aio_threads > 0);
+}
+
+/* Put the socket to sleep and hand the job to the I/O threads */
+static int mk_aio_park(struct client_session *cs, struct mk_aio_job *job,
+                       struct sched_list_node *sched)
+{
+    job->socket = cs->socket;
+    job->sched = sched;
+
+    /* zero means 'nothing pending' in the session */
+    if (++sched->aio_seq == 0) {
+        sched->aio_seq++;
+    }
+    job->id = sched->aio_seq;
+    cs->aio_id = job->id;
+
+    mk_epoll_change_mode(sched->epoll_fd, cs->socket,
+                         MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
+
+    pthread_mutex_lock(&aio_mutex);
+    mk_list_add(&job->_head, &aio_queue);
+    pthread_cond_signal(&aio_cond);
+    pthread_mutex_unlock(&aio_mutex);
+
+    return MK_AIO_PARKED;
+}
+
+#ifdef HAVE_RWF_NOWAIT
+/* Returns 0 if the byte at 'offset' is in the page cache */
+static inline int mk_aio_probe(int fd, off_t offset)
+{
+    char c;
+    struct iovec iov;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+
+    if (preadv2(fd, &iov, 1, offset, RWF_NOWAIT) >= 0) {
+        return 0;
+    }
+    return -1;
+}
+#endif
+
+/*
+ * Check if the next window of the file can be sent without blocking. If
+ * it can't, the job is queued for the I/O threads and the socket is put
+ * to sleep until mk_aio_worker_events() wakes it up.
+ */
+int mk_aio_file_check(struct client_session *cs, struct session_request *sr)
+{
+#ifdef HAVE_RWF_NOWAIT
+    int fd;
+    off_t last;
+    size_t len;
+    struct mk_aio_job *job;
+    struct sched_list_node *sched;
+
+    if (sr->aio_probe == MK_FALSE || sr->bytes_offset < sr->aio_ahead) {
+        return MK_AIO_READY;
+    }
+
+    len = sr->bytes_to_send;
+    if (len > MK_AIO_WINDOW) {
+        len = MK_AIO_WINDOW;
+    }
+    last = sr->bytes_offset + len - 1;
+
+    /* Probe both ends of the window */
+    if (mk_aio_probe(sr->fd_file, sr->bytes_offset) == 0 &&
+        mk_aio_probe(sr->fd_file, last) == 0) {
+        sr->aio_ahead = last + 1;
+        return MK_AIO_READY;
+    }
+
+    /* File system without RWF_NOWAIT support, stop probing */
+    if (errno != EAGAIN) {
+        sr->aio_probe = MK_FALSE;
+        return MK_AIO_READY;
+    }
+
+    sched = mk_sched_get_thread_conf();
+    if (sched->aio_fd == -1) {
+        return MK_AIO_READY;
+    }
+
+    fd = dup(sr->fd_file);
+    if (fd == -1) {
+        return MK_AIO_READY;
+    }
+
+    job = mk_mem_malloc(sizeof(struct mk_aio_job));
+    job->fd = fd;
+    job->offset = sr->bytes_offset;
+    job->len = len;
+    job->path = NULL;
+    sr->aio_ahead = last + 1;
+
+    MK_TRACE("[FD %i] AIO cold window at %lu, parking", cs->socket,
+             sr->bytes_offset);
+
+    return mk_aio_park(cs, job, sched);
+#else
+    (void) cs;
+    (void) sr;
+    return MK_AIO_READY;
+#endif
+}
+
+/* FNV-1a */
+static inline uint32_t mk_aio_path_hash(const char *path, int len)
+{
+    int i;
+    uint32_t h = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Check if the request path was looked up lately. If it was not, an I/O
+ * thread does the lookup and the socket is put to sleep; once woken up,
+ * the request goes on from mk_http_init_file().
+ */
+int mk_aio_path_check(struct client_session *cs, struct session_request *sr)
+{
+    uint32_t hash;
+    struct mk_aio_job *job;
+    struct mk_aio_path *slot;
+    struct sched_list_node *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (!sched->aio_paths) {
+        return MK_AIO_READY;
+    }
+
+    hash = mk_aio_path_hash(sr->real_path.data, sr->real_path.len);
+    slot = &sched->aio_paths[hash % MK_AIO_PATHS];
+    if (slot->hash == hash &&
+        log_current_utime - slot->seen < MK_AIO_PATH_TTL) {
+        slot->seen = log_current_utime;
+        return MK_AIO_READY;
+    }
+
+    job = mk_mem_malloc(sizeof(struct mk_aio_job));
+    job->path = mk_string_dup(sr->real_path.data);
+    if (!job->path) {
+        mk_mem_free(job);
+        return MK_AIO_READY;
+    }
+    job->hash = hash;
+    job->fd = -1;
+    job->offset = 0;
+    job->len = 0;
+    sr->aio_parked = MK_TRUE;
+
+    MK_TRACE("[FD %i] AIO path not looked up lately, parking", cs->socket);
+
+    return mk_aio_park(cs, job, sched);
+}
@@ -31,24 +31,20 @@
 #include "mk_macros.h"
 #include "mk_utils.h"
 
-pthread_key_t mk_cache_iov_header;
+pthread_key_t mk_cache_header_buf;
 pthread_key_t mk_cache_header_lm;
-pthread_key_t mk_cache_header_cl;
 pthread_key_t mk_cache_header_ka;
-pthread_key_t mk_cache_header_ka_max;
 pthread_key_t mk_cache_utils_gmtime;
 pthread_key_t mk_cache_utils_gmt_text;
 
 /* This function is called when a thread is created */
 void mk_cache_thread_init()
 {
-    mk_pointer *cache_header_lm; 
-    mk_pointer *cache_header_cl;
+    mk_pointer *cache_header_lm;
     mk_pointer *cache_header_ka;
-    mk_pointer *cache_header_ka_max;
 
     struct tm *cache_utils_gmtime;
-    struct mk_iov *cache_iov_header;
+    struct mk_header_buf *cache_header_buf;
     struct mk_gmt_cache *cache_utils_gmt_text;
 
     /* Cache header request -> last modified */
@@ -57,12 +53,6 @@ void mk_cache_thread_init()
     cache_header_lm->len = -1;
     pthread_setspecific(mk_cache_header_lm, (void *) cache_header_lm);
 
-    /* Cache header request -> content length */
-    cache_header_cl = mk_mem_malloc_z(sizeof(mk_pointer));
-    cache_header_cl->data = mk_mem_malloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    cache_header_cl->len = -1;
-    pthread_setspecific(mk_cache_header_cl, (void *) cache_header_cl);
-
     /* Cache header response -> keep-alive */
     cache_header_ka = mk_mem_malloc_z(sizeof(mk_pointer));
     mk_string_build(&cache_header_ka->data, &cache_header_ka->len,
@@ -70,15 +60,12 @@ void mk_cache_thread_init()
                     config->keep_alive_timeout);
     pthread_setspecific(mk_cache_header_ka, (void *) cache_header_ka);
 
-    /* Cache header response -> max=%i */
-    cache_header_ka_max = mk_mem_malloc_z(sizeof(mk_pointer));
-    cache_header_ka_max->data = mk_mem_malloc_z(64);
-    cache_header_ka_max->len  = 0;
-    pthread_setspecific(mk_cache_header_ka_max, (void *) cache_header_ka_max);
-
-    /* Cache iov header struct */
-    cache_iov_header = mk_iov_create(32, 0);
-    pthread_setspecific(mk_cache_iov_header, (void *) cache_iov_header);
+    /* Cache buffer to compose the response headers */
+    cache_header_buf = mk_mem_malloc(sizeof(struct mk_header_buf));
+    cache_header_buf->data = mk_mem_malloc(MK_HEADER_BUF_SIZE);
+    cache_header_buf->size = MK_HEADER_BUF_SIZE;
+    cache_header_buf->len = 0;
+    pthread_setspecific(mk_cache_header_buf, (void *) cache_header_buf);
 
     /* Cache gmtime buffer */
     cache_utils_gmtime = mk_mem_malloc(sizeof(struct tm));
@@ -30,6 +30,7 @@
 #include "mk_memory.h"
 #include "mk_clock.h"
 #include "mk_utils.h"
+#include "mk_slowlog.h"
 
 time_t log_current_utime;
 time_t monkey_init_time;
@@ -95,6 +96,9 @@ void *mk_clock_worker_init(void *args UNUSED_PARAM)
             mk_clock_header_set_time(cur_time);
         }
 
+        /* Slow requests queued by the workers */
+        mk_slowlog_flush();
+
         sleep(1);
     }
 
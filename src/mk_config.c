@@ -43,6 +43,9 @@
 #include "mk_memory.h"
 #include "mk_server.h"
 #include "mk_plugin.h"
+#include "mk_header.h"
+#include "mk_route.h"
+#include "mk_slowlog.h"
 #include "mk_macros.h"
 
 struct server_config *config;
@@ -312,7 +315,12 @@ void mk_config_free_all()
         mk_string_split_free(config->index_files);
     }
 
+    if (config->rcache_key_headers) {
+        mk_string_split_free(config->rcache_key_headers);
+    }
+
     if (config->user) mk_mem_free(config->user);
+    if (config->slowlog) mk_mem_free(config->slowlog);
     if (config->transport_layer) mk_mem_free(config->transport_layer);
     if (config->server_software.len) mk_pointer_free(&config->server_software);
     mk_mem_free(config);
@@ -513,6 +521,67 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
         mk_config_print_error_msg("SymLink", tmp);
     }
 
+    /* Asynchronous disk I/O threads */
+    config->aio_threads = (size_t) mk_config_section_getval(section,
+                                                         "IOThreads",
+                                                         MK_CONFIG_VAL_NUM);
+    if (config->aio_threads < 0) {
+        mk_config_print_error_msg("IOThreads", tmp);
+    }
+
+    /* Response cache */
+    config->rcache_size = (size_t) mk_config_section_getval(section,
+                                                         "ResponseCache",
+                                                         MK_CONFIG_VAL_NUM);
+    if ((int) config->rcache_size < 0) {
+        mk_config_print_error_msg("ResponseCache", tmp);
+    }
+    else {
+        config->rcache_size *= 1024 * 1024;
+    }
+
+    config->rcache_ttl = (int) (long) mk_config_section_getval(section,
+                                                            "ResponseCacheTTL",
+                                                            MK_CONFIG_VAL_NUM);
+    if (config->rcache_ttl < 0) {
+        mk_config_print_error_msg("ResponseCacheTTL", tmp);
+    }
+
+    config->rcache_stale = (int) (long) mk_config_section_getval(section,
+                                                              "ResponseCacheStale",
+                                                              MK_CONFIG_VAL_NUM);
+    if (config->rcache_stale < 0) {
+        mk_config_print_error_msg("ResponseCacheStale", tmp);
+    }
+
+    config->rcache_key_headers = mk_config_section_getval(section,
+                                                          "ResponseCacheKey",
+                                                          MK_CONFIG_VAL_LIST);
+
+    /* Slow requests log */
+    config->slowlog = mk_config_section_getval(section, "SlowLog",
+                                               MK_CONFIG_VAL_STR);
+
+    config->slowlog_threshold = (size_t) mk_config_section_getval(section,
+                                                               "SlowLogThreshold",
+                                                               MK_CONFIG_VAL_NUM);
+    if (config->slowlog_threshold < 0) {
+        mk_config_print_error_msg("SlowLogThreshold", tmp);
+    }
+    else if (config->slowlog_threshold == 0) {
+        config->slowlog_threshold = MK_SLOWLOG_THRESHOLD;
+    }
+
+    config->slowlog_sample = (size_t) mk_config_section_getval(section,
+                                                            "SlowLogSample",
+                                                            MK_CONFIG_VAL_NUM);
+    if (config->slowlog_sample < 0) {
+        mk_config_print_error_msg("SlowLogSample", tmp);
+    }
+    else if (config->slowlog_sample == 0) {
+        config->slowlog_sample = 1;
+    }
+
     /* Transport Layer plugin */
     config->transport_layer = mk_config_section_getval(section,
                                                        "TransportLayer",
@@ -704,6 +773,9 @@ struct host *mk_config_get_host(char *path)
         }
     }
 
+    /* Handler routes */
+    host->routes = mk_route_create(cnf, path);
+
     /* Server Signature */
     if (config->hideversion == MK_FALSE) {
         mk_string_build(&host->host_signature, &len,
@@ -715,6 +787,7 @@ struct host *mk_config_get_host(char *path)
     mk_string_build(&host->header_host_signature.data,
                     &host->header_host_signature.len,
                     "Server: %s", host->host_signature);
+    mk_header_host_prefix_init(host);
 
     return host;
 }
@@ -766,6 +839,8 @@ void mk_config_set_init_values(void)
     config->open_flags = O_RDONLY | O_NONBLOCK;
     config->index_files = NULL;
     config->user_dir = NULL;
+    config->rcache_key_headers = NULL;
+    config->slowlog = NULL;
 
     /* Max request buffer size allowed
      * right now, every chunk size is 4KB (4096 bytes),
@@ -818,6 +893,7 @@ int mk_config_host_find(mk_pointer host, struct host **vhost, struct host_alias
 #ifdef SAFE_FREE
 void mk_config_host_free_all()
 {
+    int i;
     struct host *host;
     struct host_alias *host_alias;
     struct mk_list *head_host;
@@ -841,6 +917,14 @@ void mk_config_host_free_all()
         mk_pointer_free(&host->documentroot);
         mk_mem_free(host->host_signature);
         mk_pointer_free(&host->header_host_signature);
+        for (i = 0; i < MK_HEADER_STATUS_MAX - MK_HEADER_STATUS_MIN; i++) {
+            mk_mem_free(host->header_prefix[i].data);
+        }
+        mk_mem_free(host->header_prefix);
+
+        if (host->routes) {
+            mk_route_free(host->routes);
+        }
 
         /* Free source configuration */
         if (host->config) mk_config_free(host->config);
@@ -105,6 +105,23 @@ int mk_conn_write(int socket)
 
     MK_TRACE("[FD %i] Connection Handler / write", socket);
 
+    /*
+     * Pending output goes out first, nobody gets a chance to produce
+     * more data for this connection until its queue is empty.
+     */
+    cs = mk_session_get(socket);
+    if (cs && mk_output_pending(&cs->output) > 0) {
+        ret = mk_output_flush(socket, &cs->output);
+        if (ret < 0) {
+            mk_request_free_list(cs);
+            mk_session_remove(socket);
+            return -1;
+        }
+        else if (ret > 0) {
+            return 0;
+        }
+    }
+
     /* Plugin hook */
     ret = mk_plugin_event_write(socket);
     switch(ret) {
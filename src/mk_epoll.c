@@ -37,6 +37,8 @@
 #include "mk_config.h"
 #include "mk_scheduler.h"
 #include "mk_epoll.h"
+#include "mk_aio.h"
+#include "mk_rcache.h"
 #include "mk_utils.h"
 #include "mk_macros.h"
 
@@ -258,6 +260,18 @@ void *mk_epoll_init(int efd, mk_epoll_handlers * handler, int max_events)
         for (i = 0; i < num_fds; i++) {
             fd = events[i].data.fd;
 
+            /* Disk I/O jobs finished */
+            if (mk_unlikely(fd == sched->aio_fd)) {
+                mk_aio_worker_events(sched);
+                continue;
+            }
+
+            /* Response cache fills ended */
+            if (mk_unlikely(fd == sched->rcache_fd)) {
+                mk_rcache_worker_events(sched);
+                continue;
+            }
+
             if (events[i].events & EPOLLIN) {
                 MK_TRACE("[FD %i] EPoll Event READ", fd);
                 ret = (*handler->read) (fd);
@@ -36,6 +36,7 @@
 #include "mk_cache.h"
 #include "mk_http.h"
 #include "mk_string.h"
+#include "mk_usdt.h"
 #include "mk_macros.h"
 
 
@@ -51,25 +52,22 @@ const mk_pointer mk_header_content_encoding = mk_pointer_init(MK_HEADER_CONTENT_
 const mk_pointer mk_header_accept_ranges = mk_pointer_init(MK_HEADER_ACCEPT_RANGES);
 const mk_pointer mk_header_te_chunked = mk_pointer_init(MK_HEADER_TE_CHUNKED);
 const mk_pointer mk_header_last_modified = mk_pointer_init(MK_HEADER_LAST_MODIFIED);
+const mk_pointer mk_header_content_range = mk_pointer_init(MK_HEADER_CONTENT_RANGE);
 
-#define status_entry(num, str) {num, sizeof(str) - 1, str}
-
-static const struct header_status_response status_response[] = {
+/*
+ * Status lines indexed by status code, unknown codes have a NULL data
+ * pointer.
+ */
+#define status_entry(num, str) [num - MK_HEADER_STATUS_MIN] = mk_pointer_init(str)
 
-    /*
-     * The most used first:
-     *
-     *  - HTTP/1.1 200 OK
-     *  - HTTP/1.1 404 Not Found
-     */
-    status_entry(MK_HTTP_OK, MK_RH_HTTP_OK),
-    status_entry(MK_CLIENT_NOT_FOUND, MK_RH_CLIENT_NOT_FOUND),
+static const mk_pointer status_response[MK_HEADER_STATUS_MAX - MK_HEADER_STATUS_MIN] = {
 
     /* Informational */
     status_entry(MK_INFO_CONTINUE, MK_RH_INFO_CONTINUE),
     status_entry(MK_INFO_SWITCH_PROTOCOL, MK_RH_INFO_SWITCH_PROTOCOL),
 
     /* Successful */
+    status_entry(MK_HTTP_OK, MK_RH_HTTP_OK),
     status_entry(MK_HTTP_CREATED, MK_RH_HTTP_CREATED),
     status_entry(MK_HTTP_ACCEPTED, MK_RH_HTTP_ACCEPTED),
     status_entry(MK_HTTP_NON_AUTH_INFO, MK_RH_HTTP_NON_AUTH_INFO),
@@ -90,6 +88,7 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_CLIENT_UNAUTH, MK_RH_CLIENT_UNAUTH),
     status_entry(MK_CLIENT_PAYMENT_REQ, MK_RH_CLIENT_PAYMENT_REQ),
     status_entry(MK_CLIENT_FORBIDDEN, MK_RH_CLIENT_FORBIDDEN),
+    status_entry(MK_CLIENT_NOT_FOUND, MK_RH_CLIENT_NOT_FOUND),
     status_entry(MK_CLIENT_METHOD_NOT_ALLOWED, MK_RH_CLIENT_METHOD_NOT_ALLOWED),
     status_entry(MK_CLIENT_NOT_ACCEPTABLE, MK_RH_CLIENT_NOT_ACCEPTABLE),
     status_entry(MK_CLIENT_PROXY_AUTH, MK_RH_CLIENT_PROXY_AUTH),
@@ -115,71 +114,152 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_SERVER_HTTP_VERSION_UNSUP, MK_RH_SERVER_HTTP_VERSION_UNSUP)
 };
 
-static const int status_response_len =
-    (sizeof(status_response)/(sizeof(status_response[0])));
+static inline const mk_pointer *mk_header_status_get(int status)
+{
+    const mk_pointer *p;
+
+    if (mk_unlikely(status < MK_HEADER_STATUS_MIN ||
+                    status >= MK_HEADER_STATUS_MAX)) {
+        return NULL;
+    }
+
+    p = &status_response[status - MK_HEADER_STATUS_MIN];
+    if (mk_unlikely(!p->data)) {
+        return NULL;
+    }
+
+    return p;
+}
 
-static int mk_header_iov_add_entry(struct mk_iov *mk_io, mk_pointer data,
-                            mk_pointer sep, int free)
+/*
+ * Pre-render for every known status the beginning of the response
+ * headers of a virtual host: status line, Server row and the Date key.
+ * It must be invoked every time the host signature changes.
+ */
+void mk_header_host_prefix_init(struct host *host)
 {
-    return mk_iov_add_entry(mk_io, data.data, data.len, sep, free);
+    int i;
+    unsigned long len;
+    const mk_pointer *status;
+
+    if (host->header_prefix) {
+        for (i = 0; i < MK_HEADER_STATUS_MAX - MK_HEADER_STATUS_MIN; i++) {
+            mk_mem_free(host->header_prefix[i].data);
+        }
+        mk_mem_free(host->header_prefix);
+    }
+
+    host->header_prefix = mk_mem_malloc_z(sizeof(mk_pointer) *
+                                          (MK_HEADER_STATUS_MAX -
+                                           MK_HEADER_STATUS_MIN));
+
+    for (i = 0; i < MK_HEADER_STATUS_MAX - MK_HEADER_STATUS_MIN; i++) {
+        status = &status_response[i];
+        if (!status->data) {
+            continue;
+        }
+
+        len = 0;
+        mk_string_build(&host->header_prefix[i].data, &len,
+                        "%s%s%s%s",
+                        status->data,
+                        host->header_host_signature.data,
+                        mk_iov_crlf.data,
+                        mk_header_short_date.data);
+        host->header_prefix[i].len = len;
+    }
 }
 
-static struct mk_iov *mk_header_iov_get()
+/* Make sure the worker header buffer can hold 'len' more bytes */
+static int mk_header_buf_grow(struct mk_header_buf *hb, int len)
 {
-    return mk_cache_get(mk_cache_iov_header);
+    int size;
+    char *tmp;
+
+    size = hb->size;
+    while (hb->len + len > size) {
+        size += MK_HEADER_BUF_CHUNK;
+    }
+
+    tmp = mk_mem_realloc(hb->data, size);
+    if (!tmp) {
+        return -1;
+    }
+
+    hb->data = tmp;
+    hb->size = size;
+    return 0;
 }
 
-static void mk_header_iov_free(struct mk_iov *iov)
+static inline void mk_header_buf_add(struct mk_header_buf *hb,
+                                     const char *data, int len)
 {
-    mk_iov_free_marked(iov);
+    if (mk_unlikely(hb->len + len > hb->size)) {
+        if (mk_header_buf_grow(hb, len) != 0) {
+            return;
+        }
+    }
+
+    memcpy(hb->data + hb->len, data, len);
+    hb->len += len;
 }
 
-/* Send response headers */
-int mk_header_send(int fd, struct client_session *cs,
-                   struct session_request *sr)
+/* Append the decimal representation of a non-negative number */
+static inline void mk_header_buf_num(struct mk_header_buf *hb, long value)
 {
-    int i=0;
-    unsigned long len = 0;
-    char *buffer = 0;
-    mk_pointer response;
+    int i = 0;
+    char tmp[24];
+
+    if (value < 0) {
+        value = 0;
+    }
+
+    do {
+        tmp[sizeof(tmp) - ++i] = '0' + (value % 10);
+    } while (value /= 10);
+
+    mk_header_buf_add(hb, tmp + sizeof(tmp) - i, i);
+}
+
+#define mk_header_buf_add_p(hb, p) mk_header_buf_add(hb, (p).data, (p).len)
+
+/*
+ * Compose the response headers in the worker buffer, the rows added by
+ * plugins included. The buffer is valid until the next call.
+ */
+struct mk_header_buf *mk_header_build(struct client_session *cs,
+                                      struct session_request *sr)
+{
+    int i;
+    const mk_pointer *prefix;
     struct response_headers *sh;
-    struct mk_iov *iov;
+    struct mk_header_buf *hb;
+    struct mk_iov *extra;
 
     sh = &sr->headers;
+    hb = mk_cache_get(mk_cache_header_buf);
+    hb->len = 0;
 
-    iov = mk_header_iov_get();
-
-    /* HTTP Status Code */
+    /* HTTP Status Code, Server and Date */
     if (sh->status == MK_CUSTOM_STATUS) {
-        response.data = sh->custom_status.data;
-        response.len = sh->custom_status.len;
+        mk_header_buf_add_p(hb, sh->custom_status);
+        mk_header_buf_add_p(hb, sr->host_conf->header_host_signature);
+        mk_header_buf_add_p(hb, mk_iov_crlf);
+        mk_header_buf_add_p(hb, mk_header_short_date);
     }
     else {
-        for (i=0; i < status_response_len; i++) {
-            if (status_response[i].status == sh->status) {
-                response.data = status_response[i].response;
-                response.len  = status_response[i].length;
-                break;
-            }
+        prefix = NULL;
+        if (mk_header_status_get(sh->status)) {
+            prefix = &sr->host_conf->header_prefix[sh->status -
+                                                   MK_HEADER_STATUS_MIN];
         }
-    }
-
-    /* Invalid status set */
-    mk_bug(i == status_response_len);
-
-    mk_header_iov_add_entry(iov, response, mk_iov_none, MK_IOV_NOT_FREE_BUF);
 
-    /* Server details */
-    mk_iov_add_entry(iov, sr->host_conf->header_host_signature.data,
-                     sr->host_conf->header_host_signature.len,
-                     mk_iov_crlf, MK_IOV_NOT_FREE_BUF);
+        /* Invalid status set */
+        mk_bug(!prefix);
 
-    /* Date */
-    mk_iov_add_entry(iov,
-                     mk_header_short_date.data,
-                     mk_header_short_date.len,
-                     header_current_time,
-                     MK_IOV_NOT_FREE_BUF);
+        mk_header_buf_add_p(hb, *prefix);
+    }
+    mk_header_buf_add_p(hb, header_current_time);
 
     /* Last-Modified */
     if (sh->last_modified > 0) {
@@ -187,9 +267,8 @@ int mk_header_send(int fd, struct client_session *cs,
         lm = mk_cache_get(mk_cache_header_lm);
         lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
 
-        mk_iov_add_entry(iov, mk_header_last_modified.data,
-                         mk_header_last_modified.len,
-                         *lm, MK_IOV_NOT_FREE_BUF);
+        mk_header_buf_add_p(hb, mk_header_last_modified);
+        mk_header_buf_add_p(hb, *lm);
     }
 
     /* Connection */
@@ -198,51 +277,40 @@ int mk_header_send(int fd, struct client_session *cs,
             if (sr->connection.len > 0) {
                 /* Get cached mk_pointers */
                 mk_pointer *ka_format = mk_cache_get(mk_cache_header_ka);
-                mk_pointer *ka_header = mk_cache_get(mk_cache_header_ka_max);
-
-                /* Compose header and add entries to iov */
-                mk_string_itop(config->max_keep_alive_request - cs->counter_connections, ka_header);
-                mk_iov_add_entry(iov, ka_format->data, ka_format->len,
-                                 mk_iov_none, MK_IOV_NOT_FREE_BUF);
-                mk_iov_add_entry(iov, ka_header->data, ka_header->len,
-                                 mk_header_conn_ka, MK_IOV_NOT_FREE_BUF);
+
+                mk_header_buf_add_p(hb, *ka_format);
+                mk_header_buf_num(hb, config->max_keep_alive_request -
+                                  cs->counter_connections);
+                mk_header_buf_add_p(hb, mk_iov_crlf);
+                mk_header_buf_add_p(hb, mk_header_conn_ka);
             }
         }
         else {
-            mk_iov_add_entry(iov,
-                             mk_header_conn_close.data,
-                             mk_header_conn_close.len,
-                             mk_iov_none, MK_IOV_NOT_FREE_BUF);
+            mk_header_buf_add_p(hb, mk_header_conn_close);
         }
-
     }
 
     /* Location */
     if (sh->location != NULL) {
-        mk_iov_add_entry(iov,
-                         mk_header_short_location.data,
-                         mk_header_short_location.len,
-                         mk_iov_none, MK_IOV_NOT_FREE_BUF);
-
-        mk_iov_add_entry(iov,
-                         sh->location,
-                         strlen(sh->location), mk_iov_crlf, MK_IOV_FREE_BUF);
+        mk_header_buf_add_p(hb, mk_header_short_location);
+        mk_header_buf_add(hb, sh->location, strlen(sh->location));
+        mk_header_buf_add_p(hb, mk_iov_crlf);
+
+        /* the location is owned by the headers once they are sent */
+        mk_mem_free(sh->location);
+        sh->location = NULL;
     }
 
     /* allowed methods */
     if (sh->allow_methods.len > 0) {
-        mk_iov_add_entry(iov,
-                         mk_header_allow.data,
-                         mk_header_allow.len,
-                         sh->allow_methods, MK_IOV_NOT_FREE_BUF) ;
+        mk_header_buf_add_p(hb, mk_header_allow);
+        mk_header_buf_add_p(hb, sh->allow_methods);
     }
 
     /* Content type */
     if (sh->content_type.len > 0) {
-        mk_iov_add_entry(iov,
-                         mk_header_short_ct.data,
-                         mk_header_short_ct.len,
-                         sh->content_type, MK_IOV_NOT_FREE_BUF);
+        mk_header_buf_add_p(hb, mk_header_short_ct);
+        mk_header_buf_add_p(hb, sh->content_type);
     }
 
     /*
@@ -252,96 +320,97 @@ int mk_header_send(int fd, struct client_session *cs,
     if ((sh->status < MK_REDIR_MULTIPLE) || (sh->status > MK_REDIR_USE_PROXY)) {
         switch (sh->transfer_encoding) {
         case MK_HEADER_TE_TYPE_CHUNKED:
-            mk_iov_add_entry(iov,
-                             mk_header_te_chunked.data,
-                             mk_header_te_chunked.len,
-                             mk_iov_none, MK_IOV_NOT_FREE_BUF);
+            mk_header_buf_add_p(hb, mk_header_te_chunked);
             break;
         }
     }
 
     /* Content-Encoding */
     if (sh->content_encoding.len > 0) {
-        mk_iov_add_entry(iov, mk_header_content_encoding.data,
-                         mk_header_content_encoding.len,
-                         mk_iov_none, MK_IOV_NOT_FREE_BUF);
-        mk_iov_add_entry(iov, sh->content_encoding.data,
-                         sh->content_encoding.len,
-                         mk_iov_none, MK_IOV_NOT_FREE_BUF);
+        mk_header_buf_add_p(hb, mk_header_content_encoding);
+        mk_header_buf_add_p(hb, sh->content_encoding);
     }
 
     /* Content-Length */
     if (sh->content_length >= 0) {
-        /* Map content length to MK_POINTER */
-        mk_pointer *cl;
-        cl = mk_cache_get(mk_cache_header_cl);
-        mk_string_itop(sh->content_length, cl);
-
-        /* Set headers */
-        mk_iov_add_entry(iov, mk_header_content_length.data,
-                         mk_header_content_length.len,
-                         *cl, MK_IOV_NOT_FREE_BUF);
+        mk_header_buf_add_p(hb, mk_header_content_length);
+        mk_header_buf_num(hb, sh->content_length);
+        mk_header_buf_add_p(hb, mk_iov_crlf);
     }
 
     if ((sh->content_length != 0 && (sh->ranges[0] >= 0 || sh->ranges[1] >= 0)) &&
         config->resume == MK_TRUE) {
-        buffer = 0;
+        long first = -1, last = -1;
 
         /* yyy- */
         if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %d-%ld/%ld",
-                            RH_CONTENT_RANGE,
-                            sh->ranges[0],
-                            (sh->real_length - 1), sh->real_length);
-            mk_iov_add_entry(iov, buffer, len, mk_iov_crlf, MK_IOV_FREE_BUF);
+            first = sh->ranges[0];
+            last  = sh->real_length - 1;
         }
 
         /* yyy-xxx */
         if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %d-%d/%ld",
-                            RH_CONTENT_RANGE,
-                            sh->ranges[0], sh->ranges[1], sh->real_length);
-
-            mk_iov_add_entry(iov, buffer, len, mk_iov_crlf, MK_IOV_FREE_BUF);
+            first = sh->ranges[0];
+            last  = sh->ranges[1];
         }
 
         /* -xxx */
         if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %ld-%ld/%ld",
-                            RH_CONTENT_RANGE,
-                            (sh->real_length - sh->ranges[1]),
-                            (sh->real_length - 1), sh->real_length);
-            mk_iov_add_entry(iov, buffer, len, mk_iov_crlf, MK_IOV_FREE_BUF);
+            first = sh->real_length - sh->ranges[1];
+            last  = sh->real_length - 1;
+        }
+
+        if (first >= 0) {
+            mk_header_buf_add_p(hb, mk_header_content_range);
+            mk_header_buf_num(hb, first);
+            mk_header_buf_add(hb, "-", 1);
+            mk_header_buf_num(hb, last);
+            mk_header_buf_add(hb, "/", 1);
+            mk_header_buf_num(hb, sh->real_length);
+            mk_header_buf_add_p(hb, mk_iov_crlf);
         }
     }
 
-    mk_socket_set_cork_flag(fd, TCP_CORK_ON);
+    /* Rows added by plugins */
+    extra = sr->headers._extra_rows;
+    if (extra) {
+        for (i = 0; i < extra->iov_idx; i++) {
+            mk_header_buf_add(hb, extra->io[i].iov_base, extra->io[i].iov_len);
+        }
+        mk_iov_free(extra);
+        sr->headers._extra_rows = NULL;
+    }
 
     if (sh->cgi == SH_NOCGI || sh->breakline == MK_HEADER_BREAKLINE) {
-        if (!sr->headers._extra_rows) {
-            mk_iov_add_entry(iov, mk_iov_crlf.data, mk_iov_crlf.len,
-                             mk_iov_none, MK_IOV_NOT_FREE_BUF);
-        }
-        else {
-            mk_iov_add_entry(sr->headers._extra_rows, mk_iov_crlf.data,
-                             mk_iov_crlf.len, mk_iov_none, MK_IOV_NOT_FREE_BUF);
-        }
+        mk_header_buf_add_p(hb, mk_iov_crlf);
     }
 
-    mk_socket_sendv(fd, iov);
-    if (sr->headers._extra_rows) {
-        mk_socket_sendv(fd, sr->headers._extra_rows);
-        mk_iov_free(sr->headers._extra_rows);
-        sr->headers._extra_rows = NULL;
+    return hb;
+}
+
+/* Send response headers */
+int mk_header_send(int fd, struct client_session *cs,
+                   struct session_request *sr)
+{
+    struct response_headers *sh;
+    struct mk_header_buf *hb;
+
+    sh = &sr->headers;
+    MK_PROBE4(header__send, fd, sr, sh->status, sh->content_length);
+
+    hb = mk_header_build(cs, sr);
+
+    /*
+     * The whole header goes out in a single call, the socket stays
+     * corked so the first chunk of the body joins the same segment.
+     * What the socket does not take waits in the connection output,
+     * ahead of the body.
+     */
+    mk_socket_set_cork_flag(fd, TCP_CORK_ON);
+    if (mk_output_send(fd, &cs->output, hb->data, hb->len) != 0) {
+        return -1;
     }
 
-    mk_header_iov_free(iov);
     sh->sent = MK_TRUE;
 
     return 0;
@@ -43,7 +43,10 @@
 #include "mk_mimetype.h"
 #include "mk_header.h"
 #include "mk_epoll.h"
+#include "mk_aio.h"
 #include "mk_plugin.h"
+#include "mk_slowlog.h"
+#include "mk_usdt.h"
 #include "mk_macros.h"
 
 const mk_pointer mk_http_method_get_p = mk_pointer_init(HTTP_METHOD_GET_STR);
@@ -330,8 +333,6 @@ static int mk_http_directory_redirect_check(struct client_session *cs,
 int mk_http_init(struct client_session *cs, struct session_request *sr)
 {
     int ret;
-    int bytes = 0;
-    struct mimetype *mime;
 
     MK_TRACE("HTTP Protocol Init");
 
@@ -377,13 +378,34 @@ int mk_http_init(struct client_session *cs, struct session_request *sr)
         return mk_request_error(MK_CLIENT_FORBIDDEN, cs, sr);
     }
 
+    /* A path not looked up lately would block the worker in lstat(2) */
+    if (mk_aio_path_check(cs, sr) == MK_AIO_PARKED) {
+        return MK_PLUGIN_RET_CONTINUE;
+    }
+
+    return mk_http_init_file(cs, sr);
+}
 
-    if (mk_file_get_info(sr->real_path.data, &sr->file_info) != 0) {
+/*
+ * Serve the request once its real path is known, the I/O threads may
+ * have looked it up in the meantime.
+ */
+int mk_http_init_file(struct client_session *cs, struct session_request *sr)
+{
+    int ret;
+    int bytes = 0;
+    struct mimetype *mime;
+
+    ret = mk_file_get_info(sr->real_path.data, &sr->file_info);
+    MK_PHASE(sr, MK_PHASE_FILE);
+
+    if (ret != 0) {
         /* if the resource requested doesn't exists, let's
          * check if some plugin would like to handle it
          */
         MK_TRACE("No file, look for handler plugin");
         ret = mk_plugin_stage_run(MK_PLUGIN_STAGE_30, cs->socket, NULL, cs, sr);
+        MK_PHASE(sr, MK_PHASE_STAGE_30);
         if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
             if (sr->headers.status > 0) {
                 return mk_request_error(sr->headers.status, cs, sr);
@@ -462,6 +484,7 @@ int mk_http_init(struct client_session *cs, struct session_request *sr)
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
         ret  = mk_plugin_stage_run(MK_PLUGIN_STAGE_30, cs->socket, NULL, cs, sr);
+        MK_PHASE(sr, MK_PHASE_STAGE_30);
         MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
         switch (ret) {
         case MK_PLUGIN_RET_CONTINUE:
@@ -563,6 +586,7 @@ int mk_http_init(struct client_session *cs, struct session_request *sr)
             return mk_request_error(MK_CLIENT_FORBIDDEN, cs, sr);
         }
         sr->bytes_to_send = sr->file_info.size;
+        mk_aio_file_open(sr);
     }
 
     /* Process methods */
@@ -596,6 +620,7 @@ int mk_http_init(struct client_session *cs, struct session_request *sr)
 
     /* Send headers */
     mk_header_send(cs->socket, cs, sr);
+    MK_PHASE(sr, MK_PHASE_HEADERS);
 
     if (mk_unlikely(sr->headers.content_length == 0)) {
         return 0;
@@ -612,6 +637,23 @@ int mk_http_init(struct client_session *cs, struct session_request *sr)
 int mk_http_send_file(struct client_session *cs, struct session_request *sr)
 {
     long int nbytes = 0;
+    ssize_t pending;
+
+    /* The part of the headers the socket did not take goes first */
+    if (mk_unlikely(mk_output_pending(&cs->output) > 0)) {
+        pending = mk_output_flush(cs->socket, &cs->output);
+        if (pending < 0) {
+            return EXIT_ABORT;
+        }
+        else if (pending > 0) {
+            return sr->bytes_to_send;
+        }
+    }
+
+    /* If the data is not in the page cache, wait for the I/O threads */
+    if (mk_aio_file_check(cs, sr) == MK_AIO_PARKED) {
+        return sr->bytes_to_send;
+    }
 
     nbytes = mk_socket_send_file(cs->socket, sr->fd_file,
                                  &sr->bytes_offset, sr->bytes_to_send);
@@ -622,6 +664,7 @@ int mk_http_send_file(struct client_session *cs, struct session_request *sr)
             mk_socket_set_cork_flag(cs->socket, TCP_CORK_OFF);
         }
     }
+    MK_PROBE4(sendfile, cs->socket, sr, nbytes, sr->bytes_to_send);
 
     sr->loop++;
 
@@ -32,8 +32,11 @@
 #include <mk_plugin.h>
 #include <dlfcn.h>
 #include <mk_clock.h>
+#include <mk_slowlog.h>
 #include <mk_mimetype.h>
 #include <mk_server.h>
+#include <mk_aio.h>
+#include <mk_header.h>
 #include <stdarg.h>
 #include <limits.h>
 
@@ -59,6 +62,8 @@ static struct host *mklib_host_find(const char *name)
 static void mklib_run(void *p)
 {
     int remote_fd, ret;
+    union sched_addr addr;
+    socklen_t addr_len;
     const mklib_ctx ctx = p;
 
     mk_utils_worker_rename("libmonkey");
@@ -71,10 +76,11 @@ static void mklib_run(void *p)
             continue;
         }
 
-        remote_fd = mk_socket_accept(config->server_fd);
+        addr_len = sizeof(addr);
+        remote_fd = mk_socket_accept(config->server_fd, &addr.sa, &addr_len);
         if (remote_fd == -1) continue;
 
-        ret = mk_sched_add_client(remote_fd);
+        ret = mk_sched_add_client(remote_fd, &addr, addr_len);
         if (ret == -1) mk_socket_close(remote_fd);
     }
 }
@@ -194,6 +200,7 @@ mklib_ctx mklib_init(const char *address, const unsigned int port,
     mk_string_build(&host->header_host_signature.data,
                     &host->header_host_signature.len,
                     "Server: %s", host->host_signature);
+    mk_header_host_prefix_init(host);
 
     struct host_alias *alias = mk_mem_malloc_z(sizeof(struct host_alias));
     alias->name = strdup(config->listen_addr);
@@ -223,6 +230,9 @@ mklib_ctx mklib_init(const char *address, const unsigned int port,
     /* Server listening socket */
     config->server_fd = mk_socket_server(config->serverport, config->listen_addr);
 
+    /* Slow requests log */
+    mk_slowlog_init();
+
     /* Clock thread */
     mk_clock_sequential_init();
     a->clock = mk_utils_worker_spawn((void *) mk_clock_worker_init, NULL);
@@ -307,6 +317,7 @@ int mklib_config(mklib_ctx ctx, ...)
                 mk_string_build(&def->header_host_signature.data,
                                 &def->header_host_signature.len,
                                 "Server: %s", def->host_signature);
+                mk_header_host_prefix_init(def);
             break;
             case MKC_RESUME:
                 i = va_arg(va, int);
@@ -423,6 +434,7 @@ int mklib_vhost_config(mklib_ctx ctx, const char *name, ...)
     h->host_signature = strdup(defaulth->host_signature);
     h->header_host_signature.data = strdup(defaulth->header_host_signature.data);
     h->header_host_signature.len = defaulth->header_host_signature.len;
+    mk_header_host_prefix_init(h);
 
     mk_list_add(&h->_head, &config->hosts);
     config->nhosts++;
@@ -437,6 +449,8 @@ int mklib_start(mklib_ctx ctx)
     if (!ctx || ctx->lib_running) return MKLIB_FALSE;
 
     mk_plugin_core_process();
+    mk_aio_init(config->aio_threads);
+    mk_stats_init();
 
     ctx->workers = mk_mem_malloc_z(sizeof(pthread_t) * config->workers);
 
@@ -0,0 +1,407 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Output queue
+ * ------------
+ * Every connection owns a queue of pending output: ranges of refcounted
+ * memory buffers, ranges of files and the small frames used by the
+ * chunked transfer encoding. Producers append data without touching the
+ * socket, the core flushes the queue with writev(2) and sendfile(2) and
+ * whatever the kernel does not accept stays queued until the next write
+ * event, so a slow client never makes a worker wait.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "monkey.h"
+#include "mk_output.h"
+#include "mk_iov.h"
+#include "mk_socket.h"
+#include "mk_memory.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+void mk_output_init(struct mk_output *out)
+{
+    out->pending = 0;
+    mk_list_init(&out->entries);
+}
+
+struct mk_output_buf *mk_output_buf_create(char *data, size_t len,
+                                           void (*release) (void *),
+                                           void *priv)
+{
+    struct mk_output_buf *buf;
+
+    buf = mk_mem_malloc(sizeof(struct mk_output_buf));
+    if (!buf) {
+        return NULL;
+    }
+
+    buf->data = data;
+    buf->len = len;
+    buf->refs = 1;
+    buf->release = release;
+    buf->priv = priv;
+
+    return buf;
+}
+
+/*
+ * Buffers of the response cache are shared by every worker, the
+ * reference counter is updated with atomic operations.
+ */
+void mk_output_buf_get(struct mk_output_buf *buf)
+{
+    __sync_fetch_and_add(&buf->refs, 1);
+}
+
+void mk_output_buf_release(struct mk_output_buf *buf)
+{
+    if (__sync_sub_and_fetch(&buf->refs, 1) > 0) {
+        return;
+    }
+
+    if (buf->release) {
+        buf->release(buf->priv);
+    }
+    mk_mem_free(buf);
+}
+
+static struct mk_output_entry *mk_output_entry_new(struct mk_output *out,
+                                                   int type, size_t len)
+{
+    struct mk_output_entry *entry;
+
+    entry = mk_mem_malloc(sizeof(struct mk_output_entry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->type = type;
+    entry->len = len;
+    entry->buf = NULL;
+    entry->offset = 0;
+    entry->fd = -1;
+    entry->fd_close = MK_FALSE;
+    entry->fd_offset = 0;
+
+    mk_list_add(&entry->_head, &out->entries);
+    out->pending += len;
+
+    return entry;
+}
+
+static void mk_output_entry_free(struct mk_output_entry *entry)
+{
+    if (entry->type == MK_OUTPUT_BUF) {
+        mk_output_buf_release(entry->buf);
+    }
+    else if (entry->type == MK_OUTPUT_FILE && entry->fd_close == MK_TRUE) {
+        close(entry->fd);
+    }
+
+    mk_list_del(&entry->_head);
+    mk_mem_free(entry);
+}
+
+/* Queue a range of a buffer, the entry takes its own reference */
+int mk_output_add_buf(struct mk_output *out, struct mk_output_buf *buf,
+                      size_t offset, size_t len)
+{
+    struct mk_output_entry *entry;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    mk_bug(offset + len > buf->len);
+
+    entry = mk_output_entry_new(out, MK_OUTPUT_BUF, len);
+    if (!entry) {
+        return -1;
+    }
+
+    mk_output_buf_get(buf);
+    entry->buf = buf;
+    entry->offset = offset;
+
+    return 0;
+}
+
+/* Queue a private copy of 'data' */
+int mk_output_add_copy(struct mk_output *out, const void *data, size_t len)
+{
+    int ret;
+    char *copy;
+    struct mk_output_buf *buf;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    copy = mk_mem_malloc(len);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, data, len);
+
+    buf = mk_output_buf_create(copy, len, mk_mem_free, copy);
+    if (!buf) {
+        mk_mem_free(copy);
+        return -1;
+    }
+
+    ret = mk_output_add_buf(out, buf, 0, len);
+    mk_output_buf_release(buf);
+
+    return ret;
+}
+
+/*
+ * Queue a file range. If close_fd is set the queue owns the descriptor
+ * from this call on: it is closed once sent, or right away when there is
+ * nothing to send or the entry can not be allocated.
+ */
+int mk_output_add_file(struct mk_output *out, int fd, off_t offset,
+                       size_t len, int close_fd)
+{
+    struct mk_output_entry *entry;
+
+    /* Nothing to send, the descriptor is done with already */
+    if (len == 0) {
+        if (close_fd == MK_TRUE) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    entry = mk_output_entry_new(out, MK_OUTPUT_FILE, len);
+    if (!entry) {
+        if (close_fd == MK_TRUE) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    entry->fd = fd;
+    entry->fd_offset = offset;
+    entry->fd_close = close_fd;
+
+    return 0;
+}
+
+/*
+ * Send 'data' right away when nothing is queued ahead of it and queue a
+ * copy of whatever the socket does not take, so the caller never has to
+ * track a short write. Returns 0, or -1 on error.
+ */
+int mk_output_send(int socket, struct mk_output *out,
+                   const void *data, size_t len)
+{
+    ssize_t bytes = 0;
+
+    if (out->pending == 0) {
+        bytes = mk_socket_send(socket, data, len);
+        if (bytes < 0) {
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            bytes = 0;
+        }
+        if ((size_t) bytes == len) {
+            return 0;
+        }
+    }
+
+    return mk_output_add_copy(out, (const char *) data + bytes, len - bytes);
+}
+
+static int mk_output_add_frame(struct mk_output *out, const char *data,
+                               size_t len)
+{
+    struct mk_output_entry *entry;
+
+    mk_bug(len > MK_OUTPUT_FRAME_SIZE);
+
+    entry = mk_output_entry_new(out, MK_OUTPUT_FRAME, len);
+    if (!entry) {
+        return -1;
+    }
+    memcpy(entry->frame, data, len);
+
+    return 0;
+}
+
+/*
+ * Queue a buffer range as one chunk of a chunked encoded body, a zero
+ * length queues the last chunk.
+ */
+int mk_output_add_chunk(struct mk_output *out, struct mk_output_buf *buf,
+                        size_t offset, size_t len)
+{
+    int n;
+    char frame[MK_OUTPUT_FRAME_SIZE];
+
+    if (len == 0) {
+        return mk_output_add_frame(out, "0\r\n\r\n", 5);
+    }
+
+    n = snprintf(frame, sizeof(frame), "%lx\r\n", (unsigned long) len);
+    if (mk_output_add_frame(out, frame, n) != 0 ||
+        mk_output_add_buf(out, buf, offset, len) != 0 ||
+        mk_output_add_frame(out, "\r\n", 2) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drop 'bytes' already written from the head of the queue */
+static void mk_output_consume(struct mk_output *out, size_t bytes)
+{
+    size_t n;
+    struct mk_list *head, *tmp;
+    struct mk_output_entry *entry;
+
+    out->pending -= bytes;
+
+    mk_list_foreach_safe(head, tmp, &out->entries) {
+        if (bytes == 0) {
+            break;
+        }
+
+        entry = mk_list_entry(head, struct mk_output_entry, _head);
+        n = (bytes < entry->len) ? bytes : entry->len;
+
+        /* sendfile(2) already moved the file offset */
+        if (entry->type != MK_OUTPUT_FILE) {
+            entry->offset += n;
+        }
+        entry->len -= n;
+        bytes -= n;
+
+        if (entry->len == 0) {
+            mk_output_entry_free(entry);
+        }
+    }
+}
+
+/*
+ * Write as much of the queue as the socket accepts. Returns the number
+ * of bytes still pending, zero once the queue is empty or -1 on error.
+ */
+ssize_t mk_output_flush(int socket, struct mk_output *out)
+{
+    ssize_t bytes;
+    size_t want;
+    struct mk_iov iov;
+    struct iovec io[MK_OUTPUT_IOV];
+    struct mk_list *head;
+    struct mk_output_entry *entry;
+
+    iov.io = io;
+    iov.buf_to_free = NULL;
+    iov.buf_idx = 0;
+    iov.size = MK_OUTPUT_IOV;
+
+    while (out->pending > 0) {
+        entry = mk_list_entry_first(&out->entries, struct mk_output_entry,
+                                    _head);
+
+        if (entry->type == MK_OUTPUT_FILE) {
+            want = entry->len;
+            bytes = mk_socket_send_file(socket, entry->fd, &entry->fd_offset,
+                                        entry->len);
+            if (bytes == 0) {
+                /* the file was truncated under us */
+                return -1;
+            }
+        }
+        else {
+            /* Gather the memory entries up to the next file */
+            iov.iov_idx = 0;
+            iov.total_len = 0;
+            mk_list_foreach(head, &out->entries) {
+                entry = mk_list_entry(head, struct mk_output_entry, _head);
+                if (entry->type == MK_OUTPUT_FILE || iov.iov_idx == iov.size) {
+                    break;
+                }
+
+                if (entry->type == MK_OUTPUT_BUF) {
+                    io[iov.iov_idx].iov_base = entry->buf->data + entry->offset;
+                }
+                else {
+                    io[iov.iov_idx].iov_base = entry->frame + entry->offset;
+                }
+                io[iov.iov_idx].iov_len = entry->len;
+                iov.iov_idx++;
+                iov.total_len += entry->len;
+            }
+
+            want = iov.total_len;
+            bytes = mk_socket_sendv(socket, &iov);
+        }
+
+        if (bytes < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            MK_TRACE("[FD %i] output flush error", socket);
+            return -1;
+        }
+
+        MK_TRACE("[FD %i] output flush %li/%lu bytes", socket, bytes,
+                 out->pending);
+        mk_output_consume(out, bytes);
+
+        /* Queue drained, let the tail of the response go out */
+        if (out->pending == 0) {
+            mk_socket_set_cork_flag(socket, TCP_CORK_OFF);
+            break;
+        }
+
+        /* the socket buffer is full, wait for the next write event */
+        if ((size_t) bytes < want) {
+            break;
+        }
+    }
+
+    return out->pending;
+}
+
+/* Release every entry still queued, used when the connection goes away */
+void mk_output_free(struct mk_output *out)
+{
+    struct mk_list *head, *tmp;
+    struct mk_output_entry *entry;
+
+    mk_list_foreach_safe(head, tmp, &out->entries) {
+        entry = mk_list_entry(head, struct mk_output_entry, _head);
+        mk_output_entry_free(entry);
+    }
+    out->pending = 0;
+}
@@ -34,6 +34,9 @@
 #include "mk_http.h"
 #include "mk_clock.h"
 #include "mk_plugin.h"
+#include "mk_route.h"
+#include "mk_slowlog.h"
+#include "mk_usdt.h"
 #include "mk_macros.h"
 #include "mk_mimetype.h"
 
@@ -47,12 +50,66 @@ static struct plugin_stagemap *plg_stagemap;
 struct plugin_network_io *plg_netiomap;
 struct plugin_api *api;
 
-static int mk_plugin_event_set_list(struct mk_list *list)
+/* Number of data slots handed out to plugins */
+static int plugin_slots = 0;
+
+/*
+ * Plugins defining global event hooks, NULL terminated. They are rebuilt
+ * every time the plugins list changes so the event handlers do not need
+ * to walk the whole list looking for hooks.
+ */
+static struct plugin **plg_event_read;
+static struct plugin **plg_event_write;
+static struct plugin **plg_event_error;
+static struct plugin **plg_event_close;
+static struct plugin **plg_event_timeout;
+
+static void mk_plugin_event_hooks_build()
 {
-    return pthread_setspecific(mk_plugin_event_k, (void *) list);
+    int n = 0;
+    int r = 0, w = 0, e = 0, c = 0, t = 0;
+    size_t size;
+    struct plugin *p;
+    struct mk_list *head;
+
+    mk_list_foreach(head, config->plugins) {
+        n++;
+    }
+    size = sizeof(struct plugin *) * (n + 1);
+
+    mk_mem_free(plg_event_read);
+    mk_mem_free(plg_event_write);
+    mk_mem_free(plg_event_error);
+    mk_mem_free(plg_event_close);
+    mk_mem_free(plg_event_timeout);
+
+    plg_event_read = mk_mem_malloc_z(size);
+    plg_event_write = mk_mem_malloc_z(size);
+    plg_event_error = mk_mem_malloc_z(size);
+    plg_event_close = mk_mem_malloc_z(size);
+    plg_event_timeout = mk_mem_malloc_z(size);
+
+    mk_list_foreach(head, config->plugins) {
+        p = mk_list_entry(head, struct plugin, _head);
+        if (p->event_read) {
+            plg_event_read[r++] = p;
+        }
+        if (p->event_write) {
+            plg_event_write[w++] = p;
+        }
+        if (p->event_error) {
+            plg_event_error[e++] = p;
+        }
+        if (p->event_close) {
+            plg_event_close[c++] = p;
+        }
+        if (p->event_timeout) {
+            plg_event_timeout[t++] = p;
+        }
+    }
 }
 
-static struct mk_list *mk_plugin_event_get_list()
+static inline struct plugin_event_table *mk_plugin_event_get_table()
 {
     return pthread_getspecific(mk_plugin_event_k);
 }
@@ -146,6 +203,8 @@ struct plugin *mk_plugin_alloc(void *handler, const char *path)
     p->name = (char *) (*info).name;
     p->version = (char *) (*info).version;
     p->hooks = (unsigned int) (*info).hooks;
+    p->slot = -1;
+    info->plugin = p;
 
     p->path = mk_string_dup(path);
     p->handler = handler;
@@ -283,17 +342,28 @@ create socket : %p\nbind : %p\nserver : %p",
         }
     }
 
+    /* Assign the data slot */
+    if (plugin_slots < MK_PLUGIN_SLOTS) {
+        p->slot = plugin_slots++;
+    }
+    else {
+        mk_warn("Plugin '%s' has no data slot available", p->shortname);
+        p->slot = -1;
+    }
+
     /* Add Plugin to the end of the list */
     mk_list_add(&p->_head, config->plugins);
 
     /* Register plugins stages */
     mk_plugin_register_stagemap(p);
+    mk_plugin_event_hooks_build();
     return p;
 }
 
 void mk_plugin_unregister(struct plugin *p)
 {
     mk_list_del(&p->_head);
+    mk_plugin_event_hooks_build();
     mk_plugin_free(p);
 }
 
@@ -394,6 +464,47 @@ void mk_plugin_init()
     api->socket_send_file = mk_socket_send_file;
     api->socket_ip_str = mk_socket_ip_str;
 
+    /* Output queue */
+    api->output_buf_create = mk_output_buf_create;
+    api->output_buf_get = mk_output_buf_get;
+    api->output_buf_release = mk_output_buf_release;
+    api->output_add_buf = mk_output_add_buf;
+    api->output_add_copy = mk_output_add_copy;
+    api->output_add_file = mk_output_add_file;
+    api->output_add_chunk = mk_output_add_chunk;
+    api->output_flush = mk_output_flush;
+    api->output_full = mk_plugin_output_full;
+
+    /* Streams */
+    api->stream_buf = mk_stream_buf;
+    api->stream_fd = mk_stream_fd;
+    api->stream_func = mk_stream_func;
+    api->stream_filter_add = mk_stream_filter_add;
+    api->stream_filter_next = mk_stream_filter_next;
+    api->stream_filter_chunked = mk_stream_filter_chunked;
+    api->stream_write = mk_stream_write;
+    api->stream_write_copy = mk_stream_write_copy;
+    api->stream_resume = mk_stream_resume;
+
+    /* Plugins data slots */
+    api->request_data_set = mk_plugin_request_data_set;
+    api->request_data_get = mk_plugin_request_data_get;
+    api->session_data_set = mk_plugin_session_data_set;
+    api->session_data_get = mk_plugin_session_data_get;
+    api->session_get = mk_session_get;
+
+    /* Response cache */
+    api->rcache_lookup = mk_rcache_lookup;
+    api->rcache_store_headers = mk_rcache_store_headers;
+    api->rcache_store_body = mk_rcache_store_body;
+    api->rcache_store_end = mk_rcache_store_end;
+    api->rcache_abort = mk_rcache_abort;
+    api->rcache_counters = mk_rcache_counters;
+
+    /* Server statistics */
+    api->stats_read = mk_stats_read;
+    api->stats_bucket_limit = mk_stats_bucket_limit;
+
     /* Config Callbacks */
     api->config_create = mk_config_create;
     api->config_free = mk_config_free;
@@ -404,6 +515,7 @@ void mk_plugin_init()
     api->sched_get_connection = mk_sched_get_connection;
     api->sched_remove_client  = mk_plugin_sched_remove_client;
     api->sched_worker_info    = mk_sched_worker_info;
+    api->sched_conn_get       = mk_sched_conn_get;
 
     api->event_add = mk_plugin_event_add;
     api->event_del = mk_plugin_event_del;
@@ -425,6 +537,9 @@ void mk_plugin_init()
 
     api->stacktrace = (void *) mk_utils_stacktrace;
     api->plugins = config->plugins;
+
+    /* No plugins registered yet, start with empty event hooks */
+    mk_plugin_event_hooks_build();
 }
 
 #ifndef SHAREDLIB
@@ -543,12 +658,57 @@ void mk_plugin_exit_all()
     mk_mem_free(api);
 }
 
+/* Call the stage 30 handler of a plugin, it decides who takes the request */
+static int mk_plugin_stage_30_call(struct plugin *p, int socket,
+                                   struct client_session *cs,
+                                   struct session_request *sr)
+{
+    int ret;
+    uint64_t start = 0;
+
+    /* only used by the probes */
+    (void) socket;
+
+    MK_TRACE("[%s] STAGE 30", p->shortname);
+    if (mk_unlikely(sr->phases.on)) {
+        start = mk_phase_now();
+    }
+    MK_PROBE3(stage__entry, 30, p->shortname, socket);
+    ret = p->stage.s30(p, cs, sr);
+    MK_PROBE4(stage__exit, 30, p->shortname, socket, ret);
+    if (mk_unlikely(sr->phases.on)) {
+        mk_slowlog_plugin(&sr->phases.stage_30, p, start);
+    }
+
+    switch (ret) {
+        case MK_PLUGIN_RET_NOT_ME:
+        case MK_PLUGIN_RET_CLOSE_CONX:
+        case MK_PLUGIN_RET_CONTINUE:
+            break;
+        case MK_PLUGIN_RET_END:
+            /*
+             * A plugin cannot say that have finish it works if the response
+             * headers have not been send. If the intention is to close the
+             * connection use MK_PLUGIN_RET_CLOSE_CONX.
+             */
+            mk_bug(sr->headers.sent == MK_FALSE);
+            break;
+        default:
+            mk_err("Plugin '%s' returns invalid value %i",
+                   p->shortname, ret);
+            exit(EXIT_FAILURE);
+    }
+
+    return ret;
+}
+
 int mk_plugin_stage_run(unsigned int hook,
                         unsigned int socket,
                         struct sched_connection *conx,
                         struct client_session *cs, struct session_request *sr)
 {
     int ret;
+    uint64_t start = 0;
     struct plugin_stagem *stm;
 
 #ifdef SHAREDLIB
@@ -558,8 +718,13 @@ int mk_plugin_stage_run(unsigned int hook,
     unsigned long len;
 
     if (hook & MK_PLUGIN_STAGE_10 && ctx->ipf) {
-        mk_socket_ip_str(socket, &ptr, bufsize, &len);
-        ret = ctx->ipf(buf);
+        if (conx && conx->ip_str_len > 0) {
+            ret = ctx->ipf(conx->ip_str);
+        }
+        else {
+            mk_socket_ip_str(socket, &ptr, bufsize, &len);
+            ret = ctx->ipf(buf);
+        }
         if (ret == MKLIB_FALSE) return MK_PLUGIN_RET_CLOSE_CONX;
     }
 
@@ -580,7 +745,9 @@ int mk_plugin_stage_run(unsigned int hook,
         stm = plg_stagemap->stage_10;
         while (stm) {
             MK_TRACE("[%s] STAGE 10", stm->p->shortname);
+            MK_PROBE3(stage__entry, 10, stm->p->shortname, socket);
             ret = stm->p->stage.s10(socket, conx);
+            MK_PROBE4(stage__exit, 10, stm->p->shortname, socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_CLOSE_CONX:
                 MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
@@ -597,7 +764,15 @@ int mk_plugin_stage_run(unsigned int hook,
         while (stm) {
             MK_TRACE("[%s] STAGE 20", stm->p->shortname);
 
+            if (mk_unlikely(sr->phases.on)) {
+                start = mk_phase_now();
+            }
+            MK_PROBE3(stage__entry, 20, stm->p->shortname, socket);
             ret = stm->p->stage.s20(cs, sr);
+            MK_PROBE4(stage__exit, 20, stm->p->shortname, socket, ret);
+            if (mk_unlikely(sr->phases.on)) {
+                mk_slowlog_plugin(&sr->phases.stage_20, stm->p, start);
+            }
             switch (ret) {
             case MK_PLUGIN_RET_CLOSE_CONX:
                 MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
@@ -614,34 +789,47 @@ int mk_plugin_stage_run(unsigned int hook,
      * request, it decides what to do with the request
      */
     if (hook & MK_PLUGIN_STAGE_30) {
-        /* The request just arrived and is required to check who can
-         * handle it */
-        stm = plg_stagemap->stage_30;
-        while (stm) {
-            /* Call stage */
-            MK_TRACE("[%s] STAGE 30", stm->p->shortname);
-            ret = stm->p->stage.s30(stm->p, cs, sr);
+        int i;
+        struct mk_route_handler *handler = NULL;
+        struct mk_route_table *routes = sr->host_conf->routes;
+
+        if (routes) {
+            /*
+             * The virtual host routes pick the handler for this URI, it
+             * runs at its place among the plugins without routes.
+             */
+            handler = mk_route_lookup(routes, sr->uri_processed.data,
+                                      sr->uri_processed.len);
+            sr->route = (handler) ? handler->p : NULL;
+
+            for (i = 0; i <= routes->n_stage_30; i++) {
+                if (handler && handler->at == i) {
+                    ret = mk_plugin_stage_30_call(handler->p, socket, cs, sr);
+                    if (ret != MK_PLUGIN_RET_NOT_ME) {
+                        return ret;
+                    }
+                }
 
-            switch (ret) {
-                case MK_PLUGIN_RET_NOT_ME:
-                    break;
-                case MK_PLUGIN_RET_END:
-                    /*
-                     * A plugin cannot say that have finish it works if the response
-                     * headers have not been send. If the intention is to close the
-                     * connection use MK_PLUGIN_RET_CLOSE_CONX.
-                     */
-                    mk_bug(sr->headers.sent == MK_FALSE);
-                    return ret;
-                case MK_PLUGIN_RET_CLOSE_CONX:
-                case MK_PLUGIN_RET_CONTINUE:
+                if (i < routes->n_stage_30) {
+                    ret = mk_plugin_stage_30_call(routes->stage_30[i],
+                                                  socket, cs, sr);
+                    if (ret != MK_PLUGIN_RET_NOT_ME) {
+                        return ret;
+                    }
+                }
+            }
+        }
+        else {
+            /* The request just arrived and is required to check who can
+             * handle it */
+            stm = plg_stagemap->stage_30;
+            while (stm) {
+                ret = mk_plugin_stage_30_call(stm->p, socket, cs, sr);
+                if (ret != MK_PLUGIN_RET_NOT_ME) {
                     return ret;
-                default:
-                    mk_err("Plugin '%s' returns invalid value %i",
-                           stm->p->shortname, ret);
-                    exit(EXIT_FAILURE);
+                }
+                stm = stm->next;
             }
-            stm = stm->next;
         }
     }
 
@@ -651,7 +839,9 @@ int mk_plugin_stage_run(unsigned int hook,
         while (stm) {
             MK_TRACE("[%s] STAGE 40", stm->p->shortname);
 
+            MK_PROBE3(stage__entry, 40, stm->p->shortname, socket);
             stm->p->stage.s40(cs, sr);
+            MK_PROBE4(stage__exit, 40, stm->p->shortname, socket, 0);
             stm = stm->next;
         }
     }
@@ -662,7 +852,9 @@ int mk_plugin_stage_run(unsigned int hook,
         while (stm) {
             MK_TRACE("[%s] STAGE 50", stm->p->shortname);
 
+            MK_PROBE3(stage__entry, 50, stm->p->shortname, socket);
             ret = stm->p->stage.s50(socket);
+            MK_PROBE4(stage__exit, 50, stm->p->shortname, socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_NOT_ME:
                 break;
@@ -715,25 +907,28 @@ int mk_plugin_stage_run(unsigned int hook,
         if (len) api->header_add(sr, header, len);
         api->header_send(socket, cs, sr);
 
-        /* Data */
-        while (clen > 0) {
-            int remaining = api->socket_send(socket, content, clen);
-            if (remaining < 0) {
-                /*
-                 * FIXME: This is a temporal fix to send out the data,
-                 * this is working in blocking mode. This will be fixed
-                 * shortly once the 'pending buffers' interface is
-                 * implemented.
-                 */
-                if (errno == EAGAIN) {
-                    continue;
-                }
+        /*
+         * Data: the content belongs to the application until closef()
+         * is invoked in stage 40, and that only happens once the output
+         * queue has been flushed, so it is queued without a copy.
+         */
+        if (clen > 0) {
+            int queued;
+            struct mk_output_buf *obuf;
+
+            obuf = mk_output_buf_create((char *) content, clen, NULL, NULL);
+            if (!obuf) {
+                return -1;
+            }
+            queued = mk_output_add_buf(&cs->output, obuf, 0, clen);
+            mk_output_buf_release(obuf);
+            if (queued != 0) {
                 return -1;
             }
-            clen -= remaining;
-            content += remaining;
         }
-        mk_socket_set_cork_flag(socket, TCP_CORK_OFF);
+        else {
+            mk_socket_set_cork_flag(socket, TCP_CORK_OFF);
+        }
 
         if (ret == MKLIB_TRUE) return MK_PLUGIN_RET_END;
     }
@@ -814,8 +1009,8 @@ void mk_plugin_preworker_calls()
 
 int mk_plugin_event_del(int socket)
 {
-    struct mk_list *head, *list, *temp;
-    struct plugin_event *node;
+    struct plugin_event_table *table;
+    struct sched_list_node *sched;
 
     MK_TRACE("[FD %i] Plugin delete event", socket);
 
@@ -823,45 +1018,59 @@ int mk_plugin_event_del(int socket)
         return -1;
     }
 
-    list = mk_plugin_event_get_list();
-    mk_list_foreach_safe(head, temp, list) {
-        node = mk_list_entry(head, struct plugin_event, _head);
-        if (node->socket == socket) {
-            mk_list_del(head);
-            mk_mem_free(node);
-            mk_plugin_event_set_list(list);
-
-            struct sched_list_node *sched = mk_sched_get_thread_conf();
-            mk_epoll_del(sched->epoll_fd, socket);
-            return 0;
-        }
+    table = mk_plugin_event_get_table();
+    if (!table || socket >= table->size || !table->handlers[socket]) {
+        MK_TRACE("[FD %i] not found, could not delete event node :/", socket);
+        return -1;
     }
 
-    MK_TRACE("[FD %i] not found, could not delete event node :/");
-    return -1;
+    table->handlers[socket] = NULL;
+
+    sched = mk_sched_get_thread_conf();
+    mk_epoll_del(sched->epoll_fd, socket);
+    return 0;
 }
 
 int mk_plugin_event_add(int socket, int mode,
                         struct plugin *handler,
                         unsigned int behavior)
 {
+    int size;
+    struct plugin **handlers;
     struct sched_list_node *sched;
-    struct plugin_event *event;
-
-    struct mk_list *list;
+    struct plugin_event_table *table;
 
     sched = mk_sched_get_thread_conf();
+    if (!sched || socket < 0) {
+        return -1;
+    }
 
-    if (sched && handler) {
-        /* Event node (this list exist at thread level */
-        event = mk_mem_malloc(sizeof(struct plugin_event));
-        event->socket = socket;
-        event->handler = handler;
-
-        /* Get thread event list */
-        list = mk_plugin_event_get_list();
-        mk_list_add(&event->_head, list);
-        mk_plugin_event_set_list(list);
+    if (handler) {
+        /*
+         * The table lives at thread level and is allocated once the
+         * worker is up, grow it to fit the new fd
+         */
+        table = mk_plugin_event_get_table();
+        if (!table) {
+            MK_TRACE("[FD %i] no event table, could not add event", socket);
+            return -1;
+        }
+        if (socket >= table->size) {
+            size = table->size;
+            while (size <= socket) {
+                size *= 2;
+            }
+            handlers = mk_mem_realloc(table->handlers,
+                                      sizeof(struct plugin *) * size);
+            if (!handlers) {
+                return -1;
+            }
+            table->handlers = handlers;
+            memset(table->handlers + table->size, 0,
+                   sizeof(struct plugin *) * (size - table->size));
+            table->size = size;
+        }
+        table->handlers[socket] = handler;
     }
 
     /*
@@ -891,6 +1100,7 @@ int mk_plugin_http_request_end(int socket)
         return -1;
     }
     sr = mk_list_entry_last(&cs->request_list, struct session_request, _head);
+    mk_request_finished(cs, sr);
     mk_plugin_stage_run(MK_PLUGIN_STAGE_40, socket, NULL, cs, sr);
 
     ret = mk_http_request_end(socket);
@@ -922,39 +1132,32 @@ int mk_plugin_event_socket_change_mode(int socket, int mode, unsigned int behavi
     return mk_epoll_change_mode(sched->epoll_fd, socket, mode, behavior);
 }
 
-struct plugin_event *mk_plugin_event_get(int socket)
+struct plugin *mk_plugin_event_get(int socket)
 {
-    struct mk_list *head, *list;
-    struct plugin_event *node;
+    struct plugin_event_table *table;
 
-    list = mk_plugin_event_get_list();
+    table = mk_plugin_event_get_table();
 
     /*
      * In some cases this function is invoked from scheduler.c when a connection is
-     * closed, on that moment there's no thread context so the returned list is NULL.
+     * closed, on that moment there's no thread context so the returned table is NULL.
      */
-    if (!list) {
+    if (!table || socket < 0 || socket >= table->size) {
         return NULL;
     }
 
-    mk_list_foreach(head, list) {
-        node = mk_list_entry(head, struct plugin_event, _head);
-        if (node->socket == socket) {
-            return node;
-        }
-    }
-
-    return NULL;
+    return table->handlers[socket];
 }
 
-void mk_plugin_event_init_list()
+void mk_plugin_event_init_table()
 {
-    struct mk_list *list;
+    struct plugin_event_table *table;
 
-    list = mk_mem_malloc(sizeof(struct mk_list));
-    mk_list_init(list);
+    table = mk_mem_malloc(sizeof(struct plugin_event_table));
+    table->size = MK_PLUGIN_EVENT_TABLE;
+    table->handlers = mk_mem_malloc_z(sizeof(struct plugin *) * table->size);
 
-    mk_plugin_event_set_list(list);
+    pthread_setspecific(mk_plugin_event_k, (void *) table);
 }
 
 /* Plugin epoll event handlers
@@ -1012,8 +1215,8 @@ int mk_plugin_event_read(int socket)
 {
     int ret;
     struct plugin *node;
-    struct mk_list *head;
-    struct plugin_event *event;
+    struct plugin **hook;
+    struct plugin *handler;
 
     MK_TRACE("[FD %i] Read Event", socket);
 
@@ -1028,30 +1231,28 @@ int mk_plugin_event_read(int socket)
     }
 
     /* Socket registered by plugin */
-    event = mk_plugin_event_get(socket);
-    if (event) {
-        if (event->handler->event_read) {
-            MK_TRACE("[%s] plugin handler",  event->handler->name);
+    handler = mk_plugin_event_get(socket);
+    if (handler) {
+        if (handler->event_read) {
+            MK_TRACE("[%s] plugin handler",  handler->name);
 
-            ret = event->handler->event_read(socket);
+            ret = handler->event_read(socket);
             mk_plugin_event_check_return("read|handled_by", ret);
             return ret;
         }
     }
 
-    mk_list_foreach(head, config->plugins) {
-        node = mk_list_entry(head, struct plugin, _head);
-        if (node->event_read) {
-            ret = node->event_read(socket);
+    for (hook = plg_event_read; *hook; hook++) {
+        node = *hook;
+        ret = node->event_read(socket);
 
-            /* validate return value */
-            mk_plugin_event_check_return("read", ret);
-            if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
-                continue;
-            }
-            else {
-                return ret;
-            }
+        /* validate return value */
+        mk_plugin_event_check_return("read", ret);
+        if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
+            continue;
+        }
+        else {
+            return ret;
         }
     }
 
@@ -1062,8 +1263,8 @@ int mk_plugin_event_write(int socket)
 {
     int ret;
     struct plugin *node;
-    struct mk_list *head;
-    struct plugin_event *event;
+    struct plugin **hook;
+    struct plugin *handler;
 
     MK_TRACE("[FD %i] Plugin event write", socket);
 
@@ -1077,30 +1278,28 @@ int mk_plugin_event_write(int socket)
         return -1;
     }
 
-    event = mk_plugin_event_get(socket);
-    if (event) {
-        if (event->handler->event_write) {
+    handler = mk_plugin_event_get(socket);
+    if (handler) {
+        if (handler->event_write) {
             MK_TRACE(" event write handled by plugin");
 
-            ret = event->handler->event_write(socket);
+            ret = handler->event_write(socket);
             mk_plugin_event_check_return("write|handled_by", ret);
             return ret;
         }
     }
 
-    mk_list_foreach(head, config->plugins) {
-        node = mk_list_entry(head, struct plugin, _head);
-        if (node->event_write) {
-            ret = node->event_write(socket);
+    for (hook = plg_event_write; *hook; hook++) {
+        node = *hook;
+        ret = node->event_write(socket);
 
-            /* validate return value */
-            mk_plugin_event_check_return("write", ret);
-            if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
-                continue;
-            }
-            else {
-                return ret;
-            }
+        /* validate return value */
+        mk_plugin_event_check_return("write", ret);
+        if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
+            continue;
+        }
+        else {
+            return ret;
         }
     }
 
@@ -1111,35 +1310,33 @@ int mk_plugin_event_error(int socket)
 {
     int ret;
     struct plugin *node;
-    struct mk_list *head;
-    struct plugin_event *event;
+    struct plugin **hook;
+    struct plugin *handler;
 
     MK_TRACE("[FD %i] Plugin event error", socket);
 
-    event = mk_plugin_event_get(socket);
-    if (event) {
-        if (event->handler->event_error) {
+    handler = mk_plugin_event_get(socket);
+    if (handler) {
+        if (handler->event_error) {
             MK_TRACE(" event error handled by plugin");
 
-            ret = event->handler->event_error(socket);
+            ret = handler->event_error(socket);
             mk_plugin_event_check_return("error|handled_by", ret);
             return ret;
         }
     }
 
-    mk_list_foreach(head, config->plugins) {
-        node = mk_list_entry(head, struct plugin, _head);
-        if (node->event_error) {
-            ret = node->event_error(socket);
+    for (hook = plg_event_error; *hook; hook++) {
+        node = *hook;
+        ret = node->event_error(socket);
 
-            /* validate return value */
-            mk_plugin_event_check_return("error", ret);
-            if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
-                continue;
-            }
-            else {
-                return ret;
-            }
+        /* validate return value */
+        mk_plugin_event_check_return("error", ret);
+        if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
+            continue;
+        }
+        else {
+            return ret;
         }
     }
 
@@ -1150,35 +1347,33 @@ int mk_plugin_event_close(int socket)
 {
     int ret;
     struct plugin *node;
-    struct mk_list *head;
-    struct plugin_event *event;
+    struct plugin **hook;
+    struct plugin *handler;
 
     MK_TRACE("[FD %i] Plugin event close", socket);
 
-    event = mk_plugin_event_get(socket);
-    if (event) {
-        if (event->handler->event_close) {
+    handler = mk_plugin_event_get(socket);
+    if (handler) {
+        if (handler->event_close) {
             MK_TRACE(" event close handled by plugin");
 
-            ret = event->handler->event_close(socket);
+            ret = handler->event_close(socket);
             mk_plugin_event_check_return("close|handled_by", ret);
             return ret;
         }
     }
 
-    mk_list_foreach(head, config->plugins) {
-        node = mk_list_entry(head, struct plugin, _head);
-        if (node->event_close) {
-            ret = node->event_close(socket);
+    for (hook = plg_event_close; *hook; hook++) {
+        node = *hook;
+        ret = node->event_close(socket);
 
-            /* validate return value */
-            mk_plugin_event_check_return("close", ret);
-            if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
-                continue;
-            }
-            else {
-                return ret;
-            }
+        /* validate return value */
+        mk_plugin_event_check_return("close", ret);
+        if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
+            continue;
+        }
+        else {
+            return ret;
         }
     }
 
@@ -1189,35 +1384,33 @@ int mk_plugin_event_timeout(int socket)
 {
     int ret;
     struct plugin *node;
-    struct mk_list *head;
-    struct plugin_event *event;
+    struct plugin **hook;
+    struct plugin *handler;
 
     MK_TRACE("[FD %i] Plugin event timeout", socket);
 
-    event = mk_plugin_event_get(socket);
-    if (event) {
-        if (event->handler->event_timeout) {
+    handler = mk_plugin_event_get(socket);
+    if (handler) {
+        if (handler->event_timeout) {
             MK_TRACE(" event close handled by plugin");
 
-            ret = event->handler->event_timeout(socket);
+            ret = handler->event_timeout(socket);
             mk_plugin_event_check_return("timeout|handled_by", ret);
             return ret;
         }
     }
 
-    mk_list_foreach(head, config->plugins) {
-        node = mk_list_entry(head, struct plugin, _head);
-        if (node->event_timeout) {
-            ret = node->event_timeout(socket);
+    for (hook = plg_event_timeout; *hook; hook++) {
+        node = *hook;
+        ret = node->event_timeout(socket);
 
-            /* validate return value */
-            mk_plugin_event_check_return("timeout", ret);
-            if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
-                continue;
-            }
-            else {
-                return ret;
-            }
+        /* validate return value */
+        mk_plugin_event_check_return("timeout", ret);
+        if (ret == MK_PLUGIN_RET_EVENT_NEXT) {
+            continue;
+        }
+        else {
+            return ret;
         }
     }
 
@@ -1234,6 +1427,74 @@ mk_pointer *mk_plugin_time_now_human()
     return &log_current_time;
 }
 
+/*
+ * Plugins data slots: a plugin stores a pointer in the request or session
+ * it is working on and gets it back from any hook in constant time. Setting
+ * a new value does not run the cleanup of the previous one, the owner is
+ * expected to release it.
+ */
+int mk_plugin_request_data_set(struct plugin *p, struct session_request *sr,
+                               void *data, void (*cleanup) (void *))
+{
+    if (!p || p->slot < 0) {
+        return -1;
+    }
+
+    sr->plugin_data[p->slot].data = data;
+    sr->plugin_data[p->slot].cleanup = cleanup;
+    return 0;
+}
+
+void *mk_plugin_request_data_get(struct plugin *p, struct session_request *sr)
+{
+    if (!p || p->slot < 0) {
+        return NULL;
+    }
+    return sr->plugin_data[p->slot].data;
+}
+
+int mk_plugin_session_data_set(struct plugin *p, struct client_session *cs,
+                               void *data, void (*cleanup) (void *))
+{
+    if (!p || p->slot < 0) {
+        return -1;
+    }
+
+    cs->plugin_data[p->slot].data = data;
+    cs->plugin_data[p->slot].cleanup = cleanup;
+    return 0;
+}
+
+void *mk_plugin_session_data_get(struct plugin *p, struct client_session *cs)
+{
+    if (!p || p->slot < 0) {
+        return NULL;
+    }
+    return cs->plugin_data[p->slot].data;
+}
+
+/* Run the cleanup callbacks of the slots still in use */
+void mk_plugin_data_release(struct mk_plugin_slot *slots)
+{
+    int i;
+    struct mk_plugin_slot *slot;
+
+    for (i = 0; i < plugin_slots; i++) {
+        slot = &slots[i];
+        if (slot->data && slot->cleanup) {
+            slot->cleanup(slot->data);
+        }
+        slot->data = NULL;
+        slot->cleanup = NULL;
+    }
+}
+
+/* Backpressure hint for producers writing to the output queue */
+int mk_plugin_output_full(struct mk_output *out)
+{
+    return mk_output_full(out);
+}
+
 int mk_plugin_sched_remove_client(int socket)
 {
     struct sched_list_node *node;
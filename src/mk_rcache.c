@@ -0,0 +1,1073 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Response micro-cache
+ * --------------------
+ * Handler plugins generating dynamic content (FastCGI, CGI) ask the cache
+ * before contacting their backend. Responses are keyed on the virtual
+ * host, the URI with its query string and the request headers listed in
+ * ResponseCacheKey, and they are kept for the time allowed by the
+ * Cache-Control and Expires headers of the backend.
+ *
+ * Only one request per key goes to the backend: the first miss inserts a
+ * placeholder and becomes the 'filler', every request arriving meanwhile
+ * is parked on the placeholder and woken up through a per worker eventfd
+ * once the response has been stored (or the fill failed). Expired entries
+ * are still served for ResponseCacheStale seconds while a single request
+ * revalidates them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <sys/eventfd.h>
+
+#include "monkey.h"
+#include "mk_rcache.h"
+#include "mk_config.h"
+#include "mk_clock.h"
+#include "mk_epoll.h"
+#include "mk_header.h"
+#include "mk_http.h"
+#include "mk_http_status.h"
+#include "mk_iov.h"
+#include "mk_memory.h"
+#include "mk_plugin.h"
+#include "mk_request.h"
+#include "mk_scheduler.h"
+#include "mk_stream.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+static struct mk_rcache_shard *rcache_shards = NULL;
+static struct mk_rcache_stats rcache_stats;
+static size_t rcache_shard_budget;
+static size_t rcache_max_object;
+
+#define mk_rcache_count(field, n) __sync_fetch_and_add(&rcache_stats.field, n)
+
+/* FNV-1a */
+static inline uint32_t mk_rcache_hash(const char *key, int len)
+{
+    int i;
+    uint32_t h = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline struct mk_rcache_shard *mk_rcache_shard(uint32_t hash)
+{
+    return &rcache_shards[hash % MK_RCACHE_SHARDS];
+}
+
+static inline struct mk_list *mk_rcache_bucket(struct mk_rcache_shard *shard,
+                                               uint32_t hash)
+{
+    return &shard->buckets[(hash / MK_RCACHE_SHARDS) % MK_RCACHE_BUCKETS];
+}
+
+/*
+ * mk_request_header_get() flags the rows it returns, the key is built
+ * more than once for a parked request so it needs a plain lookup.
+ */
+static mk_pointer mk_rcache_header(struct session_request *sr,
+                                   const char *name, int len)
+{
+    int i;
+    char *p;
+    mk_pointer var = {NULL, 0};
+    struct header_toc_row *row;
+
+    for (i = 0; i < sr->headers_toc.length; i++) {
+        row = &sr->headers_toc.rows[i];
+        if (row->end - row->init <= len || row->init[len] != ':' ||
+            strncasecmp(row->init, name, len) != 0) {
+            continue;
+        }
+
+        p = row->init + len + 1;
+        while (p < row->end && *p == ' ') {
+            p++;
+        }
+        var.data = p;
+        var.len = row->end - p;
+        break;
+    }
+
+    return var;
+}
+
+static inline int mk_rcache_key_add(char *key, int len, const char *data,
+                                    int data_len)
+{
+    if (len + data_len > MK_RCACHE_KEY_MAX) {
+        return -1;
+    }
+    memcpy(key + len, data, data_len);
+    return len + data_len;
+}
+
+/* vhost + URI + query string + the values of the key headers */
+static int mk_rcache_key(struct session_request *sr, char *key)
+{
+    int len = 0;
+    mk_pointer val;
+    struct mk_list *head;
+    struct mk_string_line *entry;
+
+    len = mk_rcache_key_add(key, len, (char *) &sr->host_conf,
+                            sizeof(sr->host_conf));
+    len = mk_rcache_key_add(key, len, sr->uri.data, sr->uri.len);
+    if (len >= 0 && sr->query_string.len > 0) {
+        len = mk_rcache_key_add(key, len, "?", 1);
+        if (len >= 0) {
+            len = mk_rcache_key_add(key, len, sr->query_string.data,
+                                    sr->query_string.len);
+        }
+    }
+
+    if (!config->rcache_key_headers) {
+        return len;
+    }
+
+    mk_list_foreach(head, config->rcache_key_headers) {
+        if (len < 0) {
+            break;
+        }
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+        val = mk_rcache_header(sr, entry->val, entry->len);
+        len = mk_rcache_key_add(key, len, "\n", 1);
+        if (len >= 0 && val.len > 0) {
+            len = mk_rcache_key_add(key, len, val.data, val.len);
+        }
+    }
+
+    return len;
+}
+
+static struct mk_rcache_entry *mk_rcache_find(struct mk_rcache_shard *shard,
+                                              uint32_t hash,
+                                              const char *key, int key_len)
+{
+    struct mk_list *head;
+    struct mk_rcache_entry *entry;
+
+    mk_list_foreach(head, mk_rcache_bucket(shard, hash)) {
+        entry = mk_list_entry(head, struct mk_rcache_entry, _hash);
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct mk_rcache_entry *mk_rcache_entry_new(struct mk_rcache_shard *shard,
+                                                   uint32_t hash,
+                                                   const char *key, int key_len)
+{
+    struct mk_rcache_entry *entry;
+
+    entry = mk_mem_malloc_z(sizeof(struct mk_rcache_entry));
+    entry->key = mk_mem_malloc(key_len);
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    entry->hash = hash;
+    entry->state = MK_RCACHE_FILLING;
+    entry->size = sizeof(struct mk_rcache_entry) + key_len;
+    mk_list_init(&entry->waiters);
+    mk_list_init(&entry->_lru);
+
+    mk_list_add(&entry->_hash, mk_rcache_bucket(shard, hash));
+    mk_rcache_count(entries, 1);
+
+    return entry;
+}
+
+/* Drop the stored response, hits in progress keep their own reference */
+static void mk_rcache_entry_clear(struct mk_rcache_shard *shard,
+                                  struct mk_rcache_entry *entry)
+{
+    if (entry->buf) {
+        mk_output_buf_release(entry->buf);
+        entry->buf = NULL;
+        shard->bytes -= entry->headers_len + entry->body_len;
+        mk_rcache_count(bytes, -(entry->headers_len + entry->body_len));
+    }
+    entry->headers_len = 0;
+    entry->body_len = 0;
+}
+
+/* Unlink and release an entry, its waiters must have been taken */
+static void mk_rcache_entry_free(struct mk_rcache_shard *shard,
+                                 struct mk_rcache_entry *entry)
+{
+    mk_rcache_entry_clear(shard, entry);
+    if (entry->state != MK_RCACHE_FILLING) {
+        shard->bytes -= entry->size;
+        mk_list_del(&entry->_lru);
+    }
+    mk_list_del(&entry->_hash);
+    mk_rcache_count(entries, -1);
+
+    mk_mem_free(entry->key);
+    mk_mem_free(entry);
+}
+
+/* Move a filled entry to the LRU and charge it to the shard budget */
+static void mk_rcache_entry_publish(struct mk_rcache_shard *shard,
+                                    struct mk_rcache_entry *entry, int state)
+{
+    entry->state = state;
+    shard->bytes += entry->size;
+    mk_list_add(&entry->_lru, &shard->lru);
+}
+
+static void mk_rcache_entry_set(struct mk_rcache_shard *shard,
+                                struct mk_rcache_entry *entry,
+                                struct mk_rcache_fill *fill)
+{
+    entry->status = fill->status;
+    entry->stored = log_current_utime;
+    entry->expires = fill->expires;
+    entry->stale_until = fill->expires + config->rcache_stale;
+    entry->headers_len = fill->headers_len;
+    entry->body_len = fill->len - fill->headers_len;
+    entry->buf = mk_output_buf_create(fill->data, fill->len,
+                                      mk_mem_free, fill->data);
+    fill->data = NULL;
+
+    shard->bytes += fill->len;
+    mk_rcache_count(bytes, fill->len);
+    mk_rcache_count(stores, 1);
+}
+
+static void mk_rcache_entry_pass(struct mk_rcache_shard *shard,
+                                 struct mk_rcache_entry *entry)
+{
+    mk_rcache_entry_clear(shard, entry);
+    entry->expires = log_current_utime + MK_RCACHE_PASS_TTL;
+    entry->stale_until = entry->expires;
+}
+
+/* Evict the least recently used entries until the shard fits its budget */
+static void mk_rcache_evict(struct mk_rcache_shard *shard)
+{
+    struct mk_rcache_entry *entry;
+
+    while (shard->bytes > rcache_shard_budget &&
+           mk_list_is_empty(&shard->lru) != 0) {
+        /* entries are appended when used, the oldest is the first one */
+        entry = mk_list_entry_first(&shard->lru, struct mk_rcache_entry, _lru);
+        mk_rcache_entry_free(shard, entry);
+        mk_rcache_count(evictions, 1);
+    }
+}
+
+/* Hand the parked requests back to the workers owning them */
+static void mk_rcache_wake(struct mk_list *waiters)
+{
+    uint64_t val = 1;
+    struct mk_list *head, *tmp;
+    struct mk_rcache_waiter *waiter;
+    struct sched_list_node *sched;
+
+    mk_list_foreach_safe(head, tmp, waiters) {
+        waiter = mk_list_entry(head, struct mk_rcache_waiter, _head);
+        sched = waiter->sched;
+
+        mk_list_del(&waiter->_head);
+        pthread_mutex_lock(&sched->rcache_mutex);
+        mk_list_add(&waiter->_head, &sched->rcache_woken);
+        pthread_mutex_unlock(&sched->rcache_mutex);
+
+        if (write(sched->rcache_fd, &val, sizeof(val)) != sizeof(val)) {
+            mk_warn("Response cache: could not notify worker %i", sched->idx);
+        }
+    }
+}
+
+static void mk_rcache_take_waiters(struct mk_rcache_entry *entry,
+                                   struct mk_list *waiters)
+{
+    struct mk_list *head, *tmp;
+
+    mk_list_foreach_safe(head, tmp, &entry->waiters) {
+        mk_list_del(head);
+        mk_list_add(head, waiters);
+    }
+}
+
+static void mk_rcache_fill_free(struct mk_rcache_fill *fill)
+{
+    if (fill->data) {
+        mk_mem_free(fill->data);
+    }
+    mk_mem_free(fill->key);
+    mk_mem_free(fill);
+}
+
+static struct mk_rcache_fill *mk_rcache_fill_new(uint32_t hash,
+                                                 const char *key, int key_len,
+                                                 struct mk_rcache_entry *entry)
+{
+    struct mk_rcache_fill *fill;
+
+    fill = mk_mem_malloc_z(sizeof(struct mk_rcache_fill));
+    fill->key = mk_mem_malloc(key_len);
+    memcpy(fill->key, key, key_len);
+    fill->key_len = key_len;
+    fill->hash = hash;
+    fill->entry = entry;
+
+    return fill;
+}
+
+/*
+ * Finish a fill: 'result' is MK_RCACHE_READY if the response has been
+ * captured, MK_RCACHE_PASS if the backend said it can't be cached and
+ * MK_RCACHE_FILLING if the request died before getting a response.
+ */
+static void mk_rcache_fill_end(struct mk_rcache_fill *fill, int result)
+{
+    struct mk_list waiters;
+    struct mk_rcache_shard *shard;
+    struct mk_rcache_entry *entry;
+
+    mk_list_init(&waiters);
+    shard = mk_rcache_shard(fill->hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    entry = mk_rcache_find(shard, fill->hash, fill->key, fill->key_len);
+
+    if (fill->entry) {
+        /* Placeholder owned by this fill, nobody else can release it */
+        entry = fill->entry;
+        mk_rcache_take_waiters(entry, &waiters);
+
+        if (result == MK_RCACHE_READY) {
+            mk_rcache_entry_set(shard, entry, fill);
+            mk_rcache_entry_publish(shard, entry, MK_RCACHE_READY);
+        }
+        else if (result == MK_RCACHE_PASS) {
+            mk_rcache_entry_pass(shard, entry);
+            mk_rcache_entry_publish(shard, entry, MK_RCACHE_PASS);
+        }
+        else {
+            mk_rcache_entry_free(shard, entry);
+        }
+    }
+    else if (entry && entry->state == MK_RCACHE_READY) {
+        /* Revalidation of a stale entry, replace it in place */
+        entry->refreshing = MK_FALSE;
+        if (result == MK_RCACHE_READY) {
+            mk_rcache_entry_clear(shard, entry);
+            mk_rcache_entry_set(shard, entry, fill);
+        }
+        else if (result == MK_RCACHE_PASS) {
+            mk_rcache_entry_pass(shard, entry);
+            entry->state = MK_RCACHE_PASS;
+        }
+    }
+    else if (!entry && result == MK_RCACHE_READY) {
+        /* The stale entry was evicted meanwhile */
+        entry = mk_rcache_entry_new(shard, fill->hash, fill->key, fill->key_len);
+        mk_rcache_entry_set(shard, entry, fill);
+        mk_rcache_entry_publish(shard, entry, MK_RCACHE_READY);
+    }
+
+    mk_rcache_evict(shard);
+    pthread_mutex_unlock(&shard->mutex);
+
+    mk_rcache_wake(&waiters);
+    mk_rcache_fill_free(fill);
+}
+
+/* Send a cached response, the caller holds a reference on the buffer */
+static void mk_rcache_serve(struct client_session *cs,
+                            struct session_request *sr,
+                            struct mk_output_buf *buf, int status,
+                            size_t headers_len, size_t body_len, time_t stored)
+{
+    int len;
+    char age[32];
+    struct mk_iov *extra;
+
+    mk_header_set_http_status(sr, status);
+    mk_pointer_reset(&sr->headers.content_type);
+    sr->headers.content_length = body_len;
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.location = NULL;
+
+    len = snprintf(age, sizeof(age), "Age: %li\r\n",
+                   (long) (log_current_utime - stored));
+
+    /* mk_header_send() copies the rows into its own buffer */
+    extra = mk_iov_create(2, 0);
+    if (headers_len > 0) {
+        mk_iov_add_entry(extra, buf->data, headers_len, mk_iov_none,
+                         MK_IOV_NOT_FREE_BUF);
+    }
+    mk_iov_add_entry(extra, age, len, mk_iov_none, MK_IOV_NOT_FREE_BUF);
+    sr->headers._extra_rows = extra;
+
+    mk_header_send(cs->socket, cs, sr);
+
+    if (sr->method != HTTP_METHOD_HEAD && body_len > 0) {
+        mk_stream_buf(cs, sr, buf, headers_len, body_len);
+    }
+}
+
+/* Put the request to sleep until the fill of 'entry' ends */
+static int mk_rcache_park(struct client_session *cs,
+                          struct session_request *sr,
+                          struct mk_rcache_entry *entry,
+                          struct sched_list_node *sched)
+{
+    struct mk_rcache_waiter *waiter;
+
+    /* zero means 'nothing pending' in the session */
+    if (++sched->rcache_seq == 0) {
+        sched->rcache_seq++;
+    }
+
+    waiter = mk_mem_malloc(sizeof(struct mk_rcache_waiter));
+    waiter->socket = cs->socket;
+    waiter->id = sched->rcache_seq;
+    waiter->sched = sched;
+    mk_list_add(&waiter->_head, &entry->waiters);
+
+    cs->rcache_id = waiter->id;
+    sr->rcache_parked = MK_TRUE;
+
+    mk_epoll_change_mode(sched->epoll_fd, cs->socket,
+                         MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
+
+    return MK_RCACHE_PARKED;
+}
+
+/*
+ * Called by handler plugins in stage 30 once they know they will serve
+ * the request. On MK_RCACHE_HIT the response has been sent and the plugin
+ * must return MK_PLUGIN_RET_END, on MK_RCACHE_PARKED it must return
+ * MK_PLUGIN_RET_CONTINUE and forget the request: stage 30 runs again once
+ * the response is available. On a miss the plugin serves the request and
+ * feeds the response to mk_rcache_store_*().
+ */
+int mk_rcache_lookup(struct client_session *cs, struct session_request *sr)
+{
+    int key_len;
+    int status;
+    int get;
+    time_t now;
+    time_t stored;
+    size_t headers_len, body_len;
+    uint32_t hash;
+    char key[MK_RCACHE_KEY_MAX];
+    struct mk_output_buf *buf;
+    struct mk_rcache_shard *shard;
+    struct mk_rcache_entry *entry;
+    struct sched_list_node *sched;
+
+    if (!rcache_shards || sr->rcache) {
+        return MK_RCACHE_MISS;
+    }
+
+    get = (sr->method == HTTP_METHOD_GET);
+    if (!get && sr->method != HTTP_METHOD_HEAD) {
+        return MK_RCACHE_MISS;
+    }
+
+    /* Never share responses to authenticated requests */
+    if (mk_rcache_header(sr, "Authorization", 13).data) {
+        return MK_RCACHE_MISS;
+    }
+
+    key_len = mk_rcache_key(sr, key);
+    if (key_len < 0) {
+        return MK_RCACHE_MISS;
+    }
+
+    hash = mk_rcache_hash(key, key_len);
+    shard = mk_rcache_shard(hash);
+    sched = mk_sched_get_thread_conf();
+    now = log_current_utime;
+
+    pthread_mutex_lock(&shard->mutex);
+    entry = mk_rcache_find(shard, hash, key, key_len);
+
+    if (entry && entry->state != MK_RCACHE_FILLING &&
+        now >= entry->stale_until) {
+        mk_rcache_entry_free(shard, entry);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        /* HEAD responses have no body to store, they only use the cache */
+        if (get) {
+            entry = mk_rcache_entry_new(shard, hash, key, key_len);
+            sr->rcache = mk_rcache_fill_new(hash, key, key_len, entry);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        mk_rcache_count(misses, 1);
+        return MK_RCACHE_MISS;
+    }
+
+    if (entry->state == MK_RCACHE_PASS) {
+        pthread_mutex_unlock(&shard->mutex);
+        mk_rcache_count(passes, 1);
+        return MK_RCACHE_MISS;
+    }
+
+    if (entry->state == MK_RCACHE_FILLING) {
+        if (!get || sched->rcache_fd == -1) {
+            pthread_mutex_unlock(&shard->mutex);
+            mk_rcache_count(misses, 1);
+            return MK_RCACHE_MISS;
+        }
+
+        MK_TRACE("[FD %i] Response cache fill in progress, parking",
+                 cs->socket);
+        mk_rcache_park(cs, sr, entry, sched);
+        pthread_mutex_unlock(&shard->mutex);
+        mk_rcache_count(collapsed, 1);
+        return MK_RCACHE_PARKED;
+    }
+
+    /*
+     * Stale entry: the first GET revalidates it with the backend, the
+     * others get the old copy until the new one is stored.
+     */
+    if (now >= entry->expires) {
+        if (get && entry->refreshing == MK_FALSE) {
+            entry->refreshing = MK_TRUE;
+            sr->rcache = mk_rcache_fill_new(hash, key, key_len, NULL);
+            pthread_mutex_unlock(&shard->mutex);
+            mk_rcache_count(misses, 1);
+            return MK_RCACHE_MISS;
+        }
+        mk_rcache_count(stale, 1);
+    }
+
+    mk_output_buf_get(entry->buf);
+    buf = entry->buf;
+    status = entry->status;
+    stored = entry->stored;
+    headers_len = entry->headers_len;
+    body_len = entry->body_len;
+
+    mk_list_del(&entry->_lru);
+    mk_list_add(&entry->_lru, &shard->lru);
+    pthread_mutex_unlock(&shard->mutex);
+
+    MK_TRACE("[FD %i] Response cache hit", cs->socket);
+    mk_rcache_count(hits, 1);
+
+    mk_rcache_serve(cs, sr, buf, status, headers_len, body_len, stored);
+    mk_output_buf_release(buf);
+
+    return MK_RCACHE_HIT;
+}
+
+/* Run stage 30 again for a request woken up from the cache */
+int mk_rcache_resume(struct client_session *cs, struct session_request *sr)
+{
+    int ret;
+
+    sr->rcache_parked = MK_FALSE;
+
+    ret = mk_plugin_stage_run(MK_PLUGIN_STAGE_30, cs->socket, NULL, cs, sr);
+    MK_TRACE("[FD %i] Response cache resume, STAGE_30 returned %i",
+             cs->socket, ret);
+
+    switch (ret) {
+    case MK_PLUGIN_RET_CONTINUE:
+        return MK_PLUGIN_RET_CONTINUE;
+    case MK_PLUGIN_RET_END:
+        return EXIT_NORMAL;
+    case MK_PLUGIN_RET_CLOSE_CONX:
+        if (sr->headers.status > 0) {
+            return mk_request_error(sr->headers.status, cs, sr);
+        }
+        return mk_request_error(MK_CLIENT_FORBIDDEN, cs, sr);
+    }
+
+    return mk_request_error(MK_CLIENT_NOT_FOUND, cs, sr);
+}
+
+static int mk_rcache_fill_add(struct mk_rcache_fill *fill,
+                              const char *data, size_t len)
+{
+    size_t size;
+    char *tmp;
+
+    if (fill->len + len > rcache_max_object) {
+        return -1;
+    }
+
+    if (fill->len + len > fill->size) {
+        size = fill->size ? fill->size : 1024;
+        while (size < fill->len + len) {
+            size *= 2;
+        }
+        tmp = mk_mem_realloc(fill->data, size);
+        if (!tmp) {
+            return -1;
+        }
+        fill->data = tmp;
+        fill->size = size;
+    }
+
+    memcpy(fill->data + fill->len, data, len);
+    fill->len += len;
+    return 0;
+}
+
+/* Parse the Cache-Control directives which matter to a shared cache */
+static int mk_rcache_cache_control(const char *p, const char *end, int *ttl)
+{
+    int s_maxage = -1, max_age = -1;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        if (end - p >= 8 && strncasecmp(p, "no-store", 8) == 0) {
+            return -1;
+        }
+        else if (end - p >= 8 && strncasecmp(p, "no-cache", 8) == 0) {
+            return -1;
+        }
+        else if (end - p >= 7 && strncasecmp(p, "private", 7) == 0) {
+            return -1;
+        }
+        else if (end - p >= 9 && strncasecmp(p, "s-maxage=", 9) == 0) {
+            s_maxage = atoi(p + 9);
+        }
+        else if (end - p >= 8 && strncasecmp(p, "max-age=", 8) == 0) {
+            max_age = atoi(p + 8);
+        }
+
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+
+    if (s_maxage >= 0) {
+        *ttl = s_maxage;
+    }
+    else if (max_age >= 0) {
+        *ttl = max_age;
+    }
+    return 0;
+}
+
+/* Vary is fine as long as every header it names is part of the key */
+static int mk_rcache_vary(const char *p, const char *end)
+{
+    int found;
+    const char *tok;
+    struct mk_list *head;
+    struct mk_string_line *entry;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        tok = p;
+        while (p < end && *p != ',' && *p != ' ') {
+            p++;
+        }
+        if (p == tok) {
+            continue;
+        }
+
+        found = MK_FALSE;
+        if (config->rcache_key_headers) {
+            mk_list_foreach(head, config->rcache_key_headers) {
+                entry = mk_list_entry(head, struct mk_string_line, _head);
+                if (entry->len == p - tok &&
+                    strncasecmp(entry->val, tok, p - tok) == 0) {
+                    found = MK_TRUE;
+                    break;
+                }
+            }
+        }
+        if (found == MK_FALSE) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#define mk_rcache_is(line, len, name) \
+    (len > (int) sizeof(name) - 1 && line[sizeof(name) - 1] == ':' && \
+     strncasecmp(line, name, sizeof(name) - 1) == 0)
+
+/*
+ * Check one header row of the response and append it to the stored
+ * headers with a CRLF ending. Returns -1 if the response can't be shared.
+ */
+static int mk_rcache_row(struct mk_rcache_fill *fill, const char *line,
+                         int len, int *ttl, time_t *expires)
+{
+    int n;
+    const char *val, *end;
+    char date[64];
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    val = memchr(line, ':', len);
+    if (!val) {
+        return 0;
+    }
+    end = line + len;
+    for (val++; val < end && *val == ' '; val++);
+
+    /* Monkey generates these ones on every response */
+    if (mk_rcache_is(line, len, "Status") ||
+        mk_rcache_is(line, len, "Content-Length") ||
+        mk_rcache_is(line, len, "Transfer-Encoding") ||
+        mk_rcache_is(line, len, "Connection") ||
+        mk_rcache_is(line, len, "Keep-Alive") ||
+        mk_rcache_is(line, len, "Date") ||
+        mk_rcache_is(line, len, "Server")) {
+        return 0;
+    }
+
+    if (mk_rcache_is(line, len, "Set-Cookie")) {
+        return -1;
+    }
+    else if (mk_rcache_is(line, len, "Cache-Control")) {
+        if (mk_rcache_cache_control(val, end, ttl) != 0) {
+            return -1;
+        }
+    }
+    else if (mk_rcache_is(line, len, "Vary")) {
+        if (mk_rcache_vary(val, end) != 0) {
+            return -1;
+        }
+    }
+    else if (mk_rcache_is(line, len, "Expires")) {
+        n = end - val;
+        if (n >= (int) sizeof(date)) {
+            return -1;
+        }
+        memcpy(date, val, n);
+        date[n] = '\0';
+        *expires = mk_utils_gmt2utime(date);
+        if (*expires <= 0) {
+            return -1;
+        }
+    }
+
+    if (mk_rcache_fill_add(fill, line, len) != 0 ||
+        mk_rcache_fill_add(fill, MK_CRLF, 2) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int mk_rcache_rows(struct mk_rcache_fill *fill, const char *rows,
+                          size_t len, int *ttl, time_t *expires)
+{
+    const char *p = rows, *end = rows + len, *eol;
+
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        if (mk_rcache_row(fill, p, eol - p, ttl, expires) != 0) {
+            return -1;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+static int mk_rcache_cacheable_status(int status)
+{
+    switch (status) {
+    case MK_HTTP_OK:
+    case MK_HTTP_NON_AUTH_INFO:
+    case MK_REDIR_MOVED:
+    case MK_CLIENT_NOT_FOUND:
+        return MK_TRUE;
+    }
+    return MK_FALSE;
+}
+
+/*
+ * The response status and headers: the ones already set in sr->headers
+ * (which must not have been sent yet) plus 'rows', raw header lines
+ * written by the plugin itself after mk_header_send().
+ */
+int mk_rcache_store_headers(struct session_request *sr,
+                            const char *rows, size_t len)
+{
+    int i;
+    int ttl = -1;
+    int ret = 0;
+    time_t expires = -1;
+    struct mk_iov *extra;
+    struct response_headers *sh = &sr->headers;
+    struct mk_rcache_fill *fill = sr->rcache;
+
+    if (!fill) {
+        return -1;
+    }
+
+    fill->status = sh->status;
+    if (mk_rcache_cacheable_status(sh->status) == MK_FALSE) {
+        goto pass;
+    }
+
+    /* the content type keeps the CRLF of the row it was taken from */
+    if (sh->content_type.len > 0) {
+        i = sh->content_type.len;
+        while (i > 0 && (sh->content_type.data[i - 1] == '\n' ||
+                         sh->content_type.data[i - 1] == '\r')) {
+            i--;
+        }
+        ret |= mk_rcache_fill_add(fill, "Content-Type: ", 14);
+        ret |= mk_rcache_fill_add(fill, sh->content_type.data, i);
+        ret |= mk_rcache_fill_add(fill, MK_CRLF, 2);
+    }
+    if (sh->location) {
+        ret |= mk_rcache_fill_add(fill, "Location: ", 10);
+        ret |= mk_rcache_fill_add(fill, sh->location, strlen(sh->location));
+        ret |= mk_rcache_fill_add(fill, MK_CRLF, 2);
+    }
+
+    extra = sh->_extra_rows;
+    for (i = 0; extra && i < extra->iov_idx && ret == 0; i++) {
+        ret |= mk_rcache_rows(fill, extra->io[i].iov_base,
+                              extra->io[i].iov_len, &ttl, &expires);
+    }
+    if (ret == 0 && rows) {
+        ret = mk_rcache_rows(fill, rows, len, &ttl, &expires);
+    }
+    if (ret != 0) {
+        goto pass;
+    }
+
+    /* Cache-Control wins over Expires, the default TTL applies to neither */
+    if (ttl < 0 && expires > 0) {
+        ttl = expires - log_current_utime;
+        if (ttl <= 0) {
+            goto pass;
+        }
+    }
+    if (ttl < 0) {
+        ttl = config->rcache_ttl;
+    }
+    if (ttl <= 0) {
+        goto pass;
+    }
+
+    fill->expires = log_current_utime + ttl;
+    fill->headers_len = fill->len;
+    fill->cacheable = MK_TRUE;
+    return 0;
+
+ pass:
+    fill->cacheable = MK_FALSE;
+    return -1;
+}
+
+int mk_rcache_store_body(struct session_request *sr,
+                         const void *data, size_t len)
+{
+    struct mk_rcache_fill *fill = sr->rcache;
+
+    if (!fill || fill->cacheable == MK_FALSE) {
+        return -1;
+    }
+
+    if (mk_rcache_fill_add(fill, data, len) != 0) {
+        /* Too big, let it through but keep the backend protected */
+        fill->cacheable = MK_FALSE;
+        return -1;
+    }
+    return 0;
+}
+
+/* The whole response went through mk_rcache_store_*() */
+void mk_rcache_store_end(struct session_request *sr)
+{
+    struct mk_rcache_fill *fill = sr->rcache;
+
+    if (!fill) {
+        return;
+    }
+
+    sr->rcache = NULL;
+    mk_rcache_fill_end(fill, fill->cacheable ? MK_RCACHE_READY : MK_RCACHE_PASS);
+}
+
+/* The request ended without a complete response, called on request free */
+void mk_rcache_abort(struct session_request *sr)
+{
+    struct mk_rcache_fill *fill = sr->rcache;
+
+    if (!fill) {
+        return;
+    }
+
+    sr->rcache = NULL;
+    mk_rcache_fill_end(fill, MK_RCACHE_FILLING);
+}
+
+/* Allocate the store, called once from the main process */
+int mk_rcache_init()
+{
+    int i, j;
+
+    memset(&rcache_stats, 0, sizeof(rcache_stats));
+    if (config->rcache_size == 0) {
+        return 0;
+    }
+
+    rcache_shards = mk_mem_malloc_z(MK_RCACHE_SHARDS *
+                                    sizeof(struct mk_rcache_shard));
+    for (i = 0; i < MK_RCACHE_SHARDS; i++) {
+        pthread_mutex_init(&rcache_shards[i].mutex, NULL);
+        mk_list_init(&rcache_shards[i].lru);
+        for (j = 0; j < MK_RCACHE_BUCKETS; j++) {
+            mk_list_init(&rcache_shards[i].buckets[j]);
+        }
+    }
+
+    rcache_shard_budget = config->rcache_size / MK_RCACHE_SHARDS;
+    rcache_max_object = rcache_shard_budget / 4;
+
+    return 0;
+}
+
+/* Per worker channel used to wake up the requests parked on a fill */
+int mk_rcache_worker_init(struct sched_list_node *sched)
+{
+    sched->rcache_fd = -1;
+    sched->rcache_seq = 0;
+    mk_list_init(&sched->rcache_woken);
+    pthread_mutex_init(&sched->rcache_mutex, NULL);
+
+    if (!rcache_shards) {
+        return 0;
+    }
+
+    sched->rcache_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sched->rcache_fd == -1) {
+        mk_warn("Response cache: eventfd() failed, worker %i won't "
+                "collapse requests", sched->idx);
+        return -1;
+    }
+
+    return mk_epoll_add(sched->epoll_fd, sched->rcache_fd,
+                        MK_EPOLL_READ, MK_EPOLL_LEVEL_TRIGGERED);
+}
+
+int mk_rcache_worker_events(struct sched_list_node *sched)
+{
+    uint64_t val;
+    struct mk_list woken;
+    struct mk_list *head, *tmp;
+    struct mk_rcache_waiter *waiter;
+    struct client_session *cs;
+
+    if (read(sched->rcache_fd, &val, sizeof(val)) != sizeof(val)) {
+        return 0;
+    }
+
+    mk_list_init(&woken);
+    pthread_mutex_lock(&sched->rcache_mutex);
+    mk_list_foreach_safe(head, tmp, &sched->rcache_woken) {
+        mk_list_del(head);
+        mk_list_add(head, &woken);
+    }
+    pthread_mutex_unlock(&sched->rcache_mutex);
+
+    mk_list_foreach_safe(head, tmp, &woken) {
+        waiter = mk_list_entry(head, struct mk_rcache_waiter, _head);
+
+        /* Same check as the disk I/O jobs, the socket may be reused */
+        cs = mk_session_get(waiter->socket);
+        if (cs && cs->rcache_id == waiter->id) {
+            MK_TRACE("[FD %i] Response cache fill ended, wake up",
+                     waiter->socket);
+            cs->rcache_id = 0;
+            mk_epoll_change_mode(sched->epoll_fd, waiter->socket,
+                                 MK_EPOLL_WAKEUP, MK_EPOLL_LEVEL_TRIGGERED);
+        }
+
+        mk_list_del(&waiter->_head);
+        mk_mem_free(waiter);
+    }
+
+    return 0;
+}
+
+void mk_rcache_counters(int (*print) (const char *, ...))
+{
+    uint64_t hits, stale, misses, lookups;
+
+    if (!rcache_shards) {
+        return;
+    }
+
+    hits = rcache_stats.hits;
+    stale = rcache_stats.stale;
+    misses = rcache_stats.misses;
+    /* collapsed requests end up as a hit or a miss once woken up */
+    lookups = hits + misses + rcache_stats.passes;
+
+    print("Response cache: %lu entries, %lu bytes (limit %lu)\n",
+          (unsigned long) rcache_stats.entries,
+          (unsigned long) rcache_stats.bytes,
+          (unsigned long) config->rcache_size);
+    print("  hits %lu (stale %lu), misses %lu, collapsed %lu, passes %lu\n",
+          (unsigned long) hits, (unsigned long) stale,
+          (unsigned long) misses, (unsigned long) rcache_stats.collapsed,
+          (unsigned long) rcache_stats.passes);
+    print("  stores %lu, evictions %lu, hit ratio %.1f%%\n",
+          (unsigned long) rcache_stats.stores,
+          (unsigned long) rcache_stats.evictions,
+          lookups ? (100.0 * hits) / lookups : 0.0);
+}
@@ -51,12 +51,17 @@
 #include "mk_utils.h"
 #include "mk_header.h"
 #include "mk_user.h"
+#include "mk_rcache.h"
 #include "mk_method.h"
 #include "mk_memory.h"
 #include "mk_socket.h"
 #include "mk_cache.h"
 #include "mk_clock.h"
 #include "mk_plugin.h"
+#include "mk_stream.h"
+#include "mk_stats.h"
+#include "mk_slowlog.h"
+#include "mk_usdt.h"
 #include "mk_macros.h"
 
 const mk_pointer mk_crlf = mk_pointer_init(MK_CRLF);
@@ -93,6 +98,7 @@ static void mk_request_init(struct session_request *request)
 
     request->bytes_to_send = -1;
     request->fd_file = -1;
+    mk_list_init(&request->streams);
 
     /* Response Headers */
     mk_header_response_reset(&request->headers);
@@ -100,6 +106,12 @@ static void mk_request_init(struct session_request *request)
 
 static void mk_request_free(struct session_request *sr)
 {
+    mk_stream_free_all(sr);
+    mk_plugin_data_release(sr->plugin_data);
+
+    /* A fill that never completed releases the requests waiting on it */
+    mk_rcache_abort(sr);
+
     if (sr->fd_file > 0) {
         close(sr->fd_file);
     }
@@ -410,6 +422,11 @@ static int mk_request_parse(struct client_session *cs)
             sr_node = mk_mem_malloc(sizeof(struct session_request));
         }
         mk_request_init(sr_node);
+        sr_node->stats_start = mk_stats_ticks();
+        MK_PROBE2(request__start, cs->socket, sr_node);
+        if (mk_unlikely(mk_slowlog_on)) {
+            mk_slowlog_begin(cs, sr_node);
+        }
 
         /* We point the block with a mk_pointer */
         sr_node->body.data = cs->body + i;
@@ -500,6 +517,7 @@ static void mk_request_premature_close(int http_status, struct client_session *c
             sr->host_conf = mk_list_entry_first(host_list, struct host, _head);
         }
         mk_request_error(http_status, cs, sr);
+        mk_request_finished(cs, sr);
 
         /* STAGE_40, request has ended */
         mk_plugin_stage_run(MK_PLUGIN_STAGE_40, cs->socket,
@@ -511,6 +529,19 @@ static void mk_request_premature_close(int http_status, struct client_session *c
     mk_session_remove(cs->socket);
 }
 
+/*
+ * The response of a request has been sent, account it before STAGE_40.
+ * Every path ending a request goes through here: the core write handler,
+ * a premature close and plugins ending the request themselves.
+ */
+void mk_request_finished(struct client_session *cs, struct session_request *sr)
+{
+    mk_stats_request(sr);
+    mk_slowlog_end(cs, sr);
+    MK_PROBE4(request__end, cs->socket, sr, sr->headers.status,
+              sr->headers.content_length);
+}
+
 static int mk_request_process(struct client_session *cs, struct session_request *sr)
 {
     int status = 0;
@@ -522,7 +553,11 @@ static int mk_request_process(struct client_session *cs, struct session_request
     sr->host_conf = mk_list_entry_first(hosts, struct host, _head);
 
     /* Parse request */
+    MK_PROBE2(request__parse__start, socket, sr);
     status = mk_request_header_process(sr);
+    MK_PHASE(sr, MK_PHASE_PARSE);
+    MK_PROBE5(request__parse__end, socket, sr, status,
+              sr->uri_processed.data, sr->uri_processed.len);
     if (status < 0) {
         mk_header_set_http_status(sr, MK_CLIENT_BAD_REQUEST);
         mk_request_error(MK_CLIENT_BAD_REQUEST, cs, sr);
@@ -579,6 +614,7 @@ static int mk_request_process(struct client_session *cs, struct session_request
     /* Plugins Stage 20 */
     int ret;
     ret = mk_plugin_stage_run(MK_PLUGIN_STAGE_20, socket, NULL, cs, sr);
+    MK_PHASE(sr, MK_PHASE_STAGE_20);
     if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
         MK_TRACE("STAGE 20 requested close conexion");
         return EXIT_ABORT;
@@ -656,6 +692,11 @@ int mk_handler_read(int socket, struct client_session *cs)
         }
     }
 
+    /* First bytes of a new request */
+    if (mk_unlikely(mk_slowlog_on) && cs->body_length == 0) {
+        cs->phase_start = mk_phase_now();
+    }
+
     /* Read content */
     bytes = mk_socket_read(socket, cs->body + cs->body_length,
                            (cs->body_size - cs->body_length));
@@ -686,6 +727,7 @@ int mk_handler_read(int socket, struct client_session *cs)
 
 int mk_handler_write(int socket, struct client_session *cs)
 {
+    int ret;
     int final_status = 0;
     struct session_request *sr_node;
     struct mk_list *sr_list, *sr_head;
@@ -700,13 +742,46 @@ int mk_handler_write(int socket, struct client_session *cs)
     mk_list_foreach(sr_head, sr_list) {
         sr_node = mk_list_entry(sr_head, struct session_request, _head);
 
-        if (sr_node->bytes_to_send > 0) {
+        if (sr_node->rcache_parked == MK_TRUE) {
+            /* Woken up, the response cache fill it waited for ended */
+            final_status = mk_rcache_resume(cs, sr_node);
+        }
+        else if (sr_node->aio_parked == MK_TRUE) {
+            /* Woken up, an I/O thread looked the path up */
+            sr_node->aio_parked = MK_FALSE;
+            final_status = mk_http_init_file(cs, sr_node);
+        }
+        else if (sr_node->bytes_to_send > 0) {
             /* Request with data to send by static file sender */
             final_status = mk_http_send_file(cs, sr_node);
         }
-        else if (sr_node->bytes_to_send < 0) {
+        else if (sr_node->bytes_to_send < 0 && !mk_stream_pending(sr_node)) {
             final_status = mk_request_process(cs, sr_node);
         }
+        /* else a handler plugin attached the body streams on its own */
+
+        /* The response body comes from streams */
+        if (final_status == EXIT_NORMAL && mk_stream_pending(sr_node)) {
+            sr_node->bytes_to_send = 0;
+            final_status = mk_stream_run(cs, sr_node);
+        }
+
+        /*
+         * The response may have been queued in the connection output,
+         * the request does not end until the queue has been flushed.
+         */
+        if (final_status <= 0 && final_status != EXIT_ABORT &&
+            mk_output_pending(&cs->output) > 0) {
+            ret = mk_output_flush(socket, &cs->output);
+            if (ret < 0) {
+                return -1;
+            }
+            else if (ret > 0) {
+                /* Nothing else to produce, just wait for the queue */
+                sr_node->bytes_to_send = 0;
+                return ret;
+            }
+        }
 
         /*
          * If we got an error, we don't want to parse
@@ -716,6 +791,8 @@ int mk_handler_write(int socket, struct client_session *cs)
             return final_status;
         }
         else {
+            mk_request_finished(cs, sr_node);
+
             /* STAGE_40, request has ended */
             mk_plugin_stage_run(MK_PLUGIN_STAGE_40, socket,
                                 NULL, cs, sr_node);
@@ -901,7 +978,7 @@ int mk_request_error(int http_status, struct client_session *cs,
 
     if (page) {
         if (sr->method != HTTP_METHOD_HEAD)
-            mk_socket_send(cs->socket, page->data, page->len);
+            mk_output_send(cs->socket, &cs->output, page->data, page->len);
 
         mk_pointer_free(page);
         mk_mem_free(page);
@@ -956,6 +1033,11 @@ struct client_session *mk_session_create(int socket, struct sched_list_node *sch
 
     /* creation time in unix time */
     cs->init_time = sc->arrive_time;
+    cs->phase_start = 0;
+
+    /* No disk I/O job nor response cache fill pending */
+    cs->aio_id = 0;
+    cs->rcache_id = 0;
 
     /* alloc space for body content */
     cs->body = cs->body_fixed;
@@ -971,6 +1053,12 @@ struct client_session *mk_session_create(int socket, struct sched_list_node *sch
     /* Init session request list */
     mk_list_init(&cs->request_list);
 
+    /* Init output queue */
+    mk_output_init(&cs->output);
+
+    /* Plugins data */
+    memset(cs->plugin_data, 0, sizeof(cs->plugin_data));
+
     /* Add this SESSION to the thread list */
     cs_list = mk_sched_get_request_list();
 
@@ -1040,6 +1128,8 @@ void mk_session_remove(int socket)
     cs_node = mk_session_get(socket);
     if (cs_node) {
         rb_erase(&cs_node->_rb_head, cs_list);
+        mk_plugin_data_release(cs_node->plugin_data);
+        mk_output_free(&cs_node->output);
         if (cs_node->body != cs_node->body_fixed) {
             mk_mem_free(cs_node->body);
         }
@@ -0,0 +1,414 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Request routing
+ * ---------------
+ * A virtual host can define in its [HANDLERS] section which plugin takes
+ * care of which URIs, by prefix, by suffix or by regular expression:
+ *
+ *     [HANDLERS]
+ *         Prefix /cgi-bin/  cgi
+ *         Suffix .php       fastcgi
+ *
+ * The routes are compiled into a prefix trie and a trie of reversed
+ * suffixes when the configuration is loaded. Once the plugins are loaded
+ * every virtual host gets the list of its stage 30 plugins without
+ * routes (e.g. auth), which keep running for every request. On stage 30
+ * the core looks up the single handler for the URI and calls it at its
+ * place in that list, other routed plugins are never visited.
+ *
+ * Lookup order: longest prefix, then longest suffix, then the regular
+ * expressions in the order they were defined.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+
+#include "monkey.h"
+#include "mk_route.h"
+#include "mk_config.h"
+#include "mk_plugin.h"
+#include "mk_string.h"
+#include "mk_memory.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+static struct mk_route_node *mk_route_node_child(struct mk_route_node *node,
+                                                 unsigned char c)
+{
+    struct mk_route_node *child;
+
+    for (child = node->child; child; child = child->next) {
+        if (child->c == c) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+/* Insert a key in the trie, 'reverse' walks it from the last byte */
+static void mk_route_node_add(struct mk_route_node *root, const char *key,
+                              int reverse, char *name)
+{
+    int i;
+    int len = strlen(key);
+    unsigned char c;
+    struct mk_route_node *node = root;
+    struct mk_route_node *child;
+
+    for (i = 0; i < len; i++) {
+        c = (reverse) ? key[len - i - 1] : key[i];
+        child = mk_route_node_child(node, c);
+        if (!child) {
+            child = mk_mem_malloc_z(sizeof(struct mk_route_node));
+            child->c = c;
+            child->next = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+
+    /* A repeated key keeps the last handler */
+    mk_mem_free(node->name);
+    node->name = name;
+}
+
+static void mk_route_node_free(struct mk_route_node *node)
+{
+    struct mk_route_node *child, *next;
+
+    for (child = node->child; child; child = next) {
+        next = child->next;
+        mk_route_node_free(child);
+        mk_mem_free(child);
+    }
+    mk_mem_free(node->name);
+}
+
+/* Read the routes of a virtual host, NULL if it does not define any */
+struct mk_route_table *mk_route_create(struct mk_config *cnf, const char *path)
+{
+    int ret;
+    int routes = 0;
+    char *type;
+    char *pattern;
+    char *name;
+    struct mk_list *line;
+    struct mk_list *head;
+    struct mk_config_section *section;
+    struct mk_config_entry *entry;
+    struct mk_route_regex *r;
+    struct mk_route_table *table;
+
+    section = mk_config_section_get(cnf, MK_ROUTE_SECTION);
+    if (!section) {
+        return NULL;
+    }
+
+    table = mk_mem_malloc_z(sizeof(struct mk_route_table));
+    mk_list_init(&table->regex);
+
+    mk_list_foreach(head, &section->entries) {
+        entry = mk_list_entry(head, struct mk_config_entry, _head);
+        type = entry->key;
+
+        /* Value format: 'pattern plugin' */
+        line = mk_string_split_line(entry->val);
+        if (!line || mk_list_is_empty(line) == 0 ||
+            line->next->next == line || line->next->next->next != line) {
+            mk_err("Invalid route '%s %s' in %s", type, entry->val, path);
+            if (line) {
+                mk_string_split_free(line);
+            }
+            continue;
+        }
+
+        pattern = mk_list_entry(line->next,
+                                struct mk_string_line, _head)->val;
+        name = mk_string_dup(mk_list_entry(line->next->next,
+                                           struct mk_string_line, _head)->val);
+
+        if (strcasecmp(type, MK_ROUTE_PREFIX) == 0) {
+            mk_route_node_add(&table->prefix, pattern, MK_FALSE, name);
+        }
+        else if (strcasecmp(type, MK_ROUTE_SUFFIX) == 0) {
+            mk_route_node_add(&table->suffix, pattern, MK_TRUE, name);
+        }
+        else if (strcasecmp(type, MK_ROUTE_REGEX) == 0) {
+            r = mk_mem_malloc_z(sizeof(struct mk_route_regex));
+            ret = regcomp(&r->re, pattern, REG_EXTENDED | REG_NOSUB);
+            if (ret != 0) {
+                mk_err("Invalid route regex '%s' in %s", pattern, path);
+                mk_mem_free(name);
+                mk_mem_free(r);
+                mk_string_split_free(line);
+                continue;
+            }
+            r->name = name;
+            mk_list_add(&r->_head, &table->regex);
+        }
+        else {
+            mk_err("Unknown route type '%s' in %s", type, path);
+            mk_mem_free(name);
+            mk_string_split_free(line);
+            continue;
+        }
+
+        MK_TRACE("Route %s '%s' -> %s", type, pattern, name);
+        mk_string_split_free(line);
+        routes++;
+    }
+
+    if (routes == 0) {
+        mk_route_free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+static struct plugin *mk_route_plugin_find(const char *name)
+{
+    struct mk_list *head;
+    struct plugin *p;
+
+    mk_list_foreach(head, config->plugins) {
+        p = mk_list_entry(head, struct plugin, _head);
+        if (strcmp(p->shortname, name) == 0) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static struct mk_route_handler *mk_route_handler_find(struct mk_route_table *table,
+                                                      struct plugin *p)
+{
+    int i;
+
+    for (i = 0; i < table->n_handlers; i++) {
+        if (table->handlers[i]->p == p) {
+            return table->handlers[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* The handler of a routed plugin, registered in the table once */
+static struct mk_route_handler *mk_route_handler_get(struct mk_route_table *table,
+                                                     struct plugin *p)
+{
+    struct mk_route_handler *h;
+
+    h = mk_route_handler_find(table, p);
+    if (h) {
+        return h;
+    }
+
+    h = mk_mem_malloc_z(sizeof(struct mk_route_handler));
+    h->p = p;
+    h->at = -1;
+
+    table->handlers = mk_mem_realloc(table->handlers,
+                                     sizeof(struct mk_route_handler *) *
+                                     (table->n_handlers + 1));
+    table->handlers[table->n_handlers++] = h;
+
+    return h;
+}
+
+static struct mk_route_handler *mk_route_handler_resolve(struct mk_route_table *table,
+                                                         const char *name)
+{
+    struct plugin *p;
+
+    p = mk_route_plugin_find(name);
+    if (!p) {
+        mk_warn("Route handler '%s' is not loaded", name);
+        return NULL;
+    }
+
+    return mk_route_handler_get(table, p);
+}
+
+static void mk_route_node_resolve(struct mk_route_table *table,
+                                  struct mk_route_node *node)
+{
+    struct mk_route_node *child;
+
+    if (node->name) {
+        node->handler = mk_route_handler_resolve(table, node->name);
+    }
+
+    for (child = node->child; child; child = child->next) {
+        mk_route_node_resolve(table, child);
+    }
+}
+
+/* Link every route with its plugin, plugins must be loaded already */
+void mk_route_resolve(struct mk_route_table *table)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_route_regex *r;
+    struct mk_route_handler *h;
+    struct plugin *p;
+
+    mk_route_node_resolve(table, &table->prefix);
+    mk_route_node_resolve(table, &table->suffix);
+
+    mk_list_foreach(head, &table->regex) {
+        r = mk_list_entry(head, struct mk_route_regex, _head);
+        r->handler = mk_route_handler_resolve(table, r->name);
+    }
+
+    /*
+     * Stage 30 plugins run in the order they were loaded: the unrouted
+     * ones are listed, each handler remembers the slot it goes in.
+     */
+    mk_list_foreach(head, config->plugins) {
+        p = mk_list_entry(head, struct plugin, _head);
+        if (!(p->hooks & MK_PLUGIN_STAGE_30)) {
+            continue;
+        }
+
+        h = mk_route_handler_find(table, p);
+        if (h) {
+            h->at = table->n_stage_30;
+            continue;
+        }
+
+        table->stage_30 = mk_mem_realloc(table->stage_30,
+                                         sizeof(struct plugin *) *
+                                         (table->n_stage_30 + 1));
+        table->stage_30[table->n_stage_30++] = p;
+    }
+
+    for (i = 0; i < table->n_handlers; i++) {
+        if (table->handlers[i]->at == -1) {
+            mk_warn("Route handler '%s' does not handle requests",
+                    table->handlers[i]->p->shortname);
+        }
+    }
+}
+
+void mk_route_resolve_all()
+{
+    struct mk_list *head;
+    struct host *host;
+
+    mk_list_foreach(head, &config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        if (host->routes) {
+            mk_route_resolve(host->routes);
+        }
+    }
+}
+
+void mk_route_free(struct mk_route_table *table)
+{
+    int i;
+    struct mk_list *head, *tmp;
+    struct mk_route_regex *r;
+
+    mk_route_node_free(&table->prefix);
+    mk_route_node_free(&table->suffix);
+
+    mk_list_foreach_safe(head, tmp, &table->regex) {
+        r = mk_list_entry(head, struct mk_route_regex, _head);
+        mk_list_del(&r->_head);
+        regfree(&r->re);
+        mk_mem_free(r->name);
+        mk_mem_free(r);
+    }
+
+    for (i = 0; i < table->n_handlers; i++) {
+        mk_mem_free(table->handlers[i]);
+    }
+    mk_mem_free(table->handlers);
+    mk_mem_free(table->stage_30);
+    mk_mem_free(table);
+}
+
+/* Find the handler for an URI, NULL if no route matches */
+struct mk_route_handler *mk_route_lookup(struct mk_route_table *table,
+                                         const char *uri, int len)
+{
+    int i;
+    struct mk_route_handler *handler = NULL;
+    struct mk_route_node *node;
+    struct mk_list *head;
+    struct mk_route_regex *r;
+    regmatch_t match;
+
+    /* Longest prefix */
+    node = &table->prefix;
+    for (i = 0; i < len; i++) {
+        node = mk_route_node_child(node, uri[i]);
+        if (!node) {
+            break;
+        }
+        if (node->handler) {
+            handler = node->handler;
+        }
+    }
+    if (handler) {
+        return handler;
+    }
+
+    /* Longest suffix */
+    node = &table->suffix;
+    for (i = len - 1; i >= 0; i--) {
+        node = mk_route_node_child(node, uri[i]);
+        if (!node) {
+            break;
+        }
+        if (node->handler) {
+            handler = node->handler;
+        }
+    }
+    if (handler) {
+        return handler;
+    }
+
+    /* The URI is not NUL terminated, REG_STARTEND sets its bounds */
+    mk_list_foreach(head, &table->regex) {
+        r = mk_list_entry(head, struct mk_route_regex, _head);
+        if (!r->handler) {
+            continue;
+        }
+
+        match.rm_so = 0;
+        match.rm_eo = len;
+        if (regexec(&r->re, uri, 1, &match, REG_STARTEND) == 0) {
+            return r->handler;
+        }
+    }
+
+    return NULL;
+}
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <string.h>
+#include <sys/resource.h>
 
 #include "monkey.h"
 #include "mk_connection.h"
@@ -42,6 +43,9 @@
 #include "mk_utils.h"
 #include "mk_macros.h"
 #include "mk_rbtree.h"
+#include "mk_aio.h"
+#include "mk_rcache.h"
+#include "mk_usdt.h"
 
 pthread_key_t worker_sched_node;
 
@@ -88,11 +92,43 @@ static inline int _next_target()
     return target;
 }
 
+/*
+ * Peer addresses handed from the accepting thread to the workers, indexed
+ * by socket. A socket above the table size gets its address from the
+ * kernel when it is registered.
+ */
+struct sched_peer
+{
+    union sched_addr addr;
+    socklen_t len;
+};
+
+static struct sched_peer *sched_peers;
+static int sched_peers_size;
+
+static void mk_sched_peers_init()
+{
+    struct rlimit lim;
+
+    /* Room for every client plus the descriptors plugins may open */
+    sched_peers_size = (config->max_load * 2) + 64;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 &&
+        lim.rlim_cur < (rlim_t) sched_peers_size) {
+        sched_peers_size = lim.rlim_cur;
+    }
+
+    sched_peers = mk_mem_malloc_z(sizeof(struct sched_peer) * sched_peers_size);
+    if (!sched_peers) {
+        sched_peers_size = 0;
+    }
+}
+
 /*
  * Assign a new incomming connection to a specific worker thread, this call comes
  * from the main monkey process.
  */
-int mk_sched_add_client(int remote_fd)
+int mk_sched_add_client(int remote_fd, union sched_addr *addr,
+                        socklen_t addr_len)
 {
     int r, t=0;
     struct sched_list_node *sched;
@@ -107,7 +143,23 @@ int mk_sched_add_client(int remote_fd)
 
     sched = &sched_list[t];
 
+    /* The worker picks the address up when the connection is registered */
+    if (mk_unlikely(!sched_peers)) {
+        mk_sched_peers_init();
+    }
+    if (remote_fd < sched_peers_size) {
+        if (addr && addr_len <= sizeof(union sched_addr)) {
+            memcpy(&sched_peers[remote_fd].addr, addr, addr_len);
+            sched_peers[remote_fd].len = addr_len;
+        }
+        else {
+            sched_peers[remote_fd].len = 0;
+        }
+    }
+
     MK_TRACE("[FD %i] Balance to WID %i", remote_fd, sched->idx);
+    MK_PROBE3(conn__balance, remote_fd, sched->idx,
+              sched->accepted_connections - sched->closed_connections);
 
     r  = mk_epoll_add(sched->epoll_fd, remote_fd, MK_EPOLL_WRITE,
                       MK_EPOLL_LEVEL_TRIGGERED);
@@ -120,6 +172,42 @@ int mk_sched_add_client(int remote_fd)
     return r;
 }
 
+/* Peer address of the connection and its text form, once per connection */
+static void mk_sched_set_peer(struct sched_connection *conx, int remote_fd)
+{
+    const void *ip = NULL;
+
+    conx->addr_len = 0;
+    if (remote_fd < sched_peers_size && sched_peers[remote_fd].len > 0) {
+        conx->addr_len = sched_peers[remote_fd].len;
+        memcpy(&conx->addr, &sched_peers[remote_fd].addr, conx->addr_len);
+    }
+    else {
+        conx->addr_len = sizeof(conx->addr);
+        if (getpeername(remote_fd, &conx->addr.sa, &conx->addr_len) != 0) {
+            conx->addr_len = 0;
+        }
+    }
+
+    conx->ip_str[0] = '\0';
+    conx->ip_str_len = 0;
+    if (conx->addr_len == 0) {
+        return;
+    }
+
+    if (conx->addr.sa.sa_family == AF_INET) {
+        ip = &conx->addr.in.sin_addr;
+    }
+    else if (conx->addr.sa.sa_family == AF_INET6) {
+        ip = &conx->addr.in6.sin6_addr;
+    }
+
+    if (ip && inet_ntop(conx->addr.sa.sa_family, ip,
+                        conx->ip_str, sizeof(conx->ip_str))) {
+        conx->ip_str_len = strlen(conx->ip_str);
+    }
+}
+
 /*
  * Register a new client connection into the scheduler, this call takes place
  * inside the worker/thread context.
@@ -131,6 +219,8 @@ int mk_sched_register_client(int remote_fd, struct sched_list_node *sched)
     struct mk_list *av_queue = &sched->av_queue;
 
     sched_conn = mk_list_entry_first(av_queue, struct sched_connection, _head);
+    mk_sched_set_peer(sched_conn, remote_fd);
+    MK_PROBE3(conn__accept, remote_fd, sched->idx, sched_conn->ip_str);
 
     /* Before to continue, we need to run plugin stage 10 */
     ret = mk_plugin_stage_run(MK_PLUGIN_STAGE_10,
@@ -264,7 +354,13 @@ void *mk_sched_launch_worker_loop(void *thread_conf)
 
     /* Plugin thread context calls */
     mk_epoll_state_init();
-    mk_plugin_event_init_list();
+    mk_plugin_event_init_table();
+
+    /* Disk I/O notifications */
+    mk_aio_worker_init(&sched_list[wid]);
+
+    /* Response cache notifications */
+    mk_rcache_worker_init(&sched_list[wid]);
 
     /* Epoll event handlers */
     handler = mk_epoll_set_handlers((void *) mk_conn_read,
@@ -369,6 +465,7 @@ int mk_sched_remove_client(struct sched_list_node *sched, int remote_fd)
     sc = mk_sched_get_connection(sched, remote_fd);
     if (sc) {
         MK_TRACE("[FD %i] Scheduler remove", remote_fd);
+        MK_PROBE2(conn__close, remote_fd, sched->idx);
 
         /* Invoke plugins in stage 50 */
         mk_plugin_stage_run(MK_PLUGIN_STAGE_50, remote_fd, NULL, NULL, NULL);
@@ -427,6 +524,18 @@ struct sched_connection *mk_sched_get_connection(struct sched_list_node *sched,
     return NULL;
 }
 
+/* Connection of the socket in the calling worker, NULL if unknown */
+struct sched_connection *mk_sched_conn_get(int remote_fd)
+{
+    struct sched_list_node *sched = mk_sched_get_thread_conf();
+
+    if (!sched) {
+        return NULL;
+    }
+
+    return mk_sched_get_connection(sched, remote_fd);
+}
+
 int mk_sched_check_timeouts(struct sched_list_node *sched)
 {
     int client_timeout;
@@ -444,6 +553,7 @@ int mk_sched_check_timeouts(struct sched_list_node *sched)
             /* Check timeout */
             if (client_timeout <= log_current_utime) {
                 MK_TRACE("Scheduler, closing fd %i due TIMEOUT", entry_conn->socket);
+                MK_PROBE2(conn__timeout, entry_conn->socket, sched->idx);
                 mk_sched_remove_client(sched, entry_conn->socket);
             }
         }
@@ -467,6 +577,7 @@ int mk_sched_check_timeouts(struct sched_list_node *sched)
             if (client_timeout <= log_current_utime) {
                 MK_TRACE("[FD %i] Scheduler, closing due to timeout (incomplete)",
                          cs_node->socket);
+                MK_PROBE2(conn__timeout, cs_node->socket, sched->idx);
 
                 mk_sched_remove_client(sched, cs_node->socket);
                 mk_session_remove(cs_node->socket);
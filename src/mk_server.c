@@ -84,6 +84,8 @@ void mk_server_loop(int server_fd)
 {
     int ret;
     int remote_fd;
+    union sched_addr addr;
+    socklen_t addr_len;
 
     /* Activate TCP_DEFER_ACCEPT */
     if (mk_socket_set_tcp_defer_accept(server_fd) != 0) {
@@ -95,7 +97,8 @@ void mk_server_loop(int server_fd)
     mk_info("HTTP Server started");
 
     while (1) {
-        remote_fd = mk_socket_accept(server_fd);
+        addr_len = sizeof(addr);
+        remote_fd = mk_socket_accept(server_fd, &addr.sa, &addr_len);
 
         if (mk_unlikely(remote_fd == -1)) {
             continue;
@@ -115,7 +118,7 @@ void mk_server_loop(int server_fd)
 #endif
 
         /* Assign socket to worker thread */
-        ret = mk_sched_add_client(remote_fd);
+        ret = mk_sched_add_client(remote_fd, &addr, addr_len);
         if (ret == -1) {
             mk_socket_close(remote_fd);
         }
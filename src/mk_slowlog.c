@@ -0,0 +1,296 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Slow requests log
+ * -----------------
+ * When 'SlowLog' is set, one of every 'SlowLogSample' requests gets a
+ * time stamp at the end of each of its phases (see enum mk_phase) and
+ * around every stage 20 and stage 30 plugin callback. When the request
+ * ends, if it took longer than 'SlowLogThreshold', the worker copies it
+ * to its own ring; the clock thread empties the rings once per second
+ * and writes one line per request with the time of each phase.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "monkey.h"
+#include "mk_slowlog.h"
+#include "mk_stats.h"
+#include "mk_request.h"
+#include "mk_config.h"
+#include "mk_scheduler.h"
+#include "mk_plugin.h"
+#include "mk_clock.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+int mk_slowlog_on;
+
+static int slowlog_fd = -1;
+static int slowlog_workers;
+static uint64_t slowlog_threshold;
+static double slowlog_ticks_us;
+static struct mk_slowlog_ring *slowlog_rings;
+
+static const char *phase_names[MK_PHASE_MAX] = {
+    NULL, "read", "parse", "stage20", "file", "stage30", "headers", "body"
+};
+
+void mk_slowlog_init()
+{
+    size_t size;
+
+    if (!config->slowlog || slowlog_rings) {
+        return;
+    }
+
+    slowlog_fd = open(config->slowlog, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (slowlog_fd < 0) {
+        mk_err("Could not open slow log '%s'", config->slowlog);
+        exit(EXIT_FAILURE);
+    }
+
+    slowlog_workers = config->workers;
+    size = sizeof(struct mk_slowlog_ring) * slowlog_workers;
+    if (posix_memalign((void **) &slowlog_rings, 64, size) != 0) {
+        mk_err("Slow log: could not allocate the rings");
+        exit(EXIT_FAILURE);
+    }
+    memset(slowlog_rings, '\0', size);
+
+    slowlog_ticks_us = mk_stats_ticks_us();
+    slowlog_threshold = (uint64_t) (slowlog_ticks_us * 1000.0 *
+                                    config->slowlog_threshold);
+    mk_slowlog_on = MK_TRUE;
+}
+
+/* A new request was parsed, time it if it is its turn */
+void mk_slowlog_begin(struct client_session *cs, struct session_request *sr)
+{
+    uint64_t now;
+    struct mk_slowlog_ring *ring;
+    struct sched_list_node *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (!sched || sched->idx >= slowlog_workers) {
+        return;
+    }
+
+    ring = &slowlog_rings[sched->idx];
+    if (++ring->sample < (unsigned int) config->slowlog_sample) {
+        return;
+    }
+    ring->sample = 0;
+
+    /* Pipelined requests were read along with the first one */
+    now = mk_phase_now();
+    sr->phases.on = MK_TRUE;
+    sr->phases.stamp[MK_PHASE_START] = cs->phase_start ? cs->phase_start : now;
+    sr->phases.stamp[MK_PHASE_READ] = now;
+    cs->phase_start = 0;
+}
+
+/* Keep the slowest callback of a plugins stage */
+void mk_slowlog_plugin(struct mk_phase_plugin *slowest, struct plugin *p,
+                       uint64_t start)
+{
+    uint64_t ticks = mk_phase_now() - start;
+
+    if (ticks >= slowest->ticks) {
+        slowest->ticks = ticks;
+        slowest->name = p->shortname;
+    }
+}
+
+/* The request ended, queue it if it was slow */
+void mk_slowlog_end(struct client_session *cs, struct session_request *sr)
+{
+    unsigned int head;
+    int len;
+    struct mk_phases *ph = &sr->phases;
+    struct mk_slowlog_ring *ring;
+    struct mk_slowlog_record *rec;
+    struct sched_connection *conx;
+    struct sched_list_node *sched;
+
+    if (mk_likely(!ph->on)) {
+        return;
+    }
+
+    ph->stamp[MK_PHASE_END] = mk_phase_now();
+    ph->on = MK_FALSE;
+    if (ph->stamp[MK_PHASE_END] - ph->stamp[MK_PHASE_START] < slowlog_threshold) {
+        return;
+    }
+
+    sched = mk_sched_get_thread_conf();
+    ring = &slowlog_rings[sched->idx];
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+        MK_SLOWLOG_RING) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &ring->records[head % MK_SLOWLOG_RING];
+    rec->time = log_current_utime;
+    rec->status = sr->headers.status;
+    rec->phases = *ph;
+    rec->vhost = (sr->host_alias) ? sr->host_alias->name : NULL;
+
+    len = sr->method_p.len;
+    if (len >= (int) sizeof(rec->method)) {
+        len = sizeof(rec->method) - 1;
+    }
+    memcpy(rec->method, sr->method_p.data, len);
+    rec->method[len] = '\0';
+
+    len = sr->uri.len;
+    if (len >= MK_SLOWLOG_URI) {
+        len = MK_SLOWLOG_URI - 1;
+    }
+    memcpy(rec->uri, sr->uri.data, len);
+    rec->uri[len] = '\0';
+
+    rec->ip[0] = '\0';
+    conx = mk_sched_conn_get(cs->socket);
+    if (conx && conx->ip_str_len > 0) {
+        memcpy(rec->ip, conx->ip_str, conx->ip_str_len + 1);
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* A line of the log, appends past its end are cut */
+struct slowlog_line
+{
+    char buf[1024];
+    int len;
+};
+
+static void line_append(struct slowlog_line *line, const char *fmt, ...)
+{
+    int n;
+    int room;
+    va_list ap;
+
+    /* Keep one byte for the new line */
+    room = sizeof(line->buf) - 1 - line->len;
+    if (room <= 0) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(line->buf + line->len, room + 1, fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        line->len += (n < room) ? n : room;
+    }
+}
+
+static void line_ms(struct slowlog_line *line, uint64_t ticks)
+{
+    line_append(line, "%.3f", (double) ticks / slowlog_ticks_us / 1000.0);
+}
+
+static void mk_slowlog_write(struct mk_slowlog_record *rec)
+{
+    int i;
+    char tstr[32];
+    uint64_t last;
+    struct tm tm;
+    struct slowlog_line line;
+    struct mk_phases *ph = &rec->phases;
+    struct mk_phase_plugin *plugins[2] = { &ph->stage_20, &ph->stage_30 };
+
+    localtime_r(&rec->time, &tm);
+    strftime(tstr, sizeof(tstr), "[%d/%b/%G %T %z]", &tm);
+
+    line.len = 0;
+    line_append(&line, "%s %s %s \"%s %s\" %i total=",
+                tstr, rec->ip[0] ? rec->ip : "-",
+                rec->vhost ? rec->vhost : "-",
+                rec->method[0] ? rec->method : "-", rec->uri, rec->status);
+    line_ms(&line, ph->stamp[MK_PHASE_END] - ph->stamp[MK_PHASE_START]);
+
+    /* Phases the request did not go through are printed as '-' */
+    last = ph->stamp[MK_PHASE_START];
+    for (i = MK_PHASE_READ; i < MK_PHASE_MAX; i++) {
+        line_append(&line, " %s=", phase_names[i]);
+        if (ph->stamp[i] == 0) {
+            line_append(&line, "-");
+            continue;
+        }
+        line_ms(&line, ph->stamp[i] - last);
+        last = ph->stamp[i];
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (!plugins[i]->name) {
+            continue;
+        }
+        line_append(&line, " %s_plugin=%s:",
+                    (i == 0) ? "stage20" : "stage30", plugins[i]->name);
+        line_ms(&line, plugins[i]->ticks);
+    }
+
+    line.buf[line.len++] = '\n';
+
+    if (write(slowlog_fd, line.buf, line.len) != line.len) {
+        MK_TRACE("Slow log write failed");
+    }
+}
+
+/* Write the queued slow requests, called by the clock thread */
+void mk_slowlog_flush()
+{
+    int i;
+    unsigned int head, tail;
+    unsigned int dropped;
+    struct mk_slowlog_ring *ring;
+
+    if (!mk_slowlog_on) {
+        return;
+    }
+
+    for (i = 0; i < slowlog_workers; i++) {
+        ring = &slowlog_rings[i];
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++) {
+            mk_slowlog_write(&ring->records[tail % MK_SLOWLOG_RING]);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            mk_warn("Slow log: worker %i dropped %u slow requests", i, dropped);
+        }
+    }
+}
@@ -156,9 +156,9 @@ int mk_socket_server(int port, char *listen_addr)
 }
 
 /* NETWORK_IO plugin functions */
-int mk_socket_accept(int server_fd)
+int mk_socket_accept(int server_fd, struct sockaddr *addr, socklen_t *len)
 {
-    return plg_netiomap->accept(server_fd);
+    return plg_netiomap->accept(server_fd, addr, len);
 }
 
 int mk_socket_sendv(int socket_fd, struct mk_iov *mk_io)
@@ -206,8 +206,17 @@ int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len)
 {
     int ret;
     struct sockaddr_storage addr;
+    struct sched_connection *conx;
     socklen_t s_len = sizeof(addr);
 
+    /* Formatted when the connection was registered */
+    conx = mk_sched_conn_get(socket_fd);
+    if (conx && conx->ip_str_len > 0 && conx->ip_str_len < (unsigned) size) {
+        memcpy(*buf, conx->ip_str, conx->ip_str_len + 1);
+        *len = conx->ip_str_len;
+        return 0;
+    }
+
     ret = getpeername(socket_fd, (struct sockaddr *) &addr, &s_len);
 
     if (mk_unlikely(ret == -1)) {
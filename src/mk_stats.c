@@ -0,0 +1,238 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Server statistics
+ * -----------------
+ * Every worker owns a block of counters: requests, bytes, status codes,
+ * a request latency histogram and per virtual host requests and bytes.
+ * The worker updates them at the end of each request with plain loads
+ * and stores, no lock and no atomic read-modify-write. mk_stats_read()
+ * adds up the blocks of all the workers; plugins get it through
+ * mk_api->stats_read (see plugins/stats).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "monkey.h"
+#include "mk_stats.h"
+#include "mk_http.h"
+#include "mk_config.h"
+#include "mk_scheduler.h"
+#include "mk_memory.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+static int stats_workers;
+static int stats_vhosts;
+static struct mk_stats *stats_list;
+
+/* Request clock ticks per microsecond, whole ticks */
+static uint64_t stats_ticks_us;
+
+/* Per worker array of virtual hosts counters, cache line padded */
+static size_t stats_vhost_stride;
+static char *stats_vhost_list;
+
+/* Bump a counter owned by the calling worker */
+#define MK_STATS_ADD(field, val) \
+    __atomic_store_n(&(field), (field) + (val), __ATOMIC_RELAXED)
+
+/*
+ * Request clock ticks per microsecond, measured against CLOCK_MONOTONIC
+ * the first time it is asked for
+ */
+double mk_stats_ticks_us()
+{
+    uint64_t t0, t1;
+    uint64_t c0, c1;
+    static double ticks_us;
+
+    if (ticks_us > 0) {
+        return ticks_us;
+    }
+
+    t0 = mk_stats_now();
+    c0 = mk_stats_ticks();
+    usleep(20000);
+    c1 = mk_stats_ticks();
+    t1 = mk_stats_now();
+
+    ticks_us = (double) (c1 - c0) * 1000.0 / (double) (t1 - t0);
+    return ticks_us;
+}
+
+int mk_stats_init()
+{
+    int idx = 0;
+    struct host *host;
+    struct mk_list *head;
+
+    if (stats_list) {
+        return 0;
+    }
+
+    /* Virtual hosts are found by their position in the list */
+    mk_list_foreach(head, &config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        host->stats_idx = idx++;
+    }
+
+    /* Bucket precision is 25%, whole ticks per microsecond are enough */
+    stats_ticks_us = (uint64_t) (mk_stats_ticks_us() + 0.5);
+    if (stats_ticks_us == 0) {
+        stats_ticks_us = 1;
+    }
+
+    stats_workers = config->workers;
+    stats_vhosts = idx;
+    stats_vhost_stride = (sizeof(struct mk_stats_vhost) * stats_vhosts + 63) &
+        ~((size_t) 63);
+
+    if (posix_memalign((void **) &stats_list, 64,
+                       sizeof(struct mk_stats) * stats_workers) != 0 ||
+        posix_memalign((void **) &stats_vhost_list, 64,
+                       stats_vhost_stride * stats_workers + 64) != 0) {
+        mk_err("Stats: could not allocate the counters");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(stats_list, '\0', sizeof(struct mk_stats) * stats_workers);
+    memset(stats_vhost_list, '\0', stats_vhost_stride * stats_workers + 64);
+
+    return 0;
+}
+
+/* Account a finished request, called by its worker before STAGE_40 */
+void mk_stats_request(struct session_request *sr)
+{
+    int status;
+    uint64_t usec;
+    uint64_t bytes = 0;
+    struct mk_stats *st;
+    struct mk_stats_vhost *vh;
+    struct sched_list_node *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (mk_unlikely(!sched || !stats_list || sched->idx >= stats_workers)) {
+        return;
+    }
+    st = &stats_list[sched->idx];
+
+    if (sr->method != HTTP_METHOD_HEAD && sr->headers.content_length > 0) {
+        bytes = sr->headers.content_length;
+    }
+
+    MK_STATS_ADD(st->requests, 1);
+    MK_STATS_ADD(st->bytes, bytes);
+
+    status = sr->headers.status;
+    if (status >= MK_STATS_STATUS_MIN && status <= MK_STATS_STATUS_MAX) {
+        MK_STATS_ADD(st->status[status - MK_STATS_STATUS_MIN], 1);
+    }
+    else {
+        MK_STATS_ADD(st->status_other, 1);
+    }
+
+    /* Requests which failed before being parsed have no start time */
+    if (sr->stats_start > 0) {
+        usec = (mk_stats_ticks() - sr->stats_start) / stats_ticks_us;
+        MK_STATS_ADD(st->latency[mk_stats_bucket(usec)], 1);
+        MK_STATS_ADD(st->latency_sum, usec);
+        MK_STATS_ADD(st->latency_count, 1);
+    }
+
+    if (sr->host_conf && sr->host_conf->stats_idx < stats_vhosts) {
+        vh = (struct mk_stats_vhost *) (stats_vhost_list +
+                                        stats_vhost_stride * sched->idx);
+        vh += sr->host_conf->stats_idx;
+        MK_STATS_ADD(vh->requests, 1);
+        MK_STATS_ADD(vh->bytes, bytes);
+    }
+}
+
+/*
+ * Sum the counters of all the workers into 'total' and, if not NULL,
+ * 'vhosts' (one entry per virtual host, in configuration order). Returns
+ * the number of virtual hosts.
+ */
+int mk_stats_read(struct mk_stats *total, struct mk_stats_vhost *vhosts)
+{
+    int i, j;
+    uint64_t *src;
+    uint64_t *dst;
+    struct mk_stats_vhost *vh;
+
+    memset(total, '\0', sizeof(struct mk_stats));
+    if (!stats_list) {
+        return 0;
+    }
+
+    /* The structure is made of 64 bits counters only */
+    for (i = 0; i < stats_workers; i++) {
+        src = (uint64_t *) &stats_list[i];
+        dst = (uint64_t *) total;
+        for (j = 0; j < (int) (sizeof(struct mk_stats) / sizeof(uint64_t));
+             j++) {
+            dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+        }
+    }
+
+    if (vhosts) {
+        memset(vhosts, '\0', sizeof(struct mk_stats_vhost) * stats_vhosts);
+        for (i = 0; i < stats_workers; i++) {
+            vh = (struct mk_stats_vhost *) (stats_vhost_list +
+                                            stats_vhost_stride * i);
+            for (j = 0; j < stats_vhosts; j++) {
+                vhosts[j].requests += __atomic_load_n(&vh[j].requests,
+                                                      __ATOMIC_RELAXED);
+                vhosts[j].bytes += __atomic_load_n(&vh[j].bytes,
+                                                   __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    return stats_vhosts;
+}
+
+/* Upper bound, in microseconds and inclusive, of a latency bucket */
+uint64_t mk_stats_bucket_limit(int bucket)
+{
+    int exp;
+    int sub;
+
+    if (bucket < MK_STATS_SUB) {
+        return bucket;
+    }
+    if (bucket >= MK_STATS_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+
+    exp = (bucket >> MK_STATS_SUB_BITS) + MK_STATS_SUB_BITS - 1;
+    sub = bucket & (MK_STATS_SUB - 1);
+
+    return ((uint64_t) (MK_STATS_SUB + sub + 1) <<
+            (exp - MK_STATS_SUB_BITS)) - 1;
+}
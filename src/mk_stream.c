@@ -0,0 +1,503 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Daemon
+ *  ------------------
+ *  Copyright (C) 2001-2012, Eduardo Silva P. <edsiper@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Streams
+ * -------
+ * A response body can be attached to a request as a list of streams,
+ * each one reading from a different source: a memory buffer, a pipe or
+ * socket, or a generator callback. mk_handler_write() drives the
+ * streams of the request in order, moving their data through the stream
+ * filters to the connection output queue until the socket or the source
+ * would block.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+
+#include "monkey.h"
+#include "mk_stream.h"
+#include "mk_output.h"
+#include "mk_request.h"
+#include "mk_header.h"
+#include "mk_config.h"
+#include "mk_epoll.h"
+#include "mk_scheduler.h"
+#include "mk_memory.h"
+#include "mk_utils.h"
+#include "mk_macros.h"
+
+static struct mk_stream *mk_stream_new(struct client_session *cs,
+                                       struct session_request *sr, int type)
+{
+    struct mk_stream *stream;
+
+    stream = mk_mem_malloc_z(sizeof(struct mk_stream));
+    if (!stream) {
+        return NULL;
+    }
+
+    stream->type = type;
+    stream->fd = -1;
+    stream->cs = cs;
+    stream->sr = sr;
+    mk_list_init(&stream->filters);
+    mk_list_add(&stream->_head, &sr->streams);
+
+    return stream;
+}
+
+static void mk_stream_free(struct mk_stream *stream)
+{
+    struct mk_list *head, *tmp;
+    struct mk_stream_filter *filter;
+
+    mk_list_foreach_safe(head, tmp, &stream->filters) {
+        filter = mk_list_entry(head, struct mk_stream_filter, _head);
+        mk_list_del(&filter->_head);
+        if (filter->free) {
+            filter->free(filter);
+        }
+    }
+
+    if (stream->buf) {
+        mk_output_buf_release(stream->buf);
+    }
+    if (stream->fd_close == MK_TRUE && stream->fd >= 0) {
+        close(stream->fd);
+    }
+
+    mk_list_del(&stream->_head);
+    mk_mem_free(stream);
+}
+
+/* Stream the range of a buffer, the stream takes its own reference */
+struct mk_stream *mk_stream_buf(struct client_session *cs,
+                                struct session_request *sr,
+                                struct mk_output_buf *buf,
+                                size_t offset, size_t len)
+{
+    struct mk_stream *stream;
+
+    stream = mk_stream_new(cs, sr, MK_STREAM_BUF);
+    if (!stream) {
+        return NULL;
+    }
+
+    mk_output_buf_get(buf);
+    stream->buf = buf;
+    stream->offset = offset;
+    stream->len = len;
+
+    return stream;
+}
+
+/* Stream a non-blocking descriptor until it reaches EOF */
+struct mk_stream *mk_stream_fd(struct client_session *cs,
+                               struct session_request *sr,
+                               int fd, int close_fd)
+{
+    struct mk_stream *stream;
+
+    stream = mk_stream_new(cs, sr, MK_STREAM_FD);
+    if (!stream) {
+        return NULL;
+    }
+
+    stream->fd = fd;
+    stream->fd_close = close_fd;
+
+    return stream;
+}
+
+/*
+ * Stream the output of a generator: the callback writes data with
+ * mk_stream_write() and returns one of the MK_STREAM_* codes.
+ */
+struct mk_stream *mk_stream_func(struct client_session *cs,
+                                 struct session_request *sr,
+                                 int (*func) (struct mk_stream *, void *),
+                                 void *data)
+{
+    struct mk_stream *stream;
+
+    stream = mk_stream_new(cs, sr, MK_STREAM_FUNC);
+    if (!stream) {
+        return NULL;
+    }
+
+    stream->func = func;
+    stream->data = data;
+
+    return stream;
+}
+
+/* Filters are applied in the same order they were added */
+int mk_stream_filter_add(struct mk_stream *stream,
+                         struct mk_stream_filter *filter)
+{
+    mk_list_add(&filter->_head, &stream->filters);
+    return 0;
+}
+
+/* Pass data to the filter after 'filter', or to the output queue */
+int mk_stream_filter_next(struct mk_stream *stream,
+                          struct mk_stream_filter *filter,
+                          struct mk_output_buf *buf,
+                          size_t offset, size_t len)
+{
+    struct mk_list *next;
+    struct mk_stream_filter *f;
+
+    next = (filter) ? filter->_head.next : stream->filters.next;
+    if (next == &stream->filters) {
+        return mk_output_add_buf(&stream->cs->output, buf, offset, len);
+    }
+
+    f = mk_list_entry(next, struct mk_stream_filter, _head);
+    return f->write(stream, f, buf, offset, len);
+}
+
+static int mk_stream_filter_next_copy(struct mk_stream *stream,
+                                      struct mk_stream_filter *filter,
+                                      const char *data, size_t len)
+{
+    int ret;
+    char *copy;
+    struct mk_output_buf *buf;
+
+    copy = mk_mem_malloc(len);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, data, len);
+
+    buf = mk_output_buf_create(copy, len, mk_mem_free, copy);
+    if (!buf) {
+        mk_mem_free(copy);
+        return -1;
+    }
+
+    ret = mk_stream_filter_next(stream, filter, buf, 0, len);
+    mk_output_buf_release(buf);
+
+    return ret;
+}
+
+static inline int mk_stream_filter_is_last(struct mk_stream *stream,
+                                           struct mk_stream_filter *filter)
+{
+    return (filter->_head.next == &stream->filters);
+}
+
+/* Chunked transfer encoding */
+static int mk_stream_chunked_write(struct mk_stream *stream,
+                                   struct mk_stream_filter *filter,
+                                   struct mk_output_buf *buf,
+                                   size_t offset, size_t len)
+{
+    int n;
+    char frame[MK_OUTPUT_FRAME_SIZE];
+
+    if (len == 0) {
+        return 0;
+    }
+
+    /* Frames are kept inline in the queue entries */
+    if (mk_stream_filter_is_last(stream, filter)) {
+        return mk_output_add_chunk(&stream->cs->output, buf, offset, len);
+    }
+
+    n = snprintf(frame, sizeof(frame), "%lx\r\n", (unsigned long) len);
+    if (mk_stream_filter_next_copy(stream, filter, frame, n) != 0 ||
+        mk_stream_filter_next(stream, filter, buf, offset, len) != 0 ||
+        mk_stream_filter_next_copy(stream, filter, "\r\n", 2) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mk_stream_chunked_end(struct mk_stream *stream,
+                                 struct mk_stream_filter *filter)
+{
+    if (mk_stream_filter_is_last(stream, filter)) {
+        return mk_output_add_chunk(&stream->cs->output, NULL, 0, 0);
+    }
+
+    return mk_stream_filter_next_copy(stream, filter, "0\r\n\r\n", 5);
+}
+
+static void mk_stream_chunked_free(struct mk_stream_filter *filter)
+{
+    mk_mem_free(filter);
+}
+
+/*
+ * Encode the stream with the chunked transfer encoding, the response
+ * headers are updated if they have not been sent yet.
+ */
+int mk_stream_filter_chunked(struct mk_stream *stream)
+{
+    struct mk_stream_filter *filter;
+
+    filter = mk_mem_malloc_z(sizeof(struct mk_stream_filter));
+    if (!filter) {
+        return -1;
+    }
+
+    filter->write = mk_stream_chunked_write;
+    filter->end = mk_stream_chunked_end;
+    filter->free = mk_stream_chunked_free;
+
+    if (stream->sr->headers.sent == MK_FALSE) {
+        stream->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        stream->sr->headers.content_length = -1;
+    }
+
+    return mk_stream_filter_add(stream, filter);
+}
+
+/* Entry point for data produced by a stream source */
+int mk_stream_write(struct mk_stream *stream, struct mk_output_buf *buf,
+                    size_t offset, size_t len)
+{
+    return mk_stream_filter_next(stream, NULL, buf, offset, len);
+}
+
+int mk_stream_write_copy(struct mk_stream *stream, const void *data,
+                         size_t len)
+{
+    return mk_stream_filter_next_copy(stream, NULL, data, len);
+}
+
+/* Read up to a block from the stream descriptor into a new buffer */
+static int mk_stream_read_block(struct mk_stream *stream)
+{
+    int ret;
+    ssize_t n;
+    char *data;
+    struct mk_output_buf *buf;
+
+    data = mk_mem_malloc(MK_STREAM_BLOCK);
+    if (!data) {
+        return MK_STREAM_ERROR;
+    }
+
+    n = read(stream->fd, data, MK_STREAM_BLOCK);
+
+    if (n <= 0) {
+        mk_mem_free(data);
+        if (n == 0) {
+            return MK_STREAM_EOF;
+        }
+        if (errno == EAGAIN || errno == EINTR) {
+            return MK_STREAM_AGAIN;
+        }
+        return MK_STREAM_ERROR;
+    }
+
+    buf = mk_output_buf_create(data, n, mk_mem_free, data);
+    if (!buf) {
+        mk_mem_free(data);
+        return MK_STREAM_ERROR;
+    }
+
+    ret = mk_stream_write(stream, buf, 0, n);
+    mk_output_buf_release(buf);
+    if (ret != 0) {
+        return MK_STREAM_ERROR;
+    }
+
+    return MK_STREAM_MORE;
+}
+
+/*
+ * Move data from a pipe straight to a plain socket with splice(2). It is
+ * only used while the output queue is empty so data keeps its order.
+ */
+static int mk_stream_splice(struct mk_stream *stream)
+{
+    int avail = 0;
+    ssize_t n;
+
+    n = splice(stream->fd, NULL, stream->cs->socket, NULL, MK_STREAM_BLOCK,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        return MK_STREAM_MORE;
+    }
+    else if (n == 0) {
+        return MK_STREAM_EOF;
+    }
+
+    if (errno != EAGAIN) {
+        return MK_STREAM_ERROR;
+    }
+
+    /* Either side could be the one that blocks */
+    if (ioctl(stream->fd, FIONREAD, &avail) == 0 && avail > 0) {
+        return MK_STREAM_FULL;
+    }
+    return MK_STREAM_AGAIN;
+}
+
+/* Produce the next piece of data of a stream */
+static int mk_stream_pump(struct mk_stream *stream)
+{
+    int ret;
+    int filtered;
+    struct mk_output *out = &stream->cs->output;
+
+    filtered = (mk_list_is_empty(&stream->filters) != 0);
+
+    switch (stream->type) {
+    case MK_STREAM_BUF:
+        ret = mk_stream_write(stream, stream->buf, stream->offset, stream->len);
+        return (ret == 0) ? MK_STREAM_EOF : MK_STREAM_ERROR;
+    case MK_STREAM_FD:
+        if (!filtered && mk_output_pending(out) == 0 &&
+            strcmp(config->transport, MK_TRANSPORT_HTTP) == 0) {
+            ret = mk_stream_splice(stream);
+            if (ret != MK_STREAM_ERROR || errno != EINVAL) {
+                return ret;
+            }
+            /* not a pipe, fall back to read(2) */
+        }
+        return mk_stream_read_block(stream);
+    case MK_STREAM_FUNC:
+        return stream->func(stream, stream->data);
+    }
+
+    return MK_STREAM_ERROR;
+}
+
+/* The source is done, let the filters emit their trailers */
+static int mk_stream_end(struct mk_stream *stream)
+{
+    struct mk_list *head;
+    struct mk_stream_filter *filter;
+
+    mk_list_foreach(head, &stream->filters) {
+        filter = mk_list_entry(head, struct mk_stream_filter, _head);
+        if (filter->end && filter->end(stream, filter) != 0) {
+            return -1;
+        }
+    }
+
+    mk_stream_free(stream);
+    return 0;
+}
+
+/*
+ * Drive the streams of a request. Returns zero once every stream has
+ * been consumed (some output can still be queued), a positive value if
+ * the socket or a source would block, or EXIT_ABORT on error.
+ */
+int mk_stream_run(struct client_session *cs, struct session_request *sr)
+{
+    int ret;
+    int rounds = 0;
+    ssize_t pending;
+    struct mk_stream *stream;
+    struct sched_list_node *sched;
+
+    while (mk_stream_pending(sr)) {
+        stream = mk_list_entry_first(&sr->streams, struct mk_stream, _head);
+
+        ret = mk_stream_pump(stream);
+        if (ret == MK_STREAM_ERROR) {
+            MK_TRACE("[FD %i] stream error", cs->socket);
+            return EXIT_ABORT;
+        }
+        else if (ret == MK_STREAM_EOF) {
+            if (mk_stream_end(stream) != 0) {
+                return EXIT_ABORT;
+            }
+            continue;
+        }
+
+        if (ret == MK_STREAM_MORE && ++rounds < MK_STREAM_ROUNDS &&
+            !mk_output_full(&cs->output)) {
+            continue;
+        }
+
+        pending = mk_output_flush(cs->socket, &cs->output);
+        if (pending < 0) {
+            return EXIT_ABORT;
+        }
+
+        if (ret == MK_STREAM_AGAIN && pending == 0) {
+            /* the producer calls mk_stream_resume() when it has data */
+            MK_TRACE("[FD %i] stream source would block, sleep", cs->socket);
+            sched = mk_sched_get_thread_conf();
+            mk_epoll_change_mode(sched->epoll_fd, cs->socket,
+                                 MK_EPOLL_SLEEP, MK_EPOLL_LEVEL_TRIGGERED);
+        }
+
+        /*
+         * Wait for the next write event, even if the socket could take
+         * more data, so other connections of this worker get their turn.
+         */
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wake up a connection put to sleep by a stream source, it must be
+ * called from the worker which owns the connection. Producers can call
+ * it each time they have data, it does nothing if the connection is
+ * not sleeping.
+ */
+void mk_stream_resume(struct client_session *cs)
+{
+    struct epoll_state *state;
+    struct sched_list_node *sched;
+
+    state = mk_epoll_state_get(cs->socket);
+    if (!state || state->mode != MK_EPOLL_SLEEP) {
+        return;
+    }
+
+    sched = mk_sched_get_thread_conf();
+    mk_epoll_change_mode(sched->epoll_fd, cs->socket,
+                         MK_EPOLL_WAKEUP, MK_EPOLL_LEVEL_TRIGGERED);
+}
+
+void mk_stream_free_all(struct session_request *sr)
+{
+    struct mk_list *head, *tmp;
+    struct mk_stream *stream;
+
+    mk_list_foreach_safe(head, tmp, &sr->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        mk_stream_free(stream);
+    }
+}
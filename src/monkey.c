@@ -36,6 +36,11 @@
 #include "mk_macros.h"
 #include "mk_env.h"
 #include "mk_http.h"
+#include "mk_aio.h"
+#include "mk_rcache.h"
+#include "mk_stats.h"
+#include "mk_slowlog.h"
+#include "mk_route.h"
 
 #if defined(__DATE__) && defined(__TIME__)
 static const char MONKEY_BUILT[] = __DATE__ " " __TIME__;
@@ -53,11 +58,9 @@ void mk_thread_keys_init(void)
     pthread_key_create(&worker_sched_node, NULL);
     pthread_key_create(&request_list, NULL);
     pthread_key_create(&mk_epoll_state_k, NULL);
-    pthread_key_create(&mk_cache_iov_header, NULL);
+    pthread_key_create(&mk_cache_header_buf, NULL);
     pthread_key_create(&mk_cache_header_lm, NULL);
-    pthread_key_create(&mk_cache_header_cl, NULL);
     pthread_key_create(&mk_cache_header_ka, NULL);
-    pthread_key_create(&mk_cache_header_ka_max, NULL);
     pthread_key_create(&mk_cache_utils_gmtime, NULL);
     pthread_key_create(&mk_cache_utils_gmt_text, NULL);
     pthread_key_create(&mk_plugin_event_k, NULL);
@@ -210,6 +213,9 @@ int main(int argc, char **argv)
     mk_plugin_init();
     mk_plugin_read_config();
 
+    /* Link the virtual hosts routes with the loaded plugins */
+    mk_route_resolve_all();
+
     /* Override TCP port if it was set in the command line */
     if (port_override > 0) {
         config->serverport = port_override;
@@ -226,6 +232,9 @@ int main(int argc, char **argv)
     /* Register PID of Monkey */
     mk_utils_register_pid();
 
+    /* Slow requests log, opened before the process owner changes */
+    mk_slowlog_init();
+
     /* Workers: logger and clock */
     mk_utils_worker_spawn((void *) mk_clock_worker_init, NULL);
 
@@ -247,6 +256,15 @@ int main(int argc, char **argv)
     /* Invoke Plugin PRCTX hooks */
     mk_plugin_core_process();
 
+    /* Disk I/O threads */
+    mk_aio_init(config->aio_threads);
+
+    /* Dynamic responses cache */
+    mk_rcache_init();
+
+    /* Per worker counters */
+    mk_stats_init();
+
     /* Launch monkey http workers */
     mk_server_launch_workers();
 